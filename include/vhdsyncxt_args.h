@@ -45,6 +45,7 @@
 /* ---------------- Internal Header includes ------------------------------- */
 
 #include <vhdsyncxt_errorlog.h>
+#include <vhdsyncxt_tune.h>
 
 /* ---------------- PreProcessor Defines ----------------------------------- */
 
@@ -52,6 +53,18 @@
 #define VHD_SYNC_XT_DEFAULT_NAME            "vhd-syncxt"
 #define VHD_SYNC_XT_DEFAULT_PATH            "."
 
+#define VHD_SYNC_XT_DEFAULT_PARALLEL_STREAMS    1
+#define VHD_SYNC_XT_MAXIMUM_PARALLEL_STREAMS    16
+
+#define VHD_SYNC_XT_DEFAULT_WRITE_BUFFER_MB     4
+#define VHD_SYNC_XT_MAXIMUM_WRITE_BUFFER_MB     8
+
+#define VHD_SYNC_XT_DEFAULT_WRITER              "pwrite"
+
+#define VHD_SYNC_XT_DEFAULT_SESSION_TIMEOUT     3600
+
+#define VHD_SYNC_XT_MAXIMUM_MIRRORS             7
+
 /* ---------------- Constant/Global Declarations --------------------------- */
 
 /* ---------------- Structure Defines -------------------------------------- */
@@ -89,6 +102,93 @@ typedef struct _vhd_sync_xt_parameters
     //
     int connection_socket;
 
+    //
+    // Number of ranged requests to keep in flight during a download.
+    //
+    int parallel_streams;
+
+    //
+    // Adapt chunk size and number of ranges in flight to the link.
+    //
+    bool adaptive;
+
+    //
+    // Get the file in a single request.
+    //
+    bool stream;
+
+    //
+    // Keep the downloaded file sparse.
+    //
+    bool sparse;
+
+    //
+    // Size of the buffer data is gathered in before it is written out.
+    //
+    int write_buffer_mb;
+
+    //
+    // Name of the backend the file is written with.
+    //
+    char *writer;
+
+    //
+    // Keep the downloaded data out of the page cache.
+    //
+    bool writeback;
+
+    //
+    // Check the downloaded file against the hash in its synchash.
+    //
+    bool verify;
+
+    //
+    // Bandwidth cap in KB/s and its burst in KB, 0 for none and for one
+    // picked from the cap.
+    //
+    int rate_limit_kb;
+    int rate_burst_kb;
+
+    //
+    // File descriptor to read commands from during the download.
+    //
+    int control_fd;
+
+    //
+    // Multiplex the ranged requests over one HTTP/2 connection.
+    //
+    bool http2;
+
+    //
+    // Unix socket to get more connected sockets to the server from.
+    //
+    int broker_fd;
+
+    //
+    // File to keep TLS sessions in between runs, and how many seconds they
+    // are kept for.
+    //
+    char *session_cache;
+    int session_timeout;
+
+    //
+    // More urls the same image can be fetched from, alongside url.
+    //
+    char *mirrors[VHD_SYNC_XT_MAXIMUM_MIRRORS];
+    int mirror_count;
+
+    //
+    // Splice the body from the connected socket into the file.
+    //
+    bool splice;
+
+    //
+    // Size receive buffers to the link, and the congestion control
+    // algorithm to use, NULL for the system default.
+    //
+    bool autotune;
+    char *congestion;
+
     //
     // cache commandline params.
     //
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for getting
+ * connected sockets from a broker. A process without network access is
+ * given a unix socket to a broker that connects sockets to the server on
+ * its behalf, and passes them over with SCM_RIGHTS.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_BROKER_H_
+#define _VHD_SYNC_XT_BROKER_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+//
+// Both ways, a message is a vhd_sync_xt_broker_message. We ask for count
+// sockets, and the broker answers with as many as it could connect, count
+// in the message and the sockets themselves attached to it. An answer of
+// none means there are no more to be had.
+//
+#define VHD_SYNC_XT_BROKER_MAGIC                    0x52425356  // "VSBR"
+#define VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS          16
+
+/* ---------------- Structure Defines -------------------------------------- */
+typedef struct _vhd_sync_xt_broker_message
+{
+    uint32_t magic;
+    uint32_t count;
+
+} vhd_sync_xt_broker_message, *pvhd_sync_xt_broker_message;
+
+/* ---------------- Function Declarations -----------------------------------*/
+bool
+vhd_sync_xt_broker_request_sockets(
+    int broker_fd,
+    int count,
+    int* sockets,
+    int* received
+    );
+
+bool
+vhd_sync_xt_broker_read_request(
+    int broker_fd,
+    int* count
+    );
+
+bool
+vhd_sync_xt_broker_send_sockets(
+    int broker_fd,
+    int* sockets,
+    int count
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_BROKER_H_
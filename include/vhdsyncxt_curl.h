@@ -30,26 +30,189 @@
 
 /* ---------------- External Header includes ------------------------------- */
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
 
 
 /* ---------------- Internal Header includes ------------------------------- */
 #include <vhdsyncxt_errorlog.h>
+#include <vhdsyncxt_broker.h>
+#include <vhdsyncxt_session.h>
+#include <vhdsyncxt_tune.h>
 
 /* ---------------- PreProcessor Defines ----------------------------------- */
 #define VHD_SYNC_XT_HTTP_HEADER_REQ_SIZE                100
+#define VHD_SYNC_XT_CURL_WAIT_TIMEOUT_MS                1000
+#define VHD_SYNC_XT_CURL_MAX_EVENTS                     32
 
 /* ---------------- Structure Defines -------------------------------------- */
+
+//
+// Everything the event loop watches is an event: the sockets curl asks us
+// to watch, the timer curl asks us to keep, and any fds and timers of our
+// own added by callers.
+//
+typedef enum _vhd_sync_xt_curl_event_type
+{
+    VHD_SYNC_XT_CURL_EVENT_SOCKET,
+    VHD_SYNC_XT_CURL_EVENT_CURL_TIMER,
+    VHD_SYNC_XT_CURL_EVENT_FD,
+    VHD_SYNC_XT_CURL_EVENT_TIMER
+
+} vhd_sync_xt_curl_event_type;
+
+//
+// Called when an fd of ours is readable or a timer of ours expires. A
+// callback returning FALSE fails the wait it was called from.
+//
+typedef bool (*vhd_sync_xt_curl_event_callback)(void* user_data);
+
+typedef struct _vhd_sync_xt_curl_event
+{
+    vhd_sync_xt_curl_event_type type;
+    int fd;
+
+    vhd_sync_xt_curl_event_callback callback;
+    void* user_data;
+
+    //
+    // Set once the event is removed. It is only freed after the events
+    // that are being dispatched are done with, as any of them may remove
+    // any other.
+    //
+    bool removed;
+
+    struct _vhd_sync_xt_curl_event *next;
+
+} vhd_sync_xt_curl_event, *pvhd_sync_xt_curl_event;
+
+//
+// One pool of connections, DNS answers and TLS sessions for every transfer
+// in the process, whichever configuration it comes from. Curl takes the
+// lock for a kind of data before it touches it, so the pool can be used
+// from more than one thread.
+//
+typedef struct _vhd_sync_xt_curl_share
+{
+    CURLSH *sharehandle;
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+
+    //
+    // Number of configurations using the pool. The last one out cleans it
+    // up.
+    //
+    int references;
+
+} vhd_sync_xt_curl_share, *pvhd_sync_xt_curl_share;
+
 typedef struct _vhd_sync_xt_curl_config
 {
     CURL *curlhandle;
 
     //
-    // Connected socket to server.
+    // Multi handle that drives all our transfers, so that they share one
+    // connection cache.
+    //
+    CURLM *multihandle;
+
+    //
+    // The pool of the process, which every handle of ours is set to use.
+    //
+    pvhd_sync_xt_curl_share share;
+
+    //
+    // Longest a wait for the transfers blocks.
+    //
+    int wait_timeout_ms;
+
+    //
+    // The event loop that drives the multi handle. Curl tells us which
+    // sockets to watch and when to call it back, and we do the waiting.
+    //
+    int epoll_fd;
+    pvhd_sync_xt_curl_event curl_timer;
+    pvhd_sync_xt_curl_event events;
+    pvhd_sync_xt_curl_event removed_events;
+
+    //
+    // Connected socket to server, and whether curl has closed it. It is
+    // only good for the one connection.
     //
     int connection_socket;
+    bool connection_socket_closed;
+
+    //
+    // Unix socket to a broker that hands us more connected sockets, the
+    // ones it gave that curl has not taken yet, and whether it has run out.
+    //
+    int broker_fd;
+    int spare_sockets[VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS];
+    int spare_count;
+    bool broker_exhausted;
+
+    //
+    // Speak HTTP/2, so that transfers run as streams of one connection.
+    //
+    bool http2;
+
+    //
+    // File to keep TLS sessions in between runs, NULL for none, how long
+    // they are kept for, and the cache for the url set.
+    //
+    char *session_cache_path;
+    long int session_timeout;
+    pvhd_sync_xt_session_cache session_cache;
+
+    //
+    // Congestion control algorithm each socket gets, NULL for the system
+    // default, and the receive buffer, 0 to leave it to the kernel.
+    //
+    char *congestion;
+    unsigned long int receive_buffer;
 
 } vhd_sync_xt_curl_config, *pvhd_sync_xt_curl_config;
 
+//
+// A transfer is an extra easy handle, duplicated from the configured one,
+// that runs alongside other transfers on the multi handle.
+//
+typedef struct _vhd_sync_xt_curl_transfer
+{
+    CURL *curlhandle;
+
+    //
+    // Set while the transfer is added to the multi handle.
+    //
+    bool active;
+
+    //
+    // Set once the transfer has completed, along with its result.
+    //
+    bool done;
+    CURLcode result;
+
+    //
+    // Socket of the connection the transfer completed on, which curl keeps
+    // for the next one, CURL_SOCKET_BAD if there was none. Curl only tells
+    // it while the transfer is in the multi handle.
+    //
+    curl_socket_t socket;
+
+    //
+    // Set while the transfer is held up by its write callback returning
+    // CURL_WRITEFUNC_PAUSE, until it is resumed.
+    //
+    bool paused;
+
+    //
+    // Extra request headers, owned by the transfer.
+    //
+    struct curl_slist *headers;
+
+} vhd_sync_xt_curl_transfer, *pvhd_sync_xt_curl_transfer;
+
 /* ---------------- Function Declarations -----------------------------------*/
 bool
 vhd_sync_xt_create_curl_config(
@@ -97,5 +260,168 @@ vhd_sync_xt_set_curl_data_range(
     unsigned long int end_offset
     );
 
+bool
+vhd_sync_xt_create_curl_transfer(
+    pvhd_sync_xt_curl_config curl_config,
+    pvhd_sync_xt_curl_transfer* transfer
+    );
+
+void
+vhd_sync_xt_destroy_curl_transfer(
+    pvhd_sync_xt_curl_config curl_config,
+    pvhd_sync_xt_curl_transfer transfer
+    );
+
+bool
+vhd_sync_xt_set_curl_transfer_write(
+    pvhd_sync_xt_curl_transfer transfer,
+    void* header_callback,
+    void* write_callback,
+    void* user_data
+    );
+
+bool
+vhd_sync_xt_set_curl_transfer_range(
+    pvhd_sync_xt_curl_transfer transfer,
+    unsigned long int start_offset,
+    unsigned long int end_offset
+    );
+
+bool
+vhd_sync_xt_set_curl_transfer_open_range(
+    pvhd_sync_xt_curl_transfer transfer,
+    unsigned long int start_offset
+    );
+
+bool
+vhd_sync_xt_set_curl_transfer_ranges(
+    pvhd_sync_xt_curl_transfer transfer,
+    unsigned long int* start_offsets,
+    unsigned long int* end_offsets,
+    int count
+    );
+
+bool
+vhd_sync_xt_set_curl_transfer_url(
+    pvhd_sync_xt_curl_transfer transfer,
+    char* url
+    );
+
+bool
+vhd_sync_xt_set_curl_transfer_header(
+    pvhd_sync_xt_curl_transfer transfer,
+    const char* header
+    );
+
+bool
+vhd_sync_xt_start_curl_transfer(
+    pvhd_sync_xt_curl_config curl_config,
+    pvhd_sync_xt_curl_transfer transfer
+    );
+
+void
+vhd_sync_xt_stop_curl_transfer(
+    pvhd_sync_xt_curl_config curl_config,
+    pvhd_sync_xt_curl_transfer transfer
+    );
+
+void
+vhd_sync_xt_resume_curl_transfer(
+    pvhd_sync_xt_curl_config curl_config,
+    pvhd_sync_xt_curl_transfer transfer
+    );
+
+bool
+vhd_sync_xt_set_curl_broker(
+    pvhd_sync_xt_curl_config curl_config,
+    int broker_fd,
+    int connections
+    );
+
+bool
+vhd_sync_xt_can_open_curl_connection(
+    pvhd_sync_xt_curl_config curl_config
+    );
+
+void
+vhd_sync_xt_set_curl_http2(
+    pvhd_sync_xt_curl_config curl_config,
+    bool http2
+    );
+
+void
+vhd_sync_xt_set_curl_session_cache(
+    pvhd_sync_xt_curl_config curl_config,
+    char* session_cache_path,
+    long int session_timeout
+    );
+
+bool
+vhd_sync_xt_set_curl_low_speed(
+    pvhd_sync_xt_curl_config curl_config,
+    long int low_speed_limit,
+    long int low_speed_time
+    );
+
+void
+vhd_sync_xt_set_curl_wait_timeout(
+    pvhd_sync_xt_curl_config curl_config,
+    int wait_timeout_ms
+    );
+
+bool
+vhd_sync_xt_wait_curl_transfers(
+    pvhd_sync_xt_curl_config curl_config
+    );
+
+bool
+vhd_sync_xt_add_curl_event(
+    pvhd_sync_xt_curl_config curl_config,
+    int fd,
+    vhd_sync_xt_curl_event_callback callback,
+    void* user_data,
+    pvhd_sync_xt_curl_event* event
+    );
+
+bool
+vhd_sync_xt_add_curl_timer(
+    pvhd_sync_xt_curl_config curl_config,
+    int interval_ms,
+    vhd_sync_xt_curl_event_callback callback,
+    void* user_data,
+    pvhd_sync_xt_curl_event* event
+    );
+
+void
+vhd_sync_xt_remove_curl_event(
+    pvhd_sync_xt_curl_config curl_config,
+    pvhd_sync_xt_curl_event event
+    );
+
+long
+vhd_sync_xt_get_curl_transfer_response_code(
+    pvhd_sync_xt_curl_transfer transfer
+    );
+
+void
+vhd_sync_xt_get_curl_transfer_times(
+    pvhd_sync_xt_curl_transfer transfer,
+    unsigned long int* first_byte_usec,
+    unsigned long int* total_usec
+    );
+
+bool
+vhd_sync_xt_get_curl_transfer_socket(
+    pvhd_sync_xt_curl_transfer transfer,
+    int* socket
+    );
+
+void
+vhd_sync_xt_set_curl_socket_tuning(
+    pvhd_sync_xt_curl_config curl_config,
+    char* congestion,
+    unsigned long int receive_buffer
+    );
+
 #endif  // ifndef _VHD_SYNC_XT_CURL_H_
 
@@ -30,29 +30,371 @@
 /* ---------------- External Header includes ------------------------------- */
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 /* ---------------- Internal Header includes ------------------------------- */
 #include <vhdsyncxt_errorlog.h>
 #include <vhdsyncxt_curl.h>
+#include <vhdsyncxt_resumemap.h>
+#include <vhdsyncxt_writer.h>
+#include <vhdsyncxt_verify.h>
+#include <vhdsyncxt_header.h>
+#include <vhdsyncxt_mirror.h>
+#include <vhdsyncxt_validators.h>
+#include <vhdsyncxt_multipart.h>
+#include <vhdsyncxt_transport.h>
+#include <vhdsyncxt_limiter.h>
 
 /* ---------------- PreProcessor Defines ----------------------------------- */
 
 #define VHD_SYNC_XT_PARTIAL_FILE_EXTENSION              ".part"
-#define VHD_SYNC_XT_DEFAULT_CHUNK_SIZE                  10000000
 #define VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH             100
+#define VHD_SYNC_XT_URL_LENGTH                          2048
 
+//
+// Chunks are whole VHD blocks, and always start on a block boundary.
+//
+#define VHD_SYNC_XT_VHD_BLOCK_SIZE                      (2 * 1024 * 1024)
+#define VHD_SYNC_XT_DEFAULT_CHUNK_SIZE                  (5 * VHD_SYNC_XT_VHD_BLOCK_SIZE)
+#define VHD_SYNC_XT_MINIMUM_CHUNK_SIZE                  VHD_SYNC_XT_VHD_BLOCK_SIZE
+#define VHD_SYNC_XT_MAXIMUM_CHUNK_SIZE                  (64 * VHD_SYNC_XT_VHD_BLOCK_SIZE)
+
+//
+// The adaptive controller sizes chunks so that the time to first byte is
+// about a tenth of the time a chunk takes, but never lets a chunk take longer
+// than a few seconds, so a failure does not waste much.
+//
+#define VHD_SYNC_XT_ADAPTIVE_OVERHEAD_RATIO             9
+#define VHD_SYNC_XT_ADAPTIVE_MAXIMUM_CHUNK_USEC         4000000
+#define VHD_SYNC_XT_ADAPTIVE_INITIAL_STREAMS            2
+#define VHD_SYNC_XT_ADAPTIVE_WINDOW_CHUNKS              4
+
+
+//
+// A range that fails is asked for again from where it got to, a few times,
+// waiting twice as long each time. The wait is jittered so that ranges that
+// failed together do not all come back at once.
+//
+#define VHD_SYNC_XT_RETRY_LIMIT                         5
+#define VHD_SYNC_XT_RETRY_BASE_MS                       250
+#define VHD_SYNC_XT_RETRY_MAXIMUM_MS                    8000
+
+//
+// A range slower than the low speed limit over a stall window is stalled.
+// Once nothing is left to hand out, idle ranges send a hedge for the rest
+// of a stalled range, or take half of what is left of the biggest one. Curl
+// gives up on a transfer that gets nothing for the low speed time, and it
+// is retried.
+//
+#define VHD_SYNC_XT_STALL_LOW_SPEED_LIMIT               (16 * 1024)
+#define VHD_SYNC_XT_STALL_WINDOW_MS                     2000
+#define VHD_SYNC_XT_STALL_LOW_SPEED_TIME                30
+#define VHD_SYNC_XT_SPLIT_MINIMUM_SIZE                  (2 * VHD_SYNC_XT_VHD_BLOCK_SIZE)
+
+//
+// When a partial file has many holes smaller than a chunk, each request
+// asks for up to this many of them at once, never more than a chunk in
+// all. A server that merges them into one range is only followed
+// while that does not more than double what is sent.
+//
+#define VHD_SYNC_XT_GATHER_MAXIMUM_RANGES               64
+#define VHD_SYNC_XT_GATHER_MINIMUM_HOLES                4
+#define VHD_SYNC_XT_GATHER_MAXIMUM_MERGE                2
+
+//
+// Commands read from the control fd, one per line.
+//
+#define VHD_SYNC_XT_CONTROL_LINE_LENGTH                 128
+#define VHD_SYNC_XT_CONTROL_RATE_LIMIT                  "ratelimit"
+#define VHD_SYNC_XT_CONTROL_RATE_BURST                  "rateburst"
 
 #define VHD_SYNC_XT_ERROR_FILE_EXISTS                   1000
+#define VHD_SYNC_XT_ERROR_NOT_MODIFIED                  1001
 
 /* ---------------- Structure Defines -------------------------------------- */
+
+//
+// Tunables for a download, filled in from the commandline parameters.
+//
+typedef struct _vhd_sync_xt_download_options
+{
+    //
+    // Number of ranged requests to keep in flight at once.
+    //
+    int parallel_streams;
+
+    //
+    // Let the controller pick the chunk size and the number of ranges in
+    // flight, up to parallel_streams.
+    //
+    bool adaptive;
+
+    //
+    // Get the file in one open ended range request instead of chunks.
+    //
+    bool stream;
+
+    //
+    // Leave blocks of zeros out of the partial file.
+    //
+    bool sparse;
+
+    //
+    // Size of the buffer each range gathers data in before writing it out.
+    //
+    size_t write_buffer_size;
+
+    //
+    // Backend the partial file is written with.
+    //
+    vhd_sync_xt_writer_type writer_type;
+
+    //
+    // Keep the data written out of the page cache.
+    //
+    bool writeback;
+
+    //
+    // Check the file against the hash in its synchash before keeping it.
+    //
+    bool verify;
+
+    //
+    // Cap on the bytes per second received over all ranges together, 0 for
+    // none, and how many bytes can go through at once.
+    //
+    unsigned long int rate_limit;
+    unsigned long int rate_burst;
+
+    //
+    // File descriptor commands are read from while downloading, 0 for none.
+    //
+    int control_fd;
+
+    //
+    // Run the ranges as streams of one HTTP/2 connection.
+    //
+    bool http2;
+
+    //
+    // Unix socket to get a connected socket from for each range, 0 for
+    // none.
+    //
+    int broker_fd;
+
+    //
+    // File TLS sessions are kept in between runs, NULL for none, and how
+    // many seconds they are kept for.
+    //
+    char *session_cache;
+    long int session_timeout;
+
+    //
+    // More urls with the same file, which ranges are fetched from too.
+    //
+    char **mirrors;
+    int mirror_count;
+
+    //
+    // Splice the body from the connected socket into the file, rather than
+    // have curl hand it over.
+    //
+    bool splice;
+
+    //
+    // Size the receive buffer of each connection to the link once the first
+    // chunks are in, and the congestion control algorithm, NULL for the
+    // system default.
+    //
+    bool autotune;
+    char *congestion;
+
+} vhd_sync_xt_download_options, *pvhd_sync_xt_download_options;
+
+//
+// State of the adaptive chunk size and concurrency controller.
+//
+typedef struct _vhd_sync_xt_download_controller
+{
+    //
+    // Smoothed per chunk measurements, bytes/sec and usec.
+    //
+    unsigned long int throughput;
+    unsigned long int first_byte_usec;
+
+    //
+    // Aggregate throughput is measured over windows of completed chunks,
+    // and the number of ranges in flight moved in the direction that
+    // improves it.
+    //
+    struct timespec window_start;
+    unsigned long int window_bytes;
+    int window_chunks;
+    unsigned long int last_window_throughput;
+    int direction;
+
+} vhd_sync_xt_download_controller, *pvhd_sync_xt_download_controller;
+
+//
+// Tuning of the sockets to the link. The bytes of the first chunks over the
+// time they took, and the lowest round trip time the kernel had for their
+// connections, give the bandwidth-delay product the receive buffer is sized
+// to.
+//
+typedef struct _vhd_sync_xt_download_tuning
+{
+    struct timespec start;
+    unsigned long int bytes;
+    int samples;
+
+    unsigned long int rtt_usec;
+    unsigned long int throughput;
+
+    //
+    // Set once the buffer is chosen, 0 if there was nothing to go on, and
+    // what the kernel last reported for a socket given it.
+    //
+    bool done;
+    unsigned long int receive_buffer;
+    unsigned long int socket_buffer;
+
+    //
+    // Socket of a transport to tune, -1 if there is none, and the congestion
+    // control algorithm the connections ended up with.
+    //
+    int socket;
+    char congestion[VHD_SYNC_XT_TUNE_CONGESTION_LENGTH];
+
+} vhd_sync_xt_download_tuning, *pvhd_sync_xt_download_tuning;
+
+//
+// Counters reported when the download ends.
+//
+typedef struct _vhd_sync_xt_download_stats
+{
+    unsigned long int retries;
+    unsigned long int hedges;
+    unsigned long int splits;
+    unsigned long int gathers;
+
+    //
+    // Bytes received that could not be kept.
+    //
+    unsigned long int wasted_bytes;
+
+} vhd_sync_xt_download_stats, *pvhd_sync_xt_download_stats;
+
+struct _vhd_sync_xt_download_context;
+
+//
+// A small body received into memory.
+//
+typedef struct _vhd_sync_xt_download_buffer
+{
+    char *data;
+    size_t size;
+    size_t length;
+
+} vhd_sync_xt_download_buffer, *pvhd_sync_xt_download_buffer;
+
+//
+// State of one ranged request. Each range writes at its own offset into the
+// partial file, so ranges can complete in any order.
+//
+typedef struct _vhd_sync_xt_download_range
+{
+    struct _vhd_sync_xt_download_context *download_context;
+
+    pvhd_sync_xt_curl_transfer transfer;
+
+    //
+    // Inclusive byte range requested, and the offset the next byte received
+    // gets written to.
+    //
+    unsigned long int start_offset;
+    unsigned long int end_offset;
+    unsigned long int write_offset;
+
+    //
+    // Offset the current request started at. A retry keeps what came
+    // before and asks for the rest, so this is past start_offset then.
+    //
+    unsigned long int request_offset;
+
+    //
+    // Retries used on this chunk, and when the next one is due. A range
+    // waiting for a retry is not idle.
+    //
+    int retries;
+    bool retry_pending;
+    struct timespec retry_at;
+
+    //
+    // Set if data could not be written out, which no retry fixes.
+    //
+    bool write_failed;
+
+    //
+    // Offset and time at the start of the current stall window, and whether
+    // the last window was below the low speed limit.
+    //
+    unsigned long int window_offset;
+    struct timespec window_start;
+    bool stalled;
+
+    //
+    // A hedge asks for the rest of a stalled range. The two point at each
+    // other until one of them gets data, and the other gives way: a hedge
+    // is cancelled, a stalled range is cut short where the hedge starts.
+    //
+    struct _vhd_sync_xt_download_range *hedge;
+    bool hedging;
+    bool cancelled;
+
+    //
+    // Mirror the current request went to, NULL between requests, and the
+    // one the last request went to.
+    //
+    pvhd_sync_xt_mirror mirror;
+    pvhd_sync_xt_mirror last_mirror;
+
+    //
+    // A gathering range asks for many holes in one request, and works
+    // through them in order, start_offset to end_offset being the one it is
+    // on. gather_index is -1 until the response has been checked.
+    //
+    bool gathering;
+    unsigned long int gather_starts[VHD_SYNC_XT_GATHER_MAXIMUM_RANGES];
+    unsigned long int gather_ends[VHD_SYNC_XT_GATHER_MAXIMUM_RANGES];
+    int gather_count;
+    int gather_index;
+    vhd_sync_xt_multipart multipart;
+
+    //
+    // Data received is gathered here and written out in large blocks. The
+    // buffer holds the buffer_length bytes just before write_offset.
+    //
+    char *buffer;
+    size_t buffer_size;
+    size_t buffer_length;
+
+    //
+    // Headers of the last response.
+    //
+    vhd_sync_xt_http_headers headers;
+
+} vhd_sync_xt_download_range, *pvhd_sync_xt_download_range;
+
 typedef struct _vhd_sync_xt_download_context
 {
     pvhd_sync_xt_curl_config    curl_config; // not owned by this module
     
+    vhd_sync_xt_download_options options;
+
     //
-    // File pointer we are writing out data to.
+    // Writes the data out to the partial file.
     //
-    FILE *out;
+    pvhd_sync_xt_writer writer;
 
     //
     // Offset to download from for partial downloads.
@@ -62,9 +404,83 @@ typedef struct _vhd_sync_xt_download_context
     unsigned long int chunk_size;
 
     //
-    // Current state of our download.
+    // Set if the server advertises byte ranges, and the headers of the
+    // first response that told us the size.
+    //
+    bool accept_ranges;
+    vhd_sync_xt_http_headers headers;
+
+    //
+    // Where the file can be fetched from, url first. Responses from the
+    // others have to match the first response.
+    //
+    vhd_sync_xt_mirror_set mirror_set;
+
+    //
+    // Validators of the file on the server, if it has any, and whether the
+    // first response said the image we have is still current.
+    //
+    vhd_sync_xt_validators validators;
+    bool has_validators;
+    bool not_modified;
+
+    //
+    // Blocks of the file we have, kept next to the partial file.
+    //
+    pvhd_sync_xt_resume_map resume_map;
+
+    //
+    // Hash of the file built up as it comes in, when verifying.
+    //
+    pvhd_sync_xt_verify verify;
+
+    //
+    // Current state of our download. current_offset counts the bytes of the
+    // file we have, next_offset is where the next range gets scheduled from.
     //
     unsigned long int current_offset;
+    unsigned long int next_offset;
+
+    //
+    // Where the next gathering request looks for holes from, and whether
+    // the server gave up on being asked for many at once.
+    //
+    unsigned long int gather_offset;
+    bool gather_stopped;
+
+    //
+    // Where the run a transport is passing on started and has got to, so
+    // each piece marks the blocks it completes.
+    //
+    unsigned long int run_start;
+    unsigned long int run_end;
+
+    //
+    // One range per parallel stream, of which target_streams are kept busy.
+    //
+    pvhd_sync_xt_download_range ranges;
+    int target_streams;
+
+    vhd_sync_xt_download_controller controller;
+
+    vhd_sync_xt_limiter limiter;
+
+    vhd_sync_xt_download_stats stats;
+
+    vhd_sync_xt_download_tuning tuning;
+
+    //
+    // Seed for the jitter of retries.
+    //
+    unsigned int retry_seed;
+
+    //
+    // The control fd is watched by the event loop, and the partial command
+    // line read from it kept here.
+    //
+    pvhd_sync_xt_curl_event control_event;
+    char control_line[VHD_SYNC_XT_CONTROL_LINE_LENGTH];
+    size_t control_length;
 
     //
     // pointers to download parameters.
@@ -96,6 +512,7 @@ vhd_sync_xt_create_download_context(
     char* ca_path,
     char* credentials,
     int progress_fd,
+    pvhd_sync_xt_download_options options,
     pvhd_sync_xt_download_context* download_context
     );
 
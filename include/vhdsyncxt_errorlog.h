@@ -46,6 +46,12 @@
 #define MAX_ERROR_COUNT                              30
 #define MAX_ERROR_SIZE                             1024
 
+//
+// Most of a url or path put in an error, so that the rest of the message
+// still fits.
+//
+#define MAX_ERROR_NAME_SIZE                         512
+
 #define VHD_SYNC_XT_ERRORLOG(...)  	\
     {\
         if (g_error_log_count < MAX_ERROR_COUNT) \
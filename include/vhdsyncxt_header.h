@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for parsing the
+ * headers of HTTP responses, one line at a time as curl hands them over.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_HEADER_H_
+#define _VHD_SYNC_XT_HEADER_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+#include <limits.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+//
+// Longest header value we keep. Validators are opaque to us and only ever
+// sent back, so one that does not fit is dropped rather than cut short.
+//
+#define VHD_SYNC_XT_HEADER_VALUE_LENGTH             256
+
+//
+// A multipart boundary is at most 70 characters.
+//
+#define VHD_SYNC_XT_HEADER_BOUNDARY_LENGTH          71
+
+#define VHD_SYNC_XT_HEADER_CONTENT_LENGTH           "Content-Length"
+#define VHD_SYNC_XT_HEADER_CONTENT_RANGE            "Content-Range"
+#define VHD_SYNC_XT_HEADER_ACCEPT_RANGES            "Accept-Ranges"
+#define VHD_SYNC_XT_HEADER_ETAG                     "ETag"
+#define VHD_SYNC_XT_HEADER_LAST_MODIFIED            "Last-Modified"
+#define VHD_SYNC_XT_HEADER_CONTENT_TYPE             "Content-Type"
+#define VHD_SYNC_XT_HEADER_MULTIPART_BYTERANGES     "multipart/byteranges"
+
+/* ---------------- Structure Defines -------------------------------------- */
+
+//
+// What we care about in the headers of a response. Everything is reset by
+// the status line, so after redirects and interim responses only the last
+// response is left.
+//
+typedef struct _vhd_sync_xt_http_headers
+{
+    long status_code;
+
+    //
+    // Set once the blank line ending the headers has been seen.
+    //
+    bool complete;
+
+    bool has_content_length;
+    unsigned long int content_length;
+
+    //
+    // Content-Range: bytes range_start-range_end/total_size. Either part
+    // may be missing, "*" in the header.
+    //
+    bool has_range;
+    unsigned long int range_start;
+    unsigned long int range_end;
+    bool has_total_size;
+    unsigned long int total_size;
+
+    bool accept_ranges;
+
+    char etag[VHD_SYNC_XT_HEADER_VALUE_LENGTH];
+    char last_modified[VHD_SYNC_XT_HEADER_VALUE_LENGTH];
+
+    //
+    // Set for a multipart/byteranges body, along with its boundary.
+    //
+    bool multipart;
+    char boundary[VHD_SYNC_XT_HEADER_BOUNDARY_LENGTH];
+
+} vhd_sync_xt_http_headers, *pvhd_sync_xt_http_headers;
+
+/* ---------------- Function Declarations -----------------------------------*/
+void
+vhd_sync_xt_reset_http_headers(
+    pvhd_sync_xt_http_headers headers
+    );
+
+void
+vhd_sync_xt_parse_http_header(
+    pvhd_sync_xt_http_headers headers,
+    const char* line,
+    size_t length
+    );
+
+bool
+vhd_sync_xt_http_headers_size(
+    pvhd_sync_xt_http_headers headers,
+    unsigned long int* file_size
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_HEADER_H_
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for the token
+ * bucket that caps the bandwidth of a download over all its connections.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_LIMITER_H_
+#define _VHD_SYNC_XT_LIMITER_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+#include <time.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+//
+// Without a burst given, the limiter lets through a tenth of a second worth
+// of data at once, so pacing stays smooth, but never less than this.
+//
+#define VHD_SYNC_XT_RATE_MINIMUM_BURST                  (64 * 1024)
+
+/* ---------------- Structure Defines -------------------------------------- */
+
+//
+// Token bucket shared by all ranges. Each write callback takes as many
+// tokens as it has bytes, which can leave the bucket below zero, and ranges
+// are paused until it refills.
+//
+typedef struct _vhd_sync_xt_limiter
+{
+    unsigned long int rate;
+    unsigned long int burst;
+    long int tokens;
+    struct timespec last_refill;
+
+} vhd_sync_xt_limiter, *pvhd_sync_xt_limiter;
+
+/* ---------------- Function Declarations -----------------------------------*/
+void
+vhd_sync_xt_set_rate_limit(
+    pvhd_sync_xt_limiter limiter,
+    unsigned long int rate,
+    unsigned long int burst
+    );
+
+void
+vhd_sync_xt_refill_tokens(
+    pvhd_sync_xt_limiter limiter
+    );
+
+bool
+vhd_sync_xt_take_tokens(
+    pvhd_sync_xt_limiter limiter,
+    size_t length
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_LIMITER_H_
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for keeping score
+ * of the mirrors an image is fetched from. Every range goes to the mirror
+ * expected to serve it fastest, and mirrors that keep failing, or that turn
+ * out to have a different file, are dropped.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_MIRROR_H_
+#define _VHD_SYNC_XT_MIRROR_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+#include <vhdsyncxt_header.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+//
+// The url given and up to seven more.
+//
+#define VHD_SYNC_XT_MIRROR_SET_SIZE                 8
+
+//
+// A mirror is dropped after this many failed requests in a row, or once it
+// has failed more than the given share of enough requests.
+//
+#define VHD_SYNC_XT_MIRROR_MAXIMUM_FAILURES         3
+#define VHD_SYNC_XT_MIRROR_MINIMUM_REQUESTS         8
+#define VHD_SYNC_XT_MIRROR_MAXIMUM_FAILURE_PERCENT  50
+
+/* ---------------- Structure Defines -------------------------------------- */
+typedef struct _vhd_sync_xt_mirror
+{
+    char *url;
+
+    //
+    // Smoothed throughput of the requests to this mirror in bytes/sec, 0
+    // until one has completed.
+    //
+    unsigned long int throughput;
+
+    //
+    // Requests in flight now, and totals so far.
+    //
+    int active;
+    unsigned long int requests;
+    unsigned long int failures;
+    unsigned long int consecutive_failures;
+    unsigned long int bytes;
+
+    bool dropped;
+
+} vhd_sync_xt_mirror, *pvhd_sync_xt_mirror;
+
+typedef struct _vhd_sync_xt_mirror_set
+{
+    vhd_sync_xt_mirror mirrors[VHD_SYNC_XT_MIRROR_SET_SIZE];
+    int mirror_count;
+
+} vhd_sync_xt_mirror_set, *pvhd_sync_xt_mirror_set;
+
+/* ---------------- Function Declarations -----------------------------------*/
+bool
+vhd_sync_xt_add_mirror(
+    pvhd_sync_xt_mirror_set mirror_set,
+    char* url
+    );
+
+pvhd_sync_xt_mirror
+vhd_sync_xt_pick_mirror(
+    pvhd_sync_xt_mirror_set mirror_set,
+    pvhd_sync_xt_mirror avoid
+    );
+
+void
+vhd_sync_xt_begin_mirror_request(
+    pvhd_sync_xt_mirror mirror
+    );
+
+void
+vhd_sync_xt_end_mirror_request(
+    pvhd_sync_xt_mirror mirror,
+    unsigned long int bytes,
+    unsigned long int usec,
+    bool success
+    );
+
+bool
+vhd_sync_xt_mirror_consistent(
+    pvhd_sync_xt_http_headers reference,
+    unsigned long int file_size,
+    pvhd_sync_xt_http_headers headers
+    );
+
+void
+vhd_sync_xt_drop_mirror(
+    pvhd_sync_xt_mirror mirror
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_MIRROR_H_
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for parsing a
+ * multipart/byteranges body as it arrives. Each part says which bytes of
+ * the file it holds, so its body is handed on as it comes in rather than
+ * searched for the boundary, and nothing but the lines around the parts is
+ * ever buffered.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_MULTIPART_H_
+#define _VHD_SYNC_XT_MULTIPART_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+#include <vhdsyncxt_header.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+//
+// Longest line outside the body of a part we take, a boundary or a header
+// of a part.
+//
+#define VHD_SYNC_XT_MULTIPART_LINE_LENGTH           512
+
+/* ---------------- Structure Defines -------------------------------------- */
+
+//
+// Called with the data of a part, offset is where in the file it goes.
+// Returning FALSE stops the parse.
+//
+typedef bool (*vhd_sync_xt_multipart_callback)(
+    void* user_data,
+    unsigned long int offset,
+    const char* data,
+    size_t length
+    );
+
+typedef enum _vhd_sync_xt_multipart_state
+{
+    MULTIPART_STATE_PREAMBLE = 0,
+    MULTIPART_STATE_BOUNDARY,
+    MULTIPART_STATE_HEADERS,
+    MULTIPART_STATE_BODY,
+    MULTIPART_STATE_DONE,
+    MULTIPART_STATE_ERROR
+} vhd_sync_xt_multipart_state, *pvhd_sync_xt_multipart_state;
+
+typedef struct _vhd_sync_xt_multipart
+{
+    vhd_sync_xt_multipart_state state;
+
+    char boundary[VHD_SYNC_XT_HEADER_BOUNDARY_LENGTH];
+
+    //
+    // The line being put together, until its end arrives.
+    //
+    char line[VHD_SYNC_XT_MULTIPART_LINE_LENGTH];
+    size_t line_length;
+
+    //
+    // Headers of the part being parsed, and where its body is up to.
+    //
+    vhd_sync_xt_http_headers part_headers;
+    unsigned long int offset;
+    unsigned long int remaining;
+
+    //
+    // Set when the body is one part with nothing around it, a plain
+    // partial response.
+    //
+    bool single;
+
+    vhd_sync_xt_multipart_callback callback;
+    void *user_data;
+
+} vhd_sync_xt_multipart, *pvhd_sync_xt_multipart;
+
+/* ---------------- Function Declarations -----------------------------------*/
+void
+vhd_sync_xt_reset_multipart(
+    pvhd_sync_xt_multipart multipart,
+    const char* boundary,
+    vhd_sync_xt_multipart_callback callback,
+    void* user_data
+    );
+
+bool
+vhd_sync_xt_expect_single_part(
+    pvhd_sync_xt_multipart multipart,
+    pvhd_sync_xt_http_headers headers
+    );
+
+bool
+vhd_sync_xt_parse_multipart(
+    pvhd_sync_xt_multipart multipart,
+    const char* data,
+    size_t length
+    );
+
+bool
+vhd_sync_xt_multipart_complete(
+    pvhd_sync_xt_multipart multipart
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_MULTIPART_H_
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for a minimal
+ * HTTP/1.1 range client over a socket that is already connected to the
+ * server. It does what a download needs: GET with a range, the headers of
+ * the response parsed here, and a body with a Content-Length. The body is
+ * moved from the socket to the partial file with splice through a pipe, so
+ * it never enters user space. Over TLS that takes the kernel to decrypt the
+ * records (kTLS), otherwise the body is decrypted by OpenSSL and copied.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_RAW_HTTP_H_
+#define _VHD_SYNC_XT_RAW_HTTP_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+#include <openssl/ssl.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+#include <vhdsyncxt_header.h>
+#include <vhdsyncxt_writer.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+#define VHD_SYNC_XT_RAW_HTTP_HOST_LENGTH            256
+#define VHD_SYNC_XT_RAW_HTTP_PATH_LENGTH            2048
+#define VHD_SYNC_XT_RAW_HTTP_REQUEST_LENGTH         (VHD_SYNC_XT_RAW_HTTP_PATH_LENGTH + 1024)
+#define VHD_SYNC_XT_RAW_HTTP_RANGE_LENGTH           64
+
+//
+// The headers of a response have to fit in the buffer. Whatever of the body
+// came in with them is written from there, the rest is spliced.
+//
+#define VHD_SYNC_XT_RAW_HTTP_BUFFER_SIZE            (16 * 1024)
+
+//
+// Size asked for the pipe the body goes through, which is how much moves
+// per splice. The kernel may give less.
+//
+#define VHD_SYNC_XT_RAW_HTTP_PIPE_SIZE              (1024 * 1024)
+
+//
+// Size of the buffer a body decrypted in user space is written out from.
+//
+#define VHD_SYNC_XT_RAW_HTTP_COPY_SIZE              (1024 * 1024)
+
+//
+// How long to wait on the socket before giving up on the server.
+//
+#define VHD_SYNC_XT_RAW_HTTP_TIMEOUT_MS             30000
+
+/* ---------------- Structure Defines -------------------------------------- */
+
+typedef struct _vhd_sync_xt_raw_http
+{
+    //
+    // Connected socket, not owned by this module.
+    //
+    int socket;
+
+    //
+    // Where requests go, from the url.
+    //
+    char host[VHD_SYNC_XT_RAW_HTTP_HOST_LENGTH];
+    char path[VHD_SYNC_XT_RAW_HTTP_PATH_LENGTH];
+
+    //
+    // Headers of the last response, and how much of its body is still to
+    // be read.
+    //
+    vhd_sync_xt_http_headers headers;
+    unsigned long int remaining;
+
+    //
+    // Data read from the socket not used yet, the start of a body.
+    //
+    char buffer[VHD_SYNC_XT_RAW_HTTP_BUFFER_SIZE];
+    size_t buffer_start;
+    size_t buffer_length;
+
+    //
+    // Pipe the body is spliced through, and how much it holds.
+    //
+    int pipe_fds[2];
+    size_t pipe_size;
+
+    //
+    // TLS session for https:// urls, NULL for plaintext. When the kernel
+    // has taken over receiving records the body is still spliced, and
+    // otherwise goes through the copy buffer.
+    //
+    SSL_CTX *ssl_ctx;
+    SSL *ssl;
+    bool ktls;
+    char *copy_buffer;
+
+} vhd_sync_xt_raw_http, *pvhd_sync_xt_raw_http;
+
+/* ---------------- Function Declarations -----------------------------------*/
+bool
+vhd_sync_xt_create_raw_http(
+    int socket,
+    const char* url,
+    const char* ca_cert,
+    const char* ca_path,
+    pvhd_sync_xt_raw_http* raw_http
+    );
+
+void
+vhd_sync_xt_destroy_raw_http(
+    pvhd_sync_xt_raw_http raw_http
+    );
+
+bool
+vhd_sync_xt_raw_http_request(
+    pvhd_sync_xt_raw_http raw_http,
+    const char* path,
+    unsigned long int start_offset,
+    unsigned long int end_offset,
+    const char* header
+    );
+
+bool
+vhd_sync_xt_raw_http_read_body(
+    pvhd_sync_xt_raw_http raw_http,
+    char* data,
+    size_t length
+    );
+
+bool
+vhd_sync_xt_raw_http_splice_body(
+    pvhd_sync_xt_raw_http raw_http,
+    pvhd_sync_xt_writer writer,
+    unsigned long int offset,
+    size_t length
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_RAW_HTTP_H_
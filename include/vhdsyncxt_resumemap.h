@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for the resume map,
+ * the sidecar of a partial download that records which blocks of it are
+ * complete and on disk.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_RESUME_MAP_H_
+#define _VHD_SYNC_XT_RESUME_MAP_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+#include <time.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+#define VHD_SYNC_XT_RESUME_MAP_EXTENSION            ".map"
+#define VHD_SYNC_XT_RESUME_MAP_MAGIC                "VHDSXMAP"
+#define VHD_SYNC_XT_RESUME_MAP_MAGIC_SIZE           8
+#define VHD_SYNC_XT_RESUME_MAP_VERSION              1
+
+//
+// A map can carry the state of a hash of the file after its bitmap, so
+// hashing picks up where it was.
+//
+#define VHD_SYNC_XT_RESUME_MAP_HASH_MAGIC           "VHDSXSHA"
+#define VHD_SYNC_XT_RESUME_MAP_HASH_STATE_SIZE      256
+
+//
+// Writing the map needs an fdatasync of the partial file first, so batch
+// marks up and write them out at most this often.
+//
+#define VHD_SYNC_XT_RESUME_MAP_FLUSH_BYTES          (64 * 1024 * 1024)
+#define VHD_SYNC_XT_RESUME_MAP_FLUSH_SECONDS        5
+
+/* ---------------- Structure Defines -------------------------------------- */
+
+//
+// On disk the header is followed by one bit per unit, set once the unit is
+// complete.
+//
+typedef struct _vhd_sync_xt_resume_map_header
+{
+    char                 magic[VHD_SYNC_XT_RESUME_MAP_MAGIC_SIZE]; // Offset 0
+    unsigned int         version;                                  // Offset 8
+    unsigned int         unit_size;                                // Offset 12
+    unsigned long int    file_size;                                // Offset 16
+    unsigned long int    unit_count;                               // Offset 24
+                                                            // Total Size : 32
+} vhd_sync_xt_resume_map_header, *pvhd_sync_xt_resume_map_header;
+
+//
+// The hash of the first offset bytes of the file, stopped part way.
+//
+typedef struct _vhd_sync_xt_resume_map_hash
+{
+    char                 magic[VHD_SYNC_XT_RESUME_MAP_MAGIC_SIZE]; // Offset 0
+    unsigned long int    offset;                                   // Offset 8
+    unsigned int         state_size;                               // Offset 16
+    unsigned int         reserved;                                 // Offset 20
+    unsigned char        state[VHD_SYNC_XT_RESUME_MAP_HASH_STATE_SIZE];
+                                                                   // Offset 24
+                                                           // Total Size : 280
+} vhd_sync_xt_resume_map_hash, *pvhd_sync_xt_resume_map_hash;
+
+typedef struct _vhd_sync_xt_resume_map
+{
+    vhd_sync_xt_resume_map_header header;
+
+    int fd;
+    unsigned char *bitmap;
+    size_t bitmap_size;
+
+    //
+    // Set if the map file had anything in it, and if that was a valid map
+    // for this file that we read back.
+    //
+    bool existed;
+    bool loaded;
+
+    //
+    // Hash state kept with the map, if any.
+    //
+    vhd_sync_xt_resume_map_hash hash;
+    bool has_hash;
+
+    //
+    // Marks not written out yet.
+    //
+    unsigned long int pending_bytes;
+    time_t last_flush;
+
+    char path[VHD_SYNC_XT_PATH_LENGTH];
+
+} vhd_sync_xt_resume_map, *pvhd_sync_xt_resume_map;
+
+/* ---------------- Function Declarations -----------------------------------*/
+bool
+vhd_sync_xt_open_resume_map(
+    char* partial_file_path,
+    unsigned long int file_size,
+    unsigned int unit_size,
+    pvhd_sync_xt_resume_map* resume_map
+    );
+
+void
+vhd_sync_xt_destroy_resume_map(
+    pvhd_sync_xt_resume_map resume_map
+    );
+
+void
+vhd_sync_xt_resume_map_set(
+    pvhd_sync_xt_resume_map resume_map,
+    unsigned long int start_offset,
+    unsigned long int end_offset
+    );
+
+unsigned long int
+vhd_sync_xt_resume_map_complete_bytes(
+    pvhd_sync_xt_resume_map resume_map
+    );
+
+bool
+vhd_sync_xt_resume_map_next_missing(
+    pvhd_sync_xt_resume_map resume_map,
+    unsigned long int offset,
+    unsigned long int* start_offset,
+    unsigned long int* end_offset
+    );
+
+void
+vhd_sync_xt_resume_map_set_hash(
+    pvhd_sync_xt_resume_map resume_map,
+    unsigned long int offset,
+    void* state,
+    unsigned int state_size
+    );
+
+bool
+vhd_sync_xt_resume_map_get_hash(
+    pvhd_sync_xt_resume_map resume_map,
+    unsigned long int* offset,
+    void* state,
+    unsigned int state_size
+    );
+
+bool
+vhd_sync_xt_flush_resume_map(
+    pvhd_sync_xt_resume_map resume_map,
+    int data_fd,
+    bool force
+    );
+
+bool
+vhd_sync_xt_remove_resume_map(
+    pvhd_sync_xt_resume_map resume_map
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_RESUME_MAP_H_
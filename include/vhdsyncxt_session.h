@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for keeping TLS
+ * sessions in a file between runs, so that the first handshake of a run
+ * can resume a session from the last one rather than start from scratch.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_SESSION_H_
+#define _VHD_SYNC_XT_SESSION_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <openssl/ssl.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+//
+// The file is a vhd_sync_xt_session_file_header followed by records, each
+// a vhd_sync_xt_session_record, its key and its session in DER. A key has
+// up to VHD_SYNC_XT_SESSION_CACHE_DEPTH records, the last sessions seen for
+// it. Servers may take a TLS 1.3 ticket only once, so each connection is
+// offered one of its own.
+//
+#define VHD_SYNC_XT_SESSION_CACHE_MAGIC             0x43535356  // "VSSC"
+#define VHD_SYNC_XT_SESSION_CACHE_MAXIMUM_SIZE      (1024 * 1024)
+#define VHD_SYNC_XT_SESSION_KEY_LENGTH              1024
+#define VHD_SYNC_XT_SESSION_CACHE_DEPTH             8
+
+/* ---------------- Structure Defines -------------------------------------- */
+typedef struct _vhd_sync_xt_session_file_header
+{
+    uint32_t magic;
+    uint32_t record_count;
+
+} vhd_sync_xt_session_file_header, *pvhd_sync_xt_session_file_header;
+
+typedef struct _vhd_sync_xt_session_record
+{
+    uint32_t key_length;
+    uint32_t session_length;
+    int64_t expires;
+
+} vhd_sync_xt_session_record, *pvhd_sync_xt_session_record;
+
+typedef struct _vhd_sync_xt_session_cache
+{
+    char *path;
+
+    //
+    // Which server, and which CAs it was checked against. A session is
+    // only offered to the server it came from, under the same CAs.
+    //
+    char key[VHD_SYNC_XT_SESSION_KEY_LENGTH];
+
+    //
+    // Longest a session is kept for, in seconds, shorter if the server
+    // says so.
+    //
+    long int timeout;
+
+    //
+    // The sessions found in the file, not yet offered. One goes to each new
+    // connection curl has none of its own for.
+    //
+    SSL_SESSION *sessions[VHD_SYNC_XT_SESSION_CACHE_DEPTH];
+    int session_count;
+
+    //
+    // The last sessions the server gave us, oldest first, written out when
+    // the cache is destroyed.
+    //
+    SSL_SESSION *new_sessions[VHD_SYNC_XT_SESSION_CACHE_DEPTH];
+    int new_session_count;
+
+} vhd_sync_xt_session_cache, *pvhd_sync_xt_session_cache;
+
+/* ---------------- Function Declarations -----------------------------------*/
+bool
+vhd_sync_xt_create_session_cache(
+    const char* path,
+    const char* key,
+    long int timeout,
+    pvhd_sync_xt_session_cache* session_cache
+    );
+
+void
+vhd_sync_xt_destroy_session_cache(
+    pvhd_sync_xt_session_cache session_cache
+    );
+
+bool
+vhd_sync_xt_attach_session_cache(
+    pvhd_sync_xt_session_cache session_cache,
+    SSL_CTX* ssl_ctx
+    );
+
+bool
+vhd_sync_xt_save_session_cache(
+    pvhd_sync_xt_session_cache session_cache
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_SESSION_H_
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for the
+ * transports, the backends that fetch ranges of the image from wherever it
+ * is. Each one tells the size and validators of the file, and reads ranges
+ * of it into a sink, with a condition that the file has not changed. A sink
+ * takes data in memory, and those transports that can put data into the
+ * partial file themselves do so when the sink has a writer.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_TRANSPORT_H_
+#define _VHD_SYNC_XT_TRANSPORT_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+#include <vhdsyncxt_curl.h>
+#include <vhdsyncxt_header.h>
+#include <vhdsyncxt_multipart.h>
+#include <vhdsyncxt_rawhttp.h>
+#include <vhdsyncxt_writer.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+#define VHD_SYNC_XT_TRANSPORT_URL_LENGTH            2048
+
+//
+// Most ranges a single read takes.
+//
+#define VHD_SYNC_XT_TRANSPORT_MAXIMUM_RANGES        64
+
+//
+// Most a transport moves before telling the sink, so that progress is seen
+// within a long range. A VHD block.
+//
+#define VHD_SYNC_XT_TRANSPORT_PIECE_SIZE            (2 * 1024 * 1024)
+
+//
+// Size of the buffer data read into memory goes through.
+//
+#define VHD_SYNC_XT_TRANSPORT_BUFFER_SIZE           (1024 * 1024)
+
+/* ---------------- Structure Defines -------------------------------------- */
+
+typedef enum _vhd_sync_xt_transport_type
+{
+    VHD_SYNC_XT_TRANSPORT_CURL = 0,
+    VHD_SYNC_XT_TRANSPORT_RAW,
+    VHD_SYNC_XT_TRANSPORT_FILE,
+    VHD_SYNC_XT_TRANSPORT_MOCK,
+    VHD_SYNC_XT_TRANSPORT_TYPE_COUNT
+} vhd_sync_xt_transport_type, *pvhd_sync_xt_transport_type;
+
+//
+// Called once data the transport put into the file itself is there.
+// Returning FALSE stops the read.
+//
+typedef bool (*vhd_sync_xt_transport_written_callback)(
+    void* user_data,
+    unsigned long int offset,
+    size_t length
+    );
+
+typedef struct _vhd_sync_xt_transport_sink
+{
+    //
+    // Takes data in memory, with where in the file it goes.
+    //
+    vhd_sync_xt_multipart_callback data;
+
+    //
+    // Told about data put into the writer, NULL if it never is.
+    //
+    vhd_sync_xt_transport_written_callback written;
+    pvhd_sync_xt_writer writer;
+
+    void *user_data;
+
+} vhd_sync_xt_transport_sink, *pvhd_sync_xt_transport_sink;
+
+//
+// How to get to the server, for the transports that go over the network.
+//
+typedef struct _vhd_sync_xt_transport_options
+{
+    int connection_socket;
+    char *ca_cert;
+    char *ca_path;
+    char *credentials;
+
+} vhd_sync_xt_transport_options, *pvhd_sync_xt_transport_options;
+
+struct _vhd_sync_xt_transport;
+
+//
+// Each backend fills in these. open sets up what the backend needs. stat
+// fills in the headers of the file, as a server would send them for it,
+// with a 304 if the condition says we have it already. read puts ranges of
+// the file, or of a file next to it named by a suffix, into a sink. It
+// fails if the condition, an If-Range, no longer holds.
+//
+typedef struct _vhd_sync_xt_transport_ops
+{
+    const char *name;
+
+    bool (*open)(struct _vhd_sync_xt_transport *transport,
+                 pvhd_sync_xt_transport_options options);
+    bool (*stat)(struct _vhd_sync_xt_transport *transport,
+                 const char *condition,
+                 pvhd_sync_xt_http_headers headers);
+    bool (*read)(struct _vhd_sync_xt_transport *transport,
+                 const char *suffix,
+                 unsigned long int *start_offsets,
+                 unsigned long int *end_offsets,
+                 int count,
+                 const char *condition,
+                 pvhd_sync_xt_transport_sink sink);
+    void (*close)(struct _vhd_sync_xt_transport *transport);
+
+} vhd_sync_xt_transport_ops, *pvhd_sync_xt_transport_ops;
+
+typedef struct _vhd_sync_xt_transport
+{
+    const vhd_sync_xt_transport_ops *ops;
+    vhd_sync_xt_transport_type type;
+
+    char url[VHD_SYNC_XT_TRANSPORT_URL_LENGTH];
+
+    //
+    // What stat found, which reads are checked against.
+    //
+    vhd_sync_xt_http_headers headers;
+    unsigned long int file_size;
+
+    //
+    // Buffer data is read into, for the backends that need one.
+    //
+    char *buffer;
+
+    //
+    // Backend state.
+    //
+    pvhd_sync_xt_curl_config curl_config;
+    pvhd_sync_xt_raw_http raw_http;
+    bool body_pending;
+    int fd;
+    bool copy_range;
+    const char *mock_data;
+    unsigned long int mock_size;
+
+    //
+    // The read in flight, for those backends that take the body in
+    // callbacks. Data outside the ranges asked for is dropped.
+    //
+    vhd_sync_xt_http_headers response;
+    vhd_sync_xt_multipart multipart;
+    unsigned long int *start_offsets;
+    unsigned long int *end_offsets;
+    int count;
+    bool checked;
+    bool suffixed;
+    bool conditional;
+    pvhd_sync_xt_transport_sink sink;
+
+    //
+    // Number of reads sent, one per request for the network backends.
+    //
+    unsigned long int requests;
+
+} vhd_sync_xt_transport, *pvhd_sync_xt_transport;
+
+/* ---------------- Function Declarations -----------------------------------*/
+bool
+vhd_sync_xt_open_transport(
+    const char* url,
+    vhd_sync_xt_transport_type type,
+    pvhd_sync_xt_transport_options options,
+    pvhd_sync_xt_transport* transport
+    );
+
+bool
+vhd_sync_xt_open_mock_transport(
+    const char* data,
+    unsigned long int size,
+    const char* etag,
+    pvhd_sync_xt_transport* transport
+    );
+
+void
+vhd_sync_xt_close_transport(
+    pvhd_sync_xt_transport transport
+    );
+
+const char*
+vhd_sync_xt_transport_name(
+    pvhd_sync_xt_transport transport
+    );
+
+bool
+vhd_sync_xt_transport_stat(
+    pvhd_sync_xt_transport transport,
+    const char* condition,
+    pvhd_sync_xt_http_headers headers
+    );
+
+bool
+vhd_sync_xt_transport_read(
+    pvhd_sync_xt_transport transport,
+    const char* suffix,
+    unsigned long int* start_offsets,
+    unsigned long int* end_offsets,
+    int count,
+    const char* condition,
+    pvhd_sync_xt_transport_sink sink
+    );
+
+bool
+vhd_sync_xt_transport_read_range(
+    pvhd_sync_xt_transport transport,
+    const char* suffix,
+    unsigned long int start_offset,
+    unsigned long int end_offset,
+    const char* condition,
+    pvhd_sync_xt_transport_sink sink
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_TRANSPORT_H_
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for tuning the
+ * sockets of a download to the link: the receive buffer sized to the
+ * bandwidth-delay product measured over the first chunks, and the
+ * congestion control algorithm.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_TUNE_H_
+#define _VHD_SYNC_XT_TUNE_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+//
+// Longest name of a congestion control algorithm, with its terminator.
+//
+#define VHD_SYNC_XT_TUNE_CONGESTION_LENGTH          16
+
+//
+// Bounds of the receive buffer we ask for. Below the lower one the kernel
+// does better on its own, and the upper one keeps a bad estimate from
+// pinning much memory per connection.
+//
+#define VHD_SYNC_XT_TUNE_MINIMUM_RECEIVE_BUFFER     (256 * 1024)
+#define VHD_SYNC_XT_TUNE_MAXIMUM_RECEIVE_BUFFER     (64 * 1024 * 1024)
+
+//
+// Chunks completed before the estimate is taken.
+//
+#define VHD_SYNC_XT_TUNE_SAMPLES                    4
+
+/* ---------------- Function Declarations -----------------------------------*/
+unsigned long int
+vhd_sync_xt_tune_buffer_size(
+    unsigned long int throughput,
+    unsigned long int rtt_usec
+    );
+
+bool
+vhd_sync_xt_tune_rtt(
+    int socket,
+    unsigned long int* rtt_usec
+    );
+
+bool
+vhd_sync_xt_tune_receive_buffer(
+    int socket,
+    unsigned long int size,
+    unsigned long int* receive_buffer
+    );
+
+bool
+vhd_sync_xt_tune_set_congestion(
+    int socket,
+    const char* congestion
+    );
+
+bool
+vhd_sync_xt_tune_get_congestion(
+    int socket,
+    char* congestion,
+    size_t length
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_TUNE_H_
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for keeping the
+ * validators of the file on the server (ETag, Last-Modified and size) in a
+ * sidecar next to the image and next to the partial file. They let a run
+ * ask the server whether an image changed without transferring it, and
+ * tell a partial file of an older version of the image from one of the
+ * current version.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_VALIDATORS_H_
+#define _VHD_SYNC_XT_VALIDATORS_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+#include <vhdsyncxt_header.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+#define VHD_SYNC_XT_VALIDATORS_EXTENSION            ".validators"
+#define VHD_SYNC_XT_VALIDATORS_MAGIC                "VHDSXVAL"
+#define VHD_SYNC_XT_VALIDATORS_MAGIC_SIZE           8
+#define VHD_SYNC_XT_VALIDATORS_VERSION              1
+
+//
+// Longest conditional header we build, name and value.
+//
+#define VHD_SYNC_XT_VALIDATORS_HEADER_LENGTH        (VHD_SYNC_XT_HEADER_VALUE_LENGTH + 32)
+
+/* ---------------- Structure Defines -------------------------------------- */
+
+//
+// This is also how the sidecar is laid out on disk. Either validator may be
+// empty, but not both.
+//
+typedef struct _vhd_sync_xt_validators
+{
+    char                 magic[VHD_SYNC_XT_VALIDATORS_MAGIC_SIZE]; // Offset 0
+    unsigned int         version;                                  // Offset 8
+    unsigned int         reserved;                                 // Offset 12
+    unsigned long int    file_size;                                // Offset 16
+    char                 etag[VHD_SYNC_XT_HEADER_VALUE_LENGTH];    // Offset 24
+    char                 last_modified[VHD_SYNC_XT_HEADER_VALUE_LENGTH];
+                                                                   // Offset 280
+                                                           // Total Size : 536
+} vhd_sync_xt_validators, *pvhd_sync_xt_validators;
+
+/* ---------------- Function Declarations -----------------------------------*/
+bool
+vhd_sync_xt_validators_from_headers(
+    pvhd_sync_xt_http_headers headers,
+    unsigned long int file_size,
+    pvhd_sync_xt_validators validators
+    );
+
+bool
+vhd_sync_xt_validators_match(
+    pvhd_sync_xt_validators validators,
+    pvhd_sync_xt_http_headers headers,
+    unsigned long int file_size
+    );
+
+bool
+vhd_sync_xt_validators_condition(
+    pvhd_sync_xt_validators validators,
+    bool if_range,
+    char* header,
+    size_t length
+    );
+
+bool
+vhd_sync_xt_load_validators(
+    const char* file_path,
+    pvhd_sync_xt_validators validators
+    );
+
+bool
+vhd_sync_xt_save_validators(
+    const char* file_path,
+    pvhd_sync_xt_validators validators
+    );
+
+bool
+vhd_sync_xt_move_validators(
+    const char* from_file_path,
+    const char* to_file_path
+    );
+
+void
+vhd_sync_xt_remove_validators(
+    const char* file_path
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_VALIDATORS_H_
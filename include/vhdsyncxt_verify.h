@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for verifying a
+ * download against the hash of the whole file in its synchash.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_VERIFY_H_
+#define _VHD_SYNC_XT_VERIFY_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+#include <openssl/sha.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+#include <vhdsyncxt_synchash.h>
+#include <vhdsyncxt_resumemap.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+//
+// Size of the buffer data already in the file is read back through.
+//
+#define VHD_SYNC_XT_VERIFY_READ_SIZE                (1024 * 1024)
+
+/* ---------------- Structure Defines -------------------------------------- */
+
+//
+// The hash of the file is built up in order. offset is how many bytes from
+// the start have gone into it.
+//
+typedef struct _vhd_sync_xt_verify
+{
+    SHA_CTX sha1_context;
+    unsigned long int offset;
+
+    unsigned char expected[VHD_SYNC_XT_SHA1_HASH_SIZE];
+
+    char *buffer;
+
+} vhd_sync_xt_verify, *pvhd_sync_xt_verify;
+
+/* ---------------- Function Declarations -----------------------------------*/
+bool
+vhd_sync_xt_create_verify(
+    unsigned char* expected,
+    pvhd_sync_xt_verify* verify
+    );
+
+void
+vhd_sync_xt_destroy_verify(
+    pvhd_sync_xt_verify verify
+    );
+
+void
+vhd_sync_xt_verify_update(
+    pvhd_sync_xt_verify verify,
+    const char* data,
+    unsigned long int offset,
+    size_t length
+    );
+
+bool
+vhd_sync_xt_verify_read(
+    pvhd_sync_xt_verify verify,
+    int fd,
+    unsigned long int end_offset
+    );
+
+void
+vhd_sync_xt_verify_save(
+    pvhd_sync_xt_verify verify,
+    pvhd_sync_xt_resume_map resume_map
+    );
+
+void
+vhd_sync_xt_verify_load(
+    pvhd_sync_xt_verify verify,
+    pvhd_sync_xt_resume_map resume_map
+    );
+
+bool
+vhd_sync_xt_verify_check(
+    pvhd_sync_xt_verify verify
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_VERIFY_H_
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the header file that contains the declarations for the writers,
+ * the backends that put downloaded data into the partial file.
+ *
+ */
+
+#ifndef _VHD_SYNC_XT_WRITER_H_
+#define _VHD_SYNC_XT_WRITER_H_
+
+/* ---------------- External Header includes ------------------------------- */
+#include <stdio.h>
+#include <sys/uio.h>
+
+/* ---------------- Internal Header includes ------------------------------- */
+#include <vhdsyncxt_errorlog.h>
+
+/* ---------------- PreProcessor Defines ----------------------------------- */
+
+//
+// Granularity at which runs of zeros are left out of the partial file.
+//
+#define VHD_SYNC_XT_SPARSE_BLOCK_SIZE                   4096
+
+//
+// O_DIRECT writes need the buffer, offset and length aligned to this.
+// Anything that is not goes through the page cache.
+//
+#define VHD_SYNC_XT_WRITER_DIRECT_ALIGNMENT             4096
+
+#define VHD_SYNC_XT_WRITER_URING_ENTRIES                8
+
+//
+// With writeback on, writeback of data is started as soon as it is written,
+// and once more than this much is waiting the oldest is waited for and
+// dropped from the page cache.
+//
+#define VHD_SYNC_XT_WRITER_WRITEBACK_BYTES              (32 * 1024 * 1024)
+#define VHD_SYNC_XT_WRITER_WRITEBACK_REGIONS            64
+
+/* ---------------- Structure Defines -------------------------------------- */
+
+typedef enum _vhd_sync_xt_writer_type
+{
+    VHD_SYNC_XT_WRITER_PWRITE = 0,
+    VHD_SYNC_XT_WRITER_DIRECT,
+    VHD_SYNC_XT_WRITER_URING,
+    VHD_SYNC_XT_WRITER_MMAP,
+    VHD_SYNC_XT_WRITER_TYPE_COUNT
+} vhd_sync_xt_writer_type, *pvhd_sync_xt_writer_type;
+
+struct _vhd_sync_xt_writer;
+struct _vhd_sync_xt_writer_uring;
+
+//
+// A region of the file under writeback.
+//
+typedef struct _vhd_sync_xt_writer_region
+{
+    unsigned long int offset;
+    unsigned long int length;
+
+} vhd_sync_xt_writer_region, *pvhd_sync_xt_writer_region;
+
+//
+// Each backend fills in these. open and close set up and tear down what the
+// backend needs on top of the file descriptor, write puts a block of data at
+// an offset.
+//
+typedef struct _vhd_sync_xt_writer_ops
+{
+    const char *name;
+
+    bool (*open)(struct _vhd_sync_xt_writer *writer);
+    bool (*write)(struct _vhd_sync_xt_writer *writer,
+                  const char *data,
+                  size_t length,
+                  unsigned long int offset);
+    void (*close)(struct _vhd_sync_xt_writer *writer);
+
+} vhd_sync_xt_writer_ops, *pvhd_sync_xt_writer_ops;
+
+typedef struct _vhd_sync_xt_writer
+{
+    const vhd_sync_xt_writer_ops *ops;
+    vhd_sync_xt_writer_type type;
+
+    //
+    // Leave blocks of zeros out of the file.
+    //
+    bool sparse;
+
+    //
+    // Keep the data written out of the page cache, oldest region first in a
+    // ring of them.
+    //
+    bool writeback;
+    vhd_sync_xt_writer_region regions[VHD_SYNC_XT_WRITER_WRITEBACK_REGIONS];
+    int region_head;
+    int region_count;
+    unsigned long int writeback_bytes;
+
+    //
+    // Buffered descriptor of the file, which every backend has, and how far
+    // the file extends with data that may not be zero.
+    //
+    int fd;
+    unsigned long int file_end;
+    unsigned long int file_size;
+
+    //
+    // Backend state.
+    //
+    int direct_fd;
+    char *mapping;
+    size_t mapping_length;
+    struct _vhd_sync_xt_writer_uring *uring;
+
+} vhd_sync_xt_writer, *pvhd_sync_xt_writer;
+
+/* ---------------- Function Declarations -----------------------------------*/
+bool
+vhd_sync_xt_writer_type_from_name(
+    const char* name,
+    pvhd_sync_xt_writer_type type
+    );
+
+const char*
+vhd_sync_xt_writer_name(
+    vhd_sync_xt_writer_type type
+    );
+
+bool
+vhd_sync_xt_open_writer(
+    char* path,
+    vhd_sync_xt_writer_type type,
+    unsigned long int file_size,
+    bool sparse,
+    bool writeback,
+    pvhd_sync_xt_writer* writer
+    );
+
+void
+vhd_sync_xt_destroy_writer(
+    pvhd_sync_xt_writer writer
+    );
+
+bool
+vhd_sync_xt_writer_register_buffers(
+    pvhd_sync_xt_writer writer,
+    struct iovec* buffers,
+    int buffer_count
+    );
+
+bool
+vhd_sync_xt_writer_reserve(
+    pvhd_sync_xt_writer writer,
+    unsigned long int offset,
+    unsigned long int length
+    );
+
+bool
+vhd_sync_xt_writer_write(
+    pvhd_sync_xt_writer writer,
+    const char* data,
+    size_t length,
+    unsigned long int offset
+    );
+
+bool
+vhd_sync_xt_writer_splice(
+    pvhd_sync_xt_writer writer,
+    int pipe_fd,
+    size_t length,
+    unsigned long int offset
+    );
+
+bool
+vhd_sync_xt_writer_copy_range(
+    pvhd_sync_xt_writer writer,
+    int source_fd,
+    unsigned long int source_offset,
+    size_t length,
+    unsigned long int offset
+    );
+
+bool
+vhd_sync_xt_writer_finish(
+    pvhd_sync_xt_writer writer
+    );
+
+bool
+vhd_sync_xt_is_zero(
+    const char *data,
+    size_t length
+    );
+
+#endif  // ifndef _VHD_SYNC_XT_WRITER_H_
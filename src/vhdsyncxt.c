@@ -98,6 +98,17 @@ vhd_sync_xt_destroy_config(
         return;
     }
     
+    //
+    // If we have a download context, destroy it. Its transfers belong to the
+    // curl config so this has to happen first.
+    //
+    if (config->parameters != NULL
+        && config->parameters->action == ACTION_DOWNLOAD
+        && config->download_context != NULL)
+    {
+        vhd_sync_xt_destroy_download_context(config->download_context);
+    }
+
     //
     // If we have the parameters struct, destroy it.
     //
@@ -137,9 +148,43 @@ vhd_sync_xt_process_download(
 {
     bool status;
     int return_code;
+    vhd_sync_xt_download_options options;
 
     return_code = 1;
 
+    memset(&options, 0, sizeof(options));
+    options.parallel_streams = config->parameters->parallel_streams;
+    options.adaptive = config->parameters->adaptive;
+    options.stream = config->parameters->stream;
+    options.sparse = config->parameters->sparse;
+    options.writeback = config->parameters->writeback;
+    options.verify = config->parameters->verify;
+    options.rate_limit = (unsigned long int)config->parameters->rate_limit_kb * 1024;
+    options.rate_burst = (unsigned long int)config->parameters->rate_burst_kb * 1024;
+    options.control_fd = config->parameters->control_fd;
+    options.http2 = config->parameters->http2;
+    options.broker_fd = config->parameters->broker_fd;
+    options.session_cache = config->parameters->session_cache;
+    options.session_timeout = config->parameters->session_timeout;
+    options.mirrors = config->parameters->mirrors;
+    options.mirror_count = config->parameters->mirror_count;
+    options.splice = config->parameters->splice;
+    options.autotune = config->parameters->autotune;
+    options.congestion = config->parameters->congestion;
+    options.write_buffer_size = (size_t)config->parameters->write_buffer_mb
+                                * 1024 * 1024;
+
+    status = vhd_sync_xt_writer_type_from_name(config->parameters->writer,
+                                               &options.writer_type
+                                               );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_process_download: Unknown writer %s.\n",
+                             config->parameters->writer);
+        return_code = 1;
+        goto End;
+    }
+
     status = vhd_sync_xt_create_download_context(config->curl_config,
                                                  config->parameters->localpath,
                                                  config->parameters->imageuuid,
@@ -148,6 +193,7 @@ vhd_sync_xt_process_download(
                                                  config->parameters->ca_path,
                                                  config->parameters->credentials,
                                                  config->parameters->progress_fd,
+                                                 &options,
                                                  &config->download_context
                                                  );
     if (status == false)
@@ -161,9 +207,11 @@ vhd_sync_xt_process_download(
     if (return_code != 0)
     {
         //
-        // If file already exists then dont return an error code
+        // If file already exists, or is still what the server has, then
+        // dont return an error code
         //
-        if (return_code == VHD_SYNC_XT_ERROR_FILE_EXISTS)
+        if (return_code == VHD_SYNC_XT_ERROR_FILE_EXISTS
+            || return_code == VHD_SYNC_XT_ERROR_NOT_MODIFIED)
         {
             return_code = 0;
             goto End;
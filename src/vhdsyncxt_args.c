@@ -45,7 +45,44 @@ vhd_sync_xt_usage =
 	"  --connectionfd [filedes]    Specifies the connected socket to send/recieve data from the server\n"\
 	"  --cacert [certificate file] Specifies the certificate file of the server.\n"\
 	"  --capath [ca path]          Specifies the certificate path of the server cert.\n"\
-    "  --credentials [<username>:<passwd>] Specifies the login credentials for the server.\n";
+    "  --credentials [<username>:<passwd>] Specifies the login credentials for the server.\n"\
+	"  --parallel [count]          Specifies the number of ranged requests to keep in flight.\n"\
+    "                                  Defaults to 1.\n"\
+	"  --adaptive                  Adapts the chunk size and the number of ranged requests\n"\
+    "                                  in flight (up to --parallel) to the link.\n"\
+	"  --stream                    Gets the file in a single request, falling back to\n"\
+    "                                  chunks if the server does not support it.\n"\
+	"  --sparse                    Leaves blocks of zeros out of the downloaded file.\n"\
+	"  --writebuffer [MB]          Specifies the size of the buffer each request gathers data\n"\
+    "                                  in before writing it out. Defaults to 4.\n"\
+	"  --writer [NAME]             Specifies how the file gets written, one of pwrite,\n"\
+    "                                  direct, uring or mmap. Defaults to pwrite.\n"\
+	"  --writeback                 Writes data back to disk as it comes in and drops it\n"\
+    "                                  from the page cache, bounding dirty memory.\n"\
+	"  --verify                    Checks the downloaded file against the SHA1 in the\n"\
+    "                                  header of its synchash, [url].synchash.\n"\
+	"  --ratelimit [KB/s]          Caps the download bandwidth over all connections.\n"\
+	"  --rateburst [KB]            Specifies how much data can go through at once under\n"\
+    "                                  the cap. Defaults to a tenth of a second.\n"\
+	"  --controlfd [filedes]       Specifies a file descriptor to read commands from while\n"\
+    "                                  downloading, \"ratelimit [KB/s]\" or \"rateburst [KB]\".\n"\
+	"  --http2                     Runs the ranged requests as HTTP/2 streams on a single\n"\
+    "                                  connection, if the server agrees to HTTP/2.\n"\
+	"  --brokerfd [filedes]        Specifies a unix socket to get more connected sockets to\n"\
+    "                                  the server from, one per ranged request in flight.\n"\
+	"  --sessioncache [file]       Specifies a file to keep TLS sessions in, so that the next\n"\
+    "                                  run resumes them rather than starting over.\n"\
+	"  --sessiontimeout [seconds]  Specifies how long TLS sessions are kept for.\n"\
+    "                                  Defaults to 3600.\n"\
+	"  --mirror [server url]       Specifies another URL with the same file, which ranges\n"\
+    "                                  are fetched from as well. Can be given up to 7 times.\n"\
+	"  --splice                    Moves the body from the --connectionfd socket straight into\n"\
+    "                                  the file with splice. Over https:// the kernel has to\n"\
+    "                                  support kTLS, otherwise the body is copied.\n"\
+	"  --autotune                  Sizes the receive buffer of each connection to the\n"\
+    "                                  bandwidth-delay product seen over the first chunks.\n"\
+	"  --congestion [name]         Specifies the TCP congestion control algorithm of the\n"\
+    "                                  connections, one of tcp_allowed_congestion_control.\n";
 
 
 typedef enum
@@ -64,7 +101,26 @@ _vhd_sync_xt_option_enum
     OPTION_CONNECTION_SOCKET,
     OPTION_CA_CERT,
     OPTION_CA_PATH,
-    OPTION_CREDENTIALS
+    OPTION_CREDENTIALS,
+    OPTION_PARALLEL_STREAMS,
+    OPTION_ADAPTIVE,
+    OPTION_STREAM,
+    OPTION_SPARSE,
+    OPTION_WRITE_BUFFER,
+    OPTION_WRITER,
+    OPTION_WRITEBACK,
+    OPTION_VERIFY,
+    OPTION_RATE_LIMIT,
+    OPTION_RATE_BURST,
+    OPTION_CONTROL_FD,
+    OPTION_HTTP2,
+    OPTION_BROKER_FD,
+    OPTION_SESSION_CACHE,
+    OPTION_SESSION_TIMEOUT,
+    OPTION_MIRROR,
+    OPTION_SPLICE,
+    OPTION_AUTOTUNE,
+    OPTION_CONGESTION
 }vhd_sync_xt_option_enum, *pvhd_sync_xt_option_enum;
 
 struct option 
@@ -83,6 +139,25 @@ vhd_sync_xt_option_flags[] =
     {"cacert",          required_argument,  0,  OPTION_CA_CERT},
     {"capath",          required_argument,  0,  OPTION_CA_PATH},
     {"credentials",     required_argument,  0,  OPTION_CREDENTIALS},
+    {"parallel",        required_argument,  0,  OPTION_PARALLEL_STREAMS},
+    {"adaptive",        no_argument,        0,  OPTION_ADAPTIVE},
+    {"stream",          no_argument,        0,  OPTION_STREAM},
+    {"sparse",          no_argument,        0,  OPTION_SPARSE},
+    {"writebuffer",     required_argument,  0,  OPTION_WRITE_BUFFER},
+    {"writer",          required_argument,  0,  OPTION_WRITER},
+    {"writeback",       no_argument,        0,  OPTION_WRITEBACK},
+    {"verify",          no_argument,        0,  OPTION_VERIFY},
+    {"ratelimit",       required_argument,  0,  OPTION_RATE_LIMIT},
+    {"rateburst",       required_argument,  0,  OPTION_RATE_BURST},
+    {"controlfd",       required_argument,  0,  OPTION_CONTROL_FD},
+    {"http2",           no_argument,        0,  OPTION_HTTP2},
+    {"brokerfd",        required_argument,  0,  OPTION_BROKER_FD},
+    {"sessioncache",    required_argument,  0,  OPTION_SESSION_CACHE},
+    {"sessiontimeout",  required_argument,  0,  OPTION_SESSION_TIMEOUT},
+    {"mirror",          required_argument,  0,  OPTION_MIRROR},
+    {"splice",          no_argument,        0,  OPTION_SPLICE},
+    {"autotune",        no_argument,        0,  OPTION_AUTOTUNE},
+    {"congestion",      required_argument,  0,  OPTION_CONGESTION},
 	{0,}
 };
 
@@ -124,6 +199,10 @@ vhd_sync_xt_create_parameters(
     parameters_local->progress_fd =  0;
     parameters_local->connection_socket = 0;
     parameters_local->localpath = VHD_SYNC_XT_DEFAULT_PATH;
+    parameters_local->parallel_streams = VHD_SYNC_XT_DEFAULT_PARALLEL_STREAMS;
+    parameters_local->write_buffer_mb = VHD_SYNC_XT_DEFAULT_WRITE_BUFFER_MB;
+    parameters_local->writer = VHD_SYNC_XT_DEFAULT_WRITER;
+    parameters_local->session_timeout = VHD_SYNC_XT_DEFAULT_SESSION_TIMEOUT;
 
     *parameters = parameters_local;
     parameters_local = NULL;
@@ -237,6 +316,86 @@ vhd_sync_xt_check_parameters(
             goto End;
         }
 
+        if (parameters->parallel_streams < 1
+            || parameters->parallel_streams > VHD_SYNC_XT_MAXIMUM_PARALLEL_STREAMS)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_parameters: Parallel streams should be between 1 and %d.\n",
+                                 VHD_SYNC_XT_MAXIMUM_PARALLEL_STREAMS);
+            status = false;
+            goto End;
+        }
+
+        if (parameters->rate_limit_kb < 0 || parameters->rate_burst_kb < 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_parameters: Rate limit and burst cannot be negative.\n");
+            status = false;
+            goto End;
+        }
+
+        //
+        // Sockets handed to us are connected to the one server.
+        //
+        if (parameters->mirror_count > 0
+            && (parameters->connection_socket != 0 || parameters->broker_fd != 0))
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_parameters: Mirrors cannot be used with a connected socket or a broker.\n");
+            status = false;
+            goto End;
+        }
+
+        //
+        // The body is only spliced on a socket handed to us, and nothing
+        // looks at it on the way to the file.
+        //
+        if (parameters->splice == true
+            && (parameters->connection_socket == 0
+                || (strncasecmp(parameters->url, "http://", 7) != 0
+                    && strncasecmp(parameters->url, "https://", 8) != 0)))
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_parameters: Splice needs a connected socket and an http:// or https:// url.\n");
+            status = false;
+            goto End;
+        }
+
+        if (parameters->splice == true
+            && (parameters->credentials != NULL
+                || parameters->sparse == true
+                || parameters->http2 == true
+                || parameters->broker_fd != 0
+                || parameters->rate_limit_kb != 0
+                || parameters->control_fd != 0
+                || parameters->session_cache != NULL))
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_parameters: Splice cannot be used with credentials, sparse, http2, a broker, a rate limit, a control fd or a session cache.\n");
+            status = false;
+            goto End;
+        }
+
+        if (parameters->congestion != NULL
+            && (parameters->congestion[0] == '\0'
+                || strlen(parameters->congestion) >= VHD_SYNC_XT_TUNE_CONGESTION_LENGTH))
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_parameters: Congestion control algorithm name is not valid.\n");
+            status = false;
+            goto End;
+        }
+
+        if (parameters->session_timeout < 1)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_parameters: Session timeout should be at least a second.\n");
+            status = false;
+            goto End;
+        }
+
+        if (parameters->write_buffer_mb < 1
+            || parameters->write_buffer_mb > VHD_SYNC_XT_MAXIMUM_WRITE_BUFFER_MB)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_parameters: Write buffer should be between 1 and %d MB.\n",
+                                 VHD_SYNC_XT_MAXIMUM_WRITE_BUFFER_MB);
+            status = false;
+            goto End;
+        }
+
     }
     //
     // Add conditions for other actions here.
@@ -360,6 +519,89 @@ vhd_sync_xt_parse_parameters(
                 parameters->credentials = optarg;
                 break;
 
+            case OPTION_PARALLEL_STREAMS:
+                parameters->parallel_streams = atoi(optarg);
+                break;
+
+            case OPTION_ADAPTIVE:
+                parameters->adaptive = true;
+                break;
+
+            case OPTION_STREAM:
+                parameters->stream = true;
+                break;
+
+            case OPTION_SPARSE:
+                parameters->sparse = true;
+                break;
+
+            case OPTION_WRITE_BUFFER:
+                parameters->write_buffer_mb = atoi(optarg);
+                break;
+
+            case OPTION_WRITER:
+                parameters->writer = optarg;
+                break;
+
+            case OPTION_WRITEBACK:
+                parameters->writeback = true;
+                break;
+
+            case OPTION_VERIFY:
+                parameters->verify = true;
+                break;
+
+            case OPTION_RATE_LIMIT:
+                parameters->rate_limit_kb = atoi(optarg);
+                break;
+
+            case OPTION_RATE_BURST:
+                parameters->rate_burst_kb = atoi(optarg);
+                break;
+
+            case OPTION_CONTROL_FD:
+                parameters->control_fd = atoi(optarg);
+                break;
+
+            case OPTION_HTTP2:
+                parameters->http2 = true;
+                break;
+
+            case OPTION_BROKER_FD:
+                parameters->broker_fd = atoi(optarg);
+                break;
+
+            case OPTION_SESSION_CACHE:
+                parameters->session_cache = optarg;
+                break;
+
+            case OPTION_SESSION_TIMEOUT:
+                parameters->session_timeout = atoi(optarg);
+                break;
+
+            case OPTION_MIRROR:
+                if (parameters->mirror_count >= VHD_SYNC_XT_MAXIMUM_MIRRORS)
+                {
+                    VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_parse_parameters: At most %d mirrors can be given.\n",
+                                         VHD_SYNC_XT_MAXIMUM_MIRRORS);
+                    status = false;
+                    goto End;
+                }
+                parameters->mirrors[parameters->mirror_count++] = optarg;
+                break;
+
+            case OPTION_SPLICE:
+                parameters->splice = true;
+                break;
+
+            case OPTION_AUTOTUNE:
+                parameters->autotune = true;
+                break;
+
+            case OPTION_CONGESTION:
+                parameters->congestion = optarg;
+                break;
+
             default:
                 VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_parse_parameters: getopt returned code : %d .\n", c);
                 status = false;
@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the functions to get connected sockets from a broker,
+ * and for a broker to hand them out.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#include <vhdsyncxt_broker.h>
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+static bool
+vhd_sync_xt_broker_read_message(
+    int broker_fd,
+    pvhd_sync_xt_broker_message message,
+    int* sockets,
+    int* socket_count
+    )
+/*
+ * This function reads a message from the other end, along with any sockets
+ * attached to it.
+ *
+ * Parameters:
+ *
+ *      broker_fd - Supplies the unix socket to the other end.
+ *
+ *      message - Supplies a placeholder to return the message.
+ *
+ *      sockets - Supplies an array of VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS to
+ *          return the sockets in, NULL if none are expected.
+ *
+ *      socket_count - Supplies a placeholder to return how many sockets came
+ *          with the message.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    struct msghdr header;
+    struct iovec data;
+    struct cmsghdr *control;
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS)];
+        struct cmsghdr align;
+    } control_buffer;
+    ssize_t result;
+    int unwanted;
+    int count;
+    int i;
+
+    status = false;
+    *socket_count = 0;
+
+    memset(&header, 0, sizeof(header));
+    data.iov_base = message;
+    data.iov_len = sizeof(*message);
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+    header.msg_control = control_buffer.buffer;
+    header.msg_controllen = sizeof(control_buffer.buffer);
+
+    do
+    {
+        result = recvmsg(broker_fd, &header, MSG_CMSG_CLOEXEC);
+    } while (result < 0 && errno == EINTR);
+
+    //
+    // Nothing was received, control data included, so the buffer holds
+    // whatever was on the stack.
+    //
+    if (result < 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_broker_read_message: Could not receive from broker fd %d : %d\n",
+                             broker_fd, errno);
+        goto End;
+    }
+
+    if (result == 0)
+    {
+        //
+        // The other end is gone, which is how a broker learns it is done.
+        //
+        goto End;
+    }
+
+    for (control = CMSG_FIRSTHDR(&header);
+         control != NULL;
+         control = CMSG_NXTHDR(&header, control))
+    {
+        if (control->cmsg_level != SOL_SOCKET
+            || control->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+
+        count = (control->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < count; ++i)
+        {
+            if (sockets != NULL && *socket_count < VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS)
+            {
+                memcpy(&sockets[(*socket_count)++],
+                       CMSG_DATA(control) + i * sizeof(int),
+                       sizeof(int)
+                       );
+            }
+            else
+            {
+                //
+                // Nobody asked for these.
+                //
+                memcpy(&unwanted, CMSG_DATA(control) + i * sizeof(int), sizeof(int));
+                close(unwanted);
+            }
+        }
+    }
+
+    if (result != sizeof(*message)
+        || message->magic != VHD_SYNC_XT_BROKER_MAGIC
+        || (header.msg_flags & MSG_CTRUNC))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_broker_read_message: Bad message from broker fd %d : %zd\n",
+                             broker_fd, result);
+        goto End;
+    }
+
+    status = true;
+
+End:
+    if (status == false)
+    {
+        for (i = 0; i < *socket_count; ++i)
+        {
+            close(sockets[i]);
+        }
+        *socket_count = 0;
+    }
+
+    return status;
+}
+
+static bool
+vhd_sync_xt_broker_write_message(
+    int broker_fd,
+    uint32_t count,
+    int* sockets,
+    int socket_count
+    )
+/*
+ * This function writes a message to the other end, attaching sockets to it.
+ *
+ * Parameters:
+ *
+ *      broker_fd - Supplies the unix socket to the other end.
+ *
+ *      count - Supplies the count to put in the message.
+ *
+ *      sockets - Supplies the sockets to attach.
+ *
+ *      socket_count - Supplies the number of sockets to attach.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_broker_message message;
+    struct msghdr header;
+    struct iovec data;
+    struct cmsghdr *control;
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS)];
+        struct cmsghdr align;
+    } control_buffer;
+    ssize_t result;
+
+    message.magic = VHD_SYNC_XT_BROKER_MAGIC;
+    message.count = count;
+
+    memset(&header, 0, sizeof(header));
+    data.iov_base = &message;
+    data.iov_len = sizeof(message);
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+
+    if (socket_count > 0)
+    {
+        memset(&control_buffer, 0, sizeof(control_buffer));
+        header.msg_control = control_buffer.buffer;
+        header.msg_controllen = CMSG_SPACE(sizeof(int) * socket_count);
+
+        control = CMSG_FIRSTHDR(&header);
+        control->cmsg_level = SOL_SOCKET;
+        control->cmsg_type = SCM_RIGHTS;
+        control->cmsg_len = CMSG_LEN(sizeof(int) * socket_count);
+        memcpy(CMSG_DATA(control), sockets, sizeof(int) * socket_count);
+    }
+
+    do
+    {
+        result = sendmsg(broker_fd, &header, MSG_NOSIGNAL);
+    } while (result < 0 && errno == EINTR);
+
+    if (result != sizeof(message))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_broker_write_message: Could not write to broker fd %d : %d\n",
+                             broker_fd, errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_broker_request_sockets(
+    int broker_fd,
+    int count,
+    int* sockets,
+    int* received
+    )
+/*
+ * This function asks the broker for connected sockets, and waits for them.
+ *
+ * Parameters:
+ *
+ *      broker_fd - Supplies the unix socket to the broker.
+ *
+ *      count - Supplies the number of sockets wanted, up to
+ *          VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS.
+ *
+ *      sockets - Supplies an array of VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS to
+ *          return the sockets in. They belong to the caller.
+ *
+ *      received - Supplies a placeholder to return the number of sockets
+ *          the broker gave, which may be fewer than asked for.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    vhd_sync_xt_broker_message message;
+
+    status = false;
+    *received = 0;
+
+    if (count < 1 || count > VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_broker_request_sockets: Bad socket count %d.\n", count);
+        goto End;
+    }
+
+    status = vhd_sync_xt_broker_write_message(broker_fd, count, NULL, 0);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_broker_read_message(broker_fd,
+                                             &message,
+                                             sockets,
+                                             received
+                                             );
+    if (status == false)
+    {
+        goto End;
+    }
+
+    if (message.count != *received || *received > count)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_broker_request_sockets: Broker sent %d sockets for %u.\n",
+                             *received, message.count);
+        while (*received > 0)
+        {
+            close(sockets[--(*received)]);
+        }
+        status = false;
+        goto End;
+    }
+
+    status = true;
+
+End:
+    return status;
+}
+
+bool
+vhd_sync_xt_broker_read_request(
+    int broker_fd,
+    int* count
+    )
+/*
+ * This function is for the broker, and waits for the next request for
+ * sockets.
+ *
+ * Parameters:
+ *
+ *      broker_fd - Supplies the unix socket to the process being served.
+ *
+ *      count - Supplies a placeholder to return the number of sockets
+ *          asked for.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE once the other end is gone or sent something
+ *      that is not a request.
+ */
+{
+    vhd_sync_xt_broker_message message;
+    int socket_count;
+
+    if (vhd_sync_xt_broker_read_message(broker_fd,
+                                        &message,
+                                        NULL,
+                                        &socket_count) == false)
+    {
+        return false;
+    }
+
+    *count = message.count;
+    if (*count > VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS)
+    {
+        *count = VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS;
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_broker_send_sockets(
+    int broker_fd,
+    int* sockets,
+    int count
+    )
+/*
+ * This function is for the broker, and answers a request with the sockets
+ * it connected. The sockets still belong to the broker, which should close
+ * its copies.
+ *
+ * Parameters:
+ *
+ *      broker_fd - Supplies the unix socket to the process being served.
+ *
+ *      sockets - Supplies the connected sockets.
+ *
+ *      count - Supplies the number of sockets, 0 to refuse the request.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    if (count < 0 || count > VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_broker_send_sockets: Bad socket count %d.\n", count);
+        return false;
+    }
+
+    return vhd_sync_xt_broker_write_message(broker_fd, count, sockets, count);
+}
@@ -30,316 +30,2502 @@
 
 #include <vhdsyncxt_curl.h>
 
+/* ---------------- Constant/Global Declarations --------------------------- */
+
+static pvhd_sync_xt_curl_share g_curl_share = NULL;
+static pthread_mutex_t g_curl_share_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* ---------------- Function Definitions ----------------------------------- */
 
+static void
+vhd_sync_xt_curl_share_lock(
+    CURL *curlhandle,
+    curl_lock_data data,
+    curl_lock_access access,
+    void *user_data
+    )
+/*
+ * This function is set as the callback curl calls before it touches a kind
+ * of shared data.
+ *
+ * Parameters:
+ *
+ *      curlhandle - Supplies the handle touching the data.
+ *
+ *      data - Supplies the kind of data.
+ *
+ *      access - Supplies whether the data is read or changed.
+ *
+ *      user_data - Supplies the pool.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    pvhd_sync_xt_curl_share share;
+
+    share = (pvhd_sync_xt_curl_share)user_data;
+
+    if (data >= 0 && data < CURL_LOCK_DATA_LAST)
+    {
+        pthread_mutex_lock(&share->locks[data]);
+    }
+}
+
+static void
+vhd_sync_xt_curl_share_unlock(
+    CURL *curlhandle,
+    curl_lock_data data,
+    void *user_data
+    )
+/*
+ * This function is set as the callback curl calls once it is done with a
+ * kind of shared data.
+ *
+ * Parameters:
+ *
+ *      curlhandle - Supplies the handle that touched the data.
+ *
+ *      data - Supplies the kind of data.
+ *
+ *      user_data - Supplies the pool.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    pvhd_sync_xt_curl_share share;
+
+    share = (pvhd_sync_xt_curl_share)user_data;
+
+    if (data >= 0 && data < CURL_LOCK_DATA_LAST)
+    {
+        pthread_mutex_unlock(&share->locks[data]);
+    }
+}
+
+static void
+vhd_sync_xt_put_curl_share(
+    pvhd_sync_xt_curl_share share
+    )
+/*
+ * This function lets go of the pool of the process, and cleans it up once
+ * nothing uses it.
+ *
+ * Parameters:
+ *
+ *      share - Supplies the pool.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    CURLSHcode res;
+    int i;
+
+    if (share == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&g_curl_share_lock);
+
+    if (--share->references > 0)
+    {
+        goto End;
+    }
+
+    if (share->sharehandle != NULL)
+    {
+        res = curl_share_cleanup(share->sharehandle);
+        if (res != CURLSHE_OK)
+        {
+            //
+            // A handle still uses it. Leave it be rather than pull it out
+            // from under the handle.
+            //
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_put_curl_share: Could not clean up share : %d\n", res);
+            goto End;
+        }
+    }
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+    {
+        pthread_mutex_destroy(&share->locks[i]);
+    }
+
+    if (g_curl_share == share)
+    {
+        g_curl_share = NULL;
+    }
+    free(share);
+
+End:
+    pthread_mutex_unlock(&g_curl_share_lock);
+}
+
+static bool
+vhd_sync_xt_get_curl_share(
+    pvhd_sync_xt_curl_share* share
+    )
+/*
+ * This function gets the pool of the process, creating it for the first
+ * configuration that asks.
+ *
+ * Parameters:
+ *
+ *      share - Supplies a placeholder to return the pool.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_curl_share share_local;
+    int i;
+
+    status = false;
+    share_local = NULL;
+
+    pthread_mutex_lock(&g_curl_share_lock);
+
+    if (g_curl_share != NULL)
+    {
+        ++g_curl_share->references;
+        *share = g_curl_share;
+        status = true;
+        goto End;
+    }
+
+    share_local = calloc(1, sizeof(vhd_sync_xt_curl_share));
+    if (share_local == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_curl_share: Could not allocate memory for share.\n");
+        goto End;
+    }
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+    {
+        pthread_mutex_init(&share_local->locks[i], NULL);
+    }
+    share_local->references = 1;
+
+    share_local->sharehandle = curl_share_init();
+    if (share_local->sharehandle == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_curl_share: Could not init curl share.\n");
+        goto End;
+    }
+
+    if (curl_share_setopt(share_local->sharehandle,
+                          CURLSHOPT_LOCKFUNC,
+                          vhd_sync_xt_curl_share_lock) != CURLSHE_OK
+        || curl_share_setopt(share_local->sharehandle,
+                             CURLSHOPT_UNLOCKFUNC,
+                             vhd_sync_xt_curl_share_unlock) != CURLSHE_OK
+        || curl_share_setopt(share_local->sharehandle,
+                             CURLSHOPT_USERDATA,
+                             share_local) != CURLSHE_OK
+        || curl_share_setopt(share_local->sharehandle,
+                             CURLSHOPT_SHARE,
+                             CURL_LOCK_DATA_DNS) != CURLSHE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_curl_share: Could not set curl share options.\n");
+        goto End;
+    }
+
+    //
+    // Older curls cannot share connections or sessions. They still get the
+    // DNS cache shared, and each multi handle keeps its own connections.
+    //
+    if (curl_share_setopt(share_local->sharehandle,
+                          CURLSHOPT_SHARE,
+                          CURL_LOCK_DATA_CONNECT) != CURLSHE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_curl_share: Connections cannot be shared with this curl.\n");
+    }
+
+    if (curl_share_setopt(share_local->sharehandle,
+                          CURLSHOPT_SHARE,
+                          CURL_LOCK_DATA_SSL_SESSION) != CURLSHE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_curl_share: TLS sessions cannot be shared with this curl.\n");
+    }
+
+    g_curl_share = share_local;
+    *share = share_local;
+    share_local = NULL;
+    status = true;
+
+End:
+    pthread_mutex_unlock(&g_curl_share_lock);
+
+    if (share_local != NULL)
+    {
+        vhd_sync_xt_put_curl_share(share_local);
+    }
+
+    return status;
+}
+
+static bool
+vhd_sync_xt_create_curl_event(
+    pvhd_sync_xt_curl_config curl_config,
+    vhd_sync_xt_curl_event_type type,
+    int fd,
+    uint32_t epoll_events,
+    vhd_sync_xt_curl_event_callback callback,
+    void* user_data,
+    pvhd_sync_xt_curl_event* event
+    )
+/*
+ * This function creates an event and adds its fd to the event loop.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      type - Supplies the type of the event.
+ *
+ *      fd - Supplies the fd to watch. Timer fds are owned by the event from
+ *          here on, other fds stay with whoever gave them.
+ *
+ *      epoll_events - Supplies the epoll events to watch the fd for.
+ *
+ *      callback - Supplies the callback for fds and timers of our own.
+ *
+ *      user_data - Supplies a user data context that is passed to the
+ *          callback.
+ *
+ *      event - Supplies a placeholder to return the event.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_curl_event event_local;
+    struct epoll_event epoll_event;
+
+    status = false;
+
+    event_local = calloc(1, sizeof(vhd_sync_xt_curl_event));
+    if (event_local == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_event: Could not allocate memory for event.\n");
+        goto End;
+    }
+
+    event_local->type = type;
+    event_local->fd = fd;
+    event_local->callback = callback;
+    event_local->user_data = user_data;
+
+    memset(&epoll_event, 0, sizeof(epoll_event));
+    epoll_event.events = epoll_events;
+    epoll_event.data.ptr = event_local;
+    if (epoll_ctl(curl_config->epoll_fd, EPOLL_CTL_ADD, fd, &epoll_event) != 0)
+    {
+        //
+        // Files and the like cannot be waited on at all, which is for the
+        // caller to deal with rather than an error.
+        //
+        if (errno != EPERM)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_event: Could not watch fd %d : %d\n",
+                                 fd, errno);
+        }
+
+        free(event_local);
+        goto End;
+    }
+
+    event_local->next = curl_config->events;
+    curl_config->events = event_local;
+
+    *event = event_local;
+    status = true;
+
+End:
+    return status;
+}
+
+static void
+vhd_sync_xt_free_curl_events(
+    pvhd_sync_xt_curl_event events
+    )
+/*
+ * This function frees a list of events, closing the timer fds they own.
+ *
+ * Parameters:
+ *
+ *      events - Supplies the first event of the list.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    pvhd_sync_xt_curl_event next;
+
+    while (events != NULL)
+    {
+        next = events->next;
+        if (events->removed == false
+            && (events->type == VHD_SYNC_XT_CURL_EVENT_CURL_TIMER
+                || events->type == VHD_SYNC_XT_CURL_EVENT_TIMER))
+        {
+            close(events->fd);
+        }
+
+        free(events);
+        events = next;
+    }
+}
+
+static int
+vhd_sync_xt_curl_socket_callback(
+        CURL *curlhandle,
+        curl_socket_t socket,
+        int what,
+        void *user_data,
+        void *socket_data
+        )
+/*
+ * This function is set as the callback for curl to tell us which of its
+ * sockets to watch, and for what.
+ *
+ * Parameters:
+ *
+ *      curlhandle - Curl supplies the easy handle the socket is for.
+ *
+ *      socket - Curl supplies the socket.
+ *
+ *      what - Curl supplies what to watch the socket for.
+ *
+ *      user_data - Supplies a pointer to our curl config struct.
+ *
+ *      socket_data - Supplies the event assigned to the socket, if any.
+ *
+ * Return Value:
+ *
+ *      0 on success, -1 otherwise.
+ */
+{
+    pvhd_sync_xt_curl_config curl_config;
+    pvhd_sync_xt_curl_event event;
+    struct epoll_event epoll_event;
+
+    curl_config = (pvhd_sync_xt_curl_config)user_data;
+    event = (pvhd_sync_xt_curl_event)socket_data;
+
+    if (what == CURL_POLL_REMOVE)
+    {
+        if (event != NULL)
+        {
+            curl_multi_assign(curl_config->multihandle, socket, NULL);
+            vhd_sync_xt_remove_curl_event(curl_config, event);
+        }
+
+        return 0;
+    }
+
+    memset(&epoll_event, 0, sizeof(epoll_event));
+    if (what & CURL_POLL_IN)
+    {
+        epoll_event.events |= EPOLLIN;
+    }
+
+    if (what & CURL_POLL_OUT)
+    {
+        epoll_event.events |= EPOLLOUT;
+    }
+
+    if (event == NULL)
+    {
+        if (vhd_sync_xt_create_curl_event(curl_config,
+                                          VHD_SYNC_XT_CURL_EVENT_SOCKET,
+                                          socket,
+                                          epoll_event.events,
+                                          NULL,
+                                          NULL,
+                                          &event) == false)
+        {
+            return -1;
+        }
+
+        curl_multi_assign(curl_config->multihandle, socket, event);
+        return 0;
+    }
+
+    epoll_event.data.ptr = event;
+    if (epoll_ctl(curl_config->epoll_fd, EPOLL_CTL_MOD, socket, &epoll_event) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_curl_socket_callback: Could not watch socket %d : %d\n",
+                             socket, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+vhd_sync_xt_curl_timer_callback(
+        CURLM *multihandle,
+        long timeout_ms,
+        void *user_data
+        )
+/*
+ * This function is set as the callback for curl to tell us when it next
+ * wants to be called for its timeouts.
+ *
+ * Parameters:
+ *
+ *      multihandle - Curl supplies the multi handle.
+ *
+ *      timeout_ms - Curl supplies the time until the call, -1 for none.
+ *
+ *      user_data - Supplies a pointer to our curl config struct.
+ *
+ * Return Value:
+ *
+ *      0 on success, -1 otherwise.
+ */
+{
+    pvhd_sync_xt_curl_config curl_config;
+    struct itimerspec timer;
+
+    curl_config = (pvhd_sync_xt_curl_config)user_data;
+
+    memset(&timer, 0, sizeof(timer));
+    if (timeout_ms == 0)
+    {
+        //
+        // An all zero timer is a disarmed one.
+        //
+        timer.it_value.tv_nsec = 1;
+    }
+    else if (timeout_ms > 0)
+    {
+        timer.it_value.tv_sec = timeout_ms / 1000;
+        timer.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+    }
+
+    if (timerfd_settime(curl_config->curl_timer->fd, 0, &timer, NULL) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_curl_timer_callback: Could not set timer : %d\n", errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+static bool
+vhd_sync_xt_run_curl_events(
+    pvhd_sync_xt_curl_config curl_config
+    )
+/*
+ * This function waits for the next events, up to the wait timeout, and
+ * handles them: socket activity and timeouts are handed to curl, while fds
+ * and timers of our own go to their callbacks.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    struct epoll_event epoll_events[VHD_SYNC_XT_CURL_MAX_EVENTS];
+    pvhd_sync_xt_curl_event event;
+    CURLMcode multi_res;
+    uint64_t expirations;
+    int count;
+    int flags;
+    int running;
+    int i;
+
+    status = false;
+
+    count = epoll_wait(curl_config->epoll_fd,
+                       epoll_events,
+                       VHD_SYNC_XT_CURL_MAX_EVENTS,
+                       curl_config->wait_timeout_ms
+                       );
+    if (count < 0)
+    {
+        if (errno == EINTR)
+        {
+            status = true;
+            goto End;
+        }
+
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_run_curl_events: epoll_wait failed : %d\n", errno);
+        goto End;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        event = (pvhd_sync_xt_curl_event)epoll_events[i].data.ptr;
+        if (event->removed == true)
+        {
+            continue;
+        }
+
+        switch (event->type)
+        {
+        case VHD_SYNC_XT_CURL_EVENT_SOCKET:
+            flags = 0;
+            if (epoll_events[i].events & EPOLLIN)
+            {
+                flags |= CURL_CSELECT_IN;
+            }
+
+            if (epoll_events[i].events & EPOLLOUT)
+            {
+                flags |= CURL_CSELECT_OUT;
+            }
+
+            if (epoll_events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                flags |= CURL_CSELECT_ERR;
+            }
+
+            multi_res = curl_multi_socket_action(curl_config->multihandle,
+                                                 event->fd,
+                                                 flags,
+                                                 &running
+                                                 );
+            if (multi_res != CURLM_OK)
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_run_curl_events: curl_multi_socket_action failed : %d\n", multi_res);
+                goto End;
+            }
+            break;
+
+        case VHD_SYNC_XT_CURL_EVENT_CURL_TIMER:
+            read(event->fd, &expirations, sizeof(expirations));
+            multi_res = curl_multi_socket_action(curl_config->multihandle,
+                                                 CURL_SOCKET_TIMEOUT,
+                                                 0,
+                                                 &running
+                                                 );
+            if (multi_res != CURLM_OK)
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_run_curl_events: curl_multi_socket_action failed : %d\n", multi_res);
+                goto End;
+            }
+            break;
+
+        case VHD_SYNC_XT_CURL_EVENT_TIMER:
+            read(event->fd, &expirations, sizeof(expirations));
+            // Fall through.
+
+        case VHD_SYNC_XT_CURL_EVENT_FD:
+            if (event->callback(event->user_data) == false)
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_run_curl_events: Callback for fd %d failed.\n", event->fd);
+                goto End;
+            }
+            break;
+        }
+    }
+
+    status = true;
+
+End:
+    vhd_sync_xt_free_curl_events(curl_config->removed_events);
+    curl_config->removed_events = NULL;
+
+    return status;
+}
+
+
+bool
+vhd_sync_xt_create_curl_config(
+    pvhd_sync_xt_curl_config* curl_config,
+    int connection_socket
+    )
+/*
+ * This function creates a curl configuration struct to store our curl 
+ * configuration.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a placeholder to return the curl configuration
+ *          struct that was created.
+ *          
+ *      connection_socket - Supplies a an opened socket that is already connected
+ *          to the server that should be used by curl.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */  
+
+{
+    bool status;
+    pvhd_sync_xt_curl_config    curl_config_local;
+    int timer_fd;
+
+    status = false;
+    curl_config_local = NULL;
+
+    curl_config_local = calloc(1, sizeof(vhd_sync_xt_curl_config));
+    if (curl_config_local == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_config: Could not allocate memory for curl configuration.\n");
+        status = false;
+        goto End;
+    }
+
+    curl_config_local->epoll_fd = -1;
+
+    curl_config_local->curlhandle  = curl_easy_init();
+    if (curl_config_local->curlhandle == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_config: Could not init curl library.\n");
+        status = false;
+        goto End;
+    }
+
+    curl_config_local->multihandle = curl_multi_init();
+    if (curl_config_local->multihandle == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_config: Could not init curl multi handle.\n");
+        status = false;
+        goto End;
+    }
+
+    curl_config_local->connection_socket = connection_socket;
+    curl_config_local->wait_timeout_ms = VHD_SYNC_XT_CURL_WAIT_TIMEOUT_MS;
+
+    //
+    // Transfers made from here on find the connections, DNS answers and TLS
+    // sessions of every other one in the process.
+    //
+    status = vhd_sync_xt_get_curl_share(&curl_config_local->share);
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_config: Could not get curl share.\n");
+        goto End;
+    }
+
+    if (curl_easy_setopt(curl_config_local->curlhandle,
+                         CURLOPT_SHARE,
+                         curl_config_local->share->sharehandle) != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_config: Could not set share option.\n");
+        status = false;
+        goto End;
+    }
+
+    //
+    // Drive the multi handle from our own event loop, so that anything
+    // else we wait on can share it.
+    //
+    curl_config_local->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (curl_config_local->epoll_fd < 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_config: Could not create epoll fd : %d\n", errno);
+        status = false;
+        goto End;
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_config: Could not create timer fd : %d\n", errno);
+        status = false;
+        goto End;
+    }
+
+    status = vhd_sync_xt_create_curl_event(curl_config_local,
+                                           VHD_SYNC_XT_CURL_EVENT_CURL_TIMER,
+                                           timer_fd,
+                                           EPOLLIN,
+                                           NULL,
+                                           NULL,
+                                           &curl_config_local->curl_timer
+                                           );
+    if (status == false)
+    {
+        close(timer_fd);
+        goto End;
+    }
+
+    curl_multi_setopt(curl_config_local->multihandle,
+                      CURLMOPT_SOCKETFUNCTION,
+                      vhd_sync_xt_curl_socket_callback
+                      );
+    curl_multi_setopt(curl_config_local->multihandle,
+                      CURLMOPT_SOCKETDATA,
+                      curl_config_local
+                      );
+    curl_multi_setopt(curl_config_local->multihandle,
+                      CURLMOPT_TIMERFUNCTION,
+                      vhd_sync_xt_curl_timer_callback
+                      );
+    curl_multi_setopt(curl_config_local->multihandle,
+                      CURLMOPT_TIMERDATA,
+                      curl_config_local
+                      );
+
+    //
+    // With a pre-connected socket there is exactly one connection to the
+    // server. Make curl queue transfers on it instead of trying to open
+    // more connections that would all hand out the same socket. Over
+    // HTTP/2 they run on it side by side as streams.
+    //
+    if (connection_socket != 0)
+    {
+        curl_multi_setopt(curl_config_local->multihandle,
+                          CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                          1L
+                          );
+    }
+
+    *curl_config = curl_config_local;
+    curl_config_local = NULL;
+    status = true;   
+
+End:
+    if (curl_config_local != NULL)
+    {
+        vhd_sync_xt_destroy_curl_config(curl_config_local);
+    }
+
+    return status;
+    
+}
+
+void
+vhd_sync_xt_destroy_curl_config(
+    pvhd_sync_xt_curl_config curl_config
+    )
+/*
+ * This function destroys a curl_config struct that stores the curl
+ * configuration.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (curl_config == NULL)
+    {
+        return;
+    }
+
+    if (curl_config->curlhandle)
+    {
+        curl_easy_cleanup(curl_config->curlhandle);
+    }
+
+    if (curl_config->multihandle)
+    {
+        curl_multi_cleanup(curl_config->multihandle);
+    }
+
+    vhd_sync_xt_put_curl_share(curl_config->share);
+
+    vhd_sync_xt_destroy_session_cache(curl_config->session_cache);
+
+    vhd_sync_xt_free_curl_events(curl_config->events);
+    vhd_sync_xt_free_curl_events(curl_config->removed_events);
+
+    while (curl_config->spare_count > 0)
+    {
+        close(curl_config->spare_sockets[--curl_config->spare_count]);
+    }
+
+    if (curl_config->epoll_fd >= 0)
+    {
+        close(curl_config->epoll_fd);
+    }
+
+    free(curl_config);
+}
+
+curl_socket_t
+vhd_sync_xt_curl_opensocket (
+        void *user_data,
+        curlsocktype purpose,
+        struct curl_sockaddr *address
+        )
+/*
+ * This function is set as the callback to open a socket from curl, if we
+ * already have socket fd. Each connection curl opens takes one of the
+ * sockets from the broker, and once those run out another is asked for.
+ *
+ * Parameters:
+ *
+ *      user_data - Supplies a pointer to our curl config struct.
+ *
+ *      purpose - Curl supplies a purpose for this socket call.
+ *
+ *      address - Curl supplies an address for this socket
+ *
+ * Return Value:
+ *
+ *      Returns the sockfd we have already opened.
+ */
+{
+    pvhd_sync_xt_curl_config curl_config;
+    int received;
+
+    curl_config  = (pvhd_sync_xt_curl_config)user_data;
+
+    if (curl_config->spare_count > 0)
+    {
+        return curl_config->spare_sockets[--curl_config->spare_count];
+    }
+
+    if (curl_config->broker_fd != 0)
+    {
+        if (vhd_sync_xt_broker_request_sockets(curl_config->broker_fd,
+                                               1,
+                                               curl_config->spare_sockets,
+                                               &received) == false
+            || received == 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_curl_opensocket: Broker has no more sockets.\n");
+            curl_config->broker_exhausted = true;
+            return CURL_SOCKET_BAD;
+        }
+
+        return curl_config->spare_sockets[0];
+    }
+
+    //
+    // Once curl has closed the socket we were given, its number may belong
+    // to something else by now.
+    //
+    if (curl_config->connection_socket_closed == true)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_curl_opensocket: Connected socket is closed.\n");
+        return CURL_SOCKET_BAD;
+    }
+
+    return curl_config->connection_socket;
+}
+
+int
+vhd_sync_xt_curl_closesocket(
+        void *user_data,
+        curl_socket_t item
+        )
+/*
+ * This function is set as the callback to close a socket from curl, if we
+ * already have socket fd. It notes that the connected socket we were given
+ * is gone, so that it is not handed out again.
+ *
+ * Parameters:
+ *
+ *      user_data - Supplies a pointer to our curl config struct.
+ *
+ *      item - Curl supplies the socket to close.
+ *
+ * Return Value:
+ *
+ *      Returns 0 on success, 1 otherwise.
+ */
+{
+    pvhd_sync_xt_curl_config curl_config;
+
+    curl_config  = (pvhd_sync_xt_curl_config)user_data;
+
+    if (item == curl_config->connection_socket)
+    {
+        curl_config->connection_socket_closed = true;
+    }
+
+    return (close(item) == 0) ? 0 : 1;
+}
+
+int
+vhd_sync_xt_curl_sockopt_callback(
+        void *user_data,
+        curl_socket_t sockfd,
+        curlsocktype purpose
+        )
+/*
+ * This function is set as the callback after the socket call from curl. It
+ * sets the congestion control algorithm and receive buffer asked for. On a
+ * socket curl opened that is before it connects, so the window scale is
+ * picked for the buffer.
+ *
+ * Parameters:
+ *
+ *      user_data - Supplies a pointer to our curl config struct.
+ *
+ *      sockfd - Supplies the socket fd for which this is called.
+ *
+ *      prupose - Curl supplies a purpose for this call.
+ *
+ * Return Value:
+ *
+ *      Returns CURL_SOCKOPT_ALREADY_CONNECTED to indicate that our
+ *      socket is already connected, CURL_SOCKOPT_OK for one curl opened.
+ */
+{
+    pvhd_sync_xt_curl_config curl_config;
+
+    curl_config = (pvhd_sync_xt_curl_config)user_data;
+
+    //
+    // Neither is worth failing the connection over.
+    //
+    if (curl_config->congestion != NULL)
+    {
+        vhd_sync_xt_tune_set_congestion(sockfd, curl_config->congestion);
+    }
+
+    if (curl_config->receive_buffer != 0)
+    {
+        vhd_sync_xt_tune_receive_buffer(sockfd, curl_config->receive_buffer, NULL);
+    }
+
+    if (curl_config->connection_socket != 0 || curl_config->broker_fd != 0)
+    {
+        return CURL_SOCKOPT_ALREADY_CONNECTED;
+    }
+
+    return CURL_SOCKOPT_OK;
+}
+
+static CURLcode
+vhd_sync_xt_curl_ssl_ctx_callback(
+        CURL *curlhandle,
+        void *ssl_ctx,
+        void *user_data
+        )
+/*
+ * This function is set as the callback curl calls with the OpenSSL context
+ * of each connection before it starts the handshake.
+ *
+ * Parameters:
+ *
+ *      curlhandle - Supplies the handle making the connection.
+ *
+ *      ssl_ctx - Supplies the OpenSSL context.
+ *
+ *      user_data - Supplies a pointer to our curl config struct.
+ *
+ * Return Value:
+ *
+ *      CURLE_OK, as the handshake can go ahead without the cache.
+ */
+{
+    pvhd_sync_xt_curl_config curl_config;
+
+    curl_config = (pvhd_sync_xt_curl_config)user_data;
+
+    vhd_sync_xt_attach_session_cache(curl_config->session_cache,
+                                     (SSL_CTX*)ssl_ctx
+                                     );
+
+    return CURLE_OK;
+}
+
+static bool
+vhd_sync_xt_set_curl_session_key(
+    pvhd_sync_xt_curl_config curl_config,
+    char* url,
+    char* ca_cert,
+    char* ca_path
+    )
+/*
+ * This function opens the TLS session cache for the server of a url and
+ * has curl hand it every connection it makes. Sessions are kept by host,
+ * port and CAs, so one is never offered where it was not checked.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a pointer to the curl configuration.
+ *
+ *      url - Supplies the url.
+ *
+ *      ca_cert - Supplies a certificate for the server.
+ *
+ *      ca_path - Supplies a ca path to verify the server certificate.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    CURLcode res;
+    char key[VHD_SYNC_XT_SESSION_KEY_LENGTH];
+    const char *host;
+    size_t host_length;
+
+    status = false;
+
+    vhd_sync_xt_destroy_session_cache(curl_config->session_cache);
+    curl_config->session_cache = NULL;
+
+    if (strncasecmp(url, "https://", 8) != 0)
+    {
+        status = true;
+        goto End;
+    }
+
+    host = url + 8;
+    host_length = strcspn(host, "/?#");
+
+    if (snprintf(key,
+                 sizeof(key),
+                 "%.*s|%s|%s",
+                 (int)host_length,
+                 host,
+                 (ca_cert != NULL) ? ca_cert : "",
+                 (ca_path != NULL) ? ca_path : "") >= sizeof(key))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_session_key: Url too long.\n");
+        goto End;
+    }
+
+    status = vhd_sync_xt_create_session_cache(curl_config->session_cache_path,
+                                              key,
+                                              curl_config->session_timeout,
+                                              &curl_config->session_cache
+                                              );
+    if (status == false)
+    {
+        goto End;
+    }
+
+    //
+    // Only the OpenSSL backend hands out its context, without it there is
+    // no cache, only full handshakes.
+    //
+    res = curl_easy_setopt(curl_config->curlhandle,
+                           CURLOPT_SSL_CTX_DATA,
+                           curl_config
+                           );
+    if (res == CURLE_OK)
+    {
+        res = curl_easy_setopt(curl_config->curlhandle,
+                               CURLOPT_SSL_CTX_FUNCTION,
+                               vhd_sync_xt_curl_ssl_ctx_callback
+                               );
+    }
+
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_session_key: TLS sessions cannot be kept with this curl : %d\n", res);
+        vhd_sync_xt_destroy_session_cache(curl_config->session_cache);
+        curl_config->session_cache = NULL;
+    }
+
+    status = true;
+
+End:
+    return status;
+}
+
+
+bool
+vhd_sync_xt_set_url(
+    pvhd_sync_xt_curl_config curl_config,
+    char* url,
+    char* ca_cert,
+    char* ca_path,
+    char* credentials
+    )
+/*
+ * This function sets the url for curl config.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a pointer to the curl configuration.
+ *
+ *      url - specifies the url for curl
+ *
+ *      ca_cert - Supplies a certificate for the server.
+ *
+ *      ca_path - Supplies a ca path to verify the server certificate.
+ *
+ *      credentials - Supplies login credentials for auth with the server.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */  
+{
+    CURLcode res;
+    bool status;
+
+    status = false;
+
+    res = curl_easy_setopt(curl_config->curlhandle, CURLOPT_URL, url);
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set url option.\n");
+        status = false;
+        goto End;
+    }
+
+    //
+    // HTTP/2 is negotiated through ALPN over TLS and through an upgrade of
+    // the first request in the clear, falling back to HTTP/1.1 if the
+    // server does not take it up. Have transfers wait for the connection to
+    // be up rather than open more of them, so that they all end up
+    // multiplexed on it.
+    //
+    if (curl_config->http2 == true)
+    {
+        res = curl_easy_setopt(curl_config->curlhandle,
+                               CURLOPT_HTTP_VERSION,
+                               (long)CURL_HTTP_VERSION_2_0
+                               );
+        if (res != CURLE_OK)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set http version option. Curl error : %d\n", res);
+            status = false;
+            goto End;
+        }
+
+        res = curl_easy_setopt(curl_config->curlhandle,
+                               CURLOPT_PIPEWAIT,
+                               1L
+                               );
+        if (res != CURLE_OK)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set pipewait option.\n");
+            status = false;
+            goto End;
+        }
+    }
+
+    if (curl_config->session_cache_path != NULL)
+    {
+        status = vhd_sync_xt_set_curl_session_key(curl_config,
+                                                  url,
+                                                  ca_cert,
+                                                  ca_path
+                                                  );
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not open TLS session cache.\n");
+            goto End;
+        }
+    }
+
+
+    //
+    // Every socket is tuned before it is used, ours and those curl opens.
+    //
+    res = curl_easy_setopt(curl_config->curlhandle,
+                           CURLOPT_SOCKOPTDATA,
+                           curl_config
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set sockoptdata option.\n");
+        status = false;
+        goto End;
+    }
+
+    res = curl_easy_setopt(curl_config->curlhandle,
+                           CURLOPT_SOCKOPTFUNCTION,
+                           vhd_sync_xt_curl_sockopt_callback);
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set sockoptfunction option.\n");
+        status = false;
+        goto End;
+    }
+
+    //
+    // If we already have a socket fd through which to channel
+    // our data, then instruct curl to use it.
+    //
+    if (curl_config->connection_socket != 0 || curl_config->broker_fd != 0)
+    {
+        res = curl_easy_setopt(curl_config->curlhandle,
+                               CURLOPT_OPENSOCKETDATA,
+                               curl_config
+                               );
+        if (res != CURLE_OK)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set opensocketdata option.\n");
+            status = false;
+            goto End;
+        }
+
+        res = curl_easy_setopt(curl_config->curlhandle,
+                               CURLOPT_OPENSOCKETFUNCTION,
+                               vhd_sync_xt_curl_opensocket
+                               );
+        if (res != CURLE_OK)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set opensocketfunction option.\n");
+            status = false;
+            goto End;
+        }
+
+        res = curl_easy_setopt(curl_config->curlhandle,
+                               CURLOPT_CLOSESOCKETDATA,
+                               curl_config
+                               );
+        if (res != CURLE_OK)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set closesocketdata option.\n");
+            status = false;
+            goto End;
+        }
+
+        res = curl_easy_setopt(curl_config->curlhandle,
+                               CURLOPT_CLOSESOCKETFUNCTION,
+                               vhd_sync_xt_curl_closesocket
+                               );
+        if (res != CURLE_OK)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set closesocketfunction option.\n");
+            status = false;
+            goto End;
+        }
+
+        //
+        // This means that the client is already connected  go to end.
+        //
+        status = true;
+        goto End;
+    }
+
+    //
+    // If we have a  certificate for the server verify it.
+    //
+    if (ca_cert != NULL)
+    {
+        res = curl_easy_setopt(curl_config->curlhandle,
+                               CURLOPT_CAINFO,
+                               ca_cert
+                               );
+        if (res != CURLE_OK)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set cert info option.\n");
+            status = false;
+            goto End;
+        }
+    }
+
+    //
+    // If we have a ca path to verify the server cert then verify the server cert.
+    //
+    if (ca_path != NULL)
+    {
+        res = curl_easy_setopt(curl_config->curlhandle,
+                               CURLOPT_CAPATH,
+                               ca_path
+                               );
+        if (res != CURLE_OK)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set cert path option.\n");
+            status = false;
+            goto End;
+        }
+
+    }
+
+    //
+    // If we have auth credentials set them.
+    //
+    if (credentials != NULL)
+    {
+        res = curl_easy_setopt(curl_config->curlhandle,
+                               CURLOPT_USERPWD,
+                               credentials
+                               );
+        if (res != CURLE_OK)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set user credential option.\n");
+            status = false;
+            goto End;
+        }
+
+        res = curl_easy_setopt(curl_config->curlhandle,
+                               CURLOPT_HTTPAUTH,
+                               CURLAUTH_DIGEST
+                               );
+        if (res != CURLE_OK)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set auth type.\n");
+            status = false;
+            goto End;
+        }
+    }
+
+    status = true;
+
+End:
+    return status;
+}
+
+
+int
+vhd_sync_xt_perform_curl(
+    pvhd_sync_xt_curl_config curl_config
+    )
+/*
+ * This function peforms the curl operation that has been configured. The
+ * request is driven through our multi handle so that its connection can be
+ * reused by the transfers that follow it.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ * Return Value:
+ *
+ *      Errno. TBD.
+ */ 
+{
+    CURLcode res;
+    CURLMcode multi_res;
+    CURLMsg *message;
+    int queued;
+    bool done;
+
+    res = CURLE_FAILED_INIT;
+    done = false;
+
+    multi_res = curl_multi_add_handle(curl_config->multihandle,
+                                      curl_config->curlhandle
+                                      );
+    if (multi_res != CURLM_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_perform_curl: Could not add handle to multi handle.\n");
+        goto End;
+    }
+
+    while (done == false)
+    {
+        while ((message = curl_multi_info_read(curl_config->multihandle,
+                                               &queued)) != NULL)
+        {
+            if (message->msg == CURLMSG_DONE
+                && message->easy_handle == curl_config->curlhandle)
+            {
+                res = message->data.result;
+                done = true;
+            }
+        }
+
+        if (done == true)
+        {
+            break;
+        }
+
+        if (vhd_sync_xt_run_curl_events(curl_config) == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_perform_curl: Could not run events.\n");
+            break;
+        }
+    }
+
+    curl_multi_remove_handle(curl_config->multihandle,
+                             curl_config->curlhandle
+                             );
+
+End:
+    return res;
+}
+
+
+bool
+vhd_sync_xt_set_curl_process_header(
+    pvhd_sync_xt_curl_config curl_config,
+    void* header_callback,
+    void* user_data
+    )
+/*
+ * This function sets the curl option to send callbacks to the requested
+ * callback function for the header of the URL
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      header_callback - Suppplies a callback for the header of the url.
+ *
+ *      user_data - Supplies a user data context that is passed to the
+ *          callback.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    CURLcode res;
+    
+    status = false;
+    res = curl_easy_setopt(curl_config->curlhandle,
+                           CURLOPT_NOBODY,
+                           1
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_process_header: Could not set nobody option.\n");
+        status = false;
+        goto End;
+    }
+
+    res = curl_easy_setopt(curl_config->curlhandle,
+                           CURLOPT_HEADERFUNCTION,
+                           header_callback
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_process_header: Could not set nobody option.\n");
+        status = false;
+        goto End;
+    }
+
+    res = curl_easy_setopt(curl_config->curlhandle,
+                           CURLOPT_WRITEHEADER,
+                           user_data
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_process_header: Could not set nobody option.\n");
+        status = false;
+        goto End;
+    }
+    status = true;
+
+End:
+    return status;
+}
+
+
+bool
+vhd_sync_xt_set_curl_get_data(
+    pvhd_sync_xt_curl_config curl_config,
+    void* header_callback,
+    FILE* outfile
+    )
+/*
+ * This function sets the curl option to send callbacks to the requested
+ * callback function for the header of the URL
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      header_callback - Suppplies a callback for the header of the url.
+ *
+ *      outfile - Supplies a file stream to write the data to.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    CURLcode res;
+
+    status = false;
+
+    //
+    // Set the option to get the body.
+    //
+    res = curl_easy_setopt(curl_config->curlhandle,
+                           CURLOPT_NOBODY,
+                           0
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_get_data: Could not set nobody option.\n");
+        status = false;
+        goto End;
+    }
+    //
+    // Do nothing in the header callback.
+    //
+    res = curl_easy_setopt(curl_config->curlhandle,
+                           CURLOPT_HEADERFUNCTION,
+                           header_callback
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_get_data: Could not set header function.\n");
+        status = false;
+        goto End;
+    }
+
+    res = curl_easy_setopt(curl_config->curlhandle,
+                           CURLOPT_FILE,
+                           outfile
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_get_data: Could not set FILE option.\n");
+        status = false;
+        goto End;
+    }
+
+    status = true;
+
+End:
+    return status;
+}
+
+
+static bool
+vhd_sync_xt_set_curl_handle_range(
+    CURL *curlhandle,
+    unsigned long int start_offset,
+    unsigned long int end_offset
+    )
+/*
+ * This function sets the range option of a curl easy handle.
+ *
+ * Parameters:
+ *
+ *      curlhandle - Supplies the curl easy handle.
+ *
+ *      start_offset - Supplies the start byte offset.
+ *
+ *      end_offset - Supplies the end byte offset.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    CURLcode res;
+    char range_request[VHD_SYNC_XT_HTTP_HEADER_REQ_SIZE];
+
+    snprintf(range_request,
+             VHD_SYNC_XT_HTTP_HEADER_REQ_SIZE,
+             "%lu-%lu",
+             start_offset,
+             end_offset);
+
+    res = curl_easy_setopt(curlhandle,
+                           CURLOPT_RANGE,
+                           range_request
+                           );
+
+    return (res == CURLE_OK);
+}
+
+
+bool
+vhd_sync_xt_set_curl_data_range(
+    pvhd_sync_xt_curl_config curl_config,
+    unsigned long int start_offset,
+    unsigned long int end_offset
+    )
+/*
+ * This function sets the curl range option to get a range of bytes.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      start_offset - Supplies the start byte offset.
+ *
+ *      end_offset - Supplies the end byte offset.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+
+    status = vhd_sync_xt_set_curl_handle_range(curl_config->curlhandle,
+                                               start_offset,
+                                               end_offset
+                                               );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_data_range: Could not set range.\n");
+        goto End;
+    }
+
+End:
+    return status;
+}
+
+
+bool
+vhd_sync_xt_create_curl_transfer(
+    pvhd_sync_xt_curl_config curl_config,
+    pvhd_sync_xt_curl_transfer* transfer
+    )
+/*
+ * This function creates a transfer that can run alongside other transfers.
+ * The transfer starts out with a copy of all the options that have been set
+ * on the curl configuration so far (url, certificates, sockets...).
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      transfer - Supplies a placeholder to return the transfer that was
+ *          created.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_curl_transfer transfer_local;
+
+    status = false;
+
+    transfer_local = calloc(1, sizeof(vhd_sync_xt_curl_transfer));
+    if (transfer_local == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_transfer: Could not allocate memory for transfer.\n");
+        status = false;
+        goto End;
+    }
+
+    transfer_local->socket = CURL_SOCKET_BAD;
+    transfer_local->curlhandle = curl_easy_duphandle(curl_config->curlhandle);
+    if (transfer_local->curlhandle == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_transfer: Could not duplicate curl handle.\n");
+        status = false;
+        goto End;
+    }
+
+    curl_easy_setopt(transfer_local->curlhandle,
+                     CURLOPT_PRIVATE,
+                     transfer_local
+                     );
+
+    if (curl_easy_setopt(transfer_local->curlhandle,
+                         CURLOPT_SHARE,
+                         curl_config->share->sharehandle) != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_transfer: Could not set share option.\n");
+        status = false;
+        goto End;
+    }
+
+    *transfer = transfer_local;
+    transfer_local = NULL;
+    status = true;
+
+End:
+    if (transfer_local != NULL)
+    {
+        vhd_sync_xt_destroy_curl_transfer(curl_config, transfer_local);
+    }
+
+    return status;
+}
+
+
+void
+vhd_sync_xt_destroy_curl_transfer(
+    pvhd_sync_xt_curl_config curl_config,
+    pvhd_sync_xt_curl_transfer transfer
+    )
+/*
+ * This function destroys a transfer, removing it from the multi handle if
+ * it is still running.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      transfer - Supplies the transfer to destroy.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (transfer == NULL)
+    {
+        return;
+    }
+
+    if (transfer->curlhandle != NULL)
+    {
+        if (transfer->active == true)
+        {
+            curl_multi_remove_handle(curl_config->multihandle,
+                                     transfer->curlhandle
+                                     );
+        }
+
+        curl_easy_cleanup(transfer->curlhandle);
+    }
+
+    curl_slist_free_all(transfer->headers);
+    free(transfer);
+}
+
+
+bool
+vhd_sync_xt_set_curl_transfer_write(
+    pvhd_sync_xt_curl_transfer transfer,
+    void* header_callback,
+    void* write_callback,
+    void* user_data
+    )
+/*
+ * This function sets up a transfer to get the body of the url, passing the
+ * header and the data to the supplied callbacks.
+ *
+ * Parameters:
+ *
+ *      transfer - Supplies the transfer.
+ *
+ *      header_callback - Supplies a callback for the header of the url.
+ *
+ *      write_callback - Supplies a callback for the body of the url.
+ *
+ *      user_data - Supplies a user data context that is passed to both
+ *          callbacks.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    CURLcode res;
+
+    status = false;
+
+    res = curl_easy_setopt(transfer->curlhandle, CURLOPT_NOBODY, 0L);
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_write: Could not set nobody option.\n");
+        goto End;
+    }
+
+    res = curl_easy_setopt(transfer->curlhandle,
+                           CURLOPT_HEADERFUNCTION,
+                           header_callback
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_write: Could not set header function.\n");
+        goto End;
+    }
+
+    res = curl_easy_setopt(transfer->curlhandle,
+                           CURLOPT_WRITEHEADER,
+                           user_data
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_write: Could not set header data.\n");
+        goto End;
+    }
+
+    res = curl_easy_setopt(transfer->curlhandle,
+                           CURLOPT_WRITEFUNCTION,
+                           write_callback
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_write: Could not set write function.\n");
+        goto End;
+    }
+
+    res = curl_easy_setopt(transfer->curlhandle,
+                           CURLOPT_WRITEDATA,
+                           user_data
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_write: Could not set write data.\n");
+        goto End;
+    }
+
+    status = true;
+
+End:
+    return status;
+}
+
+
+bool
+vhd_sync_xt_set_curl_transfer_range(
+    pvhd_sync_xt_curl_transfer transfer,
+    unsigned long int start_offset,
+    unsigned long int end_offset
+    )
+/*
+ * This function sets the range of bytes a transfer gets.
+ *
+ * Parameters:
+ *
+ *      transfer - Supplies the transfer.
+ *
+ *      start_offset - Supplies the start byte offset.
+ *
+ *      end_offset - Supplies the end byte offset.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+
+    status = vhd_sync_xt_set_curl_handle_range(transfer->curlhandle,
+                                               start_offset,
+                                               end_offset
+                                               );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_range: Could not set range.\n");
+    }
+
+    return status;
+}
+
+
+bool
+vhd_sync_xt_set_curl_transfer_open_range(
+    pvhd_sync_xt_curl_transfer transfer,
+    unsigned long int start_offset
+    )
+/*
+ * This function sets a transfer to get everything from an offset to the end
+ * of the file.
+ *
+ * Parameters:
+ *
+ *      transfer - Supplies the transfer.
+ *
+ *      start_offset - Supplies the start byte offset.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    CURLcode res;
+    char range_request[VHD_SYNC_XT_HTTP_HEADER_REQ_SIZE];
+
+    snprintf(range_request,
+             VHD_SYNC_XT_HTTP_HEADER_REQ_SIZE,
+             "%lu-",
+             start_offset);
+
+    res = curl_easy_setopt(transfer->curlhandle,
+                           CURLOPT_RANGE,
+                           range_request
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_open_range: Could not set range.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_set_curl_transfer_ranges(
+    pvhd_sync_xt_curl_transfer transfer,
+    unsigned long int* start_offsets,
+    unsigned long int* end_offsets,
+    int count
+    )
+/*
+ * This function sets a transfer to get several ranges of bytes in one
+ * request, "a-b,c-d,...". The server may send them as parts of a
+ * multipart/byteranges body, merge them, or send the whole file.
+ *
+ * Parameters:
+ *
+ *      transfer - Supplies the transfer.
+ *
+ *      start_offsets - Supplies the start byte offset of each range.
+ *
+ *      end_offsets - Supplies the end byte offset of each range.
+ *
+ *      count - Supplies the number of ranges.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    CURLcode res;
+    char *range_request;
+    size_t size;
+    size_t used;
+    int i;
+
+    status = false;
+
+    size = (size_t)count * VHD_SYNC_XT_HTTP_HEADER_REQ_SIZE;
+    range_request = malloc(size);
+    if (range_request == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_ranges: Could not allocate memory for ranges.\n");
+        goto End;
+    }
+
+    used = 0;
+    for (i = 0; i < count; ++i)
+    {
+        used += snprintf(range_request + used,
+                         size - used,
+                         "%s%lu-%lu",
+                         (i == 0) ? "" : ",",
+                         start_offsets[i],
+                         end_offsets[i]
+                         );
+    }
+
+    //
+    // Curl keeps its own copy.
+    //
+    res = curl_easy_setopt(transfer->curlhandle,
+                           CURLOPT_RANGE,
+                           range_request
+                           );
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_ranges: Could not set ranges.\n");
+        goto End;
+    }
+
+    status = true;
+
+End:
+    free(range_request);
+    return status;
+}
+
+bool
+vhd_sync_xt_set_curl_transfer_url(
+    pvhd_sync_xt_curl_transfer transfer,
+    char* url
+    )
+/*
+ * This function points a transfer at a different url on the same server,
+ * keeping the credentials and certificates it was set up with.
+ *
+ * Parameters:
+ *
+ *      transfer - Supplies the transfer.
+ *
+ *      url - Supplies the url. It is copied.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    CURLcode res;
+
+    res = curl_easy_setopt(transfer->curlhandle, CURLOPT_URL, url);
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_url: Could not set url.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_set_curl_transfer_header(
+    pvhd_sync_xt_curl_transfer transfer,
+    const char* header
+    )
+/*
+ * This function sets the one extra header the requests of a transfer carry,
+ * replacing any set before.
+ *
+ * Parameters:
+ *
+ *      transfer - Supplies the transfer.
+ *
+ *      header - Supplies the header, "Name: value", or NULL for none. It is
+ *          copied.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    CURLcode res;
+    struct curl_slist *headers;
+
+    headers = NULL;
+    if (header != NULL)
+    {
+        headers = curl_slist_append(NULL, header);
+        if (headers == NULL)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_header: Could not allocate header.\n");
+            return false;
+        }
+    }
+
+    res = curl_easy_setopt(transfer->curlhandle, CURLOPT_HTTPHEADER, headers);
+    if (res != CURLE_OK)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_transfer_header: Could not set header.\n");
+        curl_slist_free_all(headers);
+        return false;
+    }
+
+    curl_slist_free_all(transfer->headers);
+    transfer->headers = headers;
+
+    return true;
+}
+
 
 bool
-vhd_sync_xt_create_curl_config(
-    pvhd_sync_xt_curl_config* curl_config,
-    int connection_socket
+vhd_sync_xt_start_curl_transfer(
+    pvhd_sync_xt_curl_config curl_config,
+    pvhd_sync_xt_curl_transfer transfer
     )
 /*
- * This function creates a curl configuration struct to store our curl 
- * configuration.
+ * This function starts a transfer on the multi handle. The transfer makes
+ * progress in vhd_sync_xt_wait_curl_transfers.
  *
  * Parameters:
  *
- *      curl_config - Supplies a placeholder to return the curl configuration
- *          struct that was created.
- *          
- *      connection_socket - Supplies a an opened socket that is already connected
- *          to the server that should be used by curl.
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      transfer - Supplies the transfer to start.
  *
  * Return Value:
  *
  *      TRUE on success, FALSE otherwise.
- */  
-
+ */
 {
     bool status;
-    pvhd_sync_xt_curl_config    curl_config_local;
+    CURLMcode multi_res;
 
     status = false;
-    curl_config_local = NULL;
 
-    curl_config_local = calloc(1, sizeof(vhd_sync_xt_curl_config));
-    if (curl_config_local == NULL)
-    {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_config: Could not allocate memory for curl configuration.\n");
-        status = false;
-        goto End;
-    }
+    transfer->done = false;
+    transfer->paused = false;
+    transfer->result = CURLE_OK;
+    transfer->socket = CURL_SOCKET_BAD;
 
-    curl_config_local->curlhandle  = curl_easy_init();
-    if (curl_config_local->curlhandle == NULL)
+    multi_res = curl_multi_add_handle(curl_config->multihandle,
+                                      transfer->curlhandle
+                                      );
+    if (multi_res != CURLM_OK)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_curl_config: Could not init curl library.\n");
-        status = false;
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_curl_transfer: Could not add transfer to multi handle : %d\n", multi_res);
         goto End;
     }
 
-    curl_config_local->connection_socket = connection_socket;
-
-    *curl_config = curl_config_local;
-    curl_config_local = NULL;
-    status = true;   
+    transfer->active = true;
+    status = true;
 
 End:
-    if (curl_config_local != NULL)
+    return status;
+}
+
+
+void
+vhd_sync_xt_stop_curl_transfer(
+    pvhd_sync_xt_curl_config curl_config,
+    pvhd_sync_xt_curl_transfer transfer
+    )
+/*
+ * This function stops a running transfer without waiting for it to
+ * complete.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      transfer - Supplies the transfer to stop.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (transfer->active == false)
     {
-        vhd_sync_xt_destroy_curl_config(curl_config_local);
+        return;
     }
 
-    return status;
-    
+    curl_multi_remove_handle(curl_config->multihandle, transfer->curlhandle);
+    transfer->active = false;
+    transfer->done = false;
+    transfer->paused = false;
 }
 
+
 void
-vhd_sync_xt_destroy_curl_config(
-    pvhd_sync_xt_curl_config curl_config
+vhd_sync_xt_resume_curl_transfer(
+    pvhd_sync_xt_curl_config curl_config,
+    pvhd_sync_xt_curl_transfer transfer
     )
 /*
- * This function destroys a curl_config struct that stores the curl
- * configuration.
+ * This function resumes a transfer its write callback paused. Data curl
+ * held on to can be handed to the write callback before this returns, which
+ * may pause the transfer again, or end it, in which case the transfer is
+ * done as if it had completed in vhd_sync_xt_wait_curl_transfers.
  *
  * Parameters:
  *
  *      curl_config - Supplies a poitner to the curl configuration.
  *
+ *      transfer - Supplies the transfer.
+ *
  * Return Value:
  *
  *      None.
  */
 {
-    if (curl_config == NULL)
+    CURLcode res;
+
+    if (transfer->paused == false)
     {
         return;
     }
 
-    if (curl_config->curlhandle)
+    transfer->paused = false;
+    res = curl_easy_pause(transfer->curlhandle, CURLPAUSE_CONT);
+    if (res != CURLE_OK)
     {
-        curl_easy_cleanup(curl_config->curlhandle);
+        transfer->result = res;
+        transfer->done = true;
+        transfer->active = false;
+        curl_easy_getinfo(transfer->curlhandle,
+                          CURLINFO_ACTIVESOCKET,
+                          &transfer->socket
+                          );
+        curl_multi_remove_handle(curl_config->multihandle,
+                                 transfer->curlhandle
+                                 );
     }
-
-    free(curl_config);
 }
 
-curl_socket_t
-vhd_sync_xt_curl_opensocket (
-        void *user_data,
-        curlsocktype purpose,
-        struct curl_sockaddr *address
-        )
+
+bool
+vhd_sync_xt_set_curl_broker(
+    pvhd_sync_xt_curl_config curl_config,
+    int broker_fd,
+    int connections
+    )
 /*
- * This function is set as the callback to open a socket from curl, if we
- * already have socket fd.
+ * This function sets a broker to get connected sockets from, and gets
+ * enough of them up front for the given number of connections, counting
+ * the connected socket we were started with. Curl is kept to as many
+ * connections as we got sockets for. It takes effect with the next url set.
  *
  * Parameters:
  *
- *      user_data - Supplies a pointer to our curl config struct.
+ *      curl_config - Supplies a poitner to the curl configuration.
  *
- *      purpose - Curl supplies a purpose for this socket call.
+ *      broker_fd - Supplies the unix socket to the broker.
  *
- *      address - Curl supplies an address for this socket
+ *      connections - Supplies the number of connections wanted.
  *
  * Return Value:
  *
- *      Returns the sockfd we have already opened.
+ *      TRUE on success, FALSE otherwise.
  */
 {
-    pvhd_sync_xt_curl_config curl_config;
+    bool status;
+    int count;
+    int received;
 
-    curl_config  = (pvhd_sync_xt_curl_config)user_data;
+    status = false;
+    curl_config->broker_fd = broker_fd;
 
-    return curl_config->connection_socket;
+    if (curl_config->connection_socket != 0 && curl_config->spare_count == 0)
+    {
+        curl_config->spare_sockets[curl_config->spare_count++] =
+            curl_config->connection_socket;
+    }
+
+    count = connections - curl_config->spare_count;
+    if (count > VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS - curl_config->spare_count)
+    {
+        count = VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS - curl_config->spare_count;
+    }
+
+    if (count > 0)
+    {
+        status = vhd_sync_xt_broker_request_sockets(broker_fd,
+                                                    count,
+                                                    curl_config->spare_sockets
+                                                    + curl_config->spare_count,
+                                                    &received
+                                                    );
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_broker: Could not get sockets from broker.\n");
+            goto End;
+        }
+
+        curl_config->spare_count += received;
+    }
+
+    if (curl_config->spare_count == 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_broker: Broker gave no sockets.\n");
+        status = false;
+        goto End;
+    }
+
+    curl_multi_setopt(curl_config->multihandle,
+                      CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                      (long)curl_config->spare_count
+                      );
+
+    status = true;
+
+End:
+    return status;
 }
 
-int
-vhd_sync_xt_curl_sockopt_callback(
-        void *user_data,
-        curl_socket_t sockfd,
-        curlsocktype purpose
-        )
+bool
+vhd_sync_xt_can_open_curl_connection(
+    pvhd_sync_xt_curl_config curl_config
+    )
 /*
- * This function is set as the callback after the socket call from curl.
+ * This function tells whether curl can open another connection, should one
+ * be dropped. The connected socket we were started with is the only one
+ * there is without a broker, and a broker may have run out.
  *
  * Parameters:
  *
- *      user_data - Supplies a pointer to our curl config struct.
+ *      curl_config - Supplies a poitner to the curl configuration.
  *
- *      sockfd - Supplies the socket fd for which this is called.
+ * Return Value:
  *
- *      prupose - Curl supplies a purpose for this call.
+ *      TRUE if a new connection can be opened, FALSE otherwise.
+ */
+{
+    if (curl_config->broker_fd != 0)
+    {
+        return curl_config->spare_count > 0
+               || curl_config->broker_exhausted == false;
+    }
+
+    return curl_config->connection_socket == 0;
+}
+
+
+void
+vhd_sync_xt_set_curl_http2(
+    pvhd_sync_xt_curl_config curl_config,
+    bool http2
+    )
+/*
+ * This function sets whether requests are made over HTTP/2, multiplexing
+ * all the transfers on a single connection. It takes effect with the next
+ * url set.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      http2 - Supplies TRUE to use HTTP/2.
  *
  * Return Value:
  *
- *      Returns CURL_SOCKOPT_ALREADY_CONNECTED to indicate that our
- *      socket is already connected.
+ *      None.
  */
 {
-    return CURL_SOCKOPT_ALREADY_CONNECTED;
+    curl_config->http2 = http2;
+
+    curl_multi_setopt(curl_config->multihandle,
+                      CURLMOPT_PIPELINING,
+                      (http2 == true) ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING
+                      );
 }
 
 
-bool
-vhd_sync_xt_set_url(
+void
+vhd_sync_xt_set_curl_session_cache(
     pvhd_sync_xt_curl_config curl_config,
-    char* url,
-    char* ca_cert,
-    char* ca_path,
-    char* credentials
+    char* session_cache_path,
+    long int session_timeout
     )
 /*
- * This function sets the url for curl config.
+ * This function sets the file TLS sessions are kept in between runs. It
+ * takes effect with the next url set.
  *
  * Parameters:
  *
- *      curl_config - Supplies a pointer to the curl configuration.
+ *      curl_config - Supplies a poitner to the curl configuration.
  *
- *      url - specifies the url for curl
+ *      session_cache_path - Supplies the path of the file, NULL for none.
  *
- *      ca_cert - Supplies a certificate for the server.
+ *      session_timeout - Supplies the longest a session is kept for, in
+ *          seconds.
  *
- *      ca_path - Supplies a ca path to verify the server certificate.
+ * Return Value:
  *
- *      credentials - Supplies login credentials for auth with the server.
+ *      None.
+ */
+{
+    curl_config->session_cache_path = session_cache_path;
+    curl_config->session_timeout = session_timeout;
+}
+
+
+bool
+vhd_sync_xt_set_curl_low_speed(
+    pvhd_sync_xt_curl_config curl_config,
+    long int low_speed_limit,
+    long int low_speed_time
+    )
+/*
+ * This function has transfers fail once they get slower than a limit for
+ * long enough. Transfers created after this is set get it too.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      low_speed_limit - Supplies the limit in bytes per second.
+ *
+ *      low_speed_time - Supplies how many seconds a transfer can stay below
+ *          the limit.
  *
  * Return Value:
  *
  *      TRUE on success, FALSE otherwise.
- */  
+ */
 {
     CURLcode res;
-    bool status;
-
-    status = false;
 
-    res = curl_easy_setopt(curl_config->curlhandle, CURLOPT_URL, url);
+    res = curl_easy_setopt(curl_config->curlhandle,
+                           CURLOPT_LOW_SPEED_LIMIT,
+                           low_speed_limit
+                           );
     if (res != CURLE_OK)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set url option.\n");
-        status = false;
-        goto End;
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_low_speed: Could not set low speed limit : %d\n", res);
+        return false;
     }
 
-
-    //
-    // If we already have a socket fd through which to channel
-    // our data, then instruct curl to use it.
-    //
-    if (curl_config->connection_socket != 0)
+    res = curl_easy_setopt(curl_config->curlhandle,
+                           CURLOPT_LOW_SPEED_TIME,
+                           low_speed_time
+                           );
+    if (res != CURLE_OK)
     {
-        res = curl_easy_setopt(curl_config->curlhandle,
-                               CURLOPT_OPENSOCKETDATA,
-                               curl_config
-                               );
-        if (res != CURLE_OK)
-        {
-            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set opensocketdata option.\n");
-            status = false;
-            goto End;
-        }
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_low_speed: Could not set low speed time : %d\n", res);
+        return false;
+    }
 
-        res = curl_easy_setopt(curl_config->curlhandle,
-                               CURLOPT_OPENSOCKETFUNCTION,
-                               vhd_sync_xt_curl_opensocket
-                               );
-        if (res != CURLE_OK)
-        {
-            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set opensocketfunction option.\n");
-            status = false;
-            goto End;
-        }
+    return true;
+}
 
-        res = curl_easy_setopt(curl_config->curlhandle,
-                               CURLOPT_SOCKOPTDATA,
-                               curl_config
-                               );
-        if (res != CURLE_OK)
-        {
-            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set sockoptdata option.\n");
-            status = false;
-            goto End;
-        }
 
-        res = curl_easy_setopt(curl_config->curlhandle,
-                                CURLOPT_SOCKOPTFUNCTION,
-                                vhd_sync_xt_curl_sockopt_callback);
-        if (res != CURLE_OK)
-        {
-            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set sockoptfunction option.\n");
-            status = false;
-            goto End;
-        }
+void
+vhd_sync_xt_set_curl_wait_timeout(
+    pvhd_sync_xt_curl_config curl_config,
+    int wait_timeout_ms
+    )
+/*
+ * This function sets the longest a wait for the transfers blocks, for
+ * callers that have something to do at a set time.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      wait_timeout_ms - Supplies the timeout in milliseconds.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    curl_config->wait_timeout_ms = wait_timeout_ms;
+}
 
-        //
-        // This means that the client is already connected  go to end.
-        //
-        status = true;
-        goto End;
-    }
 
-    //
-    // If we have a  certificate for the server verify it.
-    //
-    if (ca_cert != NULL)
-    {
-        res = curl_easy_setopt(curl_config->curlhandle,
-                               CURLOPT_CAINFO,
-                               ca_cert
-                               );
-        if (res != CURLE_OK)
-        {
-            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set cert info option.\n");
-            status = false;
-            goto End;
-        }
-    }
+bool
+vhd_sync_xt_wait_curl_transfers(
+    pvhd_sync_xt_curl_config curl_config
+    )
+/*
+ * This function runs the event loop once, driving all the running transfers
+ * and calling back our own fds and timers, until something happens or the
+ * wait times out. Completed transfers are removed from the multi handle and
+ * have their done flag and result set.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    CURLMsg *message;
+    pvhd_sync_xt_curl_transfer transfer;
+    int queued;
 
-    //
-    // If we have a ca path to verify the server cert then verify the server cert.
-    //
-    if (ca_path != NULL)
-    {
-        res = curl_easy_setopt(curl_config->curlhandle,
-                               CURLOPT_CAPATH,
-                               ca_path
-                               );
-        if (res != CURLE_OK)
-        {
-            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set cert path option.\n");
-            status = false;
-            goto End;
-        }
+    status = false;
 
+    if (vhd_sync_xt_run_curl_events(curl_config) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_wait_curl_transfers: Could not run events.\n");
+        goto End;
     }
 
-    //
-    // If we have auth credentials set them.
-    //
-    if (credentials != NULL)
+    while ((message = curl_multi_info_read(curl_config->multihandle,
+                                           &queued)) != NULL)
     {
-        res = curl_easy_setopt(curl_config->curlhandle,
-                               CURLOPT_USERPWD,
-                               credentials
-                               );
-        if (res != CURLE_OK)
+        if (message->msg != CURLMSG_DONE)
         {
-            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set user credential option.\n");
-            status = false;
-            goto End;
+            continue;
         }
 
-        res = curl_easy_setopt(curl_config->curlhandle,
-                               CURLOPT_HTTPAUTH,
-                               CURLAUTH_DIGEST
-                               );
-        if (res != CURLE_OK)
+        transfer = NULL;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &transfer);
+        if (transfer == NULL)
         {
-            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_url: Could not set auth type.\n");
-            status = false;
-            goto End;
+            continue;
         }
+
+        transfer->result = message->data.result;
+        transfer->done = true;
+        transfer->active = false;
+        curl_easy_getinfo(transfer->curlhandle,
+                          CURLINFO_ACTIVESOCKET,
+                          &transfer->socket
+                          );
+        curl_multi_remove_handle(curl_config->multihandle,
+                                 transfer->curlhandle
+                                 );
     }
 
     status = true;
@@ -349,213 +2535,298 @@ End:
 }
 
 
-int
-vhd_sync_xt_perform_curl(
-    pvhd_sync_xt_curl_config curl_config
+bool
+vhd_sync_xt_add_curl_event(
+    pvhd_sync_xt_curl_config curl_config,
+    int fd,
+    vhd_sync_xt_curl_event_callback callback,
+    void* user_data,
+    pvhd_sync_xt_curl_event* event
     )
 /*
- * This function peforms the curl operation that has been configured.
+ * This function adds an fd of our own to the event loop. Its callback is
+ * called from the waits for the transfers whenever the fd is readable.
  *
  * Parameters:
  *
  *      curl_config - Supplies a poitner to the curl configuration.
  *
+ *      fd - Supplies the fd to watch. It stays with the caller, and must be
+ *          removed from the loop before it is closed. Regular files cannot
+ *          be waited on, and fail without an error being logged.
+ *
+ *      callback - Supplies the callback for the fd.
+ *
+ *      user_data - Supplies a user data context that is passed to the
+ *          callback.
+ *
+ *      event - Supplies a placeholder to return the event.
+ *
  * Return Value:
  *
- *      Errno. TBD.
- */ 
+ *      TRUE on success, FALSE otherwise.
+ */
 {
-    return curl_easy_perform(curl_config->curlhandle);
+    return vhd_sync_xt_create_curl_event(curl_config,
+                                         VHD_SYNC_XT_CURL_EVENT_FD,
+                                         fd,
+                                         EPOLLIN,
+                                         callback,
+                                         user_data,
+                                         event
+                                         );
 }
 
 
 bool
-vhd_sync_xt_set_curl_process_header(
+vhd_sync_xt_add_curl_timer(
     pvhd_sync_xt_curl_config curl_config,
-    void* header_callback,
-    void* user_data
+    int interval_ms,
+    vhd_sync_xt_curl_event_callback callback,
+    void* user_data,
+    pvhd_sync_xt_curl_event* event
     )
 /*
- * This function sets the curl option to send callbacks to the requested
- * callback function for the header of the URL
+ * This function adds a timer to the event loop. Its callback is called from
+ * the waits for the transfers every interval, for as long as it is in the
+ * loop.
  *
  * Parameters:
  *
  *      curl_config - Supplies a poitner to the curl configuration.
  *
- *      header_callback - Suppplies a callback for the header of the url.
+ *      interval_ms - Supplies the interval of the timer in milliseconds.
+ *
+ *      callback - Supplies the callback for the timer.
  *
  *      user_data - Supplies a user data context that is passed to the
  *          callback.
  *
+ *      event - Supplies a placeholder to return the event.
+ *
  * Return Value:
  *
  *      TRUE on success, FALSE otherwise.
  */
 {
     bool status;
-    CURLcode res;
-    
+    struct itimerspec timer;
+    int timer_fd;
+
     status = false;
-    res = curl_easy_setopt(curl_config->curlhandle,
-                           CURLOPT_NOBODY,
-                           1
-                           );
-    if (res != CURLE_OK)
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_process_header: Could not set nobody option.\n");
-        status = false;
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_add_curl_timer: Could not create timer fd : %d\n", errno);
         goto End;
     }
 
-    res = curl_easy_setopt(curl_config->curlhandle,
-                           CURLOPT_HEADERFUNCTION,
-                           header_callback
-                           );
-    if (res != CURLE_OK)
+    memset(&timer, 0, sizeof(timer));
+    timer.it_interval.tv_sec = interval_ms / 1000;
+    timer.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    timer.it_value = timer.it_interval;
+    if (timerfd_settime(timer_fd, 0, &timer, NULL) != 0)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_process_header: Could not set nobody option.\n");
-        status = false;
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_add_curl_timer: Could not set timer : %d\n", errno);
+        close(timer_fd);
         goto End;
     }
 
-    res = curl_easy_setopt(curl_config->curlhandle,
-                           CURLOPT_WRITEHEADER,
-                           user_data
-                           );
-    if (res != CURLE_OK)
+    status = vhd_sync_xt_create_curl_event(curl_config,
+                                           VHD_SYNC_XT_CURL_EVENT_TIMER,
+                                           timer_fd,
+                                           EPOLLIN,
+                                           callback,
+                                           user_data,
+                                           event
+                                           );
+    if (status == false)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_process_header: Could not set nobody option.\n");
-        status = false;
+        close(timer_fd);
         goto End;
     }
-    status = true;
 
 End:
     return status;
 }
 
 
-bool
-vhd_sync_xt_set_curl_get_data(
+void
+vhd_sync_xt_remove_curl_event(
     pvhd_sync_xt_curl_config curl_config,
-    void* header_callback,
-    FILE* outfile
+    pvhd_sync_xt_curl_event event
     )
 /*
- * This function sets the curl option to send callbacks to the requested
- * callback function for the header of the URL
+ * This function takes an event out of the event loop. It is safe to call
+ * from the callbacks of any event, including the one being removed.
  *
  * Parameters:
  *
  *      curl_config - Supplies a poitner to the curl configuration.
  *
- *      header_callback - Suppplies a callback for the header of the url.
- *
- *      outfile - Supplies a file stream to write the data to.
+ *      event - Supplies the event.
  *
  * Return Value:
  *
- *      TRUE on success, FALSE otherwise.
+ *      None.
  */
 {
-    bool status;
-    CURLcode res;
+    pvhd_sync_xt_curl_event *link;
 
-    status = false;
-
-    //
-    // Set the option to get the body.
-    //
-    res = curl_easy_setopt(curl_config->curlhandle,
-                           CURLOPT_NOBODY,
-                           0
-                           );
-    if (res != CURLE_OK)
+    if (event == NULL || event->removed == true)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_get_data: Could not set nobody option.\n");
-        status = false;
-        goto End;
+        return;
     }
-    //
-    // Do nothing in the header callback.
-    //
-    res = curl_easy_setopt(curl_config->curlhandle,
-                           CURLOPT_HEADERFUNCTION,
-                           header_callback
-                           );
-    if (res != CURLE_OK)
+
+    epoll_ctl(curl_config->epoll_fd, EPOLL_CTL_DEL, event->fd, NULL);
+    if (event->type == VHD_SYNC_XT_CURL_EVENT_CURL_TIMER
+        || event->type == VHD_SYNC_XT_CURL_EVENT_TIMER)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_get_data: Could not set header function.\n");
-        status = false;
-        goto End;
+        close(event->fd);
     }
 
-    res = curl_easy_setopt(curl_config->curlhandle,
-                           CURLOPT_FILE,
-                           outfile
-                           );
-    if (res != CURLE_OK)
+    for (link = &curl_config->events; *link != NULL; link = &(*link)->next)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_get_data: Could not set FILE option.\n");
-        status = false;
-        goto End;
+        if (*link == event)
+        {
+            *link = event->next;
+            break;
+        }
     }
 
-    status = true;
+    event->removed = true;
+    event->next = curl_config->removed_events;
+    curl_config->removed_events = event;
+}
 
-End:
-    return status;
+
+long
+vhd_sync_xt_get_curl_transfer_response_code(
+    pvhd_sync_xt_curl_transfer transfer
+    )
+/*
+ * This function returns the HTTP response code of a transfer.
+ *
+ * Parameters:
+ *
+ *      transfer - Supplies the transfer.
+ *
+ * Return Value:
+ *
+ *      The response code, 0 if no response has been received yet.
+ */
+{
+    long response_code;
+
+    response_code = 0;
+    curl_easy_getinfo(transfer->curlhandle,
+                      CURLINFO_RESPONSE_CODE,
+                      &response_code
+                      );
+
+    return response_code;
 }
 
 
-bool
-vhd_sync_xt_set_curl_data_range(
-    pvhd_sync_xt_curl_config curl_config,
-    unsigned long int start_offset,
-    unsigned long int end_offset
+void
+vhd_sync_xt_get_curl_transfer_times(
+    pvhd_sync_xt_curl_transfer transfer,
+    unsigned long int* first_byte_usec,
+    unsigned long int* total_usec
     )
 /*
- * This function sets the curl range option to get a range of bytes.
+ * This function returns the timings of the last request of a transfer.
  *
  * Parameters:
  *
- *      curl_config - Supplies a poitner to the curl configuration.
+ *      transfer - Supplies the transfer.
  *
- *      start_offset - Supplies the start byte offset.
+ *      first_byte_usec - Supplies a placeholder to return the time from the
+ *          start of the request to the first byte of the response.
  *
- *      end_offset - Supplies the end byte offset.
+ *      total_usec - Supplies a placeholder to return the total time of the
+ *          request.
  *
  * Return Value:
  *
- *      TRUE on success, FALSE otherwise.
+ *      None.
  */
 {
-    bool status;
-    CURLcode res;
-    char range_request[VHD_SYNC_XT_HTTP_HEADER_REQ_SIZE];
+    curl_off_t first_byte;
+    curl_off_t total;
 
-    status = false;
+    first_byte = 0;
+    total = 0;
 
-    snprintf(range_request,
-             VHD_SYNC_XT_HTTP_HEADER_REQ_SIZE,
-             "%lu-%lu",
-             start_offset,
-             end_offset);
+    curl_easy_getinfo(transfer->curlhandle,
+                      CURLINFO_STARTTRANSFER_TIME_T,
+                      &first_byte
+                      );
+    curl_easy_getinfo(transfer->curlhandle,
+                      CURLINFO_TOTAL_TIME_T,
+                      &total
+                      );
 
-    res = curl_easy_setopt(curl_config->curlhandle,
-                           CURLOPT_RANGE,
-                           range_request
-                           );
-    if (res != CURLE_OK)
+    *first_byte_usec = first_byte;
+    *total_usec = total;
+}
+
+bool
+vhd_sync_xt_get_curl_transfer_socket(
+    pvhd_sync_xt_curl_transfer transfer,
+    int* socket
+    )
+/*
+ * This function gets the socket of the connection a transfer completed on,
+ * which stays open as long as curl keeps the connection, so it is only good
+ * until the event loop runs again.
+ *
+ * Parameters:
+ *
+ *      transfer - Supplies the transfer.
+ *
+ *      socket - Supplies a placeholder for the socket.
+ *
+ * Return Value:
+ *
+ *      TRUE if the connection is still there, FALSE otherwise.
+ */
+{
+    if (transfer->socket == CURL_SOCKET_BAD)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_set_curl_data_range: Could not set range.\n");
-        status = false;
-        goto End;
+        return false;
     }
 
-    status = true;
+    *socket = transfer->socket;
+    return true;
+}
 
-End:
-    return status;
+void
+vhd_sync_xt_set_curl_socket_tuning(
+    pvhd_sync_xt_curl_config curl_config,
+    char* congestion,
+    unsigned long int receive_buffer
+    )
+/*
+ * This function sets what the sockets of connections made from now on are
+ * tuned to.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies a poitner to the curl configuration.
+ *
+ *      congestion - Supplies the congestion control algorithm, NULL for the
+ *          system default.
+ *
+ *      receive_buffer - Supplies the receive buffer in bytes, 0 to leave it
+ *          to the kernel.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    curl_config->congestion = congestion;
+    curl_config->receive_buffer = receive_buffer;
 }
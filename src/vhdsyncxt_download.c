@@ -27,7 +27,10 @@
 
 /* ---------------- Header includes ---------------------------------------- */
 
+#define _GNU_SOURCE
+
 #include <vhdsyncxt_download.h>
+#include <fcntl.h>
 
 /* ---------------- Function Definitions ----------------------------------- */
 bool
@@ -48,40 +51,21 @@ vhd_sync_xt_open_partial_file(
  */
 {
     bool status;
-    int return_code;
-
-    //
-    // Generate our partial download filename.
-    //
-    snprintf(download_context->partial_file_path,
-            VHD_SYNC_XT_PATH_LENGTH,
-            "%s%s",
-            download_context->local_file_path,
-            VHD_SYNC_XT_PARTIAL_FILE_EXTENSION
-            );
-
-    download_context->out = fopen(download_context->partial_file_path,"a+");
-    if (download_context->out == NULL)
-    {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_partial_file: Could not perform curl to get file size. \n");
-        status = false;
-        goto End;
-    }
 
-    //
-    // Get the file size of our partial file.
-    //
-    return_code = fseek(download_context->out, 0, SEEK_END);
-    if (return_code != 0)
+    status = vhd_sync_xt_open_writer(download_context->partial_file_path,
+                                     download_context->options.writer_type,
+                                     download_context->file_size,
+                                     download_context->options.sparse,
+                                     download_context->options.writeback,
+                                     &download_context->writer
+                                     );
+    if (status == false)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_partial_file: Could not get file size of partial download. \n");
-        status = false;
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_partial_file: Could not open partial file. \n");
         goto End;
     }
 
-    download_context->start_offset = ftell(download_context->out);
-
-    status = true;
+    download_context->start_offset = download_context->writer->file_end;
 
 End:
     return status;
@@ -115,59 +99,3515 @@ vhd_sync_xt_header_callback_null(
     return size * nmemb;
 }
 
-static size_t
-vhd_sync_xt_header_callback(
-        void *data_stream,
-        size_t size,
-        size_t nmemb,
-        void *user_data
-        )
+static bool
+vhd_sync_xt_advance_verify(
+    pvhd_sync_xt_download_context download_context
+    )
 /*
- * This function is the callback set to receive the header data. This
- * updates the download context with useful data from the header.
+ * This function moves the hash of the file on over data that is already in
+ * the partial file, written by another range or an earlier run, reading it
+ * back. It stops where the data runs out.
  *
  * Parameters:
  *
- *      data_stream - Supplies a line of header data.
+ *      download_context - Supplies the download context structure.
  *
- *      size - Supplies the size of the data unit in the stream.
+ * Return Value:
  *
- *      nmemb - Supplies the number of members of the data.
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_verify verify;
+    pvhd_sync_xt_download_range range;
+    unsigned long int end_offset;
+    unsigned long int written_offset;
+    unsigned long int missing_start;
+    unsigned long int missing_end;
+    int i;
+
+    verify = download_context->verify;
+
+    while (verify->offset < download_context->file_size)
+    {
+        end_offset = verify->offset;
+
+        for (i = 0;
+             download_context->ranges != NULL
+             && i < download_context->options.parallel_streams;
+             ++i)
+        {
+            range = &download_context->ranges[i];
+            written_offset = range->write_offset - range->buffer_length;
+            if (range->start_offset <= verify->offset
+                && written_offset > end_offset)
+            {
+                end_offset = written_offset;
+            }
+        }
+
+        if (end_offset == verify->offset)
+        {
+            if (vhd_sync_xt_resume_map_next_missing(download_context->resume_map,
+                                                    verify->offset,
+                                                    &missing_start,
+                                                    &missing_end) == false)
+            {
+                end_offset = download_context->file_size;
+            }
+            else if (missing_start > verify->offset)
+            {
+                end_offset = missing_start;
+            }
+        }
+
+        if (end_offset == verify->offset)
+        {
+            break;
+        }
+
+        if (vhd_sync_xt_verify_read(verify,
+                                    download_context->writer->fd,
+                                    end_offset) == false)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_flush_range(
+    pvhd_sync_xt_download_context download_context,
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function writes out what is in the buffer of a range, which is the
+ * data just before its write offset. If that fails the data is dropped and
+ * the write offset moved back to match.
  *
- *      user_data - Set to point to our download context.
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      range - Supplies the range.
  *
  * Return Value:
  *
- *      Returns the size of data recieved.
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+
+    status = true;
+    if (range->buffer_length == 0)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_writer_write(download_context->writer,
+                                      range->buffer,
+                                      range->buffer_length,
+                                      range->write_offset - range->buffer_length
+                                      );
+    if (status == false)
+    {
+        range->write_offset -= range->buffer_length;
+        download_context->current_offset -= range->buffer_length;
+        download_context->stats.wasted_bytes += range->buffer_length;
+        range->buffer_length = 0;
+        range->write_failed = true;
+        goto End;
+    }
+
+    //
+    // Hash the data on its way out if it is next in line, which saves
+    // reading it back.
+    //
+    if (download_context->verify != NULL)
+    {
+        vhd_sync_xt_verify_update(download_context->verify,
+                                  range->buffer,
+                                  range->write_offset - range->buffer_length,
+                                  range->buffer_length
+                                  );
+    }
+
+    range->buffer_length = 0;
+
+    if (download_context->verify != NULL)
+    {
+        status = vhd_sync_xt_advance_verify(download_context);
+    }
+
+End:
+    return status;
+}
+
+static bool
+vhd_sync_xt_read_control(
+    void *user_data
+    )
+/*
+ * This function is called from the event loop when the control fd is
+ * readable, and reads whatever commands have come in on it without
+ * blocking. A command is a line of a name and a value:
+ *
+ *      ratelimit <KB/s>    Sets the rate limit, 0 for none.
+ *
+ *      rateburst <KB>      Sets the burst, 0 to pick one from the rate.
+ *
+ * Parameters:
+ *
+ *      user_data - Supplies the download context structure.
+ *
+ * Return Value:
+ *
+ *      TRUE, as a bad command does not stop the download.
  */
 {
     pvhd_sync_xt_download_context download_context;
+    ssize_t result;
+    char *line_end;
+    char name[VHD_SYNC_XT_CONTROL_LINE_LENGTH];
+    unsigned long int value;
+
+    download_context = (pvhd_sync_xt_download_context)user_data;
+
+    while (true)
+    {
+        result = read(download_context->options.control_fd,
+                      download_context->control_line + download_context->control_length,
+                      sizeof(download_context->control_line) - 1
+                      - download_context->control_length
+                      );
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (result == 0)
+        {
+            //
+            // Nobody is going to tell us anything more.
+            //
+            vhd_sync_xt_remove_curl_event(download_context->curl_config,
+                                          download_context->control_event
+                                          );
+            download_context->control_event = NULL;
+            download_context->options.control_fd = 0;
+        }
+
+        if (result <= 0)
+        {
+            break;
+        }
+
+        download_context->control_length += result;
+        download_context->control_line[download_context->control_length] = '\0';
+
+        while ((line_end = strchr(download_context->control_line, '\n')) != NULL)
+        {
+            *line_end = '\0';
+
+            if (sscanf(download_context->control_line, "%127s %lu", name, &value) != 2)
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_read_control: Bad command %s.\n",
+                                     download_context->control_line);
+            }
+            else if (strcmp(name, VHD_SYNC_XT_CONTROL_RATE_LIMIT) == 0)
+            {
+                vhd_sync_xt_set_rate_limit(&download_context->limiter,
+                                           value * 1024,
+                                           download_context->options.rate_burst
+                                           );
+            }
+            else if (strcmp(name, VHD_SYNC_XT_CONTROL_RATE_BURST) == 0)
+            {
+                download_context->options.rate_burst = value * 1024;
+                vhd_sync_xt_set_rate_limit(&download_context->limiter,
+                                           download_context->limiter.rate,
+                                           download_context->options.rate_burst
+                                           );
+            }
+            else
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_read_control: Unknown command %s.\n", name);
+            }
+
+            download_context->control_length -= line_end + 1
+                                                - download_context->control_line;
+            memmove(download_context->control_line,
+                    line_end + 1,
+                    download_context->control_length + 1
+                    );
+        }
+
+        //
+        // A line that fills the buffer is no command of ours.
+        //
+        if (download_context->control_length == sizeof(download_context->control_line) - 1)
+        {
+            download_context->control_length = 0;
+        }
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_pace_download(
+    pvhd_sync_xt_download_context download_context
+    )
+/*
+ * This function is called before each wait for the transfers. It resumes
+ * the ranges that were paused for lack of tokens once the bucket has some
+ * again, and otherwise has the wait last until it does. Curl does not watch
+ * the sockets of transfers that are paused, so the wait is what holds the
+ * rate.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_limiter limiter;
+    long int wait_ms;
+    int i;
+
+    limiter = &download_context->limiter;
 
-    download_context = (pvhd_sync_xt_download_context) user_data;
+    vhd_sync_xt_refill_tokens(limiter);
+
+    if (limiter->rate != 0 && limiter->tokens <= 0)
+    {
+        wait_ms = (-limiter->tokens * 1000) / (long int)limiter->rate + 1;
+        vhd_sync_xt_set_curl_wait_timeout(download_context->curl_config, wait_ms);
+        return true;
+    }
+
+    for (i = 0; i < download_context->options.parallel_streams; ++i)
+    {
+        vhd_sync_xt_resume_curl_transfer(download_context->curl_config,
+                                         download_context->ranges[i].transfer
+                                         );
+    }
 
     //
-    // Why isnt strnstr in glibc? Fixme!!! curl makes no guarantees about null
-    // termination.
+    // Come back at least once per burst, so the bucket never sits full
+    // while data waits.
     //
-    if(strstr(data_stream, "Content-Length"))
+    wait_ms = VHD_SYNC_XT_CURL_WAIT_TIMEOUT_MS;
+    if (limiter->rate != 0
+        && (long int)(limiter->burst * 1000 / limiter->rate) + 1 < wait_ms)
     {
-        sscanf((char*)data_stream,
-                "Content-Length: %lu",
-                &download_context->file_size);
+        wait_ms = limiter->burst * 1000 / limiter->rate + 1;
     }
 
-    return size * nmemb;
+    vhd_sync_xt_set_curl_wait_timeout(download_context->curl_config, wait_ms);
+
+    return true;
+}
+
+static void
+vhd_sync_xt_watch_range(
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function starts a stall window for a range whose request is just
+ * starting, which only runs once the headers of the response are in.
+ *
+ * Parameters:
+ *
+ *      range - Supplies the range.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    vhd_sync_xt_reset_http_headers(&range->headers);
+    range->window_offset = range->write_offset;
+    clock_gettime(CLOCK_MONOTONIC, &range->window_start);
+    range->stalled = false;
+}
+
+static void
+vhd_sync_xt_drop_hedge(
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function undoes the pairing of a range with its hedge, or of a hedge
+ * with the range it was sent for.
+ *
+ * Parameters:
+ *
+ *      range - Supplies either of the two.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (range->hedge != NULL)
+    {
+        range->hedge->hedge = NULL;
+        range->hedge->hedging = false;
+        range->hedge = NULL;
+    }
+
+    range->hedging = false;
+    range->cancelled = false;
+}
+
+static void
+vhd_sync_xt_settle_hedge(
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function is called when a range that has a hedge out, or is one,
+ * gets its first data. It wins, and the other gives way. A stalled range
+ * that loses is cut short where the hedge starts, and stopped once it has
+ * what is left before that. A hedge that loses has nothing yet and is
+ * stopped.
+ *
+ * Parameters:
+ *
+ *      range - Supplies the range that got data.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    pvhd_sync_xt_download_range loser;
+
+    loser = range->hedge;
+
+    if (range->hedging == true)
+    {
+        loser->end_offset = range->start_offset - 1;
+    }
+    else
+    {
+        loser->cancelled = true;
+    }
+
+    range->hedge = NULL;
+    range->hedging = false;
+    loser->hedge = NULL;
+    loser->hedging = false;
+}
+
+static bool
+vhd_sync_xt_begin_range_request(
+    pvhd_sync_xt_download_context download_context,
+    pvhd_sync_xt_download_range range,
+    pvhd_sync_xt_mirror avoid
+    )
+/*
+ * This function picks the mirror a request of a range goes to, and points
+ * the transfer of the range at it.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      range - Supplies the range about to start a request.
+ *
+ *      avoid - Supplies a mirror to use only if there is no other, NULL for
+ *          none.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_mirror mirror;
+
+    mirror = vhd_sync_xt_pick_mirror(&download_context->mirror_set, avoid);
+    if (mirror == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_begin_range_request: No mirrors left.\n");
+        return false;
+    }
+
+    if (download_context->mirror_set.mirror_count > 1
+        && vhd_sync_xt_set_curl_transfer_url(range->transfer, mirror->url) == false)
+    {
+        return false;
+    }
+
+    vhd_sync_xt_begin_mirror_request(mirror);
+    range->mirror = mirror;
+
+    return true;
+}
+
+static unsigned long int
+vhd_sync_xt_elapsed_usec(
+    struct timespec *since
+    )
+/*
+ * This function returns the time elapsed since a point in time.
+ *
+ * Parameters:
+ *
+ *      since - Supplies the point in time.
+ *
+ * Return Value:
+ *
+ *      The number of microseconds elapsed.
+ */
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - since->tv_sec) * 1000000
+           + (now.tv_nsec - since->tv_nsec) / 1000;
 }
 
+static void
+vhd_sync_xt_tune_download(
+    pvhd_sync_xt_download_context download_context,
+    int socket,
+    unsigned long int bytes
+    )
+/*
+ * This function tunes the socket a chunk of the file came over to the link.
+ * The first chunks are samples, their bytes over the time since the start
+ * giving the throughput and the round trip time of their connections the
+ * delay, and the receive buffer is chosen from those once there are enough.
+ * From then on each socket is given that buffer, and the connections curl
+ * opens later get it as they are made.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      socket - Supplies the socket the chunk came over.
+ *
+ *      bytes - Supplies the size of the chunk.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    pvhd_sync_xt_download_tuning tuning;
+    unsigned long int rtt_usec;
+    unsigned long int elapsed;
+    char tuning_message[VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH];
+
+    tuning = &download_context->tuning;
+
+    if (tuning->congestion[0] == '\0')
+    {
+        vhd_sync_xt_tune_get_congestion(socket,
+                                        tuning->congestion,
+                                        sizeof(tuning->congestion)
+                                        );
+    }
+
+    if (download_context->options.autotune == false)
+    {
+        return;
+    }
+
+    if (tuning->done == false)
+    {
+        //
+        // The lowest round trip time seen is the one of the path, the rest
+        // is queueing the buffer is not there to cover.
+        //
+        if (vhd_sync_xt_tune_rtt(socket, &rtt_usec) == true
+            && (tuning->rtt_usec == 0 || rtt_usec < tuning->rtt_usec))
+        {
+            tuning->rtt_usec = rtt_usec;
+        }
+
+        tuning->bytes += bytes;
+        if (++tuning->samples < VHD_SYNC_XT_TUNE_SAMPLES)
+        {
+            return;
+        }
+
+        //
+        // The throughput is that of all connections together, so that no
+        // one of them is held back by its window if the others go quiet.
+        //
+        elapsed = vhd_sync_xt_elapsed_usec(&tuning->start);
+        tuning->throughput = (elapsed != 0)
+                             ? tuning->bytes * 1000000 / elapsed : 0;
+        tuning->receive_buffer = vhd_sync_xt_tune_buffer_size(tuning->throughput,
+                                                              tuning->rtt_usec
+                                                              );
+        tuning->done = true;
+
+        vhd_sync_xt_set_curl_socket_tuning(download_context->curl_config,
+                                           download_context->options.congestion,
+                                           tuning->receive_buffer
+                                           );
+
+        if (download_context->progress_fd != 0)
+        {
+            snprintf(tuning_message,
+                     VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH,
+                     "Tuning : rtt %lu throughput %lu rcvbuf %lu\n",
+                     tuning->rtt_usec,
+                     tuning->throughput,
+                     tuning->receive_buffer
+                     );
+            write(download_context->progress_fd,
+                  tuning_message,
+                  strlen(tuning_message)
+                  );
+        }
+    }
+
+    if (tuning->receive_buffer != 0)
+    {
+        vhd_sync_xt_tune_receive_buffer(socket,
+                                        tuning->receive_buffer,
+                                        &tuning->socket_buffer
+                                        );
+    }
+}
+
+static void
+vhd_sync_xt_end_range_request(
+    pvhd_sync_xt_download_range range,
+    bool success
+    )
+/*
+ * This function scores the mirror the request of a range went to once the
+ * request is over, and tunes the connection it came over.
+ *
+ * Parameters:
+ *
+ *      range - Supplies the range.
+ *
+ *      success - Supplies whether the request did not fail.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    unsigned long int first_byte_usec;
+    unsigned long int total_usec;
+    int socket;
+
+    if (range->mirror == NULL)
+    {
+        return;
+    }
+
+    vhd_sync_xt_get_curl_transfer_times(range->transfer,
+                                        &first_byte_usec,
+                                        &total_usec
+                                        );
+    vhd_sync_xt_end_mirror_request(range->mirror,
+                                   range->write_offset - range->request_offset,
+                                   (total_usec > first_byte_usec)
+                                   ? total_usec - first_byte_usec : 0,
+                                   success
+                                   );
+
+    if (success == true
+        && (range->download_context->options.autotune == true
+            || range->download_context->options.congestion != NULL)
+        && vhd_sync_xt_get_curl_transfer_socket(range->transfer, &socket) == true)
+    {
+        vhd_sync_xt_tune_download(range->download_context,
+                                  socket,
+                                  range->write_offset - range->request_offset
+                                  );
+    }
+
+    range->last_mirror = range->mirror;
+    range->mirror = NULL;
+}
+
+static bool
+vhd_sync_xt_buffer_range_data(
+    pvhd_sync_xt_download_range range,
+    const char* data,
+    size_t length
+    )
+/*
+ * This function adds data at the write offset of a range to its buffer,
+ * writing the buffer out each time it fills up.
+ *
+ * Parameters:
+ *
+ *      range - Supplies the range.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data, which has to fit in the
+ *          range.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the buffer could not be written out.
+ */
+{
+    size_t copied;
+    size_t copy_length;
+
+    copied = 0;
+    while (copied < length)
+    {
+        copy_length = length - copied;
+        if (copy_length > range->buffer_size - range->buffer_length)
+        {
+            copy_length = range->buffer_size - range->buffer_length;
+        }
+
+        memcpy(range->buffer + range->buffer_length,
+               data + copied,
+               copy_length
+               );
+        range->buffer_length += copy_length;
+        range->write_offset += copy_length;
+        range->download_context->current_offset += copy_length;
+        copied += copy_length;
+
+        if (range->buffer_length == range->buffer_size
+            && vhd_sync_xt_flush_range(range->download_context, range) == false)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static size_t
+vhd_sync_xt_range_write_callback(
+        void *data_stream,
+        size_t size,
+        size_t nmemb,
+        void *user_data
+        )
+/*
+ * This function is the callback set to receive the body of a ranged
+ * request. It gathers the data in the buffer of the range, which is written
+ * out to the partial file each time it fills up.
+ *
+ * Parameters:
+ *
+ *      data_stream - Supplies the data received.
+ *
+ *      size - Supplies the size of the data unit in the stream.
+ *
+ *      nmemb - Supplies the number of members of the data.
+ *
+ *      user_data - Set to point to the download range.
+ *
+ * Return Value:
+ *
+ *      Returns the size of data written, anything else aborts the transfer.
+ */
+{
+    pvhd_sync_xt_download_range range;
+    size_t length;
+    size_t usable;
+    long response_code;
+
+    range = (pvhd_sync_xt_download_range) user_data;
+    length = size * nmemb;
+
+    //
+    // The first range starts before there is a file to write to, and holds
+    // its data until there is.
+    //
+    if (range->download_context->writer == NULL)
+    {
+        range->transfer->paused = true;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    //
+    // A hedge that lost is stopped, and gets nothing in the meantime.
+    //
+    if (range->cancelled == true)
+    {
+        range->download_context->stats.wasted_bytes += length;
+        return 0;
+    }
+
+    //
+    // A server that ignores our range sends the file from offset 0, only
+    // usable if that is where the request starts. A partial response has to
+    // start where we asked, or a retry would splice in the wrong data.
+    //
+    if (range->write_offset == range->request_offset)
+    {
+        response_code = vhd_sync_xt_get_curl_transfer_response_code(
+                            range->transfer);
+        if ((response_code != 206
+             && (response_code != 200 || range->request_offset != 0))
+            || (response_code == 206
+                && range->headers.has_range == true
+                && range->headers.range_start != range->request_offset))
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_range_write_callback: Unexpected response %ld for range %lu-%lu.\n",
+                                 response_code,
+                                 range->request_offset,
+                                 range->end_offset);
+            range->download_context->stats.wasted_bytes += length;
+            return 0;
+        }
+
+        //
+        // Each mirror has to be serving the same file as the first
+        // response, and so does the server if the file changes under us.
+        //
+        if (range->mirror != NULL
+            && vhd_sync_xt_mirror_consistent(&range->download_context->headers,
+                                             range->download_context->file_size,
+                                             &range->headers) == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_range_write_callback: %.*s has a different file.\n",
+                                 MAX_ERROR_NAME_SIZE,
+                                 range->mirror->url);
+            if (range->download_context->mirror_set.mirror_count > 1)
+            {
+                vhd_sync_xt_drop_mirror(range->mirror);
+            }
+            range->download_context->stats.wasted_bytes += length;
+            return 0;
+        }
+    }
+
+    if (range->hedge != NULL)
+    {
+        vhd_sync_xt_settle_hedge(range);
+    }
+
+    //
+    // Only data that is kept counts against the rate, a response that is
+    // turned away would hold up the ranges that are not.
+    //
+    if (vhd_sync_xt_take_tokens(&range->download_context->limiter, length) == false)
+    {
+        range->transfer->paused = true;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    //
+    // Never write past the end of the range, another range owns that data.
+    // Keep what fits and abort the transfer after it.
+    //
+    usable = length;
+    if (usable > range->end_offset + 1 - range->write_offset)
+    {
+        usable = range->end_offset + 1 - range->write_offset;
+    }
+
+    if (vhd_sync_xt_buffer_range_data(range, data_stream, usable) == false)
+    {
+        return 0;
+    }
+
+    if (usable != length)
+    {
+        range->download_context->stats.wasted_bytes += length - usable;
+        return 0;
+    }
+
+    return length;
+}
+
+static size_t
+vhd_sync_xt_range_header_callback(
+        void *data_stream,
+        size_t size,
+        size_t nmemb,
+        void *user_data
+        )
+/*
+ * This function is the callback set to receive the headers of the response
+ * to a ranged request, one line at a time.
+ *
+ * Parameters:
+ *
+ *      data_stream - Supplies a line of header data.
+ *
+ *      size - Supplies the size of the data unit in the stream.
+ *
+ *      nmemb - Supplies the number of members of the data.
+ *
+ *      user_data - Set to point to the download range.
+ *
+ * Return Value:
+ *
+ *      Returns the size of data recieved.
+ */
+{
+    pvhd_sync_xt_download_range range;
+
+    range = (pvhd_sync_xt_download_range) user_data;
+
+    vhd_sync_xt_parse_http_header(&range->headers,
+                                  (char*)data_stream,
+                                  size * nmemb
+                                  );
+
+    return size * nmemb;
+}
+
+static bool
+vhd_sync_xt_probe_download(
+    pvhd_sync_xt_download_context download_context,
+    const char* condition
+    )
+/*
+ * This function learns the size of the file from the first ranged request,
+ * rather than asking for it on its own and waiting a round trip before any
+ * data moves. The first range asks for the first chunk, or the whole file
+ * when streaming, and is held paused once its headers are in. It carries on
+ * with the download from there if that data is still wanted.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      condition - Supplies a header that gets a 304 if the image we have
+ *          is still current, NULL for none.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_download_range range;
+    pvhd_sync_xt_http_headers headers;
+
+    status = false;
+    range = &download_context->ranges[0];
+    headers = &range->headers;
+
+    range->start_offset = 0;
+    range->write_offset = 0;
+    range->request_offset = 0;
+    range->retries = 0;
+    if (download_context->options.stream == true)
+    {
+        range->end_offset = ULONG_MAX - 1;
+        status = vhd_sync_xt_set_curl_transfer_open_range(range->transfer, 0);
+    }
+    else
+    {
+        range->end_offset = download_context->chunk_size
+                            / VHD_SYNC_XT_VHD_BLOCK_SIZE
+                            * VHD_SYNC_XT_VHD_BLOCK_SIZE
+                            - 1;
+        status = vhd_sync_xt_set_curl_transfer_range(range->transfer,
+                                                     range->start_offset,
+                                                     range->end_offset
+                                                     );
+    }
+
+    if (status == false
+        || vhd_sync_xt_set_curl_transfer_header(range->transfer, condition) == false
+        || vhd_sync_xt_start_curl_transfer(download_context->curl_config,
+                                           range->transfer) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_probe_download: Could not start first range.\n");
+        status = false;
+        goto End;
+    }
+    vhd_sync_xt_watch_range(range);
+
+    range->mirror = &download_context->mirror_set.mirrors[0];
+    vhd_sync_xt_begin_mirror_request(range->mirror);
+
+    while (range->transfer->active == true
+           && (headers->complete == false || headers->status_code < 200))
+    {
+        status = vhd_sync_xt_wait_curl_transfers(download_context->curl_config);
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_probe_download: Could not drive transfer.\n");
+            goto End;
+        }
+    }
+
+    if (headers->complete == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_probe_download: No response. Curl error : %d\n",
+                             range->transfer->result);
+        status = false;
+        goto End;
+    }
+
+    //
+    // Nothing to do if what we have is still current.
+    //
+    if (condition != NULL && headers->status_code == 304)
+    {
+        vhd_sync_xt_stop_curl_transfer(download_context->curl_config,
+                                       range->transfer
+                                       );
+        range->transfer->done = false;
+        vhd_sync_xt_end_range_request(range, true);
+        download_context->not_modified = true;
+        status = true;
+        goto End;
+    }
+
+    if (vhd_sync_xt_http_headers_size(headers, &download_context->file_size) == false
+        || (headers->status_code == 206 && headers->range_start != 0))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_probe_download: Could not get the file size. Response : %ld\n",
+                             headers->status_code);
+        status = false;
+        goto End;
+    }
+
+    //
+    // A server that ignores the range sends the whole file, and there is no
+    // point asking it for anything else.
+    //
+    download_context->accept_ranges = (headers->status_code == 206)
+                                      || headers->accept_ranges;
+    if (headers->status_code == 200 || range->end_offset >= download_context->file_size)
+    {
+        range->end_offset = download_context->file_size - 1;
+    }
+
+    download_context->headers = *headers;
+    download_context->has_validators = vhd_sync_xt_validators_from_headers(
+                                           headers,
+                                           download_context->file_size,
+                                           &download_context->validators);
+    status = true;
+
+End:
+    return status;
+}
+
+static void
+vhd_sync_xt_adopt_probe(
+    pvhd_sync_xt_download_context download_context
+    )
+/*
+ * This function lets the first range carry on with the download once the
+ * partial file is open, if what it asked for is still missing, and stops
+ * it otherwise.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    pvhd_sync_xt_download_range range;
+    unsigned long int missing_start;
+    unsigned long int missing_end;
+
+    range = &download_context->ranges[0];
+
+    if (range->transfer->active == true
+        && download_context->file_size != 0
+        && vhd_sync_xt_resume_map_next_missing(download_context->resume_map,
+                                               0,
+                                               &missing_start,
+                                               &missing_end) == true
+        && missing_start == 0)
+    {
+        if (range->end_offset >= missing_end)
+        {
+            range->end_offset = missing_end - 1;
+        }
+
+        download_context->next_offset = range->end_offset + 1;
+        return;
+    }
+
+    vhd_sync_xt_stop_curl_transfer(download_context->curl_config,
+                                   range->transfer
+                                   );
+    range->transfer->done = false;
+    vhd_sync_xt_end_range_request(range, true);
+}
+
+void
+vhd_sync_xt_update_progress(
+    pvhd_sync_xt_download_context download_context
+    )
+{
+    int progress;
+    char progress_message[VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH];
+
+    //
+    // Update our progress on each chunk.
+    //
+    progress = 100;
+    if (download_context->file_size != 0)
+    {
+        progress = download_context->current_offset * 100
+                   / download_context->file_size;
+    }
+
+    //
+    // With the adaptive controller on, report what it chose as well.
+    //
+    if (download_context->options.adaptive == true)
+    {
+        snprintf(progress_message,
+                VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH,
+                "Progress : %d chunk %lu streams %d\n",
+                progress,
+                download_context->chunk_size,
+                download_context->target_streams
+                );
+    }
+    else
+    {
+        snprintf(progress_message,
+                VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH,
+                "Progress : %d\n",
+                progress
+                );
+    }
+
+    if (download_context->progress_fd != 0)
+    {
+        write(download_context->progress_fd,
+              progress_message,
+              strlen(progress_message)
+              );
+    }
+}
+
+static bool
+vhd_sync_xt_start_next_range(
+    pvhd_sync_xt_download_context download_context,
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function assigns the next chunk of the file that the resume map says
+ * is missing to an idle range and starts its request. The range is left
+ * idle if nothing is missing from next_offset on.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      range - Supplies the idle range.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    unsigned long int missing_start;
+    unsigned long int missing_end;
+
+    status = false;
+
+    if (vhd_sync_xt_resume_map_next_missing(download_context->resume_map,
+                                            download_context->next_offset,
+                                            &missing_start,
+                                            &missing_end) == false)
+    {
+        download_context->next_offset = download_context->file_size;
+        status = true;
+        goto End;
+    }
+
+    //
+    // End the chunk on a block boundary, and stop at the end of the missing
+    // run.
+    //
+    range->start_offset = missing_start;
+    range->end_offset = (range->start_offset + download_context->chunk_size)
+                        / VHD_SYNC_XT_VHD_BLOCK_SIZE
+                        * VHD_SYNC_XT_VHD_BLOCK_SIZE
+                        - 1;
+    if (range->end_offset >= missing_end)
+    {
+        range->end_offset = missing_end - 1;
+    }
+    range->write_offset = range->start_offset;
+    range->request_offset = range->start_offset;
+    range->retries = 0;
+    range->write_failed = false;
+
+    status = vhd_sync_xt_begin_range_request(download_context, range, NULL);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_set_curl_transfer_range(range->transfer,
+                                                 range->start_offset,
+                                                 range->end_offset
+                                                 );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_next_range: Could not set curl range option for download.\n");
+        vhd_sync_xt_end_range_request(range, false);
+        goto End;
+    }
+
+    status = vhd_sync_xt_start_curl_transfer(download_context->curl_config,
+                                             range->transfer
+                                             );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_next_range: Could not start range %lu-%lu.\n",
+                             range->start_offset,
+                             range->end_offset);
+        vhd_sync_xt_end_range_request(range, false);
+        goto End;
+    }
+    vhd_sync_xt_watch_range(range);
+
+    download_context->next_offset = range->end_offset + 1;
+
+End:
+    return status;
+}
+
+static void
+vhd_sync_xt_adapt_download(
+    pvhd_sync_xt_download_context download_context,
+    pvhd_sync_xt_download_range range,
+    bool success
+    )
+/*
+ * This function feeds the result of a completed range to the adaptive
+ * controller, and adjusts the chunk size and the number of ranges kept in
+ * flight.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      range - Supplies the range that completed.
+ *
+ *      success - Supplies whether the range completed successfully.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    pvhd_sync_xt_download_controller controller;
+    unsigned long int first_byte_usec;
+    unsigned long int total_usec;
+    unsigned long int bytes;
+    unsigned long int throughput;
+    unsigned long int chunk_size;
+    unsigned long int elapsed;
+
+    controller = &download_context->controller;
+
+    if (download_context->options.adaptive == false)
+    {
+        return;
+    }
+
+    //
+    // A failure wastes up to a chunk, back off on both counts.
+    //
+    if (success == false)
+    {
+        download_context->chunk_size /= 2;
+        if (download_context->chunk_size < VHD_SYNC_XT_MINIMUM_CHUNK_SIZE)
+        {
+            download_context->chunk_size = VHD_SYNC_XT_MINIMUM_CHUNK_SIZE;
+        }
+
+        if (download_context->target_streams > 1)
+        {
+            --download_context->target_streams;
+        }
+        controller->direction = -1;
+        return;
+    }
+
+    //
+    // A range cut short by its hedge may have had nothing left to get.
+    //
+    bytes = range->end_offset + 1 - range->request_offset;
+    if (bytes == 0)
+    {
+        return;
+    }
+
+    vhd_sync_xt_get_curl_transfer_times(range->transfer,
+                                        &first_byte_usec,
+                                        &total_usec
+                                        );
+    if (total_usec <= first_byte_usec)
+    {
+        return;
+    }
+
+    //
+    // Chunk size: throughput and time to first byte of one stream, smoothed
+    // so that one odd chunk does not throw us off.
+    //
+    throughput = bytes * 1000000 / (total_usec - first_byte_usec);
+    if (controller->throughput == 0)
+    {
+        controller->throughput = throughput;
+        controller->first_byte_usec = first_byte_usec;
+    }
+    else
+    {
+        controller->throughput = (3 * controller->throughput + throughput) / 4;
+        controller->first_byte_usec = (3 * controller->first_byte_usec
+                                       + first_byte_usec) / 4;
+    }
+
+    chunk_size = controller->throughput / 1000
+                 * controller->first_byte_usec / 1000
+                 * VHD_SYNC_XT_ADAPTIVE_OVERHEAD_RATIO;
+    if (chunk_size > controller->throughput / 1000
+                     * (VHD_SYNC_XT_ADAPTIVE_MAXIMUM_CHUNK_USEC / 1000))
+    {
+        chunk_size = controller->throughput / 1000
+                     * (VHD_SYNC_XT_ADAPTIVE_MAXIMUM_CHUNK_USEC / 1000);
+    }
+
+    //
+    // Move at most a factor of two at a time, in whole VHD blocks.
+    //
+    if (chunk_size > 2 * download_context->chunk_size)
+    {
+        chunk_size = 2 * download_context->chunk_size;
+    }
+    if (chunk_size < download_context->chunk_size / 2)
+    {
+        chunk_size = download_context->chunk_size / 2;
+    }
+    chunk_size = (chunk_size + VHD_SYNC_XT_VHD_BLOCK_SIZE / 2)
+                 / VHD_SYNC_XT_VHD_BLOCK_SIZE
+                 * VHD_SYNC_XT_VHD_BLOCK_SIZE;
+    if (chunk_size < VHD_SYNC_XT_MINIMUM_CHUNK_SIZE)
+    {
+        chunk_size = VHD_SYNC_XT_MINIMUM_CHUNK_SIZE;
+    }
+    if (chunk_size > VHD_SYNC_XT_MAXIMUM_CHUNK_SIZE)
+    {
+        chunk_size = VHD_SYNC_XT_MAXIMUM_CHUNK_SIZE;
+    }
+    download_context->chunk_size = chunk_size;
+
+    //
+    // Concurrency: hill climb on the aggregate throughput of a window of
+    // chunks. Keep going while it improves by more than 10%, turn around
+    // when it gets worse by more than 10%.
+    //
+    controller->window_bytes += bytes;
+    ++controller->window_chunks;
+    if (controller->window_chunks
+        < VHD_SYNC_XT_ADAPTIVE_WINDOW_CHUNKS * download_context->target_streams)
+    {
+        return;
+    }
+
+    elapsed = vhd_sync_xt_elapsed_usec(&controller->window_start);
+    if (elapsed == 0)
+    {
+        return;
+    }
+    throughput = controller->window_bytes / elapsed * 1000000
+                 + controller->window_bytes % elapsed * 1000000 / elapsed;
+
+    if (controller->last_window_throughput != 0)
+    {
+        if (throughput < controller->last_window_throughput * 9 / 10)
+        {
+            controller->direction = -controller->direction;
+        }
+        else if (throughput < controller->last_window_throughput * 11 / 10)
+        {
+            controller->direction = 0;
+        }
+    }
+
+    if (controller->direction == 0 && throughput > controller->last_window_throughput)
+    {
+        controller->direction = 1;
+    }
+
+    download_context->target_streams += controller->direction;
+    if (download_context->target_streams < 1)
+    {
+        download_context->target_streams = 1;
+        controller->direction = 0;
+    }
+    if (download_context->target_streams > download_context->options.parallel_streams)
+    {
+        download_context->target_streams = download_context->options.parallel_streams;
+        controller->direction = 0;
+    }
+
+    controller->last_window_throughput = throughput;
+    controller->window_bytes = 0;
+    controller->window_chunks = 0;
+    clock_gettime(CLOCK_MONOTONIC, &controller->window_start);
+}
+
+static void
+vhd_sync_xt_record_range(
+    pvhd_sync_xt_download_context download_context,
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function marks the blocks a range has written out in the resume map,
+ * and writes the map out if it is due. Data still in the buffer of the range
+ * does not count.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      range - Supplies the range.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    vhd_sync_xt_resume_map_set(download_context->resume_map,
+                               range->start_offset,
+                               range->write_offset - range->buffer_length
+                               );
+
+    if (download_context->verify != NULL)
+    {
+        vhd_sync_xt_verify_save(download_context->verify,
+                                download_context->resume_map
+                                );
+    }
+
+    vhd_sync_xt_flush_resume_map(download_context->resume_map,
+                                 download_context->writer->fd,
+                                 false
+                                 );
+}
+
+static bool
+vhd_sync_xt_schedule_retry(
+    pvhd_sync_xt_download_context download_context,
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function sets a failed range up to ask for the rest of its chunk
+ * again after a while. What it already wrote out is kept. The wait doubles
+ * with each retry of the chunk that got nothing, and is picked at random
+ * from its upper half.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      range - Supplies the range that failed.
+ *
+ * Return Value:
+ *
+ *      TRUE if a retry is scheduled, FALSE if the range has run out of them
+ *      or cannot be helped by one.
+ */
+{
+    long int delay_ms;
+
+    //
+    // A request that got somewhere before it failed starts the count over.
+    //
+    if (range->write_offset > range->request_offset)
+    {
+        range->retries = 0;
+    }
+
+    if (range->write_failed == true || range->retries >= VHD_SYNC_XT_RETRY_LIMIT)
+    {
+        return false;
+    }
+
+    delay_ms = VHD_SYNC_XT_RETRY_BASE_MS << range->retries;
+    if (delay_ms > VHD_SYNC_XT_RETRY_MAXIMUM_MS)
+    {
+        delay_ms = VHD_SYNC_XT_RETRY_MAXIMUM_MS;
+    }
+    delay_ms = delay_ms / 2
+               + rand_r(&download_context->retry_seed) % (delay_ms / 2 + 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &range->retry_at);
+    range->retry_at.tv_sec += delay_ms / 1000;
+    range->retry_at.tv_nsec += (delay_ms % 1000) * 1000000;
+    if (range->retry_at.tv_nsec >= 1000000000)
+    {
+        range->retry_at.tv_sec += 1;
+        range->retry_at.tv_nsec -= 1000000000;
+    }
+
+    ++range->retries;
+    ++download_context->stats.retries;
+    range->retry_pending = true;
+
+    VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_schedule_retry: Retrying range %lu-%lu from %lu in %ld ms.\n",
+                         range->start_offset,
+                         range->end_offset,
+                         range->write_offset,
+                         delay_ms);
+
+    return true;
+}
+
+static long int
+vhd_sync_xt_retry_wait_ms(
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function returns how long a range has left to wait for its retry.
+ *
+ * Parameters:
+ *
+ *      range - Supplies the range waiting for a retry.
+ *
+ * Return Value:
+ *
+ *      The number of milliseconds left, 0 if the retry is due.
+ */
+{
+    struct timespec now;
+    long int wait_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    wait_ms = (range->retry_at.tv_sec - now.tv_sec) * 1000
+              + (range->retry_at.tv_nsec - now.tv_nsec) / 1000000;
+
+    return (wait_ms > 0) ? wait_ms : 0;
+}
+
+static bool
+vhd_sync_xt_retry_range(
+    pvhd_sync_xt_download_context download_context,
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function starts the retry of a range once it is due, asking only for
+ * the part of the chunk that is still missing.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      range - Supplies the range waiting for a retry.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+
+    status = true;
+    if (vhd_sync_xt_retry_wait_ms(range) > 0)
+    {
+        goto End;
+    }
+
+    range->retry_pending = false;
+    range->request_offset = range->write_offset;
+
+    //
+    // Try another mirror, if there is one.
+    //
+    status = vhd_sync_xt_begin_range_request(download_context,
+                                             range,
+                                             range->last_mirror
+                                             );
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_set_curl_transfer_range(range->transfer,
+                                                 range->request_offset,
+                                                 range->end_offset
+                                                 );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_retry_range: Could not set curl range option for download.\n");
+        vhd_sync_xt_end_range_request(range, false);
+        goto End;
+    }
+
+    status = vhd_sync_xt_start_curl_transfer(download_context->curl_config,
+                                             range->transfer
+                                             );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_retry_range: Could not restart range %lu-%lu.\n",
+                             range->request_offset,
+                             range->end_offset);
+        vhd_sync_xt_end_range_request(range, false);
+        goto End;
+    }
+    vhd_sync_xt_watch_range(range);
+
+End:
+    return status;
+}
+
+static bool
+vhd_sync_xt_check_stall(
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function closes the stall window of a range once it has run its
+ * time, and starts the next one.
+ *
+ * Parameters:
+ *
+ *      range - Supplies the range.
+ *
+ * Return Value:
+ *
+ *      TRUE if the range was below the low speed limit over the last window,
+ *      FALSE otherwise.
+ */
+{
+    unsigned long int elapsed_ms;
+
+    //
+    // A slow answer is left to curl, only a response that stops flowing
+    // counts.
+    //
+    if (range->headers.complete == false)
+    {
+        range->window_offset = range->write_offset;
+        clock_gettime(CLOCK_MONOTONIC, &range->window_start);
+        return false;
+    }
+
+    elapsed_ms = vhd_sync_xt_elapsed_usec(&range->window_start) / 1000;
+    if (elapsed_ms < VHD_SYNC_XT_STALL_WINDOW_MS)
+    {
+        return range->stalled;
+    }
+
+    range->stalled = (range->write_offset - range->window_offset) * 1000
+                     < VHD_SYNC_XT_STALL_LOW_SPEED_LIMIT * elapsed_ms;
+    range->window_offset = range->write_offset;
+    clock_gettime(CLOCK_MONOTONIC, &range->window_start);
+
+    return range->stalled;
+}
+
+static bool
+vhd_sync_xt_steal_range(
+    pvhd_sync_xt_download_context download_context,
+    pvhd_sync_xt_download_range idle,
+    bool split
+    )
+/*
+ * This function finds work for an idle range once there are no chunks left
+ * to hand out, so that the last few ranges do not hold up the whole file.
+ * A stalled range gets a hedge for the rest of it, from the next block on.
+ * Otherwise the range with the most left gives the second half of it away,
+ * split on a block boundary.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      idle - Supplies the idle range.
+ *
+ *      split - Supplies whether a range may be split, or only hedged.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    bool hedge;
+    pvhd_sync_xt_download_range range;
+    pvhd_sync_xt_download_range victim;
+    unsigned long int remaining;
+    unsigned long int largest;
+    unsigned long int start;
+    int i;
+
+    status = true;
+    victim = NULL;
+    hedge = false;
+    largest = 0;
+    start = 0;
+
+    //
+    // Ranges held back by the rate limit are slow on purpose, and a hedge
+    // needs a connection of its own.
+    //
+    for (i = 0;
+         download_context->limiter.rate == 0
+         && vhd_sync_xt_can_open_curl_connection(download_context->curl_config) == true
+         && i < download_context->options.parallel_streams;
+         ++i)
+    {
+        range = &download_context->ranges[i];
+        if (range->transfer->active == false
+            || range->stalled == false
+            || range->hedge != NULL
+            || range->cancelled == true)
+        {
+            continue;
+        }
+
+        start = (range->write_offset + VHD_SYNC_XT_VHD_BLOCK_SIZE - 1)
+                / VHD_SYNC_XT_VHD_BLOCK_SIZE
+                * VHD_SYNC_XT_VHD_BLOCK_SIZE;
+        if (start > range->end_offset)
+        {
+            continue;
+        }
+
+        victim = range;
+        hedge = true;
+        break;
+    }
+
+    for (i = 0;
+         split == true && victim == NULL && i < download_context->options.parallel_streams;
+         ++i)
+    {
+        range = &download_context->ranges[i];
+        if (range->transfer->active == false
+            || range->hedge != NULL
+            || range->cancelled == true)
+        {
+            continue;
+        }
+
+        remaining = range->end_offset + 1 - range->write_offset;
+        if (remaining >= VHD_SYNC_XT_SPLIT_MINIMUM_SIZE && remaining > largest)
+        {
+            largest = remaining;
+        }
+    }
+
+    for (i = 0; victim == NULL && largest != 0 && i < download_context->options.parallel_streams; ++i)
+    {
+        range = &download_context->ranges[i];
+        if (range->transfer->active == true
+            && range->hedge == NULL
+            && range->cancelled == false
+            && range->end_offset + 1 - range->write_offset == largest)
+        {
+            victim = range;
+            start = (range->write_offset + largest / 2)
+                    / VHD_SYNC_XT_VHD_BLOCK_SIZE
+                    * VHD_SYNC_XT_VHD_BLOCK_SIZE;
+        }
+    }
+
+    if (victim == NULL)
+    {
+        goto End;
+    }
+
+    idle->start_offset = start;
+    idle->end_offset = victim->end_offset;
+    idle->write_offset = start;
+    idle->request_offset = start;
+    idle->retries = 0;
+    idle->write_failed = false;
+    idle->cancelled = false;
+
+    //
+    // A hedge is best sent to another mirror.
+    //
+    status = vhd_sync_xt_begin_range_request(download_context,
+                                             idle,
+                                             (hedge == true) ? victim->mirror : NULL
+                                             );
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_set_curl_transfer_range(idle->transfer,
+                                                 idle->start_offset,
+                                                 idle->end_offset
+                                                 );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_steal_range: Could not set curl range option for download.\n");
+        vhd_sync_xt_end_range_request(idle, false);
+        goto End;
+    }
+
+    status = vhd_sync_xt_start_curl_transfer(download_context->curl_config,
+                                             idle->transfer
+                                             );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_steal_range: Could not start range %lu-%lu.\n",
+                             idle->start_offset,
+                             idle->end_offset);
+        vhd_sync_xt_end_range_request(idle, false);
+        goto End;
+    }
+    vhd_sync_xt_watch_range(idle);
+
+    //
+    // Nothing was received since the victim was last looked at, so it has
+    // not got past the start of the new range.
+    //
+    if (hedge == true)
+    {
+        idle->hedge = victim;
+        idle->hedging = true;
+        victim->hedge = idle;
+        ++download_context->stats.hedges;
+    }
+    else
+    {
+        victim->end_offset = start - 1;
+        ++download_context->stats.splits;
+    }
+
+End:
+    return status;
+}
+
+static void
+vhd_sync_xt_restart_stalled(
+    pvhd_sync_xt_download_context download_context
+    )
+/*
+ * This function stops the stalled ranges that did not get a hedge, so that
+ * they are retried on a new connection from where they got to.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    pvhd_sync_xt_download_range range;
+    int i;
+
+    for (i = 0; i < download_context->options.parallel_streams; ++i)
+    {
+        range = &download_context->ranges[i];
+        if (range->transfer->active == false
+            || range->stalled == false
+            || range->hedge != NULL
+            || range->cancelled == true)
+        {
+            continue;
+        }
+
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_restart_stalled: Range %lu-%lu stalled at %lu, restarting.\n",
+                             range->start_offset,
+                             range->end_offset,
+                             range->write_offset);
+        vhd_sync_xt_stop_curl_transfer(download_context->curl_config,
+                                       range->transfer
+                                       );
+        range->transfer->done = true;
+        range->transfer->result = CURLE_OPERATION_TIMEDOUT;
+    }
+}
+
+static void
+vhd_sync_xt_report_tuning(
+    pvhd_sync_xt_download_context download_context
+    )
+/*
+ * This function writes what the sockets of the download were tuned to, the
+ * estimate the receive buffer came from and what the kernel made of it, to
+ * the progress fd once the download is over.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    char tuning_message[VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH];
+
+    if (download_context->progress_fd == 0
+        || (download_context->options.autotune == false
+            && download_context->options.congestion == NULL))
+    {
+        return;
+    }
+
+    snprintf(tuning_message,
+             VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH,
+             "Tuning : rtt %lu throughput %lu rcvbuf %lu socket %lu congestion %s\n",
+             download_context->tuning.rtt_usec,
+             download_context->tuning.throughput,
+             download_context->tuning.receive_buffer,
+             download_context->tuning.socket_buffer,
+             (download_context->tuning.congestion[0] != '\0')
+             ? download_context->tuning.congestion : "unknown"
+             );
+    write(download_context->progress_fd,
+          tuning_message,
+          strlen(tuning_message)
+          );
+}
+
+static void
+vhd_sync_xt_report_stats(
+    pvhd_sync_xt_download_context download_context
+    )
+/*
+ * This function writes the counters of the download to the progress fd once
+ * it is over.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    char stats_message[VHD_SYNC_XT_URL_LENGTH + VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH];
+    pvhd_sync_xt_mirror mirror;
+    int i;
+
+    snprintf(stats_message,
+             VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH,
+             "Stats : retries %lu hedges %lu splits %lu gathers %lu wasted %lu\n",
+             download_context->stats.retries,
+             download_context->stats.hedges,
+             download_context->stats.splits,
+             download_context->stats.gathers,
+             download_context->stats.wasted_bytes
+             );
+
+    if (download_context->progress_fd != 0)
+    {
+        write(download_context->progress_fd,
+              stats_message,
+              strlen(stats_message)
+              );
+    }
+
+    vhd_sync_xt_report_tuning(download_context);
+
+    if (download_context->mirror_set.mirror_count < 2)
+    {
+        return;
+    }
+
+    for (i = 0; i < download_context->mirror_set.mirror_count; ++i)
+    {
+        mirror = &download_context->mirror_set.mirrors[i];
+        snprintf(stats_message,
+                 sizeof(stats_message),
+                 "Mirror : %s bytes %lu requests %lu failures %lu throughput %lu%s\n",
+                 mirror->url,
+                 mirror->bytes,
+                 mirror->requests,
+                 mirror->failures,
+                 mirror->throughput,
+                 (mirror->dropped == true) ? " dropped" : ""
+                 );
+
+        if (download_context->progress_fd != 0)
+        {
+            write(download_context->progress_fd,
+                  stats_message,
+                  strlen(stats_message)
+                  );
+        }
+    }
+}
+
+static size_t
+vhd_sync_xt_buffer_write_callback(
+    void *data_stream,
+    size_t size,
+    size_t nmemb,
+    void *user_data
+    )
+/*
+ * This function is the callback set to receive a small body into memory.
+ *
+ * Parameters:
+ *
+ *      data_stream - Supplies the data recieved.
+ *
+ *      size - Supplies the size of the data unit in the stream.
+ *
+ *      nmemb - Supplies the number of members of the data.
+ *
+ *      user_data - Set to point to the buffer.
+ *
+ * Return Value:
+ *
+ *      Returns the size of data handled, anything else aborts the transfer.
+ */
+{
+    pvhd_sync_xt_download_buffer buffer;
+    size_t length;
+
+    buffer = (pvhd_sync_xt_download_buffer)user_data;
+    length = size * nmemb;
+
+    if (length > buffer->size - buffer->length)
+    {
+        return 0;
+    }
+
+    memcpy(buffer->data + buffer->length, data_stream, length);
+    buffer->length += length;
+
+    return length;
+}
+
+static bool
+vhd_sync_xt_get_expected_hash(
+    pvhd_sync_xt_download_context download_context,
+    unsigned char *expected,
+    unsigned long int *file_length
+    )
+/*
+ * This function gets the header of the synchash that sits next to the file
+ * on the server, and returns the SHA1 of the whole file from it.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      expected - Supplies a placeholder to return the SHA1.
+ *
+ *      file_length - Supplies a placeholder to return the length of the
+ *          file the synchash describes.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_curl_transfer transfer;
+    vhd_sync_xt_synchash_header synchash_header;
+    vhd_sync_xt_download_buffer buffer;
+    char url[VHD_SYNC_XT_URL_LENGTH];
+    long response_code;
+
+    status = false;
+    transfer = NULL;
+
+    if (snprintf(url,
+                 sizeof(url),
+                 "%s%s",
+                 download_context->url,
+                 VHD_SYNC_XT_SYNCHASH_EXTENSION) >= sizeof(url))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_expected_hash: Url too long.\n");
+        goto End;
+    }
+
+    buffer.data = (char*)&synchash_header;
+    buffer.size = sizeof(synchash_header);
+    buffer.length = 0;
+
+    status = vhd_sync_xt_create_curl_transfer(download_context->curl_config,
+                                              &transfer
+                                              );
+    if (status == false
+        || vhd_sync_xt_set_curl_transfer_url(transfer, url) == false
+        || vhd_sync_xt_set_curl_transfer_write(transfer,
+                                               vhd_sync_xt_header_callback_null,
+                                               vhd_sync_xt_buffer_write_callback,
+                                               &buffer) == false
+        || vhd_sync_xt_set_curl_transfer_range(transfer,
+                                               0,
+                                               sizeof(synchash_header) - 1) == false
+        || vhd_sync_xt_start_curl_transfer(download_context->curl_config,
+                                           transfer) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_expected_hash: Could not set up request for %.*s.\n",
+                             MAX_ERROR_NAME_SIZE,
+                             url);
+        status = false;
+        goto End;
+    }
+
+    while (transfer->done == false)
+    {
+        status = vhd_sync_xt_wait_curl_transfers(download_context->curl_config);
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_expected_hash: Could not drive transfer.\n");
+            goto End;
+        }
+    }
+
+    response_code = vhd_sync_xt_get_curl_transfer_response_code(transfer);
+    if (transfer->result != CURLE_OK
+        || (response_code != 200 && response_code != 206)
+        || buffer.length != sizeof(synchash_header))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_expected_hash: Could not get %.*s. Curl error : %d Response : %ld\n",
+                             MAX_ERROR_NAME_SIZE,
+                             url,
+                             transfer->result,
+                             response_code);
+        status = false;
+        goto End;
+    }
+
+    if (synchash_header.hash_type != HASH_TYPE_SHA1)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_expected_hash: Synchash does not describe this file.\n");
+        status = false;
+        goto End;
+    }
+
+    memcpy(expected, synchash_header.sha1_hash, VHD_SYNC_XT_SHA1_HASH_SIZE);
+    *file_length = synchash_header.file_length;
+    status = true;
+
+End:
+    if (transfer != NULL)
+    {
+        vhd_sync_xt_destroy_curl_transfer(download_context->curl_config,
+                                          transfer
+                                          );
+    }
+
+    return status;
+}
+
+static bool
+vhd_sync_xt_stream_download(
+    pvhd_sync_xt_download_context download_context
+    )
+/*
+ * This function gets each missing run of the file in a single open ended
+ * range request, cut off where the run ends. If a request stops early,
+ * next_offset is left at the run it was on so that chunked mode can carry
+ * on from there.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ * Return Value:
+ *
+ *      TRUE if the whole file was received, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_download_range range;
+    unsigned long int missing_start;
+    unsigned long int missing_end;
+    int progress;
+    int last_progress;
+
+    status = false;
+    range = &download_context->ranges[0];
+    last_progress = -1;
+
+    //
+    // The request that found the size of the file may already be streaming
+    // the first run.
+    //
+    if (range->transfer->active == true)
+    {
+        download_context->next_offset = range->start_offset;
+    }
+
+    while (vhd_sync_xt_resume_map_next_missing(download_context->resume_map,
+                                               download_context->next_offset,
+                                               &missing_start,
+                                               &missing_end) == true)
+    {
+        download_context->next_offset = missing_start;
+
+        if (range->transfer->active == false)
+        {
+            range->start_offset = missing_start;
+            range->end_offset = missing_end - 1;
+            range->write_offset = range->start_offset;
+            range->request_offset = range->start_offset;
+
+            status = vhd_sync_xt_set_curl_transfer_open_range(range->transfer,
+                                                              range->start_offset
+                                                              );
+            if (status == false)
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_stream_download: Could not set curl range option for download.\n");
+                goto End;
+            }
+
+            status = vhd_sync_xt_start_curl_transfer(download_context->curl_config,
+                                                     range->transfer
+                                                     );
+            if (status == false)
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_stream_download: Could not start stream from %lu.\n",
+                                     range->start_offset);
+                goto End;
+            }
+
+            range->mirror = &download_context->mirror_set.mirrors[0];
+            vhd_sync_xt_begin_mirror_request(range->mirror);
+        }
+
+        while (range->transfer->active == true)
+        {
+            status = vhd_sync_xt_pace_download(download_context)
+                     && vhd_sync_xt_wait_curl_transfers(download_context->curl_config);
+            if (status == false)
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_stream_download: Could not drive transfer.\n");
+                break;
+            }
+
+            vhd_sync_xt_record_range(download_context, range);
+
+            //
+            // There are no chunks to report progress on, report it as it
+            // moves.
+            //
+            progress = download_context->current_offset * 100
+                       / download_context->file_size;
+            if (progress != last_progress)
+            {
+                vhd_sync_xt_update_progress(download_context);
+                last_progress = progress;
+            }
+        }
+        range->transfer->done = false;
+
+        vhd_sync_xt_flush_range(download_context, range);
+        vhd_sync_xt_record_range(download_context, range);
+        vhd_sync_xt_end_range_request(range,
+                                      range->write_offset == range->end_offset + 1
+                                      );
+        if (range->write_offset != range->end_offset + 1)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_stream_download: Stream stopped at %lu. Curl error : %d\n",
+                                 range->write_offset,
+                                 range->transfer->result);
+            status = false;
+            goto End;
+        }
+
+        download_context->next_offset = missing_end;
+    }
+
+    status = true;
+
+End:
+    if (range->transfer->active == true)
+    {
+        vhd_sync_xt_stop_curl_transfer(download_context->curl_config,
+                                       range->transfer
+                                       );
+        vhd_sync_xt_flush_range(download_context, range);
+        vhd_sync_xt_record_range(download_context, range);
+        vhd_sync_xt_end_range_request(range, false);
+    }
+    return status;
+}
+
+static bool
+vhd_sync_xt_next_gather_hole(
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function finishes the hole a gathering range is on, and moves it on
+ * to the next one it asked for.
+ *
+ * Parameters:
+ *
+ *      range - Supplies the gathering range.
+ *
+ * Return Value:
+ *
+ *      TRUE if there is a next hole, FALSE once it has been through them
+ *      all.
+ */
+{
+    unsigned long int received;
+
+    vhd_sync_xt_flush_range(range->download_context, range);
+    vhd_sync_xt_record_range(range->download_context, range);
+
+    ++range->gather_index;
+    if (range->gather_index >= range->gather_count)
+    {
+        return false;
+    }
+
+    //
+    // request_offset trails write_offset by what the request got, which is
+    // what its mirror is scored on.
+    //
+    received = range->write_offset - range->request_offset;
+    range->start_offset = range->gather_starts[range->gather_index];
+    range->end_offset = range->gather_ends[range->gather_index];
+    range->write_offset = range->start_offset;
+    range->request_offset = range->start_offset - received;
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_gather_data(
+    void* user_data,
+    unsigned long int offset,
+    const char* data,
+    size_t length
+    )
+/*
+ * This function is the callback of the multipart parser of a gathering
+ * range. The data is kept where it falls in a hole that was asked for, and
+ * anything in between, which a server that merges ranges sends, dropped.
+ * A hole the server leaves out, or sends only part of, stays missing in
+ * the resume map.
+ *
+ * Parameters:
+ *
+ *      user_data - Set to point to the download range.
+ *
+ *      offset - Supplies where in the file the data goes.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the data is not of this file or could not
+ *      be written out.
+ */
+{
+    pvhd_sync_xt_download_range range;
+    unsigned long int file_size;
+    size_t usable;
+
+    range = (pvhd_sync_xt_download_range) user_data;
+
+    if (range->multipart.part_headers.has_total_size == true
+        && range->multipart.part_headers.total_size != range->download_context->file_size)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_gather_data: Part is of a different file.\n");
+        return false;
+    }
+
+    file_size = range->download_context->file_size;
+    if (offset >= file_size || length > file_size - offset)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_gather_data: Part past the end of the file.\n");
+        return false;
+    }
+
+    while (length > 0)
+    {
+        if (range->gather_index >= range->gather_count)
+        {
+            range->download_context->stats.wasted_bytes += length;
+            return true;
+        }
+
+        if (offset > range->end_offset)
+        {
+            vhd_sync_xt_next_gather_hole(range);
+            continue;
+        }
+
+        if (offset < range->write_offset)
+        {
+            usable = length;
+            if (usable > range->write_offset - offset)
+            {
+                usable = range->write_offset - offset;
+            }
+
+            range->download_context->stats.wasted_bytes += usable;
+            offset += usable;
+            data += usable;
+            length -= usable;
+            continue;
+        }
+
+        //
+        // Some of the hole was left out. Keep what came before, and carry
+        // on from here.
+        //
+        if (offset > range->write_offset)
+        {
+            vhd_sync_xt_flush_range(range->download_context, range);
+            vhd_sync_xt_record_range(range->download_context, range);
+            range->request_offset += offset - range->write_offset;
+            range->start_offset = offset;
+            range->write_offset = offset;
+        }
+
+        usable = length;
+        if (usable > range->end_offset + 1 - range->write_offset)
+        {
+            usable = range->end_offset + 1 - range->write_offset;
+        }
+
+        if (vhd_sync_xt_buffer_range_data(range, data, usable) == false)
+        {
+            return false;
+        }
+
+        offset += usable;
+        data += usable;
+        length -= usable;
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_check_gather_response(
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function checks the response to a gathering request once its body
+ * starts, and gets the parser of the range ready for it. A multipart body
+ * is parsed as it is. A single range, from a server that merged what was
+ * asked for, is taken as one part if it is not much more than that.
+ * Anything else stops the request, and gathering along with it.
+ *
+ * Parameters:
+ *
+ *      range - Supplies the gathering range.
+ *
+ * Return Value:
+ *
+ *      TRUE if the body can be used, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_download_context download_context;
+    unsigned long int requested;
+    int i;
+
+    download_context = range->download_context;
+
+    if (vhd_sync_xt_get_curl_transfer_response_code(range->transfer) != 206)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_gather_response: Server refused the ranges.\n");
+        return false;
+    }
+
+    //
+    // A multipart response says how big the file is in each part, which
+    // the parts are checked for as they come.
+    //
+    if (range->headers.multipart == true)
+    {
+        range->headers.has_total_size = true;
+        range->headers.total_size = download_context->file_size;
+    }
+
+    if (vhd_sync_xt_mirror_consistent(&download_context->headers,
+                                      download_context->file_size,
+                                      &range->headers) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_gather_response: %.*s has a different file.\n",
+                             MAX_ERROR_NAME_SIZE,
+                             range->mirror->url);
+        if (download_context->mirror_set.mirror_count > 1)
+        {
+            vhd_sync_xt_drop_mirror(range->mirror);
+        }
+        return false;
+    }
+
+    vhd_sync_xt_reset_multipart(&range->multipart,
+                                range->headers.boundary,
+                                vhd_sync_xt_gather_data,
+                                range
+                                );
+    if (range->headers.multipart == true)
+    {
+        return true;
+    }
+
+    requested = 0;
+    for (i = 0; i < range->gather_count; ++i)
+    {
+        requested += range->gather_ends[i] + 1 - range->gather_starts[i];
+    }
+
+    if (range->headers.has_range == false
+        || range->headers.range_end + 1 - range->headers.range_start
+           > VHD_SYNC_XT_GATHER_MAXIMUM_MERGE * requested)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_gather_response: Server merged the ranges.\n");
+        return false;
+    }
+
+    return vhd_sync_xt_expect_single_part(&range->multipart, &range->headers);
+}
+
+static size_t
+vhd_sync_xt_gather_write_callback(
+        void *data_stream,
+        size_t size,
+        size_t nmemb,
+        void *user_data
+        )
+/*
+ * This function is the callback set to receive the body of a gathering
+ * request. The body is parsed as it comes, and each part written straight
+ * to where it goes.
+ *
+ * Parameters:
+ *
+ *      data_stream - Supplies the data received.
+ *
+ *      size - Supplies the size of the data unit in the stream.
+ *
+ *      nmemb - Supplies the number of members of the data.
+ *
+ *      user_data - Set to point to the download range.
+ *
+ * Return Value:
+ *
+ *      Returns the size of data written, anything else aborts the transfer.
+ */
+{
+    pvhd_sync_xt_download_range range;
+    size_t length;
+
+    range = (pvhd_sync_xt_download_range) user_data;
+    length = size * nmemb;
+
+    if (range->gather_index < 0)
+    {
+        if (vhd_sync_xt_check_gather_response(range) == false)
+        {
+            range->download_context->gather_stopped = true;
+            range->download_context->stats.wasted_bytes += length;
+            return 0;
+        }
+
+        range->gather_index = 0;
+    }
+
+    if (vhd_sync_xt_take_tokens(&range->download_context->limiter, length) == false)
+    {
+        range->transfer->paused = true;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    if (vhd_sync_xt_parse_multipart(&range->multipart, data_stream, length) == false)
+    {
+        return 0;
+    }
+
+    return length;
+}
+
+static bool
+vhd_sync_xt_find_gather_hole(
+    pvhd_sync_xt_download_context download_context,
+    unsigned long int* offset,
+    unsigned long int* start_offset,
+    unsigned long int* end_offset
+    )
+/*
+ * This function finds the next hole smaller than a chunk from an offset on.
+ * Holes of a chunk or more are left to ranges of their own.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      offset - Supplies where to look from, and returns where the next
+ *          look should start.
+ *
+ *      start_offset - Supplies a placeholder to return the first byte of
+ *          the hole.
+ *
+ *      end_offset - Supplies a placeholder to return the last byte of the
+ *          hole.
+ *
+ * Return Value:
+ *
+ *      TRUE if a hole was found, FALSE otherwise.
+ */
+{
+    unsigned long int missing_start;
+    unsigned long int missing_end;
+
+    while (*offset < download_context->file_size
+           && vhd_sync_xt_resume_map_next_missing(download_context->resume_map,
+                                                  *offset,
+                                                  &missing_start,
+                                                  &missing_end) == true)
+    {
+        *offset = missing_end;
+        if (missing_end - missing_start < download_context->chunk_size)
+        {
+            *start_offset = missing_start;
+            *end_offset = missing_end - 1;
+            return true;
+        }
+    }
+
+    *offset = download_context->file_size;
+    return false;
+}
+
+static bool
+vhd_sync_xt_start_gather(
+    pvhd_sync_xt_download_context download_context,
+    pvhd_sync_xt_download_range range
+    )
+/*
+ * This function sends a request from an idle range for as many of the
+ * small holes from gather_offset on as make up a chunk.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      range - Supplies the idle range.
+ *
+ * Return Value:
+ *
+ *      TRUE if the request was sent or there was nothing to ask for, FALSE
+ *      otherwise.
+ */
+{
+    bool status;
+    unsigned long int offset;
+    unsigned long int start_offset;
+    unsigned long int end_offset;
+    unsigned long int total;
+
+    range->gather_count = 0;
+    total = 0;
+    offset = download_context->gather_offset;
+
+    while (range->gather_count < VHD_SYNC_XT_GATHER_MAXIMUM_RANGES
+           && vhd_sync_xt_find_gather_hole(download_context,
+                                           &offset,
+                                           &start_offset,
+                                           &end_offset) == true)
+    {
+        total += end_offset + 1 - start_offset;
+        if (total > download_context->chunk_size)
+        {
+            break;
+        }
+
+        range->gather_starts[range->gather_count] = start_offset;
+        range->gather_ends[range->gather_count] = end_offset;
+        ++range->gather_count;
+        download_context->gather_offset = offset;
+    }
+
+    if (range->gather_count == 0)
+    {
+        download_context->gather_offset = download_context->file_size;
+        return true;
+    }
+
+    range->gathering = true;
+    range->gather_index = -1;
+    range->start_offset = range->gather_starts[0];
+    range->end_offset = range->gather_ends[0];
+    range->write_offset = range->start_offset;
+    range->request_offset = range->start_offset;
+
+    status = vhd_sync_xt_begin_range_request(download_context, range, NULL);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_set_curl_transfer_write(range->transfer,
+                                                 vhd_sync_xt_range_header_callback,
+                                                 vhd_sync_xt_gather_write_callback,
+                                                 range
+                                                 )
+             && vhd_sync_xt_set_curl_transfer_ranges(range->transfer,
+                                                     range->gather_starts,
+                                                     range->gather_ends,
+                                                     range->gather_count
+                                                     )
+             && vhd_sync_xt_start_curl_transfer(download_context->curl_config,
+                                                range->transfer
+                                                );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_gather: Could not start request for %d ranges.\n",
+                             range->gather_count);
+        vhd_sync_xt_end_range_request(range, false);
+        goto End;
+    }
+    vhd_sync_xt_watch_range(range);
+
+    ++download_context->stats.gathers;
+
+End:
+    return status;
+}
+
+static bool
+vhd_sync_xt_gather_download(
+    pvhd_sync_xt_download_context download_context
+    )
+/*
+ * This function gets the small holes of a partial file, many to a request,
+ * while there are enough of them to be worth it. Whatever it does not get,
+ * because the server will not send many ranges at once or a request
+ * failed, is left missing in the resume map for chunks to pick up.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the transfers could not be driven.
+ */
+{
+    bool status;
+    bool active;
+    bool complete;
+    pvhd_sync_xt_download_range range;
+    unsigned long int offset;
+    unsigned long int start_offset;
+    unsigned long int end_offset;
+    int holes;
+    int i;
+
+    status = true;
+    download_context->gather_offset = download_context->next_offset;
+    download_context->gather_stopped = false;
+
+    offset = download_context->gather_offset;
+    for (holes = 0; holes < VHD_SYNC_XT_GATHER_MINIMUM_HOLES; ++holes)
+    {
+        if (vhd_sync_xt_find_gather_hole(download_context,
+                                         &offset,
+                                         &start_offset,
+                                         &end_offset) == false)
+        {
+            goto End;
+        }
+    }
+
+    while (true)
+    {
+        active = false;
+        for (i = 0; i < download_context->options.parallel_streams; ++i)
+        {
+            range = &download_context->ranges[i];
+
+            if (range->transfer->active == false
+                && range->transfer->done == false
+                && download_context->gather_stopped == false
+                && download_context->gather_offset < download_context->file_size)
+            {
+                if (vhd_sync_xt_start_gather(download_context, range) == false)
+                {
+                    range->gathering = false;
+                    download_context->gather_stopped = true;
+
+                    status = vhd_sync_xt_set_curl_transfer_write(range->transfer,
+                                                                 vhd_sync_xt_range_header_callback,
+                                                                 vhd_sync_xt_range_write_callback,
+                                                                 range
+                                                                 );
+                    if (status == false)
+                    {
+                        goto End;
+                    }
+                }
+            }
+
+            if (range->gathering == true)
+            {
+                active = true;
+            }
+        }
+
+        if (active == false)
+        {
+            break;
+        }
+
+        status = vhd_sync_xt_pace_download(download_context)
+                 && vhd_sync_xt_wait_curl_transfers(download_context->curl_config);
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_gather_download: Could not drive transfers.\n");
+            break;
+        }
+
+        //
+        // The first range may still be on the chunk it started with, which
+        // is left for the chunks to finish.
+        //
+        for (i = 0; i < download_context->options.parallel_streams; ++i)
+        {
+            range = &download_context->ranges[i];
+            if (range->gathering == false || range->transfer->done == false)
+            {
+                continue;
+            }
+            range->transfer->done = false;
+            range->gathering = false;
+
+            complete = range->gather_index >= 0
+                       && range->transfer->result == CURLE_OK
+                       && vhd_sync_xt_multipart_complete(&range->multipart) == true;
+
+            if (range->gather_index >= 0)
+            {
+                vhd_sync_xt_flush_range(download_context, range);
+                vhd_sync_xt_record_range(download_context, range);
+            }
+            vhd_sync_xt_end_range_request(range, complete);
+
+            if (complete == false)
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_gather_download: Request for %d ranges failed. Curl error : %d\n",
+                                     range->gather_count,
+                                     range->transfer->result);
+                download_context->gather_stopped = true;
+            }
+
+            status = vhd_sync_xt_set_curl_transfer_write(range->transfer,
+                                                         vhd_sync_xt_range_header_callback,
+                                                         vhd_sync_xt_range_write_callback,
+                                                         range
+                                                         );
+            if (status == false)
+            {
+                goto End;
+            }
+
+            vhd_sync_xt_update_progress(download_context);
+        }
+    }
+
+End:
+    return status;
+}
+
+static bool
+vhd_sync_xt_prepare_partial_file(
+    pvhd_sync_xt_download_context download_context,
+    unsigned char* expected
+    )
+/*
+ * This function gets the partial file ready once the file on the server is
+ * known. It opens the partial file, starting over if it is of an older
+ * file, along with the map of the blocks it has and the hash of what is
+ * there so far.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      expected - Supplies the hash the file should have, when verifying.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    vhd_sync_xt_validators validators;
+    char map_path[VHD_SYNC_XT_PATH_LENGTH];
+
+    //
+    // A partial file is only of use if it is of the file on the server now,
+    // otherwise it goes and we start over. One without validators is from
+    // before they were kept, or from a server without any, and is trusted.
+    //
+    if (vhd_sync_xt_load_validators(download_context->partial_file_path,
+                                    &validators) == true
+        && vhd_sync_xt_validators_match(&validators,
+                                        &download_context->headers,
+                                        download_context->file_size) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_prepare_partial_file: Partial file is of an older file, starting over.\n");
+        unlink(download_context->partial_file_path);
+
+        //
+        // A path cut short is of some other file.
+        //
+        if (snprintf(map_path,
+                     VHD_SYNC_XT_PATH_LENGTH,
+                     "%s%s",
+                     download_context->partial_file_path,
+                     VHD_SYNC_XT_RESUME_MAP_EXTENSION
+                     ) < VHD_SYNC_XT_PATH_LENGTH)
+        {
+            unlink(map_path);
+        }
+        vhd_sync_xt_remove_validators(download_context->partial_file_path);
+    }
+
+    //
+    // The validators go down before any data, so that whatever ends up in
+    // the partial file is known to be of this file.
+    //
+    if (download_context->has_validators == true)
+    {
+        status = vhd_sync_xt_save_validators(download_context->partial_file_path,
+                                             &download_context->validators
+                                             );
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_prepare_partial_file: Could not write validators.\n");
+            goto End;
+        }
+    }
+    else
+    {
+        vhd_sync_xt_remove_validators(download_context->partial_file_path);
+    }
+
+    //
+    // Open our partial file and set our start_offest if not 0.
+    //
+    status = vhd_sync_xt_open_partial_file(download_context);
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_prepare_partial_file: Could not open partial file.\n");
+        goto End;
+    }
+
+    //
+    // Open the map of the blocks we have. A partial file from before there
+    // were maps was written in order, so its length tells us what we have.
+    // The map is written out before any data so that from now on it is the
+    // only thing that is trusted.
+    //
+    status = vhd_sync_xt_open_resume_map(download_context->partial_file_path,
+                                         download_context->file_size,
+                                         VHD_SYNC_XT_VHD_BLOCK_SIZE,
+                                         &download_context->resume_map
+                                         );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_prepare_partial_file: Could not open resume map.\n");
+        goto End;
+    }
+
+    if (download_context->resume_map->existed == false)
+    {
+        vhd_sync_xt_resume_map_set(download_context->resume_map,
+                                   0,
+                                   download_context->start_offset
+                                   );
+    }
+
+    status = vhd_sync_xt_flush_resume_map(download_context->resume_map,
+                                          download_context->writer->fd,
+                                          true
+                                          );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_prepare_partial_file: Could not write resume map.\n");
+        goto End;
+    }
+
+    //
+    // Pick the hash up where the last run left it.
+    //
+    if (download_context->options.verify == true)
+    {
+        status = vhd_sync_xt_create_verify(expected, &download_context->verify);
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_prepare_partial_file: Could not set up verification.\n");
+            goto End;
+        }
+
+        vhd_sync_xt_verify_load(download_context->verify,
+                                download_context->resume_map
+                                );
+    }
+
+End:
+    return status;
+}
+
+static bool
+vhd_sync_xt_transport_hash_data(
+    void* user_data,
+    unsigned long int offset,
+    const char* data,
+    size_t length
+    )
+/*
+ * This function is the sink of a transport that takes the header of the
+ * synchash into memory.
+ *
+ * Parameters:
+ *
+ *      user_data - Set to point to the buffer.
+ *
+ *      offset - Supplies where in the synchash the data is.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the data does not fit.
+ */
+{
+    pvhd_sync_xt_download_buffer buffer;
+
+    buffer = (pvhd_sync_xt_download_buffer)user_data;
+
+    if (offset > buffer->size || length > buffer->size - offset)
+    {
+        return false;
+    }
+
+    memcpy(buffer->data + offset, data, length);
+    buffer->length += length;
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_transport_expected_hash(
+    pvhd_sync_xt_transport transport,
+    unsigned char* expected,
+    unsigned long int* file_length
+    )
+/*
+ * This function reads the hash the file should have from the header of its
+ * synchash, through the transport, for downloads that do not use the curl
+ * engine.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport of the file.
+ *
+ *      expected - Supplies a placeholder for the SHA1 of the file.
+ *
+ *      file_length - Supplies a placeholder for the length of the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_synchash_header synchash_header;
+    vhd_sync_xt_download_buffer buffer;
+    vhd_sync_xt_transport_sink sink;
+
+    buffer.data = (char*)&synchash_header;
+    buffer.size = sizeof(synchash_header);
+    buffer.length = 0;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.data = vhd_sync_xt_transport_hash_data;
+    sink.user_data = &buffer;
+
+    if (vhd_sync_xt_transport_read_range(transport,
+                                         VHD_SYNC_XT_SYNCHASH_EXTENSION,
+                                         0,
+                                         sizeof(synchash_header) - 1,
+                                         NULL,
+                                         &sink) == false
+        || buffer.length != sizeof(synchash_header))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_expected_hash: Could not get synchash of %.*s.\n",
+                             MAX_ERROR_NAME_SIZE,
+                             transport->url);
+        return false;
+    }
+
+    if (synchash_header.hash_type != HASH_TYPE_SHA1)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_expected_hash: Synchash does not describe this file.\n");
+        return false;
+    }
+
+    memcpy(expected, synchash_header.sha1_hash, VHD_SYNC_XT_SHA1_HASH_SIZE);
+    *file_length = synchash_header.file_length;
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_transport_written(
+    void* user_data,
+    unsigned long int offset,
+    size_t length
+    )
+/*
+ * This function is told of each piece of the file a transport got into the
+ * partial file. The blocks the run it is part of has completed are marked
+ * in the map as soon as they are on disk.
+ *
+ * Parameters:
+ *
+ *      user_data - Set to point to the download context.
+ *
+ *      offset - Supplies where the piece is in the file.
+ *
+ *      length - Supplies the length of the piece.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_download_context download_context;
+
+    download_context = (pvhd_sync_xt_download_context)user_data;
+
+    if (offset != download_context->run_end)
+    {
+        download_context->run_start = offset;
+    }
+    download_context->run_end = offset + length;
+
+    download_context->current_offset += length;
+    vhd_sync_xt_resume_map_set(download_context->resume_map,
+                               download_context->run_start,
+                               download_context->run_end
+                               );
+
+    if (download_context->tuning.socket >= 0)
+    {
+        vhd_sync_xt_tune_download(download_context,
+                                  download_context->tuning.socket,
+                                  length
+                                  );
+    }
+
+    //
+    // The data may never have been in memory, so the hash reads it back.
+    //
+    if (download_context->verify != NULL)
+    {
+        if (vhd_sync_xt_advance_verify(download_context) == false)
+        {
+            return false;
+        }
+
+        vhd_sync_xt_verify_save(download_context->verify,
+                                download_context->resume_map
+                                );
+    }
+
+    vhd_sync_xt_flush_resume_map(download_context->resume_map,
+                                 download_context->writer->fd,
+                                 false
+                                 );
+
+    if (download_context->run_end % VHD_SYNC_XT_VHD_BLOCK_SIZE < length
+        || download_context->run_end == download_context->file_size)
+    {
+        vhd_sync_xt_update_progress(download_context);
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_transport_data(
+    void* user_data,
+    unsigned long int offset,
+    const char* data,
+    size_t length
+    )
+/*
+ * This function is the sink of a transport for data it has in memory,
+ * which is written to the partial file.
+ *
+ * Parameters:
+ *
+ *      user_data - Set to point to the download context.
+ *
+ *      offset - Supplies where in the file the data goes.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_download_context download_context;
+
+    download_context = (pvhd_sync_xt_download_context)user_data;
+
+    if (vhd_sync_xt_writer_write(download_context->writer,
+                                 data,
+                                 length,
+                                 offset) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_data: Could not write %lu-%lu.\n",
+                             offset,
+                             offset + length - 1);
+        return false;
+    }
+
+    return vhd_sync_xt_transport_written(user_data, offset, length);
+}
+
+static int
+vhd_sync_xt_transport_download(
+    pvhd_sync_xt_download_context download_context,
+    pvhd_sync_xt_transport transport,
+    const char* condition
+    )
+/*
+ * This function downloads the file through a transport, one read after
+ * another for the runs of blocks still missing, as many at once as a read
+ * takes. It is the engine for the sources the parallel curl engine does
+ * not cover, a connected socket spliced without curl and local files.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      transport - Supplies the transport of the file.
+ *
+ *      condition - Supplies a header that gets a 304 if the image we have
+ *          is still current, NULL for none.
+ *
+ * Return Value:
+ *
+ *      0 on success, an error code otherwise.
+ */
+{
+    int res;
+    bool status;
+    vhd_sync_xt_http_headers headers;
+    vhd_sync_xt_transport_sink sink;
+    char range_condition[VHD_SYNC_XT_VALIDATORS_HEADER_LENGTH];
+    bool conditional;
+    unsigned long int start_offsets[VHD_SYNC_XT_TRANSPORT_MAXIMUM_RANGES];
+    unsigned long int end_offsets[VHD_SYNC_XT_TRANSPORT_MAXIMUM_RANGES];
+    unsigned long int offset;
+    unsigned long int missing_start;
+    unsigned long int missing_end;
+    int count;
+    unsigned char expected[VHD_SYNC_XT_SHA1_HASH_SIZE];
+    unsigned long int expected_size;
+
+    res = 1;
+    expected_size = 0;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.data = vhd_sync_xt_transport_data;
+    sink.written = vhd_sync_xt_transport_written;
+    sink.user_data = download_context;
+
+    if (download_context->options.verify == true)
+    {
+        status = vhd_sync_xt_transport_expected_hash(transport,
+                                                     expected,
+                                                     &expected_size
+                                                     );
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_download: Could not get the hash to verify against.\n");
+            goto End;
+        }
+    }
+
+    status = vhd_sync_xt_transport_stat(transport, condition, &headers);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    if (condition != NULL && headers.status_code == 304)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_download: Local file is unchanged on the server.\n");
+        download_context->not_modified = true;
+        res = VHD_SYNC_XT_ERROR_NOT_MODIFIED;
+        goto End;
+    }
+
+    if (vhd_sync_xt_http_headers_size(&headers, &download_context->file_size) == false
+        || (headers.status_code == 206 && headers.range_start != 0))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_download: Could not get the file size. Response : %ld\n",
+                             headers.status_code);
+        goto End;
+    }
+
+    download_context->accept_ranges = (headers.status_code == 206)
+                                      || headers.accept_ranges;
+    download_context->headers = headers;
+    download_context->has_validators = vhd_sync_xt_validators_from_headers(
+                                           &headers,
+                                           download_context->file_size,
+                                           &download_context->validators);
+
+    if (download_context->options.verify == true
+        && expected_size != download_context->file_size)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_download: Synchash does not describe this file.\n");
+        goto End;
+    }
+
+    status = vhd_sync_xt_prepare_partial_file(download_context, expected);
+    if (status == false)
+    {
+        goto End;
+    }
+    sink.writer = download_context->writer;
+
+    download_context->current_offset = vhd_sync_xt_resume_map_complete_bytes(
+                                           download_context->resume_map);
+    download_context->run_start = 0;
+    download_context->run_end = 0;
+    vhd_sync_xt_update_progress(download_context);
+
+    //
+    // A server that ignores ranges has sent the whole file already.
+    //
+    if (download_context->accept_ranges == false
+        && download_context->file_size > 0)
+    {
+        download_context->current_offset = 0;
+        status = vhd_sync_xt_transport_read_range(transport,
+                                                  NULL,
+                                                  0,
+                                                  download_context->file_size - 1,
+                                                  NULL,
+                                                  &sink
+                                                  );
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_download: Could not read the file.\n");
+            goto End;
+        }
+    }
+
+    conditional = download_context->has_validators
+                  && vhd_sync_xt_validators_condition(&download_context->validators,
+                                                      true,
+                                                      range_condition,
+                                                      sizeof(range_condition)
+                                                      );
+
+    offset = 0;
+    for (;;)
+    {
+        count = 0;
+        while (count < VHD_SYNC_XT_TRANSPORT_MAXIMUM_RANGES
+               && offset < download_context->file_size
+               && vhd_sync_xt_resume_map_next_missing(download_context->resume_map,
+                                                      offset,
+                                                      &missing_start,
+                                                      &missing_end) == true)
+        {
+            start_offsets[count] = missing_start;
+            end_offsets[count] = missing_end - 1;
+            offset = missing_end;
+            ++count;
+        }
+
+        if (count == 0)
+        {
+            break;
+        }
+
+        status = vhd_sync_xt_transport_read(transport,
+                                            NULL,
+                                            start_offsets,
+                                            end_offsets,
+                                            count,
+                                            (conditional == true)
+                                            ? range_condition : NULL,
+                                            &sink
+                                            );
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_download: Could not read %d ranges from %lu.\n",
+                                 count,
+                                 start_offsets[0]);
+            goto End;
+        }
+    }
+
+    if (vhd_sync_xt_resume_map_next_missing(download_context->resume_map,
+                                            0,
+                                            &missing_start,
+                                            &missing_end) == true)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_download: Nothing came for %lu-%lu.\n",
+                             missing_start,
+                             missing_end - 1);
+        goto End;
+    }
+
+    if (vhd_sync_xt_writer_finish(download_context->writer) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_download: Could not set size of partial file.\n");
+        goto End;
+    }
+
+    res = 0;
+
+End:
+    //
+    // Whatever happened, leave the map matching what is on disk.
+    //
+    if (download_context->resume_map != NULL
+        && vhd_sync_xt_flush_resume_map(download_context->resume_map,
+                                        download_context->writer->fd,
+                                        true) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_download: Could not write resume map.\n");
+        res = (res == 0) ? 1 : res;
+    }
+
+    return res;
+}
+
+static int
+vhd_sync_xt_transport_start(
+    pvhd_sync_xt_download_context download_context,
+    vhd_sync_xt_transport_type type,
+    const char* condition
+    )
+/*
+ * This function opens a transport for the file and downloads it through
+ * that.
+ *
+ * Parameters:
+ *
+ *      download_context - Supplies the download context structure.
+ *
+ *      type - Supplies the backend.
+ *
+ *      condition - Supplies a header that gets a 304 if the image we have
+ *          is still current, NULL for none.
+ *
+ * Return Value:
+ *
+ *      0 on success, an error code otherwise.
+ */
+{
+    int res;
+    pvhd_sync_xt_transport transport;
+    vhd_sync_xt_transport_options options;
+    pvhd_sync_xt_raw_http raw_http;
+    char transport_message[VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH];
+
+    memset(&options, 0, sizeof(options));
+    options.connection_socket = download_context->curl_config->connection_socket;
+    options.ca_cert = download_context->ca_cert;
+    options.ca_path = download_context->ca_path;
+    options.credentials = download_context->credentials;
+
+    if (vhd_sync_xt_open_transport(download_context->url,
+                                   type,
+                                   &options,
+                                   &transport) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_start: Could not open transport.\n");
+        return 1;
+    }
+
+    //
+    // The raw client has the one connection, which is ours to tune. Its
+    // window scale was fixed when it was connected, so the buffer can grow
+    // only as far as that lets the window go.
+    //
+    if (type == VHD_SYNC_XT_TRANSPORT_RAW
+        && (download_context->options.autotune == true
+            || download_context->options.congestion != NULL))
+    {
+        download_context->tuning.socket = options.connection_socket;
+        if (download_context->options.congestion != NULL)
+        {
+            vhd_sync_xt_tune_set_congestion(options.connection_socket,
+                                            download_context->options.congestion
+                                            );
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &download_context->tuning.start);
+
+    //
+    // Say what the file comes through, and for the raw client whether the
+    // body really is spliced, as over TLS that is up to the kernel.
+    //
+    if (download_context->progress_fd != 0)
+    {
+        raw_http = transport->raw_http;
+        snprintf(transport_message,
+                 VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH,
+                 "Transport : %s%s%s\n",
+                 vhd_sync_xt_transport_name(transport),
+                 (raw_http == NULL) ? ""
+                 : (raw_http->ssl == NULL) ? " splice"
+                 : (raw_http->ktls == true) ? " ktls splice" : " tls copy",
+                 (transport->copy_range == true) ? " copy range" : ""
+                 );
+        write(download_context->progress_fd,
+              transport_message,
+              strlen(transport_message)
+              );
+    }
+
+    res = vhd_sync_xt_transport_download(download_context, transport, condition);
+    vhd_sync_xt_report_tuning(download_context);
+
+    vhd_sync_xt_close_transport(transport);
+    return res;
+}
 
-bool
-vhd_sync_xt_get_download_file_size(
+static bool
+vhd_sync_xt_create_ranges(
     pvhd_sync_xt_download_context download_context
     )
 /*
- * This function sends a head request to the server to get the
- * file size of the file  we are downloading. The header data is handled
- * by the vhd_sync_xt_header_callback callback function.
+ * This function creates one range, with its own curl transfer, for each
+ * parallel stream.
  *
  * Parameters:
  *
@@ -179,27 +3619,58 @@ vhd_sync_xt_get_download_file_size(
  */
 {
     bool status;
-    CURLcode res;
+    int i;
+    pvhd_sync_xt_download_range range;
 
     status = false;
 
-    status = vhd_sync_xt_set_curl_process_header(
-                 download_context->curl_config,
-                 (void*)vhd_sync_xt_header_callback,
-                 (void*)download_context
-                 );
-    if (status == false)
+    download_context->ranges = calloc((unsigned int)download_context->options.parallel_streams,
+                                      sizeof(vhd_sync_xt_download_range)
+                                      );
+    if (download_context->ranges == NULL)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_download_file_size: Could not set curl options for header download.\n");
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_ranges: Could not allocate memory for ranges.\n");
         goto End;
     }
 
-    res = vhd_sync_xt_perform_curl(download_context->curl_config);
-    if (res != CURLE_OK)
+    for (i = 0; i < download_context->options.parallel_streams; ++i)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_get_download_file_size: Could not perform curl to get file size. \n");
-        status = false;
-        goto End;
+        range = &download_context->ranges[i];
+        range->download_context = download_context;
+
+        //
+        // Page aligned, so that whole pages get handed to the kernel.
+        //
+        range->buffer_size = download_context->options.write_buffer_size;
+        if (posix_memalign((void**)&range->buffer,
+                           sysconf(_SC_PAGESIZE),
+                           range->buffer_size) != 0)
+        {
+            range->buffer = NULL;
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_ranges: Could not allocate write buffer.\n");
+            status = false;
+            goto End;
+        }
+
+        status = vhd_sync_xt_create_curl_transfer(download_context->curl_config,
+                                                  &range->transfer
+                                                  );
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_ranges: Could not create transfer.\n");
+            goto End;
+        }
+
+        status = vhd_sync_xt_set_curl_transfer_write(range->transfer,
+                                                     vhd_sync_xt_range_header_callback,
+                                                     vhd_sync_xt_range_write_callback,
+                                                     range
+                                                     );
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_ranges: Could not set curl options for download.\n");
+            goto End;
+        }
     }
 
     status = true;
@@ -208,42 +3679,14 @@ End:
     return status;
 }
 
-void
-vhd_sync_xt_update_progress(
-    pvhd_sync_xt_download_context download_context
-    )
-{
-    int progress;
-    char progress_message[VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH];
-
-    //
-    // Update our progress on each chunk.
-    //
-    progress = download_context->current_offset * 100
-               / download_context->file_size;
-
-    snprintf(progress_message,
-            VHD_SYNC_XT_PROGRESS_MESSAGE_LENGTH,
-            "Progress : %d\n",
-            progress
-            );
-
-    if (download_context->progress_fd != 0)
-    {
-        write(download_context->progress_fd,
-              progress_message,
-              strlen(progress_message)
-              );
-    }
-}
-
 int
 vhd_sync_xt_start_download(
     pvhd_sync_xt_download_context download_context
     )
 /*
  * This function starts the download of the file from the server. It tries to
- * download this file using multiple range GET reqeusts from the server.
+ * download this file using multiple range GET reqeusts from the server,
+ * keeping up to parallel_streams of them in flight at once.
  *
  *
  * Parameters:
@@ -258,100 +3701,518 @@ vhd_sync_xt_start_download(
     CURLcode res;
     bool status;
     FILE *test = NULL;
-    long unsigned int end_offset;
+    int i;
+    int active;
+    bool failed;
+    pvhd_sync_xt_download_range range;
+    struct iovec *buffers;
+    unsigned char expected[VHD_SYNC_XT_SHA1_HASH_SIZE];
+    unsigned long int expected_size;
+    vhd_sync_xt_validators validators;
+    char condition[VHD_SYNC_XT_VALIDATORS_HEADER_LENGTH];
+    bool conditional;
 
     status = false;
     res = 1;
+    failed = false;
+    conditional = false;
+    expected_size = 0;
+
+    //
+    // Add check to see if we already have the file. If we kept its
+    // validators, the server is asked whether it changed, otherwise having
+    // it is enough.
+    //
+    test = fopen(download_context->local_file_path,"rb");
+    if (test != NULL)
+    {
+        fclose(test);
+        test = NULL;
+
+        conditional = vhd_sync_xt_load_validators(download_context->local_file_path,
+                                                  &validators)
+                      && vhd_sync_xt_validators_condition(&validators,
+                                                          false,
+                                                          condition,
+                                                          sizeof(condition)
+                                                          );
+        if (conditional == false)
+        {
+            //
+            // Local file exists exit.
+            //
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Local file exists.\n");
+            res = VHD_SYNC_XT_ERROR_FILE_EXISTS;
+            goto End;
+        }
+    }
+
+    //
+    // Spliced downloads and local files go through a transport rather than
+    // the curl engine.
+    //
+    if (download_context->options.splice == true
+        || strncasecmp(download_context->url, "file://", 7) == 0)
+    {
+        res = vhd_sync_xt_transport_start(download_context,
+                                          (download_context->options.splice == true)
+                                          ? VHD_SYNC_XT_TRANSPORT_RAW
+                                          : VHD_SYNC_XT_TRANSPORT_FILE,
+                                          (conditional == true) ? condition : NULL
+                                          );
+        goto End;
+    }
 
     //
-    // Get the size of the file we are downloading.
+    // Know what the file should hash to before there is anything to check.
+    // This comes first, as the first range holds on to its connection once
+    // it starts.
     //
-    status = vhd_sync_xt_get_download_file_size(download_context);
+    if (download_context->options.verify == true)
+    {
+        status = vhd_sync_xt_get_expected_hash(download_context,
+                                               expected,
+                                               &expected_size
+                                               );
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not get the hash to verify against.\n");
+            goto End;
+        }
+    }
+
+    status = vhd_sync_xt_create_ranges(download_context);
     if (status == false)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not get the file size.\n");
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not create download ranges.\n");
         goto End;
     }
 
     //
-    // Add check to see if we already have the file.
+    // Get the size of the file we are downloading from the first range.
     //
-    test = fopen(download_context->local_file_path,"rb");
-    if (test != NULL)
+    status = vhd_sync_xt_probe_download(download_context,
+                                        (conditional == true) ? condition : NULL
+                                        );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not get the file size.\n");
+        goto End;
+    }
+
+    if (download_context->not_modified == true)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Local file is unchanged on the server.\n");
+        res = VHD_SYNC_XT_ERROR_NOT_MODIFIED;
+        goto End;
+    }
+
+    if (download_context->options.verify == true
+        && expected_size != download_context->file_size)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Synchash does not describe this file.\n");
+        status = false;
+        goto End;
+    }
+
+    status = vhd_sync_xt_prepare_partial_file(download_context, expected);
+    if (status == false)
     {
-        //
-        // Local file exists exit.
-        //
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Local file exists.\n");
-        fclose(test);
-        test = NULL;
-        res = VHD_SYNC_XT_ERROR_FILE_EXISTS;
         goto End;
     }
 
     //
-    // Open our partial file and set our start_offest if not 0.
+    // From here on every request only gets the range it asks for if the
+    // file is still the same, and the whole new file otherwise, which the
+    // ranges turn down.
     //
-    status = vhd_sync_xt_open_partial_file(download_context);
+    conditional = download_context->has_validators
+                  && vhd_sync_xt_validators_condition(&download_context->validators,
+                                                      true,
+                                                      condition,
+                                                      sizeof(condition)
+                                                      );
+    for (i = 0; i < download_context->options.parallel_streams; ++i)
+    {
+        status = vhd_sync_xt_set_curl_transfer_header(download_context->ranges[i].transfer,
+                                                      (conditional == true)
+                                                      ? condition : NULL
+                                                      );
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not set conditional header.\n");
+            goto End;
+        }
+    }
+
+    //
+    // Ranges can complete out of order, so reserve the space for the whole
+    // file up front to keep it from fragmenting. Not when the file is meant
+    // to stay sparse.
+    //
+    if (download_context->options.parallel_streams > 1
+        && download_context->options.sparse == false
+        && download_context->file_size > download_context->start_offset)
+    {
+        vhd_sync_xt_writer_reserve(download_context->writer,
+                                   download_context->start_offset,
+                                   download_context->file_size - download_context->start_offset
+                                   );
+    }
+
+    //
+    // All data is written from the buffers of the ranges.
+    //
+    buffers = calloc((unsigned int)download_context->options.parallel_streams,
+                     sizeof(struct iovec)
+                     );
+    if (buffers == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not allocate memory for buffers.\n");
+        status = false;
+        goto End;
+    }
+
+    for (i = 0; i < download_context->options.parallel_streams; ++i)
+    {
+        buffers[i].iov_base = download_context->ranges[i].buffer;
+        buffers[i].iov_len = download_context->ranges[i].buffer_size;
+    }
+
+    status = vhd_sync_xt_writer_register_buffers(download_context->writer,
+                                                 buffers,
+                                                 download_context->options.parallel_streams
+                                                 );
+    free(buffers);
     if (status == false)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not open partial file.\n");
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not register buffers.\n");
         goto End;
     }
 
+    //
+    // Commands come in while data does, so never block on them.
+    //
+    vhd_sync_xt_set_rate_limit(&download_context->limiter,
+                               download_context->options.rate_limit,
+                               download_context->options.rate_burst
+                               );
+    download_context->limiter.tokens = download_context->limiter.burst;
 
-    status = vhd_sync_xt_set_curl_get_data(download_context->curl_config,
-                                           vhd_sync_xt_header_callback_null,
-                                           download_context->out
-                                           );
-    if(status == false)
+    if (download_context->options.control_fd != 0)
+    {
+        fcntl(download_context->options.control_fd,
+              F_SETFL,
+              fcntl(download_context->options.control_fd, F_GETFL) | O_NONBLOCK
+              );
+
+        //
+        // Files cannot be waited on, but they hold all the commands they
+        // ever will, so take them in now.
+        //
+        if (vhd_sync_xt_add_curl_event(download_context->curl_config,
+                                       download_context->options.control_fd,
+                                       vhd_sync_xt_read_control,
+                                       download_context,
+                                       &download_context->control_event) == false)
+        {
+            vhd_sync_xt_read_control(download_context);
+            download_context->options.control_fd = 0;
+        }
+    }
+
+    //
+    //  Download in chunks, one chunk per range in flight.
+    //
+    download_context->current_offset = vhd_sync_xt_resume_map_complete_bytes(
+                                           download_context->resume_map);
+    download_context->next_offset = 0;
+    vhd_sync_xt_adopt_probe(download_context);
+    vhd_sync_xt_update_progress(download_context);
+
+    //
+    // A partial file that was resumed with many small holes gets them many
+    // to a request first, unless it is being streamed. A new one has no
+    // holes but the whole file.
+    //
+    if (download_context->options.stream == false
+        && download_context->accept_ranges == true
+        && download_context->resume_map->existed == true
+        && vhd_sync_xt_gather_download(download_context) == false)
     {
-        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not set curl options for download\n");
+        res = 1;
         goto End;
     }
 
     //
-    //  Download in chunks
+    // Streaming sends one request for the rest of the file. If the server
+    // does not do ranges or the stream breaks, chunks take over from
+    // wherever it got to.
     //
+    if (download_context->options.stream == true
+        && download_context->current_offset < download_context->file_size)
+    {
+        if (download_context->accept_ranges == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Server does not accept ranges, not streaming.\n");
+        }
+        else if (vhd_sync_xt_stream_download(download_context) == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Stream broke, continuing in chunks.\n");
+        }
+    }
+
+    download_context->target_streams = download_context->options.parallel_streams;
+    if (download_context->options.adaptive == true
+        && download_context->target_streams > VHD_SYNC_XT_ADAPTIVE_INITIAL_STREAMS)
+    {
+        download_context->target_streams = VHD_SYNC_XT_ADAPTIVE_INITIAL_STREAMS;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &download_context->controller.window_start);
+    download_context->tuning.start = download_context->controller.window_start;
 
-    download_context->current_offset = download_context->start_offset;
-    while (download_context->current_offset < download_context->file_size)
+    res = CURLE_OK;
+    while (true)
     {
-        end_offset = download_context->current_offset
-                     + download_context->chunk_size
-                     -1;
-        if (end_offset > download_context->file_size)
+        active = 0;
+        for (i = 0; i < download_context->options.parallel_streams; ++i)
         {
-            end_offset = download_context->file_size;
+            range = &download_context->ranges[i];
+
+            //
+            // Once the run has failed, retries are not worth waiting for.
+            //
+            if (failed == true)
+            {
+                range->retry_pending = false;
+            }
+
+            if (range->transfer->active == true || range->retry_pending == true)
+            {
+                ++active;
+            }
+
+            if (range->transfer->active == true)
+            {
+                vhd_sync_xt_check_stall(range);
+            }
         }
 
-        vhd_sync_xt_update_progress(download_context);
+        for (i = 0; i < download_context->options.parallel_streams; ++i)
+        {
+            range = &download_context->ranges[i];
+
+            if (range->retry_pending == true)
+            {
+                status = vhd_sync_xt_retry_range(download_context, range);
+                if (status == false)
+                {
+                    range->retry_pending = false;
+                    failed = true;
+                }
+                continue;
+            }
+
+            if (range->transfer->active == false
+                && range->transfer->done == false
+                && active < download_context->target_streams
+                && failed == false
+                && download_context->next_offset < download_context->file_size)
+            {
+                status = vhd_sync_xt_start_next_range(download_context, range);
+                if (status == false)
+                {
+                    VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not start range.\n");
+                    failed = true;
+                    continue;
+                }
+
+                if (range->transfer->active == true)
+                {
+                    ++active;
+                }
+            }
+
+            //
+            // With nothing left to hand out, help out the ranges still
+            // going. A stalled range is not using its share, so it can
+            // always get a hedge.
+            //
+            if (range->transfer->active == false
+                && range->transfer->done == false
+                && range->retry_pending == false
+                && failed == false
+                && download_context->accept_ranges == true
+                && download_context->next_offset >= download_context->file_size)
+            {
+                status = vhd_sync_xt_steal_range(download_context,
+                                                 range,
+                                                 active < download_context->target_streams
+                                                 );
+                if (status == false)
+                {
+                    failed = true;
+                    continue;
+                }
+
+                if (range->transfer->active == true)
+                {
+                    ++active;
+                }
+            }
+        }
+
+        if (active == 0)
+        {
+            break;
+        }
 
         //
-        // Set our data range.
+        // A stalled range is only stopped if it can get a new connection,
+        // otherwise it waits out the slow spell on the one it has.
         //
-        status = vhd_sync_xt_set_curl_data_range(download_context->curl_config,
-                                                 download_context->current_offset,
-                                                 end_offset
-                                                 );
-        if(status == false)
+        if (download_context->limiter.rate == 0
+            && download_context->accept_ranges == true
+            && vhd_sync_xt_can_open_curl_connection(download_context->curl_config) == true)
         {
-            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not set curl range option for download.\n");
-            goto End;
+            vhd_sync_xt_restart_stalled(download_context);
         }
 
+        status = vhd_sync_xt_pace_download(download_context);
+
         //
-        // Get our range data.
+        // Wake up in time for the next retry.
         //
-        res = vhd_sync_xt_perform_curl(download_context->curl_config);
+        for (i = 0; status == true && i < download_context->options.parallel_streams; ++i)
+        {
+            range = &download_context->ranges[i];
+            if (range->retry_pending == true
+                && vhd_sync_xt_retry_wait_ms(range)
+                   < download_context->curl_config->wait_timeout_ms)
+            {
+                vhd_sync_xt_set_curl_wait_timeout(download_context->curl_config,
+                                                  vhd_sync_xt_retry_wait_ms(range) + 1
+                                                  );
+            }
+        }
+
+        status = status
+                 && vhd_sync_xt_wait_curl_transfers(download_context->curl_config);
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not drive transfers.\n");
+            res = 1;
+            goto End;
+        }
 
         //
-        // update our current offset.
+        // A range that was cut short may have all it needs but still be
+        // waiting on a stalled connection, and a hedge that lost has to
+        // stop.
         //
-        download_context->current_offset = end_offset + 1;
+        for (i = 0; i < download_context->options.parallel_streams; ++i)
+        {
+            range = &download_context->ranges[i];
+            if (range->transfer->active == true
+                && (range->cancelled == true
+                    || range->write_offset == range->end_offset + 1))
+            {
+                vhd_sync_xt_stop_curl_transfer(download_context->curl_config,
+                                               range->transfer
+                                               );
+                range->transfer->done = true;
+            }
+        }
+
+        for (i = 0; i < download_context->options.parallel_streams; ++i)
+        {
+            range = &download_context->ranges[i];
+            if (range->transfer->done == false)
+            {
+                continue;
+            }
+            range->transfer->done = false;
+
+            //
+            // A hedge that lost, or ended before it got anything, leaves the
+            // range it was sent for to carry on alone.
+            //
+            if (range->cancelled == true || range->hedging == true)
+            {
+                vhd_sync_xt_end_range_request(range, range->cancelled);
+                vhd_sync_xt_drop_hedge(range);
+                continue;
+            }
+
+            vhd_sync_xt_flush_range(download_context, range);
+            vhd_sync_xt_record_range(download_context, range);
+            vhd_sync_xt_end_range_request(range,
+                                          range->write_offset == range->end_offset + 1
+                                          );
+
+            //
+            // A range is complete once all of its bytes are written, even
+            // if curl complains about anything after that. Otherwise what
+            // it got is kept and the rest asked for again.
+            //
+            if (range->write_offset != range->end_offset + 1)
+            {
+                vhd_sync_xt_adapt_download(download_context, range, false);
+                if (failed == false
+                    && vhd_sync_xt_schedule_retry(download_context, range) == true)
+                {
+                    continue;
+                }
+
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Range %lu-%lu failed at %lu. Curl error : %d\n",
+                                     range->start_offset,
+                                     range->end_offset,
+                                     range->write_offset,
+                                     range->transfer->result);
+                failed = true;
+                res = (range->transfer->result != CURLE_OK)
+                      ? range->transfer->result : CURLE_PARTIAL_FILE;
+                continue;
+            }
+
+            vhd_sync_xt_adapt_download(download_context, range, true);
+            vhd_sync_xt_update_progress(download_context);
+        }
+    }
+
+    //
+    // Whatever happened, leave the map matching what is on disk.
+    //
+    if (vhd_sync_xt_flush_resume_map(download_context->resume_map,
+                                     download_context->writer->fd,
+                                     true) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not write resume map.\n");
+        failed = true;
+    }
+
+    if (failed == true)
+    {
+        if (res == CURLE_OK)
+        {
+            res = 1;
+        }
+        goto End;
+    }
+
+    if (vhd_sync_xt_writer_finish(download_context->writer) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_start_download: Could not set size of partial file.\n");
+        res = 1;
+        goto End;
     }
 
 End:
+    if (download_context->ranges != NULL)
+    {
+        vhd_sync_xt_report_stats(download_context);
+    }
+
     return res;
 
 }
@@ -379,6 +4240,26 @@ vhd_sync_xt_finalize_download(
 
     status = false;
 
+    //
+    // Whatever has not been hashed yet is in the file by now. A file that
+    // does not match is no use to resume either, so it goes.
+    //
+    if (download_context->verify != NULL)
+    {
+        status = vhd_sync_xt_advance_verify(download_context);
+        if (status == false
+            || download_context->verify->offset != download_context->file_size
+            || vhd_sync_xt_verify_check(download_context->verify) == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_finalize_download: Downloaded file does not match its hash.\n");
+            unlink(download_context->partial_file_path);
+            vhd_sync_xt_remove_resume_map(download_context->resume_map);
+            vhd_sync_xt_remove_validators(download_context->partial_file_path);
+            status = false;
+            goto End;
+        }
+    }
+
     result = rename(download_context->partial_file_path,
                     download_context->local_file_path
                     );
@@ -389,6 +4270,26 @@ vhd_sync_xt_finalize_download(
         goto End;
     }
 
+    //
+    // The validators follow the file, after it so that a crash in between
+    // leaves old validators with a new image, which costs a download at
+    // worst, and never the other way round.
+    //
+    if (vhd_sync_xt_move_validators(download_context->partial_file_path,
+                                    download_context->local_file_path) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_finalize_download: Could not move validators.\n");
+        vhd_sync_xt_remove_validators(download_context->local_file_path);
+    }
+
+    //
+    // The map has done its job.
+    //
+    if (download_context->resume_map != NULL)
+    {
+        vhd_sync_xt_remove_resume_map(download_context->resume_map);
+    }
+
     vhd_sync_xt_update_progress(download_context);
 
     status = true;
@@ -407,6 +4308,7 @@ vhd_sync_xt_create_download_context(
     char* ca_path,
     char* credentials,
     int progress_fd,
+    pvhd_sync_xt_download_options options,
     pvhd_sync_xt_download_context* download_context
     )
 /*
@@ -431,6 +4333,8 @@ vhd_sync_xt_create_download_context(
  *
  *      progress_fd - Supplies a file descriptor to write progress status to.
  *
+ *      options - Supplies the tunables for the download.
+ *
  *      download_context - Supplies a placeholder to return the download context
  *          that was created.
  *          
@@ -441,6 +4345,7 @@ vhd_sync_xt_create_download_context(
 {
     bool status;
     pvhd_sync_xt_download_context download_context_local;
+    int i;
 
     status = false;
 
@@ -459,6 +4364,8 @@ vhd_sync_xt_create_download_context(
         goto End;
     }
     download_context_local->curl_config = curl_config;
+    download_context_local->options = *options;
+    download_context_local->retry_seed = time(NULL) ^ getpid();
 
     download_context_local->local_path = local_path;
     download_context_local->local_filename = local_filename;
@@ -469,6 +4376,22 @@ vhd_sync_xt_create_download_context(
 
     download_context_local->progress_fd = progress_fd;
 
+    //
+    // The url comes first among the mirrors.
+    //
+    status = vhd_sync_xt_add_mirror(&download_context_local->mirror_set, url);
+    for (i = 0; status == true && i < options->mirror_count; ++i)
+    {
+        status = vhd_sync_xt_add_mirror(&download_context_local->mirror_set,
+                                        options->mirrors[i]
+                                        );
+    }
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_download_context: Could not add mirrors.\n");
+        goto End;
+    }
+
     //
     // Set default chunk size.
     //
@@ -484,9 +4407,55 @@ vhd_sync_xt_create_download_context(
             download_context_local->local_filename
             );
 
+    //
+    // Generate our partial download filename.
+    //
+    snprintf(download_context_local->partial_file_path,
+            VHD_SYNC_XT_PATH_LENGTH,
+            "%s%s",
+            download_context_local->local_file_path,
+            VHD_SYNC_XT_PARTIAL_FILE_EXTENSION
+            );
+
     //
     // Set the curl url
     //
+    vhd_sync_xt_set_curl_http2(download_context_local->curl_config,
+                               download_context_local->options.http2
+                               );
+    vhd_sync_xt_set_curl_session_cache(download_context_local->curl_config,
+                                       download_context_local->options.session_cache,
+                                       download_context_local->options.session_timeout
+                                       );
+    vhd_sync_xt_set_curl_socket_tuning(download_context_local->curl_config,
+                                       download_context_local->options.congestion,
+                                       0
+                                       );
+    download_context_local->tuning.socket = -1;
+
+    status = vhd_sync_xt_set_curl_low_speed(download_context_local->curl_config,
+                                            1,
+                                            VHD_SYNC_XT_STALL_LOW_SPEED_TIME
+                                            );
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_download_context: could not set low speed limit.\n");
+        goto End;
+    }
+
+    if (download_context_local->options.broker_fd != 0)
+    {
+        status = vhd_sync_xt_set_curl_broker(download_context_local->curl_config,
+                                             download_context_local->options.broker_fd,
+                                             download_context_local->options.parallel_streams
+                                             );
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_download_context: could not get sockets from broker.\n");
+            goto End;
+        }
+    }
+
     status = vhd_sync_xt_set_url(download_context_local->curl_config,
                                  download_context_local->url,
                                  download_context_local->ca_cert,
@@ -530,14 +4499,40 @@ vhd_sync_xt_destroy_download_context(
  *      None.
  */  
 {
+    int i;
+
     if (download_context == NULL)
     {
         return;
     }
 
-    if (download_context->out != NULL)
+    vhd_sync_xt_remove_curl_event(download_context->curl_config,
+                                  download_context->control_event
+                                  );
+
+    if (download_context->ranges != NULL)
+    {
+        for (i = 0; i < download_context->options.parallel_streams; ++i)
+        {
+            vhd_sync_xt_destroy_curl_transfer(download_context->curl_config,
+                                              download_context->ranges[i].transfer
+                                              );
+            free(download_context->ranges[i].buffer);
+        }
+
+        free(download_context->ranges);
+    }
+
+    if (download_context->resume_map != NULL)
+    {
+        vhd_sync_xt_destroy_resume_map(download_context->resume_map);
+    }
+
+    vhd_sync_xt_destroy_verify(download_context->verify);
+
+    if (download_context->writer != NULL)
     {
-    	fclose(download_context->out);
+        vhd_sync_xt_destroy_writer(download_context->writer);
     }
 
     free (download_context);
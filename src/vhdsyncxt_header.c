@@ -0,0 +1,473 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the functions that parse the headers of HTTP
+ * responses. Curl hands over one line at a time, with no terminating NUL,
+ * so nothing here reads past the length it is given.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#include <vhdsyncxt_header.h>
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+static size_t
+vhd_sync_xt_parse_header_number(
+    const char* value,
+    size_t length,
+    unsigned long int* number
+    )
+/*
+ * This function parses a decimal number at the start of a value.
+ *
+ * Parameters:
+ *
+ *      value - Supplies the value.
+ *
+ *      length - Supplies the length of the value.
+ *
+ *      number - Supplies a placeholder to return the number.
+ *
+ * Return Value:
+ *
+ *      The number of characters parsed, 0 if there was no number or it
+ *      does not fit.
+ */
+{
+    unsigned long int digit;
+    size_t used;
+
+    *number = 0;
+
+    for (used = 0; used < length && isdigit((unsigned char)value[used]); ++used)
+    {
+        digit = value[used] - '0';
+        if (*number > (ULONG_MAX - digit) / 10)
+        {
+            return 0;
+        }
+
+        *number = *number * 10 + digit;
+    }
+
+    return used;
+}
+
+static bool
+vhd_sync_xt_header_name_is(
+    const char* name,
+    size_t name_length,
+    const char* expected
+    )
+/*
+ * This function compares a header name, without regard to case.
+ *
+ * Parameters:
+ *
+ *      name - Supplies the name from the header line.
+ *
+ *      name_length - Supplies the length of the name.
+ *
+ *      expected - Supplies the name to compare against.
+ *
+ * Return Value:
+ *
+ *      TRUE if the names match, FALSE otherwise.
+ */
+{
+    return name_length == strlen(expected)
+           && strncasecmp(name, expected, name_length) == 0;
+}
+
+static void
+vhd_sync_xt_parse_content_range(
+    pvhd_sync_xt_http_headers headers,
+    const char* value,
+    size_t length
+    )
+/*
+ * This function parses a Content-Range value, "bytes start-end/total",
+ * where either the range or the total can be "*".
+ *
+ * Parameters:
+ *
+ *      headers - Supplies the headers to fill in.
+ *
+ *      value - Supplies the value.
+ *
+ *      length - Supplies the length of the value.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    size_t used;
+
+    if (length < 6 || strncasecmp(value, "bytes ", 6) != 0)
+    {
+        return;
+    }
+    value += 6;
+    length -= 6;
+
+    if (length > 0 && *value == '*')
+    {
+        value += 1;
+        length -= 1;
+    }
+    else
+    {
+        used = vhd_sync_xt_parse_header_number(value, length, &headers->range_start);
+        if (used == 0 || used == length || value[used] != '-')
+        {
+            return;
+        }
+        value += used + 1;
+        length -= used + 1;
+
+        used = vhd_sync_xt_parse_header_number(value, length, &headers->range_end);
+        if (used == 0 || headers->range_end < headers->range_start)
+        {
+            return;
+        }
+        value += used;
+        length -= used;
+
+        headers->has_range = true;
+    }
+
+    if (length < 2 || *value != '/')
+    {
+        headers->has_range = false;
+        return;
+    }
+
+    if (value[1] == '*')
+    {
+        return;
+    }
+
+    used = vhd_sync_xt_parse_header_number(value + 1, length - 1, &headers->total_size);
+    if (used != length - 1
+        || (headers->has_range == true
+            && headers->range_end >= headers->total_size))
+    {
+        headers->has_range = false;
+        return;
+    }
+
+    headers->has_total_size = true;
+}
+
+static void
+vhd_sync_xt_copy_header_value(
+    char* destination,
+    const char* value,
+    size_t length
+    )
+/*
+ * This function keeps a copy of a header value, or none if it is too long.
+ *
+ * Parameters:
+ *
+ *      destination - Supplies a buffer of VHD_SYNC_XT_HEADER_VALUE_LENGTH.
+ *
+ *      value - Supplies the value.
+ *
+ *      length - Supplies the length of the value.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (length >= VHD_SYNC_XT_HEADER_VALUE_LENGTH)
+    {
+        destination[0] = '\0';
+        return;
+    }
+
+    memcpy(destination, value, length);
+    destination[length] = '\0';
+}
+
+static void
+vhd_sync_xt_parse_content_type(
+    pvhd_sync_xt_http_headers headers,
+    const char* value,
+    size_t length
+    )
+/*
+ * This function parses a Content-Type value, and only cares whether it is
+ * "multipart/byteranges; boundary=..." with the boundary quoted or not.
+ *
+ * Parameters:
+ *
+ *      headers - Supplies the headers to fill in.
+ *
+ *      value - Supplies the value.
+ *
+ *      length - Supplies the length of the value.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    size_t type_length;
+    size_t boundary_length;
+
+    type_length = strlen(VHD_SYNC_XT_HEADER_MULTIPART_BYTERANGES);
+    if (length < type_length
+        || strncasecmp(value, VHD_SYNC_XT_HEADER_MULTIPART_BYTERANGES, type_length) != 0)
+    {
+        return;
+    }
+    value += type_length;
+    length -= type_length;
+
+    //
+    // Find the boundary among the parameters.
+    //
+    while (length > 9 && strncasecmp(value, "boundary=", 9) != 0)
+    {
+        ++value;
+        --length;
+    }
+
+    if (length <= 9)
+    {
+        return;
+    }
+    value += 9;
+    length -= 9;
+
+    if (*value == '"')
+    {
+        ++value;
+        --length;
+        boundary_length = 0;
+        while (boundary_length < length && value[boundary_length] != '"')
+        {
+            ++boundary_length;
+        }
+    }
+    else
+    {
+        boundary_length = 0;
+        while (boundary_length < length
+               && value[boundary_length] != ';'
+               && isspace((unsigned char)value[boundary_length]) == 0)
+        {
+            ++boundary_length;
+        }
+    }
+
+    if (boundary_length == 0 || boundary_length >= VHD_SYNC_XT_HEADER_BOUNDARY_LENGTH)
+    {
+        return;
+    }
+
+    memcpy(headers->boundary, value, boundary_length);
+    headers->boundary[boundary_length] = '\0';
+    headers->multipart = true;
+}
+
+void
+vhd_sync_xt_reset_http_headers(
+    pvhd_sync_xt_http_headers headers
+    )
+/*
+ * This function forgets everything parsed so far.
+ *
+ * Parameters:
+ *
+ *      headers - Supplies the headers.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    memset(headers, 0, sizeof(*headers));
+}
+
+void
+vhd_sync_xt_parse_http_header(
+    pvhd_sync_xt_http_headers headers,
+    const char* line,
+    size_t length
+    )
+/*
+ * This function parses one line of the headers of a response. Header names
+ * are matched without regard to case, HTTP/2 sends them all in lower case.
+ *
+ * Parameters:
+ *
+ *      headers - Supplies the headers to fill in.
+ *
+ *      line - Supplies the line, which need not be NUL terminated.
+ *
+ *      length - Supplies the length of the line.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    const char *colon;
+    const char *value;
+    size_t name_length;
+    size_t value_length;
+    size_t used;
+    unsigned long int status_code;
+
+    //
+    // Drop the line ending.
+    //
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+    {
+        --length;
+    }
+
+    //
+    // A new status line starts a new response.
+    //
+    if (length > 5 && strncmp(line, "HTTP/", 5) == 0)
+    {
+        vhd_sync_xt_reset_http_headers(headers);
+
+        value = memchr(line, ' ', length);
+        if (value != NULL)
+        {
+            ++value;
+            used = vhd_sync_xt_parse_header_number(value,
+                                                   line + length - value,
+                                                   &status_code
+                                                   );
+            if (used == 3)
+            {
+                headers->status_code = status_code;
+            }
+        }
+        return;
+    }
+
+    if (length == 0)
+    {
+        headers->complete = true;
+        return;
+    }
+
+    colon = memchr(line, ':', length);
+    if (colon == NULL)
+    {
+        return;
+    }
+
+    name_length = colon - line;
+    while (name_length > 0 && isspace((unsigned char)line[name_length - 1]))
+    {
+        --name_length;
+    }
+
+    value = colon + 1;
+    value_length = line + length - value;
+    while (value_length > 0 && isspace((unsigned char)*value))
+    {
+        ++value;
+        --value_length;
+    }
+    while (value_length > 0 && isspace((unsigned char)value[value_length - 1]))
+    {
+        --value_length;
+    }
+
+    if (vhd_sync_xt_header_name_is(line, name_length, VHD_SYNC_XT_HEADER_CONTENT_LENGTH))
+    {
+        used = vhd_sync_xt_parse_header_number(value,
+                                               value_length,
+                                               &headers->content_length
+                                               );
+        headers->has_content_length = (used != 0 && used == value_length);
+    }
+    else if (vhd_sync_xt_header_name_is(line, name_length, VHD_SYNC_XT_HEADER_CONTENT_RANGE))
+    {
+        vhd_sync_xt_parse_content_range(headers, value, value_length);
+    }
+    else if (vhd_sync_xt_header_name_is(line, name_length, VHD_SYNC_XT_HEADER_ACCEPT_RANGES))
+    {
+        headers->accept_ranges = (value_length == 5
+                                  && strncasecmp(value, "bytes", 5) == 0);
+    }
+    else if (vhd_sync_xt_header_name_is(line, name_length, VHD_SYNC_XT_HEADER_ETAG))
+    {
+        vhd_sync_xt_copy_header_value(headers->etag, value, value_length);
+    }
+    else if (vhd_sync_xt_header_name_is(line, name_length, VHD_SYNC_XT_HEADER_LAST_MODIFIED))
+    {
+        vhd_sync_xt_copy_header_value(headers->last_modified, value, value_length);
+    }
+    else if (vhd_sync_xt_header_name_is(line, name_length, VHD_SYNC_XT_HEADER_CONTENT_TYPE))
+    {
+        vhd_sync_xt_parse_content_type(headers, value, value_length);
+    }
+}
+
+bool
+vhd_sync_xt_http_headers_size(
+    pvhd_sync_xt_http_headers headers,
+    unsigned long int* file_size
+    )
+/*
+ * This function works out the size of the whole file from the headers of
+ * a response to a ranged request. A partial response gives it after the
+ * range, a full one as its length, and a range the file does not reach
+ * gives it on its own.
+ *
+ * Parameters:
+ *
+ *      headers - Supplies the headers.
+ *
+ *      file_size - Supplies a placeholder to return the size of the file.
+ *
+ * Return Value:
+ *
+ *      TRUE if the headers tell the size, FALSE otherwise.
+ */
+{
+    if ((headers->status_code == 206 || headers->status_code == 416)
+        && headers->has_total_size == true)
+    {
+        *file_size = headers->total_size;
+        return true;
+    }
+
+    if (headers->status_code == 200 && headers->has_content_length == true)
+    {
+        *file_size = headers->content_length;
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the functions of the token bucket that caps the
+ * bandwidth of a download over all its connections.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#include <vhdsyncxt_limiter.h>
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+void
+vhd_sync_xt_set_rate_limit(
+    pvhd_sync_xt_limiter limiter,
+    unsigned long int rate,
+    unsigned long int burst
+    )
+/*
+ * This function sets the rate the limiter lets data through at.
+ *
+ * Parameters:
+ *
+ *      limiter - Supplies the limiter.
+ *
+ *      rate - Supplies the rate in bytes per second, 0 for no limit.
+ *
+ *      burst - Supplies the most bytes let through at once, 0 to pick one
+ *          from the rate.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (burst == 0)
+    {
+        burst = rate / 10;
+        if (burst < VHD_SYNC_XT_RATE_MINIMUM_BURST)
+        {
+            burst = VHD_SYNC_XT_RATE_MINIMUM_BURST;
+        }
+    }
+
+    limiter->rate = rate;
+    limiter->burst = burst;
+    if (limiter->tokens > (long int)burst)
+    {
+        limiter->tokens = burst;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &limiter->last_refill);
+}
+
+void
+vhd_sync_xt_refill_tokens(
+    pvhd_sync_xt_limiter limiter
+    )
+/*
+ * This function adds the tokens earned since the last refill to the bucket.
+ *
+ * Parameters:
+ *
+ *      limiter - Supplies the limiter.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    struct timespec now;
+    unsigned long int elapsed_usec;
+    unsigned long int earned;
+
+    if (limiter->rate == 0)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_usec = (now.tv_sec - limiter->last_refill.tv_sec) * 1000000
+                   + (now.tv_nsec - limiter->last_refill.tv_nsec) / 1000;
+
+    //
+    // Leave the clock alone until a whole token is earned, or frequent
+    // refills would round everything away.
+    //
+    earned = limiter->rate * elapsed_usec / 1000000;
+    if (earned == 0)
+    {
+        return;
+    }
+
+    limiter->last_refill = now;
+    if (earned > limiter->burst
+        || limiter->tokens + (long int)earned > (long int)limiter->burst)
+    {
+        limiter->tokens = limiter->burst;
+    }
+    else
+    {
+        limiter->tokens += earned;
+    }
+}
+
+bool
+vhd_sync_xt_take_tokens(
+    pvhd_sync_xt_limiter limiter,
+    size_t length
+    )
+/*
+ * This function takes tokens for data received. Data is let through while
+ * there are any tokens at all, since curl hands it over in pieces that
+ * cannot be split, and the debt is paid off before anything else goes.
+ *
+ * Parameters:
+ *
+ *      limiter - Supplies the limiter.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      TRUE if the data can go through, FALSE if it has to wait.
+ */
+{
+    if (limiter->rate == 0)
+    {
+        return true;
+    }
+
+    vhd_sync_xt_refill_tokens(limiter);
+    if (limiter->tokens <= 0)
+    {
+        return false;
+    }
+
+    limiter->tokens -= length;
+    return true;
+}
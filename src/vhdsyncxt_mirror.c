@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the functions that keep score of the mirrors an image
+ * is fetched from, and pick the mirror each range goes to.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#include <vhdsyncxt_mirror.h>
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+bool
+vhd_sync_xt_add_mirror(
+    pvhd_sync_xt_mirror_set mirror_set,
+    char* url
+    )
+/*
+ * This function adds a mirror to the set. The first one added is the one
+ * the size and validators of the file are learned from.
+ *
+ * Parameters:
+ *
+ *      mirror_set - Supplies the set of mirrors.
+ *
+ *      url - Supplies the url of the file on the mirror. It is not copied.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the set is full.
+ */
+{
+    pvhd_sync_xt_mirror mirror;
+
+    if (mirror_set->mirror_count >= VHD_SYNC_XT_MIRROR_SET_SIZE)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_add_mirror: No room for mirror %.*s.\n",
+                             MAX_ERROR_NAME_SIZE,
+                             url);
+        return false;
+    }
+
+    mirror = &mirror_set->mirrors[mirror_set->mirror_count++];
+    memset(mirror, 0, sizeof(*mirror));
+    mirror->url = url;
+
+    return true;
+}
+
+pvhd_sync_xt_mirror
+vhd_sync_xt_pick_mirror(
+    pvhd_sync_xt_mirror_set mirror_set,
+    pvhd_sync_xt_mirror avoid
+    )
+/*
+ * This function picks the mirror the next request goes to. A mirror that
+ * has not been measured yet gets a request of its own first. After that the
+ * mirror with the most throughput to spare for one more request wins, so
+ * that requests are shared out in proportion to how fast mirrors are.
+ *
+ * Parameters:
+ *
+ *      mirror_set - Supplies the set of mirrors.
+ *
+ *      avoid - Supplies a mirror to pick only if there is no other, NULL for
+ *          none.
+ *
+ * Return Value:
+ *
+ *      The mirror, NULL if the set is empty.
+ */
+{
+    pvhd_sync_xt_mirror mirror;
+    pvhd_sync_xt_mirror best;
+    unsigned long int fastest;
+    unsigned long int throughput;
+    unsigned long int score;
+    unsigned long int best_score;
+    int i;
+
+    best = NULL;
+    best_score = 0;
+    fastest = 1;
+
+    for (i = 0; i < mirror_set->mirror_count; ++i)
+    {
+        if (mirror_set->mirrors[i].throughput > fastest)
+        {
+            fastest = mirror_set->mirrors[i].throughput;
+        }
+    }
+
+    for (i = 0; i < mirror_set->mirror_count; ++i)
+    {
+        mirror = &mirror_set->mirrors[i];
+        if (mirror->dropped == true || mirror == avoid)
+        {
+            continue;
+        }
+
+        if (mirror->throughput == 0 && mirror->active == 0)
+        {
+            return mirror;
+        }
+
+        //
+        // Until it is measured, a mirror is taken to be as fast as the
+        // fastest one.
+        //
+        throughput = (mirror->throughput != 0) ? mirror->throughput : fastest;
+        score = throughput / (mirror->active + 1);
+        if (best == NULL || score > best_score)
+        {
+            best = mirror;
+            best_score = score;
+        }
+    }
+
+    if (best == NULL && avoid != NULL && avoid->dropped == false)
+    {
+        best = avoid;
+    }
+
+    //
+    // The url given cannot have a different file, so once every mirror
+    // has been dropped for failing it is the one left to retry, and the
+    // retry limit decides when to give up.
+    //
+    if (best == NULL && mirror_set->mirror_count > 0)
+    {
+        best = &mirror_set->mirrors[0];
+    }
+
+    return best;
+}
+
+void
+vhd_sync_xt_begin_mirror_request(
+    pvhd_sync_xt_mirror mirror
+    )
+/*
+ * This function counts a request to a mirror as in flight.
+ *
+ * Parameters:
+ *
+ *      mirror - Supplies the mirror.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    ++mirror->active;
+}
+
+void
+vhd_sync_xt_end_mirror_request(
+    pvhd_sync_xt_mirror mirror,
+    unsigned long int bytes,
+    unsigned long int usec,
+    bool success
+    )
+/*
+ * This function scores a mirror on a request that ended, and drops it if it
+ * fails too often.
+ *
+ * Parameters:
+ *
+ *      mirror - Supplies the mirror.
+ *
+ *      bytes - Supplies the number of bytes the request got.
+ *
+ *      usec - Supplies how long the body took to arrive, 0 if unknown.
+ *
+ *      success - Supplies whether the request got all it asked for.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    unsigned long int throughput;
+
+    --mirror->active;
+    ++mirror->requests;
+    mirror->bytes += bytes;
+
+    //
+    // A failed request still tells how fast the mirror was going.
+    //
+    if (bytes != 0 && usec != 0)
+    {
+        throughput = bytes * 1000000 / usec;
+        if (mirror->throughput == 0)
+        {
+            mirror->throughput = throughput;
+        }
+        else
+        {
+            mirror->throughput = (3 * mirror->throughput + throughput) / 4;
+        }
+
+        if (mirror->throughput == 0)
+        {
+            mirror->throughput = 1;
+        }
+    }
+
+    if (success == true)
+    {
+        mirror->consecutive_failures = 0;
+        return;
+    }
+
+    ++mirror->failures;
+    ++mirror->consecutive_failures;
+
+    if (mirror->dropped == false
+        && (mirror->consecutive_failures >= VHD_SYNC_XT_MIRROR_MAXIMUM_FAILURES
+            || (mirror->requests >= VHD_SYNC_XT_MIRROR_MINIMUM_REQUESTS
+                && mirror->failures * 100
+                   > mirror->requests * VHD_SYNC_XT_MIRROR_MAXIMUM_FAILURE_PERCENT)))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_end_mirror_request: Dropping mirror %.*s after %lu failures in %lu requests.\n",
+                             MAX_ERROR_NAME_SIZE,
+                             mirror->url,
+                             mirror->failures,
+                             mirror->requests);
+        mirror->dropped = true;
+    }
+}
+
+bool
+vhd_sync_xt_mirror_consistent(
+    pvhd_sync_xt_http_headers reference,
+    unsigned long int file_size,
+    pvhd_sync_xt_http_headers headers
+    )
+/*
+ * This function checks that a response from a mirror is for the same file
+ * as the first response. The size has to match, and so does each validator
+ * that both responses have. Mirrors are expected to publish the same file
+ * with the same modification time.
+ *
+ * Parameters:
+ *
+ *      reference - Supplies the headers of the first response.
+ *
+ *      file_size - Supplies the size of the file.
+ *
+ *      headers - Supplies the headers of the response to check.
+ *
+ * Return Value:
+ *
+ *      TRUE if the response is for the same file, FALSE otherwise.
+ */
+{
+    unsigned long int size;
+
+    if (vhd_sync_xt_http_headers_size(headers, &size) == false
+        || size != file_size)
+    {
+        return false;
+    }
+
+    if (reference->etag[0] != '\0'
+        && headers->etag[0] != '\0'
+        && strcmp(reference->etag, headers->etag) != 0)
+    {
+        return false;
+    }
+
+    if (reference->last_modified[0] != '\0'
+        && headers->last_modified[0] != '\0'
+        && strcmp(reference->last_modified, headers->last_modified) != 0)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+void
+vhd_sync_xt_drop_mirror(
+    pvhd_sync_xt_mirror mirror
+    )
+/*
+ * This function stops any more requests going to a mirror.
+ *
+ * Parameters:
+ *
+ *      mirror - Supplies the mirror.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (mirror->dropped == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_drop_mirror: Dropping mirror %.*s.\n",
+                             MAX_ERROR_NAME_SIZE,
+                             mirror->url);
+        mirror->dropped = true;
+    }
+}
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the functions that parse a multipart/byteranges body
+ * as it arrives, in whatever pieces curl hands it over.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#include <vhdsyncxt_multipart.h>
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+static bool
+vhd_sync_xt_multipart_is_boundary(
+    pvhd_sync_xt_multipart multipart,
+    bool* last
+    )
+/*
+ * This function checks whether the line put together is a delimiter,
+ * "--boundary", or the one that closes the body, "--boundary--".
+ *
+ * Parameters:
+ *
+ *      multipart - Supplies the parser.
+ *
+ *      last - Supplies a placeholder to return whether it closes the body.
+ *
+ * Return Value:
+ *
+ *      TRUE if the line is a delimiter, FALSE otherwise.
+ */
+{
+    size_t boundary_length;
+    size_t length;
+
+    boundary_length = strlen(multipart->boundary);
+    length = multipart->line_length;
+
+    //
+    // Anything after the delimiter on its line is padding.
+    //
+    while (length > 0 && (multipart->line[length - 1] == ' '
+                          || multipart->line[length - 1] == '\t'))
+    {
+        --length;
+    }
+
+    if (length < boundary_length + 2
+        || multipart->line[0] != '-'
+        || multipart->line[1] != '-'
+        || memcmp(multipart->line + 2, multipart->boundary, boundary_length) != 0)
+    {
+        return false;
+    }
+
+    if (length == boundary_length + 2)
+    {
+        *last = false;
+        return true;
+    }
+
+    if (length == boundary_length + 4
+        && multipart->line[boundary_length + 2] == '-'
+        && multipart->line[boundary_length + 3] == '-')
+    {
+        *last = true;
+        return true;
+    }
+
+    return false;
+}
+
+static bool
+vhd_sync_xt_multipart_line(
+    pvhd_sync_xt_multipart multipart
+    )
+/*
+ * This function acts on a whole line outside the body of a part.
+ *
+ * Parameters:
+ *
+ *      multipart - Supplies the parser.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the body is not what it should be.
+ */
+{
+    bool last;
+
+    switch (multipart->state)
+    {
+        case MULTIPART_STATE_PREAMBLE:
+        case MULTIPART_STATE_BOUNDARY:
+            if (vhd_sync_xt_multipart_is_boundary(multipart, &last) == true)
+            {
+                multipart->state = (last == true) ? MULTIPART_STATE_DONE
+                                                  : MULTIPART_STATE_HEADERS;
+                vhd_sync_xt_reset_http_headers(&multipart->part_headers);
+                return true;
+            }
+
+            //
+            // Only the preamble has text of its own, a part is followed
+            // straight away by the next delimiter.
+            //
+            return multipart->state == MULTIPART_STATE_PREAMBLE
+                   || multipart->line_length == 0;
+
+        case MULTIPART_STATE_HEADERS:
+            if (multipart->line_length != 0)
+            {
+                vhd_sync_xt_parse_http_header(&multipart->part_headers,
+                                              multipart->line,
+                                              multipart->line_length
+                                              );
+                return true;
+            }
+
+            if (multipart->part_headers.has_range == false)
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_multipart_line: Part without a range.\n");
+                return false;
+            }
+
+            multipart->offset = multipart->part_headers.range_start;
+            multipart->remaining = multipart->part_headers.range_end + 1
+                                   - multipart->part_headers.range_start;
+            multipart->state = MULTIPART_STATE_BODY;
+            return true;
+
+        default:
+            return true;
+    }
+}
+
+void
+vhd_sync_xt_reset_multipart(
+    pvhd_sync_xt_multipart multipart,
+    const char* boundary,
+    vhd_sync_xt_multipart_callback callback,
+    void* user_data
+    )
+/*
+ * This function gets a parser ready for a new body.
+ *
+ * Parameters:
+ *
+ *      multipart - Supplies the parser.
+ *
+ *      boundary - Supplies the boundary from the Content-Type of the body.
+ *
+ *      callback - Supplies the function the data of the parts goes to.
+ *
+ *      user_data - Supplies what is passed to the callback.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    memset(multipart, 0, sizeof(*multipart));
+    multipart->state = MULTIPART_STATE_PREAMBLE;
+    snprintf(multipart->boundary,
+             VHD_SYNC_XT_HEADER_BOUNDARY_LENGTH,
+             "%s",
+             boundary
+             );
+    multipart->callback = callback;
+    multipart->user_data = user_data;
+}
+
+bool
+vhd_sync_xt_expect_single_part(
+    pvhd_sync_xt_multipart multipart,
+    pvhd_sync_xt_http_headers headers
+    )
+/*
+ * This function sets a parser that was just reset to take a body that is
+ * a single range, for a server that sent what was asked for as one part.
+ *
+ * Parameters:
+ *
+ *      multipart - Supplies the parser.
+ *
+ *      headers - Supplies the headers of the response.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the response has no range.
+ */
+{
+    if (headers->has_range == false)
+    {
+        return false;
+    }
+
+    multipart->part_headers = *headers;
+    multipart->offset = headers->range_start;
+    multipart->remaining = headers->range_end + 1 - headers->range_start;
+    multipart->single = true;
+    multipart->state = MULTIPART_STATE_BODY;
+
+    return true;
+}
+
+bool
+vhd_sync_xt_parse_multipart(
+    pvhd_sync_xt_multipart multipart,
+    const char* data,
+    size_t length
+    )
+/*
+ * This function parses the next piece of a body. The body of each part is
+ * passed to the callback without being copied, and may take more than one
+ * call if it arrives in pieces.
+ *
+ * Parameters:
+ *
+ *      multipart - Supplies the parser.
+ *
+ *      data - Supplies the piece of the body.
+ *
+ *      length - Supplies the length of the piece.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the body is not what it should be or the
+ *      callback stopped the parse. The parser takes nothing more after that.
+ */
+{
+    size_t used;
+
+    while (length > 0)
+    {
+        switch (multipart->state)
+        {
+            case MULTIPART_STATE_BODY:
+                used = length;
+                if (used > multipart->remaining)
+                {
+                    used = multipart->remaining;
+                }
+
+                if (multipart->callback(multipart->user_data,
+                                        multipart->offset,
+                                        data,
+                                        used) == false)
+                {
+                    multipart->state = MULTIPART_STATE_ERROR;
+                    return false;
+                }
+
+                multipart->offset += used;
+                multipart->remaining -= used;
+                data += used;
+                length -= used;
+
+                //
+                // What follows the body is the line break that starts the
+                // next delimiter.
+                //
+                if (multipart->remaining == 0)
+                {
+                    multipart->state = (multipart->single == true)
+                                       ? MULTIPART_STATE_DONE
+                                       : MULTIPART_STATE_BOUNDARY;
+                    multipart->line_length = 0;
+                }
+                break;
+
+            case MULTIPART_STATE_DONE:
+                return true;
+
+            case MULTIPART_STATE_ERROR:
+                return false;
+
+            default:
+                if (*data == '\n')
+                {
+                    if (multipart->line_length > 0
+                        && multipart->line[multipart->line_length - 1] == '\r')
+                    {
+                        --multipart->line_length;
+                    }
+
+                    if (vhd_sync_xt_multipart_line(multipart) == false)
+                    {
+                        multipart->state = MULTIPART_STATE_ERROR;
+                        return false;
+                    }
+
+                    multipart->line_length = 0;
+                }
+                else if (multipart->line_length < VHD_SYNC_XT_MULTIPART_LINE_LENGTH)
+                {
+                    multipart->line[multipart->line_length++] = *data;
+                }
+                else if (multipart->state != MULTIPART_STATE_PREAMBLE)
+                {
+                    VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_parse_multipart: Line too long.\n");
+                    multipart->state = MULTIPART_STATE_ERROR;
+                    return false;
+                }
+
+                ++data;
+                --length;
+                break;
+        }
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_multipart_complete(
+    pvhd_sync_xt_multipart multipart
+    )
+/*
+ * This function tells whether the closing delimiter has been seen.
+ *
+ * Parameters:
+ *
+ *      multipart - Supplies the parser.
+ *
+ * Return Value:
+ *
+ *      TRUE if the body is complete, FALSE otherwise.
+ */
+{
+    return multipart->state == MULTIPART_STATE_DONE;
+}
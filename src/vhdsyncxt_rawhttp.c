@@ -0,0 +1,1008 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains a minimal HTTP/1.1 range client over a socket that is
+ * already connected to the server, which splices the body of a response
+ * into the partial file. Over TLS it asks OpenSSL to hand the records to
+ * the kernel, which decrypts them so the body can still be spliced.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#define _GNU_SOURCE
+
+#include <vhdsyncxt_rawhttp.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+static bool
+vhd_sync_xt_raw_http_wait(
+    pvhd_sync_xt_raw_http raw_http,
+    short events
+    )
+/*
+ * This function waits for the socket to be ready. It may have been left
+ * non blocking by whoever used it before.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client.
+ *
+ *      events - Supplies what to wait for, POLLIN or POLLOUT.
+ *
+ * Return Value:
+ *
+ *      TRUE once the socket is ready, FALSE on a timeout or error.
+ */
+{
+    struct pollfd poll_fd;
+    int result;
+
+    poll_fd.fd = raw_http->socket;
+    poll_fd.events = events;
+    poll_fd.revents = 0;
+
+    do
+    {
+        result = poll(&poll_fd, 1, VHD_SYNC_XT_RAW_HTTP_TIMEOUT_MS);
+    } while (result < 0 && errno == EINTR);
+
+    if (result <= 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_wait: Server did not respond : %d\n",
+                             (result == 0) ? ETIMEDOUT : errno);
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_raw_http_retry(
+    pvhd_sync_xt_raw_http raw_http,
+    int result,
+    short events
+    )
+/*
+ * This function decides whether a read or write that did not go through is
+ * worth trying again, waiting for the socket first if it is not ready. Over
+ * TLS a read can need a write and the other way round.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client.
+ *
+ *      result - Supplies what the read or write returned.
+ *
+ *      events - Supplies what a plaintext socket waits for, POLLIN or
+ *          POLLOUT.
+ *
+ * Return Value:
+ *
+ *      TRUE to try again, FALSE on an error.
+ */
+{
+    if (raw_http->ssl != NULL)
+    {
+        switch (SSL_get_error(raw_http->ssl, result))
+        {
+            case SSL_ERROR_WANT_READ:
+                return vhd_sync_xt_raw_http_wait(raw_http, POLLIN);
+
+            case SSL_ERROR_WANT_WRITE:
+                return vhd_sync_xt_raw_http_wait(raw_http, POLLOUT);
+
+            case SSL_ERROR_SYSCALL:
+                return errno == EINTR;
+
+            default:
+                return false;
+        }
+    }
+
+    if (errno == EINTR)
+    {
+        return true;
+    }
+
+    return (errno == EAGAIN || errno == EWOULDBLOCK)
+           && vhd_sync_xt_raw_http_wait(raw_http, events);
+}
+
+static bool
+vhd_sync_xt_raw_http_send(
+    pvhd_sync_xt_raw_http raw_http,
+    const char* data,
+    size_t length
+    )
+/*
+ * This function sends all of a request.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client.
+ *
+ *      data - Supplies the request.
+ *
+ *      length - Supplies the length of the request.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    ssize_t result;
+
+    while (length > 0)
+    {
+        if (raw_http->ssl != NULL)
+        {
+            result = SSL_write(raw_http->ssl, data, length);
+        }
+        else
+        {
+            result = send(raw_http->socket, data, length, MSG_NOSIGNAL);
+        }
+
+        if (result <= 0)
+        {
+            if (vhd_sync_xt_raw_http_retry(raw_http, result, POLLOUT) == true)
+            {
+                continue;
+            }
+
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_send: Could not send request : %d\n", errno);
+            return false;
+        }
+
+        data += result;
+        length -= result;
+    }
+
+    return true;
+}
+
+static ssize_t
+vhd_sync_xt_raw_http_recv(
+    pvhd_sync_xt_raw_http raw_http,
+    char* data,
+    size_t length
+    )
+/*
+ * This function reads whatever the connection has, up to a length,
+ * decrypting it first over TLS.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client.
+ *
+ *      data - Supplies the buffer to read into.
+ *
+ *      length - Supplies the size of the buffer.
+ *
+ * Return Value:
+ *
+ *      The number of bytes read, 0 if the server closed the connection or
+ *      -1 on an error.
+ */
+{
+    ssize_t result;
+
+    while (true)
+    {
+        if (raw_http->ssl != NULL)
+        {
+            result = SSL_read(raw_http->ssl, data, length);
+            if (result <= 0
+                && SSL_get_error(raw_http->ssl, result) == SSL_ERROR_ZERO_RETURN)
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            result = recv(raw_http->socket, data, length, 0);
+            if (result == 0)
+            {
+                return 0;
+            }
+        }
+
+        if (result > 0)
+        {
+            return result;
+        }
+
+        if (vhd_sync_xt_raw_http_retry(raw_http, result, POLLIN) == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_recv: Could not receive : %d\n", errno);
+            return -1;
+        }
+    }
+}
+
+static bool
+vhd_sync_xt_raw_http_receive(
+    pvhd_sync_xt_raw_http raw_http
+    )
+/*
+ * This function reads whatever the connection has into the free end of the
+ * buffer.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client.
+ *
+ * Return Value:
+ *
+ *      TRUE if anything was read, FALSE if the buffer is full, the server
+ *      closed the connection or there was an error.
+ */
+{
+    ssize_t result;
+    size_t end;
+
+    end = raw_http->buffer_start + raw_http->buffer_length;
+    if (end == VHD_SYNC_XT_RAW_HTTP_BUFFER_SIZE)
+    {
+        return false;
+    }
+
+    result = vhd_sync_xt_raw_http_recv(raw_http,
+                                       raw_http->buffer + end,
+                                       VHD_SYNC_XT_RAW_HTTP_BUFFER_SIZE - end
+                                       );
+    if (result == 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_receive: Server closed the connection.\n");
+    }
+
+    if (result <= 0)
+    {
+        return false;
+    }
+
+    raw_http->buffer_length += result;
+    return true;
+}
+
+static bool
+vhd_sync_xt_raw_http_read_headers(
+    pvhd_sync_xt_raw_http raw_http
+    )
+/*
+ * This function reads and parses the headers of a response, leaving what
+ * came in after them in the buffer. Interim responses are skipped.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    char *line;
+    char *line_end;
+    size_t line_length;
+
+    vhd_sync_xt_reset_http_headers(&raw_http->headers);
+
+    while (raw_http->headers.complete == false
+           || raw_http->headers.status_code < 200)
+    {
+        if (raw_http->headers.complete == true)
+        {
+            vhd_sync_xt_reset_http_headers(&raw_http->headers);
+        }
+
+        line = raw_http->buffer + raw_http->buffer_start;
+        line_end = memchr(line, '\n', raw_http->buffer_length);
+        if (line_end == NULL)
+        {
+            //
+            // Move what there is of the line to the front, to make room
+            // for the rest of it.
+            //
+            memmove(raw_http->buffer, line, raw_http->buffer_length);
+            raw_http->buffer_start = 0;
+
+            if (vhd_sync_xt_raw_http_receive(raw_http) == false)
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_read_headers: No complete response.\n");
+                return false;
+            }
+            continue;
+        }
+
+        line_length = line_end + 1 - line;
+        vhd_sync_xt_parse_http_header(&raw_http->headers, line, line_length);
+        raw_http->buffer_start += line_length;
+        raw_http->buffer_length -= line_length;
+    }
+
+    if (raw_http->buffer_length == 0)
+    {
+        raw_http->buffer_start = 0;
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_raw_http_start_tls(
+    pvhd_sync_xt_raw_http raw_http,
+    const char* ca_cert,
+    const char* ca_path
+    )
+/*
+ * This function runs the TLS handshake on the socket, checking the server
+ * against the certificates given, or the system ones if none are. OpenSSL
+ * is asked to hand the records to the kernel once the keys are agreed, and
+ * whether the kernel took them for receiving decides how bodies are read.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client, with its host set.
+ *
+ *      ca_cert - Supplies a certificate file for the server, NULL for none.
+ *
+ *      ca_path - Supplies a directory of certificates, NULL for none.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    char name[VHD_SYNC_XT_RAW_HTTP_HOST_LENGTH];
+    char *port;
+    int result;
+    X509_VERIFY_PARAM *verify_param;
+
+    status = false;
+
+    //
+    // Certificates are checked against the host without its port or the
+    // brackets of an IPv6 address.
+    //
+    if (raw_http->host[0] == '[')
+    {
+        snprintf(name, sizeof(name), "%s", raw_http->host + 1);
+        port = strchr(name, ']');
+    }
+    else
+    {
+        snprintf(name, sizeof(name), "%s", raw_http->host);
+        port = strchr(name, ':');
+    }
+
+    if (port != NULL)
+    {
+        *port = '\0';
+    }
+
+    raw_http->ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (raw_http->ssl_ctx == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_start_tls: Could not create TLS context.\n");
+        goto End;
+    }
+
+    SSL_CTX_set_options(raw_http->ssl_ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_verify(raw_http->ssl_ctx, SSL_VERIFY_PEER, NULL);
+
+    if (ca_cert != NULL || ca_path != NULL)
+    {
+        result = SSL_CTX_load_verify_locations(raw_http->ssl_ctx, ca_cert, ca_path);
+    }
+    else
+    {
+        result = SSL_CTX_set_default_verify_paths(raw_http->ssl_ctx);
+    }
+
+    if (result != 1)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_start_tls: Could not load certificates.\n");
+        goto End;
+    }
+
+    raw_http->ssl = SSL_new(raw_http->ssl_ctx);
+    if (raw_http->ssl == NULL
+        || SSL_set_fd(raw_http->ssl, raw_http->socket) != 1
+        || SSL_set_alpn_protos(raw_http->ssl,
+                               (const unsigned char*)"\x08http/1.1",
+                               9) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_start_tls: Could not create TLS session.\n");
+        goto End;
+    }
+
+    verify_param = SSL_get0_param(raw_http->ssl);
+    if (X509_VERIFY_PARAM_set1_ip_asc(verify_param, name) != 1)
+    {
+        if (X509_VERIFY_PARAM_set1_host(verify_param, name, 0) != 1
+            || SSL_set_tlsext_host_name(raw_http->ssl, name) != 1)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_start_tls: Could not set host name.\n");
+            goto End;
+        }
+    }
+
+    while ((result = SSL_connect(raw_http->ssl)) != 1)
+    {
+        if (vhd_sync_xt_raw_http_retry(raw_http, result, POLLIN) == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_start_tls: Handshake failed : %s\n",
+                                 ERR_reason_error_string(ERR_get_error()));
+            goto End;
+        }
+    }
+
+    //
+    // Even with kTLS some of a body can need OpenSSL to read it.
+    //
+    raw_http->ktls = BIO_get_ktls_recv(SSL_get_rbio(raw_http->ssl));
+    raw_http->copy_buffer = malloc(VHD_SYNC_XT_RAW_HTTP_COPY_SIZE);
+    if (raw_http->copy_buffer == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_start_tls: Could not allocate memory for copy buffer.\n");
+        goto End;
+    }
+
+    status = true;
+
+End:
+    return status;
+}
+
+bool
+vhd_sync_xt_create_raw_http(
+    int socket,
+    const char* url,
+    const char* ca_cert,
+    const char* ca_path,
+    pvhd_sync_xt_raw_http* raw_http
+    )
+/*
+ * This function creates a client for a url over a connected socket. For an
+ * https:// url that includes the TLS handshake.
+ *
+ * Parameters:
+ *
+ *      socket - Supplies the socket, which stays owned by the caller.
+ *
+ *      url - Supplies the url, http:// or https://.
+ *
+ *      ca_cert - Supplies a certificate file for the server, NULL for the
+ *          system ones.
+ *
+ *      ca_path - Supplies a directory of certificates, NULL for the system
+ *          ones.
+ *
+ *      raw_http - Supplies a placeholder to return the client.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_raw_http raw_http_local;
+    const char *host;
+    const char *path;
+    size_t host_length;
+    bool tls;
+
+    status = false;
+    raw_http_local = NULL;
+
+    if (strncasecmp(url, "http://", 7) == 0)
+    {
+        host = url + 7;
+        tls = false;
+    }
+    else if (strncasecmp(url, "https://", 8) == 0)
+    {
+        host = url + 8;
+        tls = true;
+    }
+    else
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_raw_http: Only http:// and https:// urls are supported.\n");
+        goto End;
+    }
+
+    path = strchr(host, '/');
+    if (path == NULL)
+    {
+        path = "/";
+        host_length = strlen(host);
+    }
+    else
+    {
+        host_length = path - host;
+    }
+
+    if (host_length == 0
+        || host_length >= VHD_SYNC_XT_RAW_HTTP_HOST_LENGTH
+        || memchr(host, '@', host_length) != NULL
+        || strlen(path) >= VHD_SYNC_XT_RAW_HTTP_PATH_LENGTH)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_raw_http: Url not supported.\n");
+        goto End;
+    }
+
+    raw_http_local = calloc(1, sizeof(vhd_sync_xt_raw_http));
+    if (raw_http_local == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_raw_http: Could not allocate memory for client.\n");
+        goto End;
+    }
+
+    raw_http_local->socket = socket;
+    raw_http_local->pipe_fds[0] = -1;
+    raw_http_local->pipe_fds[1] = -1;
+    memcpy(raw_http_local->host, host, host_length);
+    raw_http_local->host[host_length] = '\0';
+    strcpy(raw_http_local->path, path);
+
+    if (pipe2(raw_http_local->pipe_fds, O_CLOEXEC) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_raw_http: Could not create pipe : %d\n", errno);
+        goto End;
+    }
+
+    //
+    // A bigger pipe moves more per splice. Without one the default does.
+    //
+    fcntl(raw_http_local->pipe_fds[1], F_SETPIPE_SZ, VHD_SYNC_XT_RAW_HTTP_PIPE_SIZE);
+    raw_http_local->pipe_size = fcntl(raw_http_local->pipe_fds[1], F_GETPIPE_SZ);
+    if ((ssize_t)raw_http_local->pipe_size <= 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_raw_http: Could not get pipe size : %d\n", errno);
+        goto End;
+    }
+
+    if (tls == true
+        && vhd_sync_xt_raw_http_start_tls(raw_http_local, ca_cert, ca_path) == false)
+    {
+        goto End;
+    }
+
+    *raw_http = raw_http_local;
+    raw_http_local = NULL;
+    status = true;
+
+End:
+    vhd_sync_xt_destroy_raw_http(raw_http_local);
+    return status;
+}
+
+void
+vhd_sync_xt_destroy_raw_http(
+    pvhd_sync_xt_raw_http raw_http
+    )
+/*
+ * This function destroys a client. The socket is left open, and no more
+ * use over TLS.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (raw_http == NULL)
+    {
+        return;
+    }
+
+    if (raw_http->pipe_fds[0] >= 0)
+    {
+        close(raw_http->pipe_fds[0]);
+    }
+
+    if (raw_http->pipe_fds[1] >= 0)
+    {
+        close(raw_http->pipe_fds[1]);
+    }
+
+    if (raw_http->ssl != NULL)
+    {
+        SSL_free(raw_http->ssl);
+    }
+
+    if (raw_http->ssl_ctx != NULL)
+    {
+        SSL_CTX_free(raw_http->ssl_ctx);
+    }
+
+    free(raw_http->copy_buffer);
+
+    free(raw_http);
+}
+
+bool
+vhd_sync_xt_raw_http_request(
+    pvhd_sync_xt_raw_http raw_http,
+    const char* path,
+    unsigned long int start_offset,
+    unsigned long int end_offset,
+    const char* header
+    )
+/*
+ * This function sends a request for a range of the file and reads the
+ * headers of the response. The body of the last response has to have been
+ * read in full first.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client.
+ *
+ *      path - Supplies the path to ask for, NULL for the one of the url.
+ *
+ *      start_offset - Supplies the start byte offset.
+ *
+ *      end_offset - Supplies the end byte offset, ULONG_MAX for the rest of
+ *          the file.
+ *
+ *      header - Supplies one more header line to send, NULL for none.
+ *
+ * Return Value:
+ *
+ *      TRUE if a response came back, FALSE otherwise. The headers are left
+ *      in the client, and how much body there is to read.
+ */
+{
+    char request[VHD_SYNC_XT_RAW_HTTP_REQUEST_LENGTH];
+    char range[VHD_SYNC_XT_RAW_HTTP_RANGE_LENGTH];
+    int length;
+
+    if (raw_http->remaining != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_request: Body of the last response not read.\n");
+        return false;
+    }
+
+    if (end_offset == ULONG_MAX)
+    {
+        snprintf(range, sizeof(range), "%lu-", start_offset);
+    }
+    else
+    {
+        snprintf(range, sizeof(range), "%lu-%lu", start_offset, end_offset);
+    }
+
+    length = snprintf(request,
+                      sizeof(request),
+                      "GET %s HTTP/1.1\r\n"
+                      "Host: %s\r\n"
+                      "Range: bytes=%s\r\n"
+                      "Accept: */*\r\n"
+                      "%s%s"
+                      "\r\n",
+                      (path != NULL) ? path : raw_http->path,
+                      raw_http->host,
+                      range,
+                      (header != NULL) ? header : "",
+                      (header != NULL) ? "\r\n" : ""
+                      );
+    if (length < 0 || length >= sizeof(request))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_request: Request too long.\n");
+        return false;
+    }
+
+    if (vhd_sync_xt_raw_http_send(raw_http, request, length) == false
+        || vhd_sync_xt_raw_http_read_headers(raw_http) == false)
+    {
+        return false;
+    }
+
+    //
+    // Only a body with a length can be told apart from the next response.
+    //
+    raw_http->remaining = 0;
+    if (raw_http->headers.status_code != 204
+        && raw_http->headers.status_code != 304)
+    {
+        if (raw_http->headers.has_content_length == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_request: Response without a Content-Length.\n");
+            return false;
+        }
+
+        raw_http->remaining = raw_http->headers.content_length;
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_raw_http_read_body(
+    pvhd_sync_xt_raw_http raw_http,
+    char* data,
+    size_t length
+    )
+/*
+ * This function reads some of the body of the last response into memory,
+ * for bodies too small to be worth splicing.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client.
+ *
+ *      data - Supplies a buffer for the body, NULL to drop it.
+ *
+ *      length - Supplies how much of the body to read.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    size_t used;
+
+    if (length > raw_http->remaining)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_read_body: Read past the end of the body.\n");
+        return false;
+    }
+
+    while (length > 0)
+    {
+        if (raw_http->buffer_length == 0)
+        {
+            raw_http->buffer_start = 0;
+            if (vhd_sync_xt_raw_http_receive(raw_http) == false)
+            {
+                return false;
+            }
+        }
+
+        used = (length < raw_http->buffer_length) ? length : raw_http->buffer_length;
+        if (data != NULL)
+        {
+            memcpy(data, raw_http->buffer + raw_http->buffer_start, used);
+            data += used;
+        }
+
+        raw_http->buffer_start += used;
+        raw_http->buffer_length -= used;
+        raw_http->remaining -= used;
+        length -= used;
+    }
+
+    return true;
+}
+
+static ssize_t
+vhd_sync_xt_raw_http_copy_body(
+    pvhd_sync_xt_raw_http raw_http,
+    pvhd_sync_xt_writer writer,
+    unsigned long int offset,
+    size_t length
+    )
+/*
+ * This function moves some of the body into the file through the copy
+ * buffer, for a TLS session whose records are decrypted in user space. With
+ * kTLS it only takes what one read gets, which lets OpenSSL deal with a
+ * record that is not data, or with data it read before the kernel took
+ * over.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client.
+ *
+ *      writer - Supplies the writer of the file.
+ *
+ *      offset - Supplies where in the file the body goes.
+ *
+ *      length - Supplies how much of the body is left to move.
+ *
+ * Return Value:
+ *
+ *      The number of bytes moved, -1 on an error.
+ */
+{
+    size_t filled;
+    ssize_t result;
+
+    if (length > VHD_SYNC_XT_RAW_HTTP_COPY_SIZE)
+    {
+        length = VHD_SYNC_XT_RAW_HTTP_COPY_SIZE;
+    }
+
+    filled = 0;
+    do
+    {
+        result = vhd_sync_xt_raw_http_recv(raw_http,
+                                           raw_http->copy_buffer + filled,
+                                           length - filled
+                                           );
+        if (result <= 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_copy_body: Body ended early.\n");
+            return -1;
+        }
+
+        filled += result;
+    } while (filled < length && raw_http->ktls == false);
+
+    if (vhd_sync_xt_writer_write(writer, raw_http->copy_buffer, filled, offset) == false)
+    {
+        return -1;
+    }
+
+    return filled;
+}
+
+bool
+vhd_sync_xt_raw_http_splice_body(
+    pvhd_sync_xt_raw_http raw_http,
+    pvhd_sync_xt_writer writer,
+    unsigned long int offset,
+    size_t length
+    )
+/*
+ * This function moves some of the body of the last response into the file
+ * at an offset. What came in with the headers is written from the buffer,
+ * the rest goes from the socket through the pipe into the file. Over TLS
+ * without kTLS it is copied instead.
+ *
+ * Parameters:
+ *
+ *      raw_http - Supplies the client.
+ *
+ *      writer - Supplies the writer of the file.
+ *
+ *      offset - Supplies where in the file the body goes.
+ *
+ *      length - Supplies how much of the body to move.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    size_t used;
+    ssize_t result;
+
+    if (length > raw_http->remaining)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_splice_body: Read past the end of the body.\n");
+        return false;
+    }
+
+    if (raw_http->buffer_length > 0)
+    {
+        used = (length < raw_http->buffer_length) ? length : raw_http->buffer_length;
+        if (vhd_sync_xt_writer_write(writer,
+                                     raw_http->buffer + raw_http->buffer_start,
+                                     used,
+                                     offset) == false)
+        {
+            return false;
+        }
+
+        raw_http->buffer_start += used;
+        raw_http->buffer_length -= used;
+        raw_http->remaining -= used;
+        offset += used;
+        length -= used;
+    }
+
+    while (length > 0)
+    {
+        if (raw_http->ssl != NULL
+            && (raw_http->ktls == false || SSL_pending(raw_http->ssl) > 0))
+        {
+            result = vhd_sync_xt_raw_http_copy_body(raw_http, writer, offset, length);
+            if (result < 0)
+            {
+                return false;
+            }
+
+            raw_http->remaining -= result;
+            offset += result;
+            length -= result;
+            continue;
+        }
+
+        result = splice(raw_http->socket,
+                        NULL,
+                        raw_http->pipe_fds[1],
+                        NULL,
+                        (length < raw_http->pipe_size) ? length : raw_http->pipe_size,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+                        );
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EAGAIN
+                && vhd_sync_xt_raw_http_wait(raw_http, POLLIN) == true)
+            {
+                continue;
+            }
+
+            //
+            // The kernel does not splice records that are not data, such as
+            // a new session ticket. OpenSSL reads past them.
+            //
+            if (errno == EINVAL && raw_http->ktls == true)
+            {
+                result = vhd_sync_xt_raw_http_copy_body(raw_http, writer, offset, length);
+                if (result < 0)
+                {
+                    return false;
+                }
+
+                raw_http->remaining -= result;
+                offset += result;
+                length -= result;
+                continue;
+            }
+
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_splice_body: Could not splice from socket : %d\n", errno);
+            return false;
+        }
+
+        if (result == 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_raw_http_splice_body: Server closed the connection.\n");
+            return false;
+        }
+
+        //
+        // The pipe has to be empty again before the next splice, as what is
+        // in it belongs at this offset.
+        //
+        if (vhd_sync_xt_writer_splice(writer,
+                                      raw_http->pipe_fds[0],
+                                      result,
+                                      offset) == false)
+        {
+            return false;
+        }
+
+        raw_http->remaining -= result;
+        offset += result;
+        length -= result;
+    }
+
+    return true;
+}
@@ -0,0 +1,594 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the functions that maintain the resume map of a
+ * partial download. The map holds one bit per unit (a VHD block) of the
+ * file, set once all of the unit has been written and flushed to disk, so
+ * that an interrupted download can pick up exactly the units it is missing,
+ * however they were ordered.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#include <vhdsyncxt_resumemap.h>
+#include <fcntl.h>
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+static unsigned long int
+vhd_sync_xt_resume_map_unit_end(
+    pvhd_sync_xt_resume_map resume_map,
+    unsigned long int unit
+    )
+/*
+ * This function returns the offset just past the end of a unit. All units
+ * are unit_size long, except the last one which ends at the end of the file.
+ *
+ * Parameters:
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ *      unit - Supplies the index of the unit.
+ *
+ * Return Value:
+ *
+ *      The end offset of the unit, exclusive.
+ */
+{
+    unsigned long int end_offset;
+
+    end_offset = (unit + 1) * resume_map->header.unit_size;
+    if (end_offset > resume_map->header.file_size)
+    {
+        end_offset = resume_map->header.file_size;
+    }
+
+    return end_offset;
+}
+
+static bool
+vhd_sync_xt_resume_map_is_set(
+    pvhd_sync_xt_resume_map resume_map,
+    unsigned long int unit
+    )
+/*
+ * This function returns whether a unit is complete.
+ *
+ * Parameters:
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ *      unit - Supplies the index of the unit.
+ *
+ * Return Value:
+ *
+ *      TRUE if the unit is complete, FALSE otherwise.
+ */
+{
+    return (resume_map->bitmap[unit / 8] & (1 << (unit % 8))) != 0;
+}
+
+bool
+vhd_sync_xt_open_resume_map(
+    char* partial_file_path,
+    unsigned long int file_size,
+    unsigned int unit_size,
+    pvhd_sync_xt_resume_map* resume_map
+    )
+/*
+ * This function opens the resume map of a partial file, creating it if it
+ * does not exist yet. A map that was written for a different file size or
+ * unit size is discarded.
+ *
+ * Parameters:
+ *
+ *      partial_file_path - Supplies the path of the partial file.
+ *
+ *      file_size - Supplies the size of the complete file.
+ *
+ *      unit_size - Supplies the number of bytes each bit stands for.
+ *
+ *      resume_map - Supplies a placeholder to return the resume map.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_resume_map resume_map_local;
+    vhd_sync_xt_resume_map_header disk_header;
+    ssize_t result;
+
+    status = false;
+
+    resume_map_local = calloc(1, sizeof(vhd_sync_xt_resume_map));
+    if (resume_map_local == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_resume_map: Could not allocate memory for resume map.\n");
+        goto End;
+    }
+    resume_map_local->fd = -1;
+
+    memcpy(resume_map_local->header.magic,
+           VHD_SYNC_XT_RESUME_MAP_MAGIC,
+           VHD_SYNC_XT_RESUME_MAP_MAGIC_SIZE
+           );
+    resume_map_local->header.version = VHD_SYNC_XT_RESUME_MAP_VERSION;
+    resume_map_local->header.unit_size = unit_size;
+    resume_map_local->header.file_size = file_size;
+    resume_map_local->header.unit_count = (file_size + unit_size - 1) / unit_size;
+
+    resume_map_local->bitmap_size = (resume_map_local->header.unit_count + 7) / 8;
+    resume_map_local->bitmap = calloc(1, resume_map_local->bitmap_size + 1);
+    if (resume_map_local->bitmap == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_resume_map: Could not allocate memory for bitmap.\n");
+        goto End;
+    }
+
+    //
+    // A path cut short would be of some other file, maybe the partial file
+    // itself, which the map would be written over.
+    //
+    if (snprintf(resume_map_local->path,
+                 VHD_SYNC_XT_PATH_LENGTH,
+                 "%s%s",
+                 partial_file_path,
+                 VHD_SYNC_XT_RESUME_MAP_EXTENSION
+                 ) >= VHD_SYNC_XT_PATH_LENGTH)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_resume_map: Path too long.\n");
+        goto End;
+    }
+
+    resume_map_local->fd = open(resume_map_local->path, O_RDWR | O_CREAT, 0644);
+    if (resume_map_local->fd < 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_resume_map: Could not open %s : %d\n",
+                             resume_map_local->path,
+                             errno);
+        goto End;
+    }
+
+    //
+    // Use what is on disk if it describes the same file.
+    //
+    result = pread(resume_map_local->fd, &disk_header, sizeof(disk_header), 0);
+    if (result > 0)
+    {
+        resume_map_local->existed = true;
+    }
+
+    if (result == sizeof(disk_header)
+        && memcmp(&disk_header,
+                  &resume_map_local->header,
+                  sizeof(disk_header)) == 0)
+    {
+        result = pread(resume_map_local->fd,
+                       resume_map_local->bitmap,
+                       resume_map_local->bitmap_size,
+                       sizeof(disk_header)
+                       );
+        if (result == resume_map_local->bitmap_size)
+        {
+            resume_map_local->loaded = true;
+
+            result = pread(resume_map_local->fd,
+                           &resume_map_local->hash,
+                           sizeof(resume_map_local->hash),
+                           sizeof(disk_header) + resume_map_local->bitmap_size
+                           );
+            if (result == sizeof(resume_map_local->hash)
+                && memcmp(resume_map_local->hash.magic,
+                          VHD_SYNC_XT_RESUME_MAP_HASH_MAGIC,
+                          VHD_SYNC_XT_RESUME_MAP_MAGIC_SIZE) == 0
+                && resume_map_local->hash.offset <= file_size
+                && resume_map_local->hash.state_size
+                   <= VHD_SYNC_XT_RESUME_MAP_HASH_STATE_SIZE)
+            {
+                resume_map_local->has_hash = true;
+            }
+        }
+        else
+        {
+            memset(resume_map_local->bitmap, 0, resume_map_local->bitmap_size);
+        }
+    }
+
+    resume_map_local->last_flush = time(NULL);
+
+    *resume_map = resume_map_local;
+    resume_map_local = NULL;
+    status = true;
+
+End:
+    if (resume_map_local != NULL)
+    {
+        vhd_sync_xt_destroy_resume_map(resume_map_local);
+    }
+
+    return status;
+}
+
+void
+vhd_sync_xt_destroy_resume_map(
+    pvhd_sync_xt_resume_map resume_map
+    )
+/*
+ * This function destroys a resume map. Marks that have not been flushed are
+ * lost.
+ *
+ * Parameters:
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (resume_map == NULL)
+    {
+        return;
+    }
+
+    if (resume_map->fd >= 0)
+    {
+        close(resume_map->fd);
+    }
+
+    if (resume_map->bitmap != NULL)
+    {
+        free(resume_map->bitmap);
+    }
+
+    free(resume_map);
+}
+
+void
+vhd_sync_xt_resume_map_set(
+    pvhd_sync_xt_resume_map resume_map,
+    unsigned long int start_offset,
+    unsigned long int end_offset
+    )
+/*
+ * This function marks the units that lie entirely within a range of the
+ * file as complete. The data of the range must have been written to the
+ * partial file already.
+ *
+ * Parameters:
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ *      start_offset - Supplies the start of the range.
+ *
+ *      end_offset - Supplies the end of the range, exclusive.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    unsigned long int unit;
+    unsigned long int unit_end;
+
+    unit = (start_offset + resume_map->header.unit_size - 1)
+           / resume_map->header.unit_size;
+
+    for (; unit < resume_map->header.unit_count; ++unit)
+    {
+        unit_end = vhd_sync_xt_resume_map_unit_end(resume_map, unit);
+        if (unit_end > end_offset)
+        {
+            break;
+        }
+
+        if (vhd_sync_xt_resume_map_is_set(resume_map, unit) == false)
+        {
+            resume_map->bitmap[unit / 8] |= (1 << (unit % 8));
+            resume_map->pending_bytes += unit_end
+                                         - unit * resume_map->header.unit_size;
+        }
+    }
+}
+
+unsigned long int
+vhd_sync_xt_resume_map_complete_bytes(
+    pvhd_sync_xt_resume_map resume_map
+    )
+/*
+ * This function returns how many bytes of the file are complete.
+ *
+ * Parameters:
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ * Return Value:
+ *
+ *      The number of bytes in complete units.
+ */
+{
+    unsigned long int unit;
+    unsigned long int complete;
+
+    complete = 0;
+    for (unit = 0; unit < resume_map->header.unit_count; ++unit)
+    {
+        if (vhd_sync_xt_resume_map_is_set(resume_map, unit) == true)
+        {
+            complete += vhd_sync_xt_resume_map_unit_end(resume_map, unit)
+                        - unit * resume_map->header.unit_size;
+        }
+    }
+
+    return complete;
+}
+
+bool
+vhd_sync_xt_resume_map_next_missing(
+    pvhd_sync_xt_resume_map resume_map,
+    unsigned long int offset,
+    unsigned long int* start_offset,
+    unsigned long int* end_offset
+    )
+/*
+ * This function finds the first run of missing units at or after an offset.
+ *
+ * Parameters:
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ *      offset - Supplies the offset to search from. The unit containing it
+ *          is included in the search, nothing is found from the end of the
+ *          file on.
+ *
+ *      start_offset - Supplies a placeholder to return the start of the run.
+ *
+ *      end_offset - Supplies a placeholder to return the end of the run,
+ *          exclusive.
+ *
+ * Return Value:
+ *
+ *      TRUE if a missing run was found, FALSE if everything from the offset
+ *      on is complete.
+ */
+{
+    unsigned long int unit;
+    unsigned long int last;
+
+    //
+    // The end of the file falls in the short last unit, if there is one,
+    // which is not after it.
+    //
+    if (offset >= resume_map->header.file_size)
+    {
+        return false;
+    }
+
+    unit = offset / resume_map->header.unit_size;
+
+    while (unit < resume_map->header.unit_count
+           && vhd_sync_xt_resume_map_is_set(resume_map, unit) == true)
+    {
+        ++unit;
+    }
+
+    if (unit >= resume_map->header.unit_count)
+    {
+        return false;
+    }
+
+    last = unit;
+    while (last + 1 < resume_map->header.unit_count
+           && vhd_sync_xt_resume_map_is_set(resume_map, last + 1) == false)
+    {
+        ++last;
+    }
+
+    *start_offset = unit * resume_map->header.unit_size;
+    *end_offset = vhd_sync_xt_resume_map_unit_end(resume_map, last);
+
+    return true;
+}
+
+void
+vhd_sync_xt_resume_map_set_hash(
+    pvhd_sync_xt_resume_map resume_map,
+    unsigned long int offset,
+    void* state,
+    unsigned int state_size
+    )
+/*
+ * This function keeps the state of a hash of the file with the map. It is
+ * written out with the next flush, so the bytes hashed must have been
+ * written to the partial file already.
+ *
+ * Parameters:
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ *      offset - Supplies how many bytes from the start have been hashed.
+ *
+ *      state - Supplies the state of the hash.
+ *
+ *      state_size - Supplies the size of the state, at most
+ *          VHD_SYNC_XT_RESUME_MAP_HASH_STATE_SIZE.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    memcpy(resume_map->hash.magic,
+           VHD_SYNC_XT_RESUME_MAP_HASH_MAGIC,
+           VHD_SYNC_XT_RESUME_MAP_MAGIC_SIZE
+           );
+    resume_map->hash.offset = offset;
+    resume_map->hash.state_size = state_size;
+    memcpy(resume_map->hash.state, state, state_size);
+    resume_map->has_hash = true;
+}
+
+bool
+vhd_sync_xt_resume_map_get_hash(
+    pvhd_sync_xt_resume_map resume_map,
+    unsigned long int* offset,
+    void* state,
+    unsigned int state_size
+    )
+/*
+ * This function returns the hash state kept with the map.
+ *
+ * Parameters:
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ *      offset - Supplies a placeholder to return how many bytes from the
+ *          start have been hashed.
+ *
+ *      state - Supplies a placeholder to return the state of the hash.
+ *
+ *      state_size - Supplies the size of the state expected.
+ *
+ * Return Value:
+ *
+ *      TRUE if the map has a hash state of that size, FALSE otherwise.
+ */
+{
+    if (resume_map->has_hash == false
+        || resume_map->hash.state_size != state_size)
+    {
+        return false;
+    }
+
+    *offset = resume_map->hash.offset;
+    memcpy(state, resume_map->hash.state, state_size);
+
+    return true;
+}
+
+bool
+vhd_sync_xt_flush_resume_map(
+    pvhd_sync_xt_resume_map resume_map,
+    int data_fd,
+    bool force
+    )
+/*
+ * This function writes the resume map out to disk. The partial file is
+ * synced first, so that the map never claims data that could still be lost.
+ * Unless forced, the write is skipped until enough marks have built up or
+ * enough time has passed since the last one.
+ *
+ * Parameters:
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ *      data_fd - Supplies the file descriptor of the partial file.
+ *
+ *      force - Supplies whether to write the map out regardless.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    time_t now;
+
+    status = false;
+    now = time(NULL);
+
+    if (force == false
+        && (resume_map->pending_bytes == 0
+            || (resume_map->pending_bytes < VHD_SYNC_XT_RESUME_MAP_FLUSH_BYTES
+                && now - resume_map->last_flush < VHD_SYNC_XT_RESUME_MAP_FLUSH_SECONDS)))
+    {
+        status = true;
+        goto End;
+    }
+
+    if (data_fd >= 0 && fdatasync(data_fd) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_flush_resume_map: Could not sync partial file : %d\n", errno);
+        goto End;
+    }
+
+    if (pwrite(resume_map->fd,
+               &resume_map->header,
+               sizeof(resume_map->header),
+               0) != sizeof(resume_map->header)
+        || pwrite(resume_map->fd,
+                  resume_map->bitmap,
+                  resume_map->bitmap_size,
+                  sizeof(resume_map->header)) != resume_map->bitmap_size
+        || (resume_map->has_hash == true
+            && pwrite(resume_map->fd,
+                      &resume_map->hash,
+                      sizeof(resume_map->hash),
+                      sizeof(resume_map->header) + resume_map->bitmap_size)
+               != sizeof(resume_map->hash)))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_flush_resume_map: Could not write resume map : %d\n", errno);
+        goto End;
+    }
+
+    if (fdatasync(resume_map->fd) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_flush_resume_map: Could not sync resume map : %d\n", errno);
+        goto End;
+    }
+
+    resume_map->pending_bytes = 0;
+    resume_map->last_flush = now;
+    status = true;
+
+End:
+    return status;
+}
+
+bool
+vhd_sync_xt_remove_resume_map(
+    pvhd_sync_xt_resume_map resume_map
+    )
+/*
+ * This function removes the resume map from disk once the download it
+ * tracks is complete.
+ *
+ * Parameters:
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    if (unlink(resume_map->path) != 0 && errno != ENOENT)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_remove_resume_map: Could not remove %s : %d\n",
+                             resume_map->path,
+                             errno);
+        return false;
+    }
+
+    return true;
+}
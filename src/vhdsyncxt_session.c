@@ -0,0 +1,713 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the functions that keep TLS sessions in a file between
+ * runs. Curl keeps sessions for as long as a process lives, which for us is
+ * one image. The cache hooks the OpenSSL context of each connection curl
+ * makes, offers the session from the file to the first handshake, and
+ * keeps the newest session the server hands out to write back.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#include <vhdsyncxt_session.h>
+
+/* ---------------- Constant/Global Declarations --------------------------- */
+
+//
+// Where the cache hangs off each SSL_CTX, and the callbacks curl had set on
+// it that ours pass on to. Curl sets the same ones on every context.
+//
+static int g_session_cache_index = -1;
+static int (*g_session_cache_new_callback)(SSL*, SSL_SESSION*) = NULL;
+static void (*g_session_cache_info_callback)(const SSL*, int, int) = NULL;
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+static bool
+vhd_sync_xt_read_session_file(
+    const char* path,
+    unsigned char** buffer,
+    size_t* length
+    )
+/*
+ * This function reads the whole of the cache file.
+ *
+ * Parameters:
+ *
+ *      path - Supplies the path of the cache file.
+ *
+ *      buffer - Supplies a placeholder to return the contents, to be freed
+ *          by the caller.
+ *
+ *      length - Supplies a placeholder to return the length of the contents.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if there is no file or it cannot be read.
+ */
+{
+    bool status;
+    struct stat file_stat;
+    ssize_t result;
+    int fd;
+
+    status = false;
+    *buffer = NULL;
+    *length = 0;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        goto End;
+    }
+
+    if (fstat(fd, &file_stat) != 0
+        || file_stat.st_size < sizeof(vhd_sync_xt_session_file_header)
+        || file_stat.st_size > VHD_SYNC_XT_SESSION_CACHE_MAXIMUM_SIZE)
+    {
+        goto End;
+    }
+
+    *buffer = malloc(file_stat.st_size);
+    if (*buffer == NULL)
+    {
+        goto End;
+    }
+
+    while (*length < file_stat.st_size)
+    {
+        result = read(fd, *buffer + *length, file_stat.st_size - *length);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (result <= 0)
+        {
+            goto End;
+        }
+
+        *length += result;
+    }
+
+    if (((pvhd_sync_xt_session_file_header)*buffer)->magic
+        != VHD_SYNC_XT_SESSION_CACHE_MAGIC)
+    {
+        goto End;
+    }
+
+    status = true;
+
+End:
+    if (status == false)
+    {
+        free(*buffer);
+        *buffer = NULL;
+        *length = 0;
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    return status;
+}
+
+static bool
+vhd_sync_xt_next_session_record(
+    unsigned char* buffer,
+    size_t length,
+    size_t* offset,
+    pvhd_sync_xt_session_record record,
+    unsigned char** key,
+    unsigned char** session
+    )
+/*
+ * This function steps to the next record of the cache file, checking that
+ * all of it is there.
+ *
+ * Parameters:
+ *
+ *      buffer - Supplies the contents of the file.
+ *
+ *      length - Supplies the length of the contents.
+ *
+ *      offset - Supplies the offset of the record, and returns the offset
+ *          of the one after it.
+ *
+ *      record - Supplies a placeholder to return the record.
+ *
+ *      key - Supplies a placeholder to return the key of the record.
+ *
+ *      session - Supplies a placeholder to return the session data.
+ *
+ * Return Value:
+ *
+ *      TRUE if there was a whole record, FALSE otherwise.
+ */
+{
+    if (length - *offset < sizeof(*record))
+    {
+        return false;
+    }
+
+    memcpy(record, buffer + *offset, sizeof(*record));
+    if (record->key_length > length - *offset - sizeof(*record)
+        || record->session_length > length - *offset - sizeof(*record)
+                                    - record->key_length)
+    {
+        return false;
+    }
+
+    *key = buffer + *offset + sizeof(*record);
+    *session = *key + record->key_length;
+    *offset += sizeof(*record) + record->key_length + record->session_length;
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_is_session_key(
+    pvhd_sync_xt_session_cache session_cache,
+    pvhd_sync_xt_session_record record,
+    unsigned char* key
+    )
+/*
+ * This function checks whether a record is for our server and CAs.
+ *
+ * Parameters:
+ *
+ *      session_cache - Supplies the session cache.
+ *
+ *      record - Supplies the record.
+ *
+ *      key - Supplies the key of the record.
+ *
+ * Return Value:
+ *
+ *      TRUE if the record is ours, FALSE otherwise.
+ */
+{
+    return record->key_length == strlen(session_cache->key)
+           && memcmp(key, session_cache->key, record->key_length) == 0;
+}
+
+static int
+vhd_sync_xt_session_new_callback(
+    SSL* ssl,
+    SSL_SESSION* session
+    )
+/*
+ * This function is called by OpenSSL each time the server hands us a
+ * session, which for TLS 1.3 is after the handshake.
+ *
+ * Parameters:
+ *
+ *      ssl - Supplies the connection.
+ *
+ *      session - Supplies the new session.
+ *
+ * Return Value:
+ *
+ *      1 if a reference to the session was kept by curl, 0 otherwise.
+ */
+{
+    pvhd_sync_xt_session_cache session_cache;
+
+    session_cache = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl),
+                                        g_session_cache_index
+                                        );
+    if (session_cache != NULL && SSL_SESSION_is_resumable(session) == 1)
+    {
+        if (session_cache->new_session_count == VHD_SYNC_XT_SESSION_CACHE_DEPTH)
+        {
+            SSL_SESSION_free(session_cache->new_sessions[0]);
+            memmove(session_cache->new_sessions,
+                    session_cache->new_sessions + 1,
+                    sizeof(SSL_SESSION*) * (VHD_SYNC_XT_SESSION_CACHE_DEPTH - 1)
+                    );
+            --session_cache->new_session_count;
+        }
+
+        SSL_SESSION_up_ref(session);
+        session_cache->new_sessions[session_cache->new_session_count++] = session;
+    }
+
+    if (g_session_cache_new_callback != NULL)
+    {
+        return g_session_cache_new_callback(ssl, session);
+    }
+
+    return 0;
+}
+
+static void
+vhd_sync_xt_session_info_callback(
+    const SSL* ssl,
+    int where,
+    int value
+    )
+/*
+ * This function is called by OpenSSL as a handshake goes along. When one
+ * starts, curl has set up the connection and given it any session it has
+ * of its own, so a connection still without one gets ours.
+ *
+ * Parameters:
+ *
+ *      ssl - Supplies the connection.
+ *
+ *      where - Supplies where the handshake is at.
+ *
+ *      value - Supplies the value that goes with it.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    pvhd_sync_xt_session_cache session_cache;
+    SSL_CTX *ssl_ctx;
+    int (*new_callback)(SSL*, SSL_SESSION*);
+
+    ssl_ctx = SSL_get_SSL_CTX(ssl);
+    session_cache = SSL_CTX_get_ex_data(ssl_ctx, g_session_cache_index);
+
+    if ((where & SSL_CB_HANDSHAKE_START) && session_cache != NULL)
+    {
+        //
+        // Curl sets its own callback for new sessions, possibly after ours
+        // was attached. Go between it and OpenSSL.
+        //
+        new_callback = SSL_CTX_sess_get_new_cb(ssl_ctx);
+        if (new_callback != vhd_sync_xt_session_new_callback)
+        {
+            g_session_cache_new_callback = new_callback;
+            SSL_CTX_sess_set_new_cb(ssl_ctx, vhd_sync_xt_session_new_callback);
+        }
+
+        if (SSL_get_session(ssl) == NULL && session_cache->session_count > 0)
+        {
+            --session_cache->session_count;
+            SSL_set_session((SSL*)ssl,
+                            session_cache->sessions[session_cache->session_count]
+                            );
+            SSL_SESSION_free(session_cache->sessions[session_cache->session_count]);
+        }
+    }
+
+    if (g_session_cache_info_callback != NULL)
+    {
+        g_session_cache_info_callback(ssl, where, value);
+    }
+}
+
+bool
+vhd_sync_xt_create_session_cache(
+    const char* path,
+    const char* key,
+    long int timeout,
+    pvhd_sync_xt_session_cache* session_cache
+    )
+/*
+ * This function creates a session cache and picks up the sessions kept for
+ * the key that have not expired. A cache file that is missing or unreadable
+ * is as good as empty.
+ *
+ * Parameters:
+ *
+ *      path - Supplies the path of the cache file.
+ *
+ *      key - Supplies the server and CAs the sessions are for.
+ *
+ *      timeout - Supplies the longest a session is kept for, in seconds.
+ *
+ *      session_cache - Supplies a placeholder to return the session cache.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_session_cache session_cache_local;
+    vhd_sync_xt_session_record record;
+    unsigned char *buffer;
+    unsigned char *record_key;
+    unsigned char *session;
+    const unsigned char *session_data;
+    SSL_SESSION *ssl_session;
+    size_t length;
+    size_t offset;
+
+    status = false;
+    buffer = NULL;
+
+    session_cache_local = calloc(1, sizeof(vhd_sync_xt_session_cache));
+    if (session_cache_local == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_session_cache: Could not allocate memory for session cache.\n");
+        goto End;
+    }
+
+    session_cache_local->path = strdup(path);
+    if (session_cache_local->path == NULL
+        || strlen(key) >= sizeof(session_cache_local->key))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_session_cache: Could not set up session cache for %s.\n", key);
+        goto End;
+    }
+
+    strcpy(session_cache_local->key, key);
+    session_cache_local->timeout = timeout;
+
+    if (vhd_sync_xt_read_session_file(path, &buffer, &length) == true)
+    {
+        offset = sizeof(vhd_sync_xt_session_file_header);
+        while (vhd_sync_xt_next_session_record(buffer,
+                                               length,
+                                               &offset,
+                                               &record,
+                                               &record_key,
+                                               &session) == true)
+        {
+            if (vhd_sync_xt_is_session_key(session_cache_local,
+                                           &record,
+                                           record_key) == false
+                || record.expires <= time(NULL))
+            {
+                continue;
+            }
+
+            session_data = session;
+            ssl_session = d2i_SSL_SESSION(NULL,
+                                          &session_data,
+                                          record.session_length
+                                          );
+            if (ssl_session != NULL)
+            {
+                session_cache_local->sessions[session_cache_local->session_count++] = ssl_session;
+                if (session_cache_local->session_count == VHD_SYNC_XT_SESSION_CACHE_DEPTH)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    *session_cache = session_cache_local;
+    session_cache_local = NULL;
+    status = true;
+
+End:
+    free(buffer);
+    vhd_sync_xt_destroy_session_cache(session_cache_local);
+    return status;
+}
+
+void
+vhd_sync_xt_destroy_session_cache(
+    pvhd_sync_xt_session_cache session_cache
+    )
+/*
+ * This function writes out the last sessions the server gave, and frees
+ * the session cache.
+ *
+ * Parameters:
+ *
+ *      session_cache - Supplies the session cache.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (session_cache == NULL)
+    {
+        return;
+    }
+
+    vhd_sync_xt_save_session_cache(session_cache);
+
+    while (session_cache->session_count > 0)
+    {
+        SSL_SESSION_free(session_cache->sessions[--session_cache->session_count]);
+    }
+
+    while (session_cache->new_session_count > 0)
+    {
+        SSL_SESSION_free(session_cache->new_sessions[--session_cache->new_session_count]);
+    }
+
+    free(session_cache->path);
+    free(session_cache);
+}
+
+bool
+vhd_sync_xt_attach_session_cache(
+    pvhd_sync_xt_session_cache session_cache,
+    SSL_CTX* ssl_ctx
+    )
+/*
+ * This function hooks the session cache into the OpenSSL context of a
+ * connection.
+ *
+ * Parameters:
+ *
+ *      session_cache - Supplies the session cache.
+ *
+ *      ssl_ctx - Supplies the OpenSSL context.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    void (*info_callback)(const SSL*, int, int);
+
+    if (g_session_cache_index < 0)
+    {
+        g_session_cache_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+        if (g_session_cache_index < 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_attach_session_cache: Could not get an index.\n");
+            return false;
+        }
+    }
+
+    if (SSL_CTX_set_ex_data(ssl_ctx, g_session_cache_index, session_cache) != 1)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_attach_session_cache: Could not attach session cache.\n");
+        return false;
+    }
+
+    info_callback = SSL_CTX_get_info_callback(ssl_ctx);
+    if (info_callback != vhd_sync_xt_session_info_callback)
+    {
+        g_session_cache_info_callback = info_callback;
+        SSL_CTX_set_info_callback(ssl_ctx, vhd_sync_xt_session_info_callback);
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_save_session_cache(
+    pvhd_sync_xt_session_cache session_cache
+    )
+/*
+ * This function writes the last sessions the server gave into the cache
+ * file, in place of the older ones for the same key. Other processes share
+ * the file, so it is read again, and the new file renamed over it, keeping
+ * whatever they wrote that has not expired.
+ *
+ * Parameters:
+ *
+ *      session_cache - Supplies the session cache.
+ *
+ * Return Value:
+ *
+ *      TRUE on success or if there was nothing to save, FALSE otherwise.
+ */
+{
+    bool status;
+    vhd_sync_xt_session_file_header file_header;
+    vhd_sync_xt_session_record record;
+    char temporary_path[VHD_SYNC_XT_PATH_LENGTH];
+    SSL_SESSION *ssl_session;
+    unsigned char *buffer;
+    unsigned char *output;
+    unsigned char *output_end;
+    unsigned char *record_key;
+    unsigned char *session;
+    size_t length;
+    size_t offset;
+    size_t output_length;
+    int session_length;
+    int64_t expires;
+    ssize_t result;
+    int fd;
+    int i;
+
+    status = false;
+    buffer = NULL;
+    output = NULL;
+    fd = -1;
+    temporary_path[0] = '\0';
+
+    if (session_cache->new_session_count == 0)
+    {
+        status = true;
+        goto End;
+    }
+
+    output = malloc(VHD_SYNC_XT_SESSION_CACHE_MAXIMUM_SIZE);
+    if (output == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_save_session_cache: Could not allocate memory.\n");
+        goto End;
+    }
+
+    //
+    // Our sessions go first, then the others that are still good.
+    //
+    file_header.magic = VHD_SYNC_XT_SESSION_CACHE_MAGIC;
+    file_header.record_count = 0;
+    output_length = sizeof(file_header);
+
+    for (i = 0; i < session_cache->new_session_count; ++i)
+    {
+        ssl_session = session_cache->new_sessions[i];
+
+        session_length = i2d_SSL_SESSION(ssl_session, NULL);
+        if (session_length <= 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_save_session_cache: Could not encode session.\n");
+            continue;
+        }
+
+        expires = SSL_SESSION_get_time(ssl_session)
+                  + SSL_SESSION_get_timeout(ssl_session);
+        if (expires > time(NULL) + session_cache->timeout)
+        {
+            expires = time(NULL) + session_cache->timeout;
+        }
+
+        record.key_length = strlen(session_cache->key);
+        record.session_length = session_length;
+        record.expires = expires;
+        if (output_length + sizeof(record) + record.key_length + session_length
+            > VHD_SYNC_XT_SESSION_CACHE_MAXIMUM_SIZE)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_save_session_cache: Session too big to keep.\n");
+            continue;
+        }
+
+        memcpy(output + output_length, &record, sizeof(record));
+        output_length += sizeof(record);
+        memcpy(output + output_length, session_cache->key, record.key_length);
+        output_length += record.key_length;
+        output_end = output + output_length;
+        i2d_SSL_SESSION(ssl_session, &output_end);
+        output_length += session_length;
+        ++file_header.record_count;
+    }
+
+    if (vhd_sync_xt_read_session_file(session_cache->path, &buffer, &length) == true)
+    {
+        offset = sizeof(vhd_sync_xt_session_file_header);
+        while (vhd_sync_xt_next_session_record(buffer,
+                                               length,
+                                               &offset,
+                                               &record,
+                                               &record_key,
+                                               &session) == true)
+        {
+            if (vhd_sync_xt_is_session_key(session_cache,
+                                           &record,
+                                           record_key) == true
+                || record.expires <= time(NULL)
+                || output_length + sizeof(record) + record.key_length
+                   + record.session_length > VHD_SYNC_XT_SESSION_CACHE_MAXIMUM_SIZE)
+            {
+                continue;
+            }
+
+            memcpy(output + output_length,
+                   record_key - sizeof(record),
+                   sizeof(record) + record.key_length + record.session_length
+                   );
+            output_length += sizeof(record) + record.key_length + record.session_length;
+            ++file_header.record_count;
+        }
+    }
+
+    memcpy(output, &file_header, sizeof(file_header));
+
+    //
+    // Sessions are secrets, keep them to ourselves.
+    //
+    if (snprintf(temporary_path,
+                 sizeof(temporary_path),
+                 "%s.XXXXXX",
+                 session_cache->path) >= sizeof(temporary_path))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_save_session_cache: Path too long.\n");
+        temporary_path[0] = '\0';
+        goto End;
+    }
+
+    fd = mkstemp(temporary_path);
+    if (fd < 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_save_session_cache: Could not create %s : %d\n",
+                             temporary_path, errno);
+        temporary_path[0] = '\0';
+        goto End;
+    }
+
+    for (offset = 0; offset < output_length; offset += result)
+    {
+        result = write(fd, output + offset, output_length - offset);
+        if (result < 0 && errno == EINTR)
+        {
+            result = 0;
+            continue;
+        }
+
+        if (result <= 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_save_session_cache: Could not write %s : %d\n",
+                                 temporary_path, errno);
+            goto End;
+        }
+    }
+
+    if (rename(temporary_path, session_cache->path) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_save_session_cache: Could not replace %s : %d\n",
+                             session_cache->path, errno);
+        goto End;
+    }
+
+    temporary_path[0] = '\0';
+    while (session_cache->new_session_count > 0)
+    {
+        SSL_SESSION_free(session_cache->new_sessions[--session_cache->new_session_count]);
+    }
+    status = true;
+
+End:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    if (temporary_path[0] != '\0')
+    {
+        unlink(temporary_path);
+    }
+
+    free(output);
+    free(buffer);
+    return status;
+}
@@ -0,0 +1,1981 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the transports, the backends a download fetches the
+ * image through. They are:
+ *
+ *      curl - Any url curl takes, one transfer per read with all its
+ *             ranges in it.
+ *
+ *      raw  - The minimal HTTP/1.1 client over a connected socket, one
+ *             request per range, with the body spliced into the file.
+ *
+ *      file - A local file or block device, file:// urls. Reads are copied
+ *             within the kernel where the filesystems allow it.
+ *
+ *      mock - A file held in memory, for tests.
+ *
+ * The file and mock backends answer as a server would, with validators made
+ * up from the file, so that a download does the same against all of them.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#define _GNU_SOURCE
+
+#include <vhdsyncxt_transport.h>
+#include <vhdsyncxt_mirror.h>
+#include <vhdsyncxt_validators.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+static bool
+vhd_sync_xt_transport_condition_holds(
+    pvhd_sync_xt_transport transport,
+    const char* condition,
+    bool if_range
+    )
+/*
+ * This function checks a condition against the validators of a file the
+ * transport made up itself, by building the header a download would send
+ * for the file as it is now.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      condition - Supplies the conditional header.
+ *
+ *      if_range - Supplies whether it is an If-Range.
+ *
+ * Return Value:
+ *
+ *      TRUE if the condition is for the file as it is, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_validators validators;
+    char header[VHD_SYNC_XT_VALIDATORS_HEADER_LENGTH];
+
+    if (vhd_sync_xt_validators_from_headers(&transport->headers,
+                                            transport->file_size,
+                                            &validators) == false
+        || vhd_sync_xt_validators_condition(&validators,
+                                            if_range,
+                                            header,
+                                            sizeof(header)) == false)
+    {
+        return false;
+    }
+
+    return strcmp(condition, header) == 0;
+}
+
+static void
+vhd_sync_xt_transport_local_headers(
+    pvhd_sync_xt_transport transport,
+    const char* condition,
+    pvhd_sync_xt_http_headers headers
+    )
+/*
+ * This function answers a stat for the local backends, as a server would a
+ * request for the whole file.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      condition - Supplies a header that gets a 304 if it holds, NULL for
+ *          none.
+ *
+ *      headers - Supplies a placeholder for the headers.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    *headers = transport->headers;
+    headers->complete = true;
+
+    if (condition != NULL
+        && vhd_sync_xt_transport_condition_holds(transport, condition, false) == true)
+    {
+        headers->status_code = 304;
+        headers->has_content_length = false;
+        return;
+    }
+
+    headers->status_code = 200;
+    headers->has_content_length = true;
+    headers->content_length = transport->file_size;
+    headers->accept_ranges = true;
+}
+
+static bool
+vhd_sync_xt_transport_check_ranges(
+    unsigned long int* start_offsets,
+    unsigned long int* end_offsets,
+    int count,
+    unsigned long int file_size
+    )
+/*
+ * This function checks that the ranges of a read from a local file are in
+ * it.
+ *
+ * Parameters:
+ *
+ *      start_offsets - Supplies the first byte of each range.
+ *
+ *      end_offsets - Supplies the last byte of each range.
+ *
+ *      count - Supplies the number of ranges.
+ *
+ *      file_size - Supplies the size of the file.
+ *
+ * Return Value:
+ *
+ *      TRUE if they are, FALSE otherwise.
+ */
+{
+    int i;
+
+    for (i = 0; i < count; ++i)
+    {
+        if (end_offsets[i] >= file_size)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_check_ranges: Range %lu-%lu is past the end of the file.\n",
+                                 start_offsets[i],
+                                 end_offsets[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_transport_clip(
+    void* user_data,
+    unsigned long int offset,
+    const char* data,
+    size_t length
+    )
+/*
+ * This function passes on the data of a body to the sink of the read, only
+ * what is in the ranges asked for. A server may send more than that, the
+ * whole file or ranges merged.
+ *
+ * Parameters:
+ *
+ *      user_data - Set to point to the transport.
+ *
+ *      offset - Supplies where in the file the data goes.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the sink stopped the read.
+ */
+{
+    pvhd_sync_xt_transport transport;
+    unsigned long int start;
+    unsigned long int end;
+    int i;
+
+    transport = (pvhd_sync_xt_transport)user_data;
+
+    for (i = 0; i < transport->count; ++i)
+    {
+        start = transport->start_offsets[i];
+        end = transport->end_offsets[i] + 1;
+        if (start < offset)
+        {
+            start = offset;
+        }
+        if (end > offset + length)
+        {
+            end = offset + length;
+        }
+
+        if (start < end
+            && transport->sink->data(transport->sink->user_data,
+                                     start,
+                                     data + (start - offset),
+                                     end - start) == false)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_transport_read_fd(
+    pvhd_sync_xt_transport transport,
+    int fd,
+    bool copy_range,
+    unsigned long int start_offset,
+    unsigned long int end_offset,
+    pvhd_sync_xt_transport_sink sink
+    )
+/*
+ * This function reads a range of a local file into a sink, copying it in
+ * the kernel when the sink has a writer and the file can be copied from,
+ * and through the buffer otherwise.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      fd - Supplies the file.
+ *
+ *      copy_range - Supplies whether to try copying in the kernel.
+ *
+ *      start_offset - Supplies the first byte of the range.
+ *
+ *      end_offset - Supplies the last byte of the range.
+ *
+ *      sink - Supplies where the data goes.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    unsigned long int offset;
+    size_t length;
+    ssize_t result;
+
+    copy_range = copy_range && sink->writer != NULL && sink->written != NULL;
+
+    for (offset = start_offset; offset <= end_offset; offset += length)
+    {
+        if (copy_range == true)
+        {
+            length = end_offset + 1 - offset;
+            if (length > VHD_SYNC_XT_TRANSPORT_PIECE_SIZE)
+            {
+                length = VHD_SYNC_XT_TRANSPORT_PIECE_SIZE;
+            }
+
+            if (vhd_sync_xt_writer_copy_range(sink->writer,
+                                              fd,
+                                              offset,
+                                              length,
+                                              offset) == true)
+            {
+                if (sink->written(sink->user_data, offset, length) == false)
+                {
+                    return false;
+                }
+                continue;
+            }
+
+            //
+            // Not between these two filesystems, the rest goes through
+            // memory.
+            //
+            copy_range = false;
+            transport->copy_range = false;
+        }
+
+        length = end_offset + 1 - offset;
+        if (length > VHD_SYNC_XT_TRANSPORT_BUFFER_SIZE)
+        {
+            length = VHD_SYNC_XT_TRANSPORT_BUFFER_SIZE;
+        }
+
+        result = pread(fd, transport->buffer, length, offset);
+        if (result <= 0)
+        {
+            if (result < 0 && errno == EINTR)
+            {
+                length = 0;
+                continue;
+            }
+
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_read_fd: Could not read at %lu : %d\n",
+                                 offset,
+                                 (result < 0) ? errno : 0);
+            return false;
+        }
+        length = result;
+
+        if (sink->data(sink->user_data, offset, transport->buffer, length) == false)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_transport_open_file(
+    pvhd_sync_xt_transport transport,
+    pvhd_sync_xt_transport_options options
+    )
+/*
+ * This function sets up the file backend, opening the file or block device
+ * of a file:// url. A regular file gets validators made up from its inode,
+ * size and time of change, a block device has none.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      options - Supplies how to get to the server, not used.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    const char *path;
+    struct stat stat_buffer;
+    unsigned long long int size;
+    struct tm modified;
+
+    path = transport->url + strlen("file://");
+    if (strncmp(path, "localhost/", strlen("localhost/")) == 0)
+    {
+        path += strlen("localhost");
+    }
+
+    if (*path != '/')
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_open_file: Only local files are supported : %.*s\n",
+                             MAX_ERROR_NAME_SIZE,
+                             transport->url);
+        return false;
+    }
+
+    transport->fd = open(path, O_RDONLY);
+    if (transport->fd < 0 || fstat(transport->fd, &stat_buffer) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_open_file: Could not open %.*s : %d\n",
+                             MAX_ERROR_NAME_SIZE,
+                             path,
+                             errno);
+        return false;
+    }
+
+    vhd_sync_xt_reset_http_headers(&transport->headers);
+
+    if (S_ISBLK(stat_buffer.st_mode))
+    {
+        if (ioctl(transport->fd, BLKGETSIZE64, &size) != 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_open_file: Could not get size of %.*s : %d\n",
+                                 MAX_ERROR_NAME_SIZE,
+                                 path,
+                                 errno);
+            return false;
+        }
+
+        transport->file_size = size;
+        return true;
+    }
+
+    if (S_ISREG(stat_buffer.st_mode) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_open_file: %.*s is not a file.\n",
+                             MAX_ERROR_NAME_SIZE,
+                             path);
+        return false;
+    }
+
+    transport->file_size = stat_buffer.st_size;
+    transport->copy_range = true;
+
+    snprintf(transport->headers.etag,
+             VHD_SYNC_XT_HEADER_VALUE_LENGTH,
+             "\"%lx-%lx-%lx.%09lx\"",
+             (unsigned long int)stat_buffer.st_ino,
+             (unsigned long int)stat_buffer.st_size,
+             (unsigned long int)stat_buffer.st_mtim.tv_sec,
+             (unsigned long int)stat_buffer.st_mtim.tv_nsec
+             );
+    if (gmtime_r(&stat_buffer.st_mtim.tv_sec, &modified) != NULL)
+    {
+        strftime(transport->headers.last_modified,
+                 VHD_SYNC_XT_HEADER_VALUE_LENGTH,
+                 "%a, %d %b %Y %H:%M:%S GMT",
+                 &modified
+                 );
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_transport_stat_local(
+    pvhd_sync_xt_transport transport,
+    const char* condition,
+    pvhd_sync_xt_http_headers headers
+    )
+/*
+ * This function tells the size and validators of a local file, or of a
+ * file held in memory.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      condition - Supplies a header that gets a 304 if it holds, NULL for
+ *          none.
+ *
+ *      headers - Supplies a placeholder for the headers.
+ *
+ * Return Value:
+ *
+ *      TRUE, the file is known from when it was opened.
+ */
+{
+    vhd_sync_xt_transport_local_headers(transport, condition, headers);
+    return true;
+}
+
+static bool
+vhd_sync_xt_transport_read_file(
+    pvhd_sync_xt_transport transport,
+    const char* suffix,
+    unsigned long int* start_offsets,
+    unsigned long int* end_offsets,
+    int count,
+    const char* condition,
+    pvhd_sync_xt_transport_sink sink
+    )
+/*
+ * This function reads ranges of a local file, or of the file next to it.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      suffix - Supplies what to add to the path for the file next to it,
+ *          NULL for the file itself.
+ *
+ *      start_offsets - Supplies the first byte of each range.
+ *
+ *      end_offsets - Supplies the last byte of each range.
+ *
+ *      count - Supplies the number of ranges.
+ *
+ *      condition - Supplies an If-Range the file has to meet, NULL for none.
+ *
+ *      sink - Supplies where the data goes.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    int fd;
+    struct stat stat_buffer;
+    char path[VHD_SYNC_XT_TRANSPORT_URL_LENGTH];
+    int i;
+
+    status = false;
+    fd = transport->fd;
+    ++transport->requests;
+
+    if (suffix != NULL)
+    {
+        snprintf(path,
+                 sizeof(path),
+                 "%s%s",
+                 transport->url + strlen("file://"),
+                 suffix
+                 );
+        if (strncmp(path, "localhost/", strlen("localhost/")) == 0)
+        {
+            memmove(path,
+                    path + strlen("localhost"),
+                    strlen(path) + 1 - strlen("localhost")
+                    );
+        }
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &stat_buffer) != 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_read_file: Could not open %.*s : %d\n",
+                                 MAX_ERROR_NAME_SIZE,
+                                 path,
+                                 errno);
+            goto End;
+        }
+
+        if (vhd_sync_xt_transport_check_ranges(start_offsets,
+                                               end_offsets,
+                                               count,
+                                               stat_buffer.st_size) == false)
+        {
+            goto End;
+        }
+    }
+    else
+    {
+        if (condition != NULL
+            && vhd_sync_xt_transport_condition_holds(transport,
+                                                     condition,
+                                                     true) == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_read_file: File changed.\n");
+            goto End;
+        }
+
+        if (vhd_sync_xt_transport_check_ranges(start_offsets,
+                                               end_offsets,
+                                               count,
+                                               transport->file_size) == false)
+        {
+            goto End;
+        }
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        status = vhd_sync_xt_transport_read_fd(transport,
+                                               fd,
+                                               suffix == NULL && transport->copy_range,
+                                               start_offsets[i],
+                                               end_offsets[i],
+                                               sink
+                                               );
+        if (status == false)
+        {
+            goto End;
+        }
+    }
+
+    status = true;
+
+End:
+    if (fd >= 0 && fd != transport->fd)
+    {
+        close(fd);
+    }
+
+    return status;
+}
+
+static void
+vhd_sync_xt_transport_close_file(
+    pvhd_sync_xt_transport transport
+    )
+/*
+ * This function tears down the file backend.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (transport->fd >= 0)
+    {
+        close(transport->fd);
+        transport->fd = -1;
+    }
+}
+
+static bool
+vhd_sync_xt_transport_open_mock(
+    pvhd_sync_xt_transport transport,
+    pvhd_sync_xt_transport_options options
+    )
+/*
+ * This function sets up the mock backend, whose file was given when the
+ * transport was created.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      options - Supplies how to get to the server, not used.
+ *
+ * Return Value:
+ *
+ *      TRUE if there is a file, FALSE otherwise.
+ */
+{
+    return transport->mock_data != NULL;
+}
+
+static bool
+vhd_sync_xt_transport_read_mock(
+    pvhd_sync_xt_transport transport,
+    const char* suffix,
+    unsigned long int* start_offsets,
+    unsigned long int* end_offsets,
+    int count,
+    const char* condition,
+    pvhd_sync_xt_transport_sink sink
+    )
+/*
+ * This function reads ranges of the file held in memory. There is nothing
+ * next to it.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      suffix - Supplies what to add to the name for the file next to it,
+ *          which has to be NULL.
+ *
+ *      start_offsets - Supplies the first byte of each range.
+ *
+ *      end_offsets - Supplies the last byte of each range.
+ *
+ *      count - Supplies the number of ranges.
+ *
+ *      condition - Supplies an If-Range the file has to meet, NULL for none.
+ *
+ *      sink - Supplies where the data goes.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    int i;
+
+    ++transport->requests;
+
+    if (suffix != NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_read_mock: No file %.*s.\n",
+                             MAX_ERROR_NAME_SIZE,
+                             suffix);
+        return false;
+    }
+
+    if (condition != NULL
+        && vhd_sync_xt_transport_condition_holds(transport,
+                                                 condition,
+                                                 true) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_read_mock: File changed.\n");
+        return false;
+    }
+
+    if (vhd_sync_xt_transport_check_ranges(start_offsets,
+                                           end_offsets,
+                                           count,
+                                           transport->mock_size) == false)
+    {
+        return false;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        if (sink->data(sink->user_data,
+                       start_offsets[i],
+                       transport->mock_data + start_offsets[i],
+                       end_offsets[i] + 1 - start_offsets[i]) == false)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+vhd_sync_xt_transport_close_mock(
+    pvhd_sync_xt_transport transport
+    )
+/*
+ * This function tears down the mock backend. The file belongs to the
+ * caller.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    transport->mock_data = NULL;
+}
+
+static bool
+vhd_sync_xt_transport_open_raw(
+    pvhd_sync_xt_transport transport,
+    pvhd_sync_xt_transport_options options
+    )
+/*
+ * This function sets up the raw backend, the client over the connected
+ * socket.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      options - Supplies the socket and the certificates for the server.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    if (options->credentials != NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_open_raw: Credentials are not supported.\n");
+        return false;
+    }
+
+    return vhd_sync_xt_create_raw_http(options->connection_socket,
+                                       transport->url,
+                                       options->ca_cert,
+                                       options->ca_path,
+                                       &transport->raw_http
+                                       );
+}
+
+static bool
+vhd_sync_xt_transport_stat_raw(
+    pvhd_sync_xt_transport transport,
+    const char* condition,
+    pvhd_sync_xt_http_headers headers
+    )
+/*
+ * This function asks the server for the first byte of the file, which
+ * tells its size and validators. A server that ignores ranges sends the
+ * whole file, which is kept for the first read rather than asked for
+ * again.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      condition - Supplies a header that gets a 304 if it holds, NULL for
+ *          none.
+ *
+ *      headers - Supplies a placeholder for the headers.
+ *
+ * Return Value:
+ *
+ *      TRUE if the server responded, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_raw_http raw_http;
+
+    raw_http = transport->raw_http;
+    ++transport->requests;
+
+    if (vhd_sync_xt_raw_http_request(raw_http, NULL, 0, 0, condition) == false)
+    {
+        return false;
+    }
+
+    *headers = raw_http->headers;
+
+    if (headers->status_code == 200)
+    {
+        transport->body_pending = true;
+        return true;
+    }
+
+    return vhd_sync_xt_raw_http_read_body(raw_http, NULL, raw_http->remaining);
+}
+
+static bool
+vhd_sync_xt_transport_deliver_raw(
+    pvhd_sync_xt_transport transport,
+    unsigned long int offset,
+    unsigned long int length,
+    pvhd_sync_xt_transport_sink sink
+    )
+/*
+ * This function passes on the next part of the body of the response to a
+ * sink, spliced into its writer if it has one, in pieces.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      offset - Supplies where in the file the part goes.
+ *
+ *      length - Supplies the length of the part.
+ *
+ *      sink - Supplies where the data goes.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_raw_http raw_http;
+    unsigned long int piece;
+
+    raw_http = transport->raw_http;
+
+    for (; length > 0; offset += piece, length -= piece)
+    {
+        if (sink->writer != NULL && sink->written != NULL)
+        {
+            piece = (length > VHD_SYNC_XT_TRANSPORT_PIECE_SIZE)
+                    ? VHD_SYNC_XT_TRANSPORT_PIECE_SIZE : length;
+
+            if (vhd_sync_xt_raw_http_splice_body(raw_http,
+                                                 sink->writer,
+                                                 offset,
+                                                 piece) == false)
+            {
+                VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_deliver_raw: Could not splice %lu-%lu.\n",
+                                     offset,
+                                     offset + piece - 1);
+                return false;
+            }
+
+            if (sink->written(sink->user_data, offset, piece) == false)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            piece = (length > VHD_SYNC_XT_TRANSPORT_BUFFER_SIZE)
+                    ? VHD_SYNC_XT_TRANSPORT_BUFFER_SIZE : length;
+
+            if (vhd_sync_xt_raw_http_read_body(raw_http,
+                                               transport->buffer,
+                                               piece) == false
+                || sink->data(sink->user_data,
+                              offset,
+                              transport->buffer,
+                              piece) == false)
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_transport_deliver_whole_raw(
+    pvhd_sync_xt_transport transport,
+    unsigned long int* start_offsets,
+    unsigned long int* end_offsets,
+    int count,
+    pvhd_sync_xt_transport_sink sink
+    )
+/*
+ * This function takes the ranges asked for out of a body that is the whole
+ * file, skipping what is between them. The ranges are in order.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      start_offsets - Supplies the first byte of each range.
+ *
+ *      end_offsets - Supplies the last byte of each range.
+ *
+ *      count - Supplies the number of ranges.
+ *
+ *      sink - Supplies where the data goes.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_raw_http raw_http;
+    unsigned long int offset;
+    int i;
+
+    raw_http = transport->raw_http;
+    offset = 0;
+
+    for (i = 0; i < count; ++i)
+    {
+        if (start_offsets[i] < offset
+            || end_offsets[i] - offset >= raw_http->remaining)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_deliver_whole_raw: Range %lu-%lu not in the body.\n",
+                                 start_offsets[i],
+                                 end_offsets[i]);
+            return false;
+        }
+
+        if (vhd_sync_xt_raw_http_read_body(raw_http,
+                                           NULL,
+                                           start_offsets[i] - offset) == false
+            || vhd_sync_xt_transport_deliver_raw(transport,
+                                                 start_offsets[i],
+                                                 end_offsets[i] + 1 - start_offsets[i],
+                                                 sink) == false)
+        {
+            return false;
+        }
+
+        offset = end_offsets[i] + 1;
+    }
+
+    return vhd_sync_xt_raw_http_read_body(raw_http, NULL, raw_http->remaining);
+}
+
+static bool
+vhd_sync_xt_transport_read_raw(
+    pvhd_sync_xt_transport transport,
+    const char* suffix,
+    unsigned long int* start_offsets,
+    unsigned long int* end_offsets,
+    int count,
+    const char* condition,
+    pvhd_sync_xt_transport_sink sink
+    )
+/*
+ * This function reads ranges from the server over the connected socket,
+ * one request for each. Only a response with the range asked for of the
+ * file stat found is taken, or the whole file where there is no condition
+ * it could have failed.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      suffix - Supplies what to add to the url for the file next to it,
+ *          NULL for the file itself.
+ *
+ *      start_offsets - Supplies the first byte of each range.
+ *
+ *      end_offsets - Supplies the last byte of each range.
+ *
+ *      count - Supplies the number of ranges.
+ *
+ *      condition - Supplies an If-Range the file has to meet, NULL for none.
+ *
+ *      sink - Supplies where the data goes.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_raw_http raw_http;
+    pvhd_sync_xt_http_headers headers;
+    char path[VHD_SYNC_XT_RAW_HTTP_PATH_LENGTH];
+    int i;
+
+    raw_http = transport->raw_http;
+    headers = &raw_http->headers;
+
+    if (suffix != NULL
+        && snprintf(path,
+                    sizeof(path),
+                    "%s%s",
+                    raw_http->path,
+                    suffix) >= sizeof(path))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_read_raw: Url too long.\n");
+        return false;
+    }
+
+    //
+    // The whole file that came back to the stat.
+    //
+    if (suffix == NULL && transport->body_pending == true)
+    {
+        transport->body_pending = false;
+        return vhd_sync_xt_transport_deliver_whole_raw(transport,
+                                                       start_offsets,
+                                                       end_offsets,
+                                                       count,
+                                                       sink
+                                                       );
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        ++transport->requests;
+        if (vhd_sync_xt_raw_http_request(raw_http,
+                                         (suffix != NULL) ? path : NULL,
+                                         start_offsets[i],
+                                         end_offsets[i],
+                                         condition) == false)
+        {
+            return false;
+        }
+
+        if (headers->status_code == 200 && condition == NULL)
+        {
+            return vhd_sync_xt_transport_deliver_whole_raw(transport,
+                                                           start_offsets + i,
+                                                           end_offsets + i,
+                                                           count - i,
+                                                           sink
+                                                           );
+        }
+
+        if (headers->status_code != 206
+            || headers->range_start != start_offsets[i]
+            || headers->range_end != end_offsets[i]
+            || (suffix == NULL
+                && vhd_sync_xt_mirror_consistent(&transport->headers,
+                                                 transport->file_size,
+                                                 headers) == false))
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_read_raw: Range %lu-%lu refused or file changed. Response : %ld\n",
+                                 start_offsets[i],
+                                 end_offsets[i],
+                                 headers->status_code);
+            return false;
+        }
+
+        if (vhd_sync_xt_transport_deliver_raw(transport,
+                                              start_offsets[i],
+                                              end_offsets[i] + 1 - start_offsets[i],
+                                              sink) == false)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+vhd_sync_xt_transport_close_raw(
+    pvhd_sync_xt_transport transport
+    )
+/*
+ * This function tears down the raw backend. The socket belongs to the
+ * caller.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    vhd_sync_xt_destroy_raw_http(transport->raw_http);
+    transport->raw_http = NULL;
+}
+
+static size_t
+vhd_sync_xt_transport_header_callback(
+    void *data_stream,
+    size_t size,
+    size_t nmemb,
+    void *user_data
+    )
+/*
+ * This function is the callback set to receive the headers of a response
+ * to a curl transport, one line at a time.
+ *
+ * Parameters:
+ *
+ *      data_stream - Supplies a line of header data.
+ *
+ *      size - Supplies the size of the data unit in the stream.
+ *
+ *      nmemb - Supplies the number of members of the data.
+ *
+ *      user_data - Set to point to the transport.
+ *
+ * Return Value:
+ *
+ *      Returns the size of data recieved.
+ */
+{
+    pvhd_sync_xt_transport transport;
+
+    transport = (pvhd_sync_xt_transport)user_data;
+
+    vhd_sync_xt_parse_http_header(&transport->response,
+                                  (char*)data_stream,
+                                  size * nmemb
+                                  );
+
+    return size * nmemb;
+}
+
+static size_t
+vhd_sync_xt_transport_stat_write_callback(
+    void *data_stream,
+    size_t size,
+    size_t nmemb,
+    void *user_data
+    )
+/*
+ * This function is the callback set to receive the body of the response
+ * to a stat. The byte asked for is dropped, and a whole file stops the
+ * transfer.
+ *
+ * Parameters:
+ *
+ *      data_stream - Supplies the data received.
+ *
+ *      size - Supplies the size of the data unit in the stream.
+ *
+ *      nmemb - Supplies the number of members of the data.
+ *
+ *      user_data - Set to point to the transport.
+ *
+ * Return Value:
+ *
+ *      Returns the size of data handled, anything else aborts the transfer.
+ */
+{
+    pvhd_sync_xt_transport transport;
+
+    transport = (pvhd_sync_xt_transport)user_data;
+
+    if (transport->response.status_code != 206)
+    {
+        return 0;
+    }
+
+    return size * nmemb;
+}
+
+static bool
+vhd_sync_xt_transport_check_curl_response(
+    pvhd_sync_xt_transport transport,
+    long response_code
+    )
+/*
+ * This function checks the response to a read once its body starts, and
+ * gets the parser ready for it. A single range or multipart body has to be
+ * of the file stat found, and a whole file is only taken where there is no
+ * condition it could have failed.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      response_code - Supplies the status of the response.
+ *
+ * Return Value:
+ *
+ *      TRUE if the body can be used, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_http_headers response;
+
+    response = &transport->response;
+
+    vhd_sync_xt_reset_multipart(&transport->multipart,
+                                response->boundary,
+                                vhd_sync_xt_transport_clip,
+                                transport
+                                );
+
+    if (response_code == 200 && transport->conditional == false)
+    {
+        if (response->has_content_length == false
+            || response->content_length == 0)
+        {
+            return false;
+        }
+
+        response->has_range = true;
+        response->range_start = 0;
+        response->range_end = response->content_length - 1;
+        return vhd_sync_xt_expect_single_part(&transport->multipart, response);
+    }
+
+    if (response_code != 206)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_curl_response: Ranges refused or file changed. Response : %ld\n",
+                             response_code);
+        return false;
+    }
+
+    if (transport->suffixed == false)
+    {
+        if (response->multipart == true)
+        {
+            response->has_total_size = true;
+            response->total_size = transport->file_size;
+        }
+
+        if (vhd_sync_xt_mirror_consistent(&transport->headers,
+                                          transport->file_size,
+                                          response) == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_check_curl_response: File changed.\n");
+            return false;
+        }
+    }
+
+    if (response->multipart == true)
+    {
+        return true;
+    }
+
+    return vhd_sync_xt_expect_single_part(&transport->multipart, response);
+}
+
+static size_t
+vhd_sync_xt_transport_read_write_callback(
+    void *data_stream,
+    size_t size,
+    size_t nmemb,
+    void *user_data
+    )
+/*
+ * This function is the callback set to receive the body of a read through
+ * curl. The body is parsed as it comes and the ranges passed on.
+ *
+ * Parameters:
+ *
+ *      data_stream - Supplies the data received.
+ *
+ *      size - Supplies the size of the data unit in the stream.
+ *
+ *      nmemb - Supplies the number of members of the data.
+ *
+ *      user_data - Set to point to the transport.
+ *
+ * Return Value:
+ *
+ *      Returns the size of data handled, anything else aborts the transfer.
+ */
+{
+    pvhd_sync_xt_transport transport;
+    size_t length;
+
+    transport = (pvhd_sync_xt_transport)user_data;
+    length = size * nmemb;
+
+    if (transport->checked == false)
+    {
+        if (vhd_sync_xt_transport_check_curl_response(transport,
+                                                      transport->response.status_code) == false)
+        {
+            return 0;
+        }
+
+        transport->checked = true;
+    }
+
+    if (vhd_sync_xt_parse_multipart(&transport->multipart, data_stream, length) == false)
+    {
+        return 0;
+    }
+
+    return length;
+}
+
+static bool
+vhd_sync_xt_transport_curl_request(
+    pvhd_sync_xt_transport transport,
+    const char* suffix,
+    unsigned long int* start_offsets,
+    unsigned long int* end_offsets,
+    int count,
+    const char* condition,
+    void* write_callback
+    )
+/*
+ * This function sends a request through curl and waits for it to finish.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      suffix - Supplies what to add to the url, NULL for nothing.
+ *
+ *      start_offsets - Supplies the first byte of each range.
+ *
+ *      end_offsets - Supplies the last byte of each range.
+ *
+ *      count - Supplies the number of ranges.
+ *
+ *      condition - Supplies the extra header, NULL for none.
+ *
+ *      write_callback - Supplies the callback for the body.
+ *
+ * Return Value:
+ *
+ *      TRUE if the transfer finished or was stopped by the callback after
+ *      the headers, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_curl_transfer transfer;
+    char url[VHD_SYNC_XT_TRANSPORT_URL_LENGTH];
+
+    status = false;
+    transfer = NULL;
+    ++transport->requests;
+
+    if (snprintf(url,
+                 sizeof(url),
+                 "%s%s",
+                 transport->url,
+                 (suffix != NULL) ? suffix : "") >= sizeof(url))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_curl_request: Url too long.\n");
+        goto End;
+    }
+
+    vhd_sync_xt_reset_http_headers(&transport->response);
+
+    status = vhd_sync_xt_create_curl_transfer(transport->curl_config,
+                                              &transfer
+                                              );
+    if (status == false
+        || vhd_sync_xt_set_curl_transfer_url(transfer, url) == false
+        || vhd_sync_xt_set_curl_transfer_write(transfer,
+                                               vhd_sync_xt_transport_header_callback,
+                                               write_callback,
+                                               transport) == false
+        || ((count == 1)
+            ? vhd_sync_xt_set_curl_transfer_range(transfer,
+                                                  start_offsets[0],
+                                                  end_offsets[0])
+            : vhd_sync_xt_set_curl_transfer_ranges(transfer,
+                                                   start_offsets,
+                                                   end_offsets,
+                                                   count)) == false
+        || (condition != NULL
+            && vhd_sync_xt_set_curl_transfer_header(transfer,
+                                                    condition) == false)
+        || vhd_sync_xt_start_curl_transfer(transport->curl_config,
+                                           transfer) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_curl_request: Could not set up request for %.*s.\n",
+                             MAX_ERROR_NAME_SIZE,
+                             url);
+        status = false;
+        goto End;
+    }
+
+    while (transfer->done == false)
+    {
+        status = vhd_sync_xt_wait_curl_transfers(transport->curl_config);
+        if (status == false)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_curl_request: Could not drive transfer.\n");
+            goto End;
+        }
+    }
+
+    transport->response.status_code = vhd_sync_xt_get_curl_transfer_response_code(transfer);
+    status = transfer->result == CURLE_OK
+             || (transfer->result == CURLE_WRITE_ERROR
+                 && transport->response.complete == true);
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_curl_request: Could not get %.*s. Curl error : %d\n",
+                             MAX_ERROR_NAME_SIZE,
+                             url,
+                             transfer->result);
+    }
+
+End:
+    if (transfer != NULL)
+    {
+        vhd_sync_xt_destroy_curl_transfer(transport->curl_config,
+                                          transfer
+                                          );
+    }
+
+    return status;
+}
+
+static bool
+vhd_sync_xt_transport_open_curl(
+    pvhd_sync_xt_transport transport,
+    pvhd_sync_xt_transport_options options
+    )
+/*
+ * This function sets up the curl backend, with a configuration of its own.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      options - Supplies the socket, certificates and credentials for the
+ *          server.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    if (vhd_sync_xt_create_curl_config(&transport->curl_config,
+                                       options->connection_socket) == false)
+    {
+        return false;
+    }
+
+    return vhd_sync_xt_set_url(transport->curl_config,
+                               transport->url,
+                               options->ca_cert,
+                               options->ca_path,
+                               options->credentials
+                               );
+}
+
+static bool
+vhd_sync_xt_transport_stat_curl(
+    pvhd_sync_xt_transport transport,
+    const char* condition,
+    pvhd_sync_xt_http_headers headers
+    )
+/*
+ * This function asks the server for the first byte of the file, which
+ * tells its size and validators. A whole file is stopped after its
+ * headers.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      condition - Supplies a header that gets a 304 if it holds, NULL for
+ *          none.
+ *
+ *      headers - Supplies a placeholder for the headers.
+ *
+ * Return Value:
+ *
+ *      TRUE if the server responded, FALSE otherwise.
+ */
+{
+    unsigned long int start_offset;
+    unsigned long int end_offset;
+
+    start_offset = 0;
+    end_offset = 0;
+
+    if (vhd_sync_xt_transport_curl_request(transport,
+                                           NULL,
+                                           &start_offset,
+                                           &end_offset,
+                                           1,
+                                           condition,
+                                           vhd_sync_xt_transport_stat_write_callback) == false)
+    {
+        return false;
+    }
+
+    *headers = transport->response;
+    return true;
+}
+
+static bool
+vhd_sync_xt_transport_read_curl(
+    pvhd_sync_xt_transport transport,
+    const char* suffix,
+    unsigned long int* start_offsets,
+    unsigned long int* end_offsets,
+    int count,
+    const char* condition,
+    pvhd_sync_xt_transport_sink sink
+    )
+/*
+ * This function reads ranges through curl, all in one request. What comes
+ * back, a multipart body, a single range or the whole file, is taken apart
+ * and what was asked for passed on.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      suffix - Supplies what to add to the url for the file next to it,
+ *          NULL for the file itself.
+ *
+ *      start_offsets - Supplies the first byte of each range.
+ *
+ *      end_offsets - Supplies the last byte of each range.
+ *
+ *      count - Supplies the number of ranges.
+ *
+ *      condition - Supplies an If-Range the file has to meet, NULL for none.
+ *
+ *      sink - Supplies where the data goes.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+
+    transport->start_offsets = start_offsets;
+    transport->end_offsets = end_offsets;
+    transport->count = count;
+    transport->sink = sink;
+    transport->checked = false;
+    transport->suffixed = (suffix != NULL);
+    transport->conditional = (condition != NULL);
+
+    status = vhd_sync_xt_transport_curl_request(transport,
+                                                suffix,
+                                                start_offsets,
+                                                end_offsets,
+                                                count,
+                                                condition,
+                                                vhd_sync_xt_transport_read_write_callback
+                                                );
+    if (status == true
+        && (transport->checked == false
+            || vhd_sync_xt_multipart_complete(&transport->multipart) == false))
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_read_curl: Body incomplete. Response : %ld\n",
+                             transport->response.status_code);
+        status = false;
+    }
+
+    transport->sink = NULL;
+    return status;
+}
+
+static void
+vhd_sync_xt_transport_close_curl(
+    pvhd_sync_xt_transport transport
+    )
+/*
+ * This function tears down the curl backend.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (transport->curl_config != NULL)
+    {
+        vhd_sync_xt_destroy_curl_config(transport->curl_config);
+        transport->curl_config = NULL;
+    }
+}
+
+static const vhd_sync_xt_transport_ops
+g_vhd_sync_xt_transport_ops[VHD_SYNC_XT_TRANSPORT_TYPE_COUNT] =
+{
+    {
+        "curl",
+        vhd_sync_xt_transport_open_curl,
+        vhd_sync_xt_transport_stat_curl,
+        vhd_sync_xt_transport_read_curl,
+        vhd_sync_xt_transport_close_curl
+    },
+    {
+        "raw",
+        vhd_sync_xt_transport_open_raw,
+        vhd_sync_xt_transport_stat_raw,
+        vhd_sync_xt_transport_read_raw,
+        vhd_sync_xt_transport_close_raw
+    },
+    {
+        "file",
+        vhd_sync_xt_transport_open_file,
+        vhd_sync_xt_transport_stat_local,
+        vhd_sync_xt_transport_read_file,
+        vhd_sync_xt_transport_close_file
+    },
+    {
+        "mock",
+        vhd_sync_xt_transport_open_mock,
+        vhd_sync_xt_transport_stat_local,
+        vhd_sync_xt_transport_read_mock,
+        vhd_sync_xt_transport_close_mock
+    }
+};
+
+static bool
+vhd_sync_xt_create_transport(
+    const char* url,
+    vhd_sync_xt_transport_type type,
+    pvhd_sync_xt_transport* transport
+    )
+/*
+ * This function allocates a transport, with nothing opened yet.
+ *
+ * Parameters:
+ *
+ *      url - Supplies the url of the file.
+ *
+ *      type - Supplies the backend.
+ *
+ *      transport - Supplies a placeholder to return the transport.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_transport transport_local;
+
+    if (type < 0 || type >= VHD_SYNC_XT_TRANSPORT_TYPE_COUNT
+        || strlen(url) >= VHD_SYNC_XT_TRANSPORT_URL_LENGTH)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_transport: Bad transport for %.*s.\n",
+                             MAX_ERROR_NAME_SIZE,
+                             url);
+        return false;
+    }
+
+    transport_local = calloc(1, sizeof(vhd_sync_xt_transport));
+    if (transport_local == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_transport: Could not allocate memory for transport.\n");
+        return false;
+    }
+
+    transport_local->ops = &g_vhd_sync_xt_transport_ops[type];
+    transport_local->type = type;
+    transport_local->fd = -1;
+    strcpy(transport_local->url, url);
+    vhd_sync_xt_reset_http_headers(&transport_local->headers);
+
+    transport_local->buffer = malloc(VHD_SYNC_XT_TRANSPORT_BUFFER_SIZE);
+    if (transport_local->buffer == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_transport: Could not allocate memory for buffer.\n");
+        free(transport_local);
+        return false;
+    }
+
+    *transport = transport_local;
+    return true;
+}
+
+bool
+vhd_sync_xt_open_transport(
+    const char* url,
+    vhd_sync_xt_transport_type type,
+    pvhd_sync_xt_transport_options options,
+    pvhd_sync_xt_transport* transport
+    )
+/*
+ * This function creates a transport for a url through a backend.
+ *
+ * Parameters:
+ *
+ *      url - Supplies the url of the file.
+ *
+ *      type - Supplies the backend.
+ *
+ *      options - Supplies how to get to the server.
+ *
+ *      transport - Supplies a placeholder to return the transport.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_transport transport_local;
+
+    if (vhd_sync_xt_create_transport(url, type, &transport_local) == false)
+    {
+        return false;
+    }
+
+    if (transport_local->ops->open(transport_local, options) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_transport: Could not open %s transport for %.*s.\n",
+                             transport_local->ops->name,
+                             MAX_ERROR_NAME_SIZE,
+                             url);
+        vhd_sync_xt_close_transport(transport_local);
+        return false;
+    }
+
+    *transport = transport_local;
+    return true;
+}
+
+bool
+vhd_sync_xt_open_mock_transport(
+    const char* data,
+    unsigned long int size,
+    const char* etag,
+    pvhd_sync_xt_transport* transport
+    )
+/*
+ * This function creates a transport for a file held in memory.
+ *
+ * Parameters:
+ *
+ *      data - Supplies the file, which has to stay until the transport is
+ *          closed.
+ *
+ *      size - Supplies the size of the file.
+ *
+ *      etag - Supplies the ETag of the file, NULL for none.
+ *
+ *      transport - Supplies a placeholder to return the transport.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_transport transport_local;
+    vhd_sync_xt_transport_options options;
+
+    if (vhd_sync_xt_create_transport("mock://",
+                                     VHD_SYNC_XT_TRANSPORT_MOCK,
+                                     &transport_local) == false)
+    {
+        return false;
+    }
+
+    transport_local->mock_data = data;
+    transport_local->mock_size = size;
+    transport_local->file_size = size;
+    if (etag != NULL)
+    {
+        snprintf(transport_local->headers.etag,
+                 VHD_SYNC_XT_HEADER_VALUE_LENGTH,
+                 "%s",
+                 etag
+                 );
+    }
+
+    memset(&options, 0, sizeof(options));
+    if (transport_local->ops->open(transport_local, &options) == false)
+    {
+        vhd_sync_xt_close_transport(transport_local);
+        return false;
+    }
+
+    *transport = transport_local;
+    return true;
+}
+
+void
+vhd_sync_xt_close_transport(
+    pvhd_sync_xt_transport transport
+    )
+/*
+ * This function closes a transport.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport, NULL for none.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (transport == NULL)
+    {
+        return;
+    }
+
+    transport->ops->close(transport);
+    free(transport->buffer);
+    free(transport);
+}
+
+const char*
+vhd_sync_xt_transport_name(
+    pvhd_sync_xt_transport transport
+    )
+/*
+ * This function returns the name of the backend of a transport.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ * Return Value:
+ *
+ *      The name of the backend.
+ */
+{
+    return transport->ops->name;
+}
+
+bool
+vhd_sync_xt_transport_stat(
+    pvhd_sync_xt_transport transport,
+    const char* condition,
+    pvhd_sync_xt_http_headers headers
+    )
+/*
+ * This function finds out the size and validators of the file, as the
+ * headers of a response for it. Those of a 200 or 206 are what reads are
+ * checked against from then on.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      condition - Supplies a header that gets a 304 if the file we have is
+ *          still current, NULL for none.
+ *
+ *      headers - Supplies a placeholder for the headers.
+ *
+ * Return Value:
+ *
+ *      TRUE if there was a response, FALSE otherwise. What it was is in the
+ *      headers.
+ */
+{
+    if (transport->ops->stat(transport, condition, headers) == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_stat: No response for %.*s.\n",
+                             MAX_ERROR_NAME_SIZE,
+                             transport->url);
+        return false;
+    }
+
+    if ((headers->status_code == 200 || headers->status_code == 206)
+        && vhd_sync_xt_http_headers_size(headers, &transport->file_size) == true)
+    {
+        transport->headers = *headers;
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_transport_read(
+    pvhd_sync_xt_transport transport,
+    const char* suffix,
+    unsigned long int* start_offsets,
+    unsigned long int* end_offsets,
+    int count,
+    const char* condition,
+    pvhd_sync_xt_transport_sink sink
+    )
+/*
+ * This function reads ranges of the file into a sink. The ranges are in
+ * order and do not overlap. Each byte asked for is passed to the sink once,
+ * in order within its range.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      suffix - Supplies what to add to the url for the file next to it,
+ *          such as its synchash, NULL for the file itself.
+ *
+ *      start_offsets - Supplies the first byte of each range.
+ *
+ *      end_offsets - Supplies the last byte of each range.
+ *
+ *      count - Supplies the number of ranges.
+ *
+ *      condition - Supplies an If-Range the file has to meet, NULL for none.
+ *
+ *      sink - Supplies where the data goes.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    int i;
+
+    if (count < 1 || count > VHD_SYNC_XT_TRANSPORT_MAXIMUM_RANGES)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_read: Bad number of ranges : %d\n", count);
+        return false;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        if (start_offsets[i] > end_offsets[i]
+            || (i > 0 && start_offsets[i] <= end_offsets[i - 1]))
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_transport_read: Ranges out of order.\n");
+            return false;
+        }
+    }
+
+    return transport->ops->read(transport,
+                                suffix,
+                                start_offsets,
+                                end_offsets,
+                                count,
+                                condition,
+                                sink
+                                );
+}
+
+bool
+vhd_sync_xt_transport_read_range(
+    pvhd_sync_xt_transport transport,
+    const char* suffix,
+    unsigned long int start_offset,
+    unsigned long int end_offset,
+    const char* condition,
+    pvhd_sync_xt_transport_sink sink
+    )
+/*
+ * This function reads a single range of the file into a sink.
+ *
+ * Parameters:
+ *
+ *      transport - Supplies the transport.
+ *
+ *      suffix - Supplies what to add to the url for the file next to it,
+ *          NULL for the file itself.
+ *
+ *      start_offset - Supplies the first byte of the range.
+ *
+ *      end_offset - Supplies the last byte of the range.
+ *
+ *      condition - Supplies an If-Range the file has to meet, NULL for none.
+ *
+ *      sink - Supplies where the data goes.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    return vhd_sync_xt_transport_read(transport,
+                                      suffix,
+                                      &start_offset,
+                                      &end_offset,
+                                      1,
+                                      condition,
+                                      sink
+                                      );
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the functions that tune the sockets of a download to
+ * the link. A connection cannot carry more than its receive window per
+ * round trip, and on a long fat link the default buffer caps it well below
+ * what the link can do. The buffer is sized from the round trip time the
+ * kernel measures and the throughput the download sees.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#include <vhdsyncxt_tune.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+unsigned long int
+vhd_sync_xt_tune_buffer_size(
+    unsigned long int throughput,
+    unsigned long int rtt_usec
+    )
+/*
+ * This function works out the receive buffer a connection needs to carry a
+ * throughput over a round trip time. That is twice the bandwidth-delay
+ * product, as the window the kernel advertises is only part of the buffer,
+ * and it leaves the window room to grow past what was measured.
+ *
+ * Parameters:
+ *
+ *      throughput - Supplies the throughput to carry, in bytes/sec.
+ *
+ *      rtt_usec - Supplies the round trip time, in usec.
+ *
+ * Return Value:
+ *
+ *      The size of the buffer in bytes, 0 if there is nothing to go on.
+ */
+{
+    unsigned long int size;
+
+    if (throughput == 0 || rtt_usec == 0)
+    {
+        return 0;
+    }
+
+    size = 2 * (throughput / 1000) * rtt_usec / 1000;
+
+    if (size < VHD_SYNC_XT_TUNE_MINIMUM_RECEIVE_BUFFER)
+    {
+        size = VHD_SYNC_XT_TUNE_MINIMUM_RECEIVE_BUFFER;
+    }
+    else if (size > VHD_SYNC_XT_TUNE_MAXIMUM_RECEIVE_BUFFER)
+    {
+        size = VHD_SYNC_XT_TUNE_MAXIMUM_RECEIVE_BUFFER;
+    }
+
+    //
+    // Rounded up to 64KB, so that estimates a little apart ask for the
+    // same.
+    //
+    return (size + 0xFFFF) & ~0xFFFFUL;
+}
+
+bool
+vhd_sync_xt_tune_rtt(
+    int socket,
+    unsigned long int* rtt_usec
+    )
+/*
+ * This function gets the smoothed round trip time of a connection from the
+ * kernel. A receiver sends little, so when the kernel has not timed any of
+ * it the estimate made from the data received is used.
+ *
+ * Parameters:
+ *
+ *      socket - Supplies the connected socket.
+ *
+ *      rtt_usec - Supplies a placeholder for the round trip time, in usec.
+ *
+ * Return Value:
+ *
+ *      TRUE if the kernel has an estimate, FALSE otherwise.
+ */
+{
+    struct tcp_info info;
+    socklen_t length;
+
+    memset(&info, 0, sizeof(info));
+    length = sizeof(info);
+
+    if (getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &length) != 0)
+    {
+        return false;
+    }
+
+    *rtt_usec = (info.tcpi_rtt != 0) ? info.tcpi_rtt : info.tcpi_rcv_rtt;
+
+    return *rtt_usec != 0;
+}
+
+bool
+vhd_sync_xt_tune_receive_buffer(
+    int socket,
+    unsigned long int size,
+    unsigned long int* receive_buffer
+    )
+/*
+ * This function makes the receive buffer of a socket at least a size. A
+ * buffer the kernel has already grown that far is left alone, as setting
+ * one stops the kernel from tuning it any further. The size is forced past
+ * the system limit where we are allowed to, and capped by it otherwise.
+ *
+ * Parameters:
+ *
+ *      socket - Supplies the socket.
+ *
+ *      size - Supplies the size wanted, in bytes.
+ *
+ *      receive_buffer - Supplies a placeholder for the size the socket has
+ *          now, as the kernel reports it, NULL if not wanted.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    int value;
+    socklen_t length;
+
+    length = sizeof(value);
+    if (getsockopt(socket, SOL_SOCKET, SO_RCVBUF, &value, &length) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_tune_receive_buffer: Could not get receive buffer : %d\n", errno);
+        return false;
+    }
+
+    //
+    // The kernel reports twice what was set, the rest going to its own
+    // bookkeeping.
+    //
+    if ((unsigned long int)value < 2 * size)
+    {
+        value = size;
+        if (setsockopt(socket, SOL_SOCKET, SO_RCVBUFFORCE, &value, sizeof(value)) != 0
+            && setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) != 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_tune_receive_buffer: Could not set receive buffer : %d\n", errno);
+            return false;
+        }
+
+        length = sizeof(value);
+        if (getsockopt(socket, SOL_SOCKET, SO_RCVBUF, &value, &length) != 0)
+        {
+            return false;
+        }
+    }
+
+    if (receive_buffer != NULL)
+    {
+        *receive_buffer = value;
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_tune_set_congestion(
+    int socket,
+    const char* congestion
+    )
+/*
+ * This function sets the congestion control algorithm of a socket. Those
+ * not in net.ipv4.tcp_allowed_congestion_control need privileges, and
+ * those not loaded are not there at all.
+ *
+ * Parameters:
+ *
+ *      socket - Supplies the socket.
+ *
+ *      congestion - Supplies the name of the algorithm.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the algorithm is not permitted or there.
+ */
+{
+    if (setsockopt(socket,
+                   IPPROTO_TCP,
+                   TCP_CONGESTION,
+                   congestion,
+                   strlen(congestion)) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_tune_set_congestion: Could not use %s : %d\n",
+                             congestion,
+                             errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_tune_get_congestion(
+    int socket,
+    char* congestion,
+    size_t length
+    )
+/*
+ * This function gets the name of the congestion control algorithm a
+ * socket uses.
+ *
+ * Parameters:
+ *
+ *      socket - Supplies the socket.
+ *
+ *      congestion - Supplies a buffer for the name.
+ *
+ *      length - Supplies the size of the buffer.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    char name[VHD_SYNC_XT_TUNE_CONGESTION_LENGTH];
+    socklen_t name_length;
+
+    memset(name, 0, sizeof(name));
+    name_length = sizeof(name) - 1;
+
+    if (getsockopt(socket, IPPROTO_TCP, TCP_CONGESTION, name, &name_length) != 0)
+    {
+        return false;
+    }
+
+    return snprintf(congestion, length, "%s", name) < length;
+}
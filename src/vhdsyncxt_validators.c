@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the functions that keep the validators of the file on
+ * the server in a sidecar, and turn them into conditional request headers.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#include <vhdsyncxt_validators.h>
+#include <fcntl.h>
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+static bool
+vhd_sync_xt_validators_path(
+    const char* file_path,
+    char* path
+    )
+/*
+ * This function works out where the sidecar of a file is.
+ *
+ * Parameters:
+ *
+ *      file_path - Supplies the path of the image or partial file.
+ *
+ *      path - Supplies a buffer of VHD_SYNC_XT_PATH_LENGTH for the path of
+ *          the sidecar.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the path is too long.
+ */
+{
+    if (snprintf(path,
+                 VHD_SYNC_XT_PATH_LENGTH,
+                 "%s%s",
+                 file_path,
+                 VHD_SYNC_XT_VALIDATORS_EXTENSION) >= VHD_SYNC_XT_PATH_LENGTH)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_validators_path: Path too long.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_validators_from_headers(
+    pvhd_sync_xt_http_headers headers,
+    unsigned long int file_size,
+    pvhd_sync_xt_validators validators
+    )
+/*
+ * This function takes the validators from the headers of a response.
+ *
+ * Parameters:
+ *
+ *      headers - Supplies the headers of the response.
+ *
+ *      file_size - Supplies the size of the file.
+ *
+ *      validators - Supplies a placeholder to return the validators.
+ *
+ * Return Value:
+ *
+ *      TRUE if the response had a validator, FALSE otherwise.
+ */
+{
+    memset(validators, 0, sizeof(*validators));
+    memcpy(validators->magic,
+           VHD_SYNC_XT_VALIDATORS_MAGIC,
+           VHD_SYNC_XT_VALIDATORS_MAGIC_SIZE
+           );
+    validators->version = VHD_SYNC_XT_VALIDATORS_VERSION;
+    validators->file_size = file_size;
+    strcpy(validators->etag, headers->etag);
+    strcpy(validators->last_modified, headers->last_modified);
+
+    return validators->etag[0] != '\0' || validators->last_modified[0] != '\0';
+}
+
+bool
+vhd_sync_xt_validators_match(
+    pvhd_sync_xt_validators validators,
+    pvhd_sync_xt_http_headers headers,
+    unsigned long int file_size
+    )
+/*
+ * This function checks whether a response is for the file the validators
+ * were taken from. The size has to match, and the ETag if both have one,
+ * otherwise Last-Modified. A response with neither cannot be matched.
+ *
+ * Parameters:
+ *
+ *      validators - Supplies the validators.
+ *
+ *      headers - Supplies the headers of the response.
+ *
+ *      file_size - Supplies the size of the file in the response.
+ *
+ * Return Value:
+ *
+ *      TRUE if the response is for the same file, FALSE otherwise.
+ */
+{
+    if (validators->file_size != file_size)
+    {
+        return false;
+    }
+
+    if (validators->etag[0] != '\0' && headers->etag[0] != '\0')
+    {
+        return strcmp(validators->etag, headers->etag) == 0;
+    }
+
+    if (validators->last_modified[0] != '\0' && headers->last_modified[0] != '\0')
+    {
+        return strcmp(validators->last_modified, headers->last_modified) == 0;
+    }
+
+    return false;
+}
+
+bool
+vhd_sync_xt_validators_condition(
+    pvhd_sync_xt_validators validators,
+    bool if_range,
+    char* header,
+    size_t length
+    )
+/*
+ * This function builds the header that makes a request conditional on the
+ * file still being the one the validators were taken from. If-None-Match
+ * gets a 304 with no body for an unchanged file. If-Range gets the range
+ * asked for if the file is unchanged and the whole new file otherwise,
+ * which only takes a strong ETag, so a weak one falls back to the date.
+ *
+ * Parameters:
+ *
+ *      validators - Supplies the validators.
+ *
+ *      if_range - Supplies whether to build an If-Range header rather than
+ *          one that asks for nothing if the file is unchanged.
+ *
+ *      header - Supplies a buffer for the header.
+ *
+ *      length - Supplies the size of the buffer.
+ *
+ * Return Value:
+ *
+ *      TRUE if there was a validator to build the header from, FALSE
+ *      otherwise.
+ */
+{
+    int result;
+
+    if (validators->etag[0] != '\0'
+        && (if_range == false || strncmp(validators->etag, "W/", 2) != 0))
+    {
+        result = snprintf(header,
+                          length,
+                          "%s: %s",
+                          (if_range == true) ? "If-Range" : "If-None-Match",
+                          validators->etag
+                          );
+    }
+    else if (validators->last_modified[0] != '\0')
+    {
+        result = snprintf(header,
+                          length,
+                          "%s: %s",
+                          (if_range == true) ? "If-Range" : "If-Modified-Since",
+                          validators->last_modified
+                          );
+    }
+    else
+    {
+        return false;
+    }
+
+    return result > 0 && result < length;
+}
+
+bool
+vhd_sync_xt_load_validators(
+    const char* file_path,
+    pvhd_sync_xt_validators validators
+    )
+/*
+ * This function reads the sidecar of a file back.
+ *
+ * Parameters:
+ *
+ *      file_path - Supplies the path of the image or partial file.
+ *
+ *      validators - Supplies a placeholder to return the validators.
+ *
+ * Return Value:
+ *
+ *      TRUE if the file has a valid sidecar, FALSE otherwise.
+ */
+{
+    char path[VHD_SYNC_XT_PATH_LENGTH];
+    ssize_t result;
+    int fd;
+
+    if (vhd_sync_xt_validators_path(file_path, path) == false)
+    {
+        return false;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    result = read(fd, validators, sizeof(*validators));
+    close(fd);
+
+    if (result != sizeof(*validators)
+        || memcmp(validators->magic,
+                  VHD_SYNC_XT_VALIDATORS_MAGIC,
+                  VHD_SYNC_XT_VALIDATORS_MAGIC_SIZE) != 0
+        || validators->version != VHD_SYNC_XT_VALIDATORS_VERSION)
+    {
+        return false;
+    }
+
+    validators->etag[VHD_SYNC_XT_HEADER_VALUE_LENGTH - 1] = '\0';
+    validators->last_modified[VHD_SYNC_XT_HEADER_VALUE_LENGTH - 1] = '\0';
+
+    return validators->etag[0] != '\0' || validators->last_modified[0] != '\0';
+}
+
+bool
+vhd_sync_xt_save_validators(
+    const char* file_path,
+    pvhd_sync_xt_validators validators
+    )
+/*
+ * This function writes the sidecar of a file. The old sidecar is replaced
+ * in one go, so a crash leaves one or the other.
+ *
+ * Parameters:
+ *
+ *      file_path - Supplies the path of the image or partial file.
+ *
+ *      validators - Supplies the validators.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    char path[VHD_SYNC_XT_PATH_LENGTH];
+    char temporary_path[VHD_SYNC_XT_PATH_LENGTH + 8];
+    int fd;
+
+    status = false;
+    fd = -1;
+    temporary_path[0] = '\0';
+
+    if (vhd_sync_xt_validators_path(file_path, path) == false)
+    {
+        goto End;
+    }
+
+    snprintf(temporary_path, sizeof(temporary_path), "%s.XXXXXX", path);
+    fd = mkstemp(temporary_path);
+    if (fd < 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_save_validators: Could not create %s : %d\n",
+                             temporary_path, errno);
+        temporary_path[0] = '\0';
+        goto End;
+    }
+
+    if (fchmod(fd, 0644) != 0
+        || write(fd, validators, sizeof(*validators)) != sizeof(*validators)
+        || fsync(fd) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_save_validators: Could not write %s : %d\n",
+                             temporary_path, errno);
+        goto End;
+    }
+
+    if (rename(temporary_path, path) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_save_validators: Could not replace %s : %d\n",
+                             path, errno);
+        goto End;
+    }
+
+    temporary_path[0] = '\0';
+    status = true;
+
+End:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    if (temporary_path[0] != '\0')
+    {
+        unlink(temporary_path);
+    }
+
+    return status;
+}
+
+bool
+vhd_sync_xt_move_validators(
+    const char* from_file_path,
+    const char* to_file_path
+    )
+/*
+ * This function moves the sidecar of one file over to another, once the
+ * file itself has been renamed. If the first file has no sidecar, the
+ * second is left without one too.
+ *
+ * Parameters:
+ *
+ *      from_file_path - Supplies the path the file had.
+ *
+ *      to_file_path - Supplies the path the file has now.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    char from_path[VHD_SYNC_XT_PATH_LENGTH];
+    char to_path[VHD_SYNC_XT_PATH_LENGTH];
+
+    if (vhd_sync_xt_validators_path(from_file_path, from_path) == false
+        || vhd_sync_xt_validators_path(to_file_path, to_path) == false)
+    {
+        return false;
+    }
+
+    if (rename(from_path, to_path) == 0)
+    {
+        return true;
+    }
+
+    if (errno == ENOENT && (unlink(to_path) == 0 || errno == ENOENT))
+    {
+        return true;
+    }
+
+    VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_move_validators: Could not move %s : %d\n",
+                         from_path, errno);
+    return false;
+}
+
+void
+vhd_sync_xt_remove_validators(
+    const char* file_path
+    )
+/*
+ * This function removes the sidecar of a file, if it has one.
+ *
+ * Parameters:
+ *
+ *      file_path - Supplies the path of the image or partial file.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    char path[VHD_SYNC_XT_PATH_LENGTH];
+
+    if (vhd_sync_xt_validators_path(file_path, path) == true)
+    {
+        unlink(path);
+    }
+}
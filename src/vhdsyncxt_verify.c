@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the functions that verify a download against the SHA1
+ * of the whole file. Data is hashed as it arrives when it is next in line,
+ * so a download that comes in order is verified without reading anything
+ * back. Data that lands ahead of the hash, from another range or an earlier
+ * run, is read back from the partial file once the hash gets to it. The
+ * state of the hash is kept in the resume map, so a resumed download does
+ * not start it over.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+//
+// The SHA1 context is saved and restored as is, which needs the low level
+// interface.
+//
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <vhdsyncxt_verify.h>
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+bool
+vhd_sync_xt_create_verify(
+    unsigned char* expected,
+    pvhd_sync_xt_verify* verify
+    )
+/*
+ * This function creates the state to verify a file against a hash.
+ *
+ * Parameters:
+ *
+ *      expected - Supplies the SHA1 the file should have.
+ *
+ *      verify - Supplies a placeholder to return the verify state.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_verify verify_local;
+
+    status = false;
+
+    verify_local = calloc(1, sizeof(vhd_sync_xt_verify));
+    if (verify_local == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_verify: Could not allocate memory for verify.\n");
+        goto End;
+    }
+
+    verify_local->buffer = malloc(VHD_SYNC_XT_VERIFY_READ_SIZE);
+    if (verify_local->buffer == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_create_verify: Could not allocate memory for buffer.\n");
+        goto End;
+    }
+
+    SHA1_Init(&verify_local->sha1_context);
+    memcpy(verify_local->expected, expected, VHD_SYNC_XT_SHA1_HASH_SIZE);
+
+    *verify = verify_local;
+    verify_local = NULL;
+    status = true;
+
+End:
+    vhd_sync_xt_destroy_verify(verify_local);
+    return status;
+}
+
+void
+vhd_sync_xt_destroy_verify(
+    pvhd_sync_xt_verify verify
+    )
+/*
+ * This function destroys the verify state.
+ *
+ * Parameters:
+ *
+ *      verify - Supplies the verify state.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (verify == NULL)
+    {
+        return;
+    }
+
+    free(verify->buffer);
+    free(verify);
+}
+
+void
+vhd_sync_xt_verify_update(
+    pvhd_sync_xt_verify verify,
+    const char* data,
+    unsigned long int offset,
+    size_t length
+    )
+/*
+ * This function hashes whatever part of a block of data is next in line.
+ * Data before the hash is already in it, data after it has to wait.
+ *
+ * Parameters:
+ *
+ *      verify - Supplies the verify state.
+ *
+ *      data - Supplies the data.
+ *
+ *      offset - Supplies the offset of the data in the file.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (offset > verify->offset || offset + length <= verify->offset)
+    {
+        return;
+    }
+
+    SHA1_Update(&verify->sha1_context,
+                data + (verify->offset - offset),
+                offset + length - verify->offset
+                );
+    verify->offset = offset + length;
+}
+
+bool
+vhd_sync_xt_verify_read(
+    pvhd_sync_xt_verify verify,
+    int fd,
+    unsigned long int end_offset
+    )
+/*
+ * This function reads data that is already in the file back up to an
+ * offset, and hashes it.
+ *
+ * Parameters:
+ *
+ *      verify - Supplies the verify state.
+ *
+ *      fd - Supplies the file.
+ *
+ *      end_offset - Supplies the offset to hash up to.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    ssize_t result;
+    size_t length;
+
+    while (verify->offset < end_offset)
+    {
+        length = end_offset - verify->offset;
+        if (length > VHD_SYNC_XT_VERIFY_READ_SIZE)
+        {
+            length = VHD_SYNC_XT_VERIFY_READ_SIZE;
+        }
+
+        result = pread(fd, verify->buffer, length, verify->offset);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (result <= 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_verify_read: Could not read partial file at %lu : %d\n",
+                                 verify->offset,
+                                 errno);
+            return false;
+        }
+
+        SHA1_Update(&verify->sha1_context, verify->buffer, result);
+        verify->offset += result;
+    }
+
+    return true;
+}
+
+void
+vhd_sync_xt_verify_save(
+    pvhd_sync_xt_verify verify,
+    pvhd_sync_xt_resume_map resume_map
+    )
+/*
+ * This function keeps the state of the hash with the resume map, to be
+ * written out with it.
+ *
+ * Parameters:
+ *
+ *      verify - Supplies the verify state.
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    vhd_sync_xt_resume_map_set_hash(resume_map,
+                                    verify->offset,
+                                    &verify->sha1_context,
+                                    sizeof(verify->sha1_context)
+                                    );
+}
+
+void
+vhd_sync_xt_verify_load(
+    pvhd_sync_xt_verify verify,
+    pvhd_sync_xt_resume_map resume_map
+    )
+/*
+ * This function picks the hash up from the state kept with the resume map,
+ * if there is one. Otherwise the hash starts from the beginning.
+ *
+ * Parameters:
+ *
+ *      verify - Supplies the verify state.
+ *
+ *      resume_map - Supplies the resume map.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (vhd_sync_xt_resume_map_get_hash(resume_map,
+                                        &verify->offset,
+                                        &verify->sha1_context,
+                                        sizeof(verify->sha1_context)) == false)
+    {
+        SHA1_Init(&verify->sha1_context);
+        verify->offset = 0;
+    }
+}
+
+bool
+vhd_sync_xt_verify_check(
+    pvhd_sync_xt_verify verify
+    )
+/*
+ * This function compares the hash against the one expected. Everything up
+ * to the end of the file must have been hashed.
+ *
+ * Parameters:
+ *
+ *      verify - Supplies the verify state.
+ *
+ * Return Value:
+ *
+ *      TRUE if the hashes match, FALSE otherwise.
+ */
+{
+    SHA_CTX sha1_context;
+    unsigned char digest[VHD_SYNC_XT_SHA1_HASH_SIZE];
+
+    //
+    // Finish a copy, so the state is still good to save.
+    //
+    sha1_context = verify->sha1_context;
+    SHA1_Final(digest, &sha1_context);
+
+    return memcmp(digest, verify->expected, VHD_SYNC_XT_SHA1_HASH_SIZE) == 0;
+}
@@ -0,0 +1,1632 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This file contains the writers, the backends that put downloaded data into
+ * the partial file. All of them leave runs of zeros out of the file when
+ * asked to, and differ in how the rest gets there:
+ *
+ *      pwrite - Plain writes through the page cache.
+ *
+ *      direct - O_DIRECT writes straight from the aligned download buffers,
+ *               keeping the download out of the page cache.
+ *
+ *      uring  - io_uring writes, from registered buffers where the data is
+ *               in one.
+ *
+ *      mmap   - Copies into a shared mapping of the whole file.
+ *
+ */
+
+/* ---------------- Header includes ---------------------------------------- */
+
+#define _GNU_SOURCE
+
+#include <vhdsyncxt_writer.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define VHD_SYNC_XT_HAVE_IO_URING
+#endif
+#endif
+
+/* ---------------- Structure Defines -------------------------------------- */
+
+#ifdef VHD_SYNC_XT_HAVE_IO_URING
+//
+// The rings shared with the kernel. There is no liburing on the hosts, so
+// this talks to the system calls directly and keeps one write in flight.
+//
+typedef struct _vhd_sync_xt_writer_uring
+{
+    int ring_fd;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    //
+    // Buffers registered with the ring, if any.
+    //
+    struct iovec *buffers;
+    int buffer_count;
+
+} vhd_sync_xt_writer_uring, *pvhd_sync_xt_writer_uring;
+#endif
+
+/* ---------------- Function Definitions ----------------------------------- */
+
+static bool
+vhd_sync_xt_writer_pwrite_fd(
+    int fd,
+    const char *data,
+    size_t length,
+    unsigned long int offset
+    )
+/*
+ * This function writes all of a block of data to a file descriptor at an
+ * offset.
+ *
+ * Parameters:
+ *
+ *      fd - Supplies the file descriptor.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ *      offset - Supplies the offset in the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    size_t written;
+    ssize_t result;
+
+    written = 0;
+    while (written < length)
+    {
+        result = pwrite(fd,
+                        data + written,
+                        length - written,
+                        offset + written
+                        );
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_pwrite_fd: Could not write to partial file : %d\n", errno);
+            return false;
+        }
+
+        written += result;
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_writer_open_pwrite(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function sets up the pwrite backend, which needs nothing more than
+ * the file descriptor.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      TRUE.
+ */
+{
+    return true;
+}
+
+static bool
+vhd_sync_xt_writer_write_pwrite(
+    pvhd_sync_xt_writer writer,
+    const char *data,
+    size_t length,
+    unsigned long int offset
+    )
+/*
+ * This function writes a block of data through the page cache.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ *      offset - Supplies the offset in the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    return vhd_sync_xt_writer_pwrite_fd(writer->fd, data, length, offset);
+}
+
+static void
+vhd_sync_xt_writer_close_pwrite(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function tears down the pwrite backend.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+}
+
+static bool
+vhd_sync_xt_writer_open_direct(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function sets up the O_DIRECT backend, which opens the file a second
+ * time for direct writes.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    char path[VHD_SYNC_XT_PATH_LENGTH];
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", writer->fd);
+    writer->direct_fd = open(path, O_WRONLY | O_DIRECT);
+    if (writer->direct_fd < 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_open_direct: File system does not do direct writes : %d\n", errno);
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_writer_write_direct(
+    pvhd_sync_xt_writer writer,
+    const char *data,
+    size_t length,
+    unsigned long int offset
+    )
+/*
+ * This function writes a block of data around the page cache if it is
+ * aligned well enough, and through it otherwise. The kernel keeps the two
+ * coherent.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ *      offset - Supplies the offset in the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    if (((unsigned long int)data | length | offset)
+        % VHD_SYNC_XT_WRITER_DIRECT_ALIGNMENT != 0)
+    {
+        return vhd_sync_xt_writer_pwrite_fd(writer->fd, data, length, offset);
+    }
+
+    return vhd_sync_xt_writer_pwrite_fd(writer->direct_fd, data, length, offset);
+}
+
+static void
+vhd_sync_xt_writer_close_direct(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function tears down the O_DIRECT backend.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (writer->direct_fd >= 0)
+    {
+        close(writer->direct_fd);
+        writer->direct_fd = -1;
+    }
+}
+
+#ifdef VHD_SYNC_XT_HAVE_IO_URING
+static bool
+vhd_sync_xt_writer_open_uring(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function sets up the io_uring backend, creating the ring and mapping
+ * its queues.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_writer_uring uring;
+    struct io_uring_params params;
+
+    status = false;
+
+    uring = calloc(1, sizeof(vhd_sync_xt_writer_uring));
+    if (uring == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_open_uring: Could not allocate memory for ring.\n");
+        goto End;
+    }
+    writer->uring = uring;
+    uring->ring_fd = -1;
+
+    memset(&params, 0, sizeof(params));
+    uring->ring_fd = syscall(__NR_io_uring_setup,
+                             VHD_SYNC_XT_WRITER_URING_ENTRIES,
+                             &params
+                             );
+    if (uring->ring_fd < 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_open_uring: Could not set up io_uring : %d\n", errno);
+        goto End;
+    }
+
+    uring->sq_ring_size = params.sq_off.array
+                          + params.sq_entries * sizeof(unsigned int);
+    uring->cq_ring_size = params.cq_off.cqes
+                          + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+    {
+        if (uring->cq_ring_size > uring->sq_ring_size)
+        {
+            uring->sq_ring_size = uring->cq_ring_size;
+        }
+        uring->cq_ring_size = 0;
+    }
+
+    uring->sq_ring = mmap(NULL,
+                          uring->sq_ring_size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE,
+                          uring->ring_fd,
+                          IORING_OFF_SQ_RING
+                          );
+    if (uring->sq_ring == MAP_FAILED)
+    {
+        uring->sq_ring = NULL;
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_open_uring: Could not map submission queue.\n");
+        goto End;
+    }
+
+    uring->cq_ring = uring->sq_ring;
+    if (uring->cq_ring_size != 0)
+    {
+        uring->cq_ring = mmap(NULL,
+                              uring->cq_ring_size,
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE,
+                              uring->ring_fd,
+                              IORING_OFF_CQ_RING
+                              );
+        if (uring->cq_ring == MAP_FAILED)
+        {
+            uring->cq_ring = NULL;
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_open_uring: Could not map completion queue.\n");
+            goto End;
+        }
+    }
+
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL,
+                       uring->sqes_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       uring->ring_fd,
+                       IORING_OFF_SQES
+                       );
+    if (uring->sqes == MAP_FAILED)
+    {
+        uring->sqes = NULL;
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_open_uring: Could not map submission entries.\n");
+        goto End;
+    }
+
+    uring->sq_tail = (unsigned int*)((char*)uring->sq_ring + params.sq_off.tail);
+    uring->sq_mask = (unsigned int*)((char*)uring->sq_ring + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned int*)((char*)uring->sq_ring + params.sq_off.array);
+    uring->cq_head = (unsigned int*)((char*)uring->cq_ring + params.cq_off.head);
+    uring->cq_tail = (unsigned int*)((char*)uring->cq_ring + params.cq_off.tail);
+    uring->cq_mask = (unsigned int*)((char*)uring->cq_ring + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*)((char*)uring->cq_ring + params.cq_off.cqes);
+
+    status = true;
+
+End:
+    return status;
+}
+
+static bool
+vhd_sync_xt_writer_write_uring(
+    pvhd_sync_xt_writer writer,
+    const char *data,
+    size_t length,
+    unsigned long int offset
+    )
+/*
+ * This function writes a block of data through the ring and waits for it to
+ * complete, so the buffer can be reused as soon as it returns. Data that
+ * lies in a registered buffer is written with a fixed buffer write.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ *      offset - Supplies the offset in the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_writer_uring uring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned int tail;
+    unsigned int head;
+    unsigned int index;
+    int buffer_index;
+    int i;
+    int result;
+
+    uring = writer->uring;
+
+    buffer_index = -1;
+    for (i = 0; i < uring->buffer_count; ++i)
+    {
+        if (data >= (char*)uring->buffers[i].iov_base
+            && data + length <= (char*)uring->buffers[i].iov_base
+                                + uring->buffers[i].iov_len)
+        {
+            buffer_index = i;
+            break;
+        }
+    }
+
+    while (length > 0)
+    {
+        tail = *uring->sq_tail;
+        index = tail & *uring->sq_mask;
+        sqe = &uring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = (buffer_index >= 0) ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = writer->fd;
+        sqe->addr = (unsigned long int)data;
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->buf_index = (buffer_index >= 0) ? buffer_index : 0;
+        uring->sq_array[index] = index;
+        __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        do
+        {
+            result = syscall(__NR_io_uring_enter,
+                             uring->ring_fd,
+                             1,
+                             1,
+                             IORING_ENTER_GETEVENTS,
+                             NULL,
+                             0
+                             );
+        } while (result < 0 && errno == EINTR);
+        if (result < 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_write_uring: Could not submit write : %d\n", errno);
+            return false;
+        }
+
+        head = *uring->cq_head;
+        while (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            syscall(__NR_io_uring_enter,
+                    uring->ring_fd,
+                    0,
+                    1,
+                    IORING_ENTER_GETEVENTS,
+                    NULL,
+                    0
+                    );
+        }
+        cqe = &uring->cqes[head & *uring->cq_mask];
+        result = cqe->res;
+        __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (result == -EINTR || result == -EAGAIN)
+        {
+            continue;
+        }
+
+        if (result <= 0)
+        {
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_write_uring: Could not write to partial file : %d\n", -result);
+            return false;
+        }
+
+        data += result;
+        length -= result;
+        offset += result;
+    }
+
+    return true;
+}
+
+static void
+vhd_sync_xt_writer_close_uring(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function tears down the io_uring backend.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    pvhd_sync_xt_writer_uring uring;
+
+    uring = writer->uring;
+    if (uring == NULL)
+    {
+        return;
+    }
+
+    if (uring->sqes != NULL)
+    {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+
+    if (uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring)
+    {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+
+    if (uring->sq_ring != NULL)
+    {
+        munmap(uring->sq_ring, uring->sq_ring_size);
+    }
+
+    if (uring->ring_fd >= 0)
+    {
+        close(uring->ring_fd);
+    }
+
+    free(uring->buffers);
+    free(uring);
+    writer->uring = NULL;
+}
+#else
+static bool
+vhd_sync_xt_writer_open_uring(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function fails, io_uring was not available when this was built.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      FALSE.
+ */
+{
+    VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_open_uring: Built without io_uring.\n");
+    return false;
+}
+
+#define vhd_sync_xt_writer_write_uring      vhd_sync_xt_writer_write_pwrite
+#define vhd_sync_xt_writer_close_uring      vhd_sync_xt_writer_close_pwrite
+#endif
+
+static bool
+vhd_sync_xt_writer_open_mmap(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function sets up the mmap backend. The file is extended to its full
+ * size, which leaves a hole that reads back as zeros, and mapped whole.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    if (writer->file_end < writer->file_size
+        && ftruncate(writer->fd, writer->file_size) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_open_mmap: Could not extend partial file : %d\n", errno);
+        return false;
+    }
+
+    if (writer->file_size == 0)
+    {
+        return true;
+    }
+
+    writer->mapping_length = writer->file_size;
+    writer->mapping = mmap(NULL,
+                           writer->mapping_length,
+                           PROT_READ | PROT_WRITE,
+                           MAP_SHARED,
+                           writer->fd,
+                           0
+                           );
+    if (writer->mapping == MAP_FAILED)
+    {
+        writer->mapping = NULL;
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_open_mmap: Could not map partial file : %d\n", errno);
+        return false;
+    }
+
+    //
+    // Each page is only written, reading ahead around it is wasted.
+    //
+    madvise(writer->mapping, writer->mapping_length, MADV_RANDOM);
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_writer_write_mmap(
+    pvhd_sync_xt_writer writer,
+    const char *data,
+    size_t length,
+    unsigned long int offset
+    )
+/*
+ * This function copies a block of data into the mapping of the file.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ *      offset - Supplies the offset in the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    if (offset + length > writer->mapping_length)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_write_mmap: Write past the end of the file at %lu.\n", offset);
+        return false;
+    }
+
+    memcpy(writer->mapping + offset, data, length);
+
+    return true;
+}
+
+static void
+vhd_sync_xt_writer_close_mmap(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function tears down the mmap backend.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (writer->mapping != NULL)
+    {
+        munmap(writer->mapping, writer->mapping_length);
+        writer->mapping = NULL;
+    }
+}
+
+static const vhd_sync_xt_writer_ops
+g_vhd_sync_xt_writer_ops[VHD_SYNC_XT_WRITER_TYPE_COUNT] =
+{
+    {
+        "pwrite",
+        vhd_sync_xt_writer_open_pwrite,
+        vhd_sync_xt_writer_write_pwrite,
+        vhd_sync_xt_writer_close_pwrite
+    },
+    {
+        "direct",
+        vhd_sync_xt_writer_open_direct,
+        vhd_sync_xt_writer_write_direct,
+        vhd_sync_xt_writer_close_direct
+    },
+    {
+        "uring",
+        vhd_sync_xt_writer_open_uring,
+        vhd_sync_xt_writer_write_uring,
+        vhd_sync_xt_writer_close_uring
+    },
+    {
+        "mmap",
+        vhd_sync_xt_writer_open_mmap,
+        vhd_sync_xt_writer_write_mmap,
+        vhd_sync_xt_writer_close_mmap
+    }
+};
+
+bool
+vhd_sync_xt_is_zero(
+    const char *data,
+    size_t length
+    )
+/*
+ * This function checks whether a block of data is all zeros, 64 bytes at a
+ * time with SSE2 where we have it.
+ *
+ * Parameters:
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      TRUE if every byte is zero, FALSE otherwise.
+ */
+{
+    size_t i;
+
+    i = 0;
+
+#ifdef __SSE2__
+    {
+        __m128i zero;
+        __m128i accumulate;
+
+        zero = _mm_setzero_si128();
+        for (; i + 64 <= length; i += 64)
+        {
+            accumulate = _mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i)),
+                             _mm_loadu_si128((const __m128i*)(data + i + 16))),
+                _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i + 32)),
+                             _mm_loadu_si128((const __m128i*)(data + i + 48))));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(accumulate, zero)) != 0xFFFF)
+            {
+                return false;
+            }
+        }
+    }
+#else
+    {
+        unsigned long int word;
+
+        for (; i + sizeof(word) <= length; i += sizeof(word))
+        {
+            memcpy(&word, data + i, sizeof(word));
+            if (word != 0)
+            {
+                return false;
+            }
+        }
+    }
+#endif
+
+    for (; i < length; ++i)
+    {
+        if (data[i] != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_writer_drop_region(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function waits for the oldest region under writeback to reach the
+ * disk, and drops it from the page cache.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_writer_region region;
+    unsigned long int page_size;
+    unsigned long int start;
+    unsigned long int end;
+
+    region = &writer->regions[writer->region_head];
+    writer->region_head = (writer->region_head + 1) % VHD_SYNC_XT_WRITER_WRITEBACK_REGIONS;
+    writer->region_count--;
+    writer->writeback_bytes -= region->length;
+
+    if (sync_file_range(writer->fd,
+                        region->offset,
+                        region->length,
+                        SYNC_FILE_RANGE_WAIT_BEFORE
+                        | SYNC_FILE_RANGE_WRITE
+                        | SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_drop_region: Could not write back partial file : %d\n", errno);
+        return false;
+    }
+
+    //
+    // Pages still mapped are not dropped, so unmap them first. They are
+    // clean by now.
+    //
+    if (writer->mapping != NULL)
+    {
+        page_size = sysconf(_SC_PAGESIZE);
+        start = (region->offset + page_size - 1) / page_size * page_size;
+        end = (region->offset + region->length) / page_size * page_size;
+        if (end > start)
+        {
+            madvise(writer->mapping + start, end - start, MADV_DONTNEED);
+        }
+    }
+
+    posix_fadvise(writer->fd,
+                  region->offset,
+                  region->length,
+                  POSIX_FADV_DONTNEED
+                  );
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_writer_start_writeback(
+    pvhd_sync_xt_writer writer,
+    unsigned long int offset,
+    unsigned long int length
+    )
+/*
+ * This function starts writeback of data just written, without waiting for
+ * it, and queues the region to be dropped from the page cache later. Once
+ * too much is queued the oldest regions are waited for and dropped, which
+ * keeps the dirty data bounded.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      offset - Supplies the offset of the data written.
+ *
+ *      length - Supplies the length of the data written.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    pvhd_sync_xt_writer_region region;
+
+    if (sync_file_range(writer->fd, offset, length, SYNC_FILE_RANGE_WRITE) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_start_writeback: Could not start writeback : %d\n", errno);
+        return false;
+    }
+
+    //
+    // Data from one range comes in order, so it usually carries on the last
+    // region.
+    //
+    region = NULL;
+    if (writer->region_count > 0)
+    {
+        region = &writer->regions[(writer->region_head + writer->region_count - 1)
+                                  % VHD_SYNC_XT_WRITER_WRITEBACK_REGIONS];
+        if (region->offset + region->length != offset)
+        {
+            region = NULL;
+        }
+    }
+
+    if (region == NULL)
+    {
+        if (writer->region_count == VHD_SYNC_XT_WRITER_WRITEBACK_REGIONS
+            && vhd_sync_xt_writer_drop_region(writer) == false)
+        {
+            return false;
+        }
+
+        region = &writer->regions[(writer->region_head + writer->region_count)
+                                  % VHD_SYNC_XT_WRITER_WRITEBACK_REGIONS];
+        region->offset = offset;
+        region->length = 0;
+        writer->region_count++;
+    }
+
+    region->length += length;
+    writer->writeback_bytes += length;
+
+    while (writer->writeback_bytes > VHD_SYNC_XT_WRITER_WRITEBACK_BYTES
+           && writer->region_count > 1)
+    {
+        if (vhd_sync_xt_writer_drop_region(writer) == false)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_writer_write_data(
+                              pvhd_sync_xt_writer writer,
+                              const char *data,
+                              size_t length,
+                              unsigned long int offset
+                              )
+/*
+ * This function writes a block of data with the backend, and keeps track of
+ * how far the file extends.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ *      offset - Supplies the offset in the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    if (writer->ops->write(writer, data, length, offset) == false)
+    {
+        return false;
+    }
+
+    if (writer->writeback == true
+        && vhd_sync_xt_writer_start_writeback(writer, offset, length) == false)
+    {
+        return false;
+    }
+
+    if (offset + length > writer->file_end)
+    {
+        writer->file_end = offset + length;
+    }
+
+    return true;
+}
+
+static bool
+vhd_sync_xt_writer_write_zero(
+                              pvhd_sync_xt_writer writer,
+                              size_t length,
+                              unsigned long int offset
+                              )
+/*
+ * This function makes a region of the file read back as zeros without
+ * writing it. Past the end of the file there is nothing to do, the file gets
+ * extended over it later. Below the end it may hold old data, so a hole is
+ * punched.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      length - Supplies the length of the region.
+ *
+ *      offset - Supplies the offset of the region in the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    static const char zeros[VHD_SYNC_XT_SPARSE_BLOCK_SIZE]
+        __attribute__((aligned(VHD_SYNC_XT_WRITER_DIRECT_ALIGNMENT)));
+    size_t punch_length;
+
+    if (offset >= writer->file_end)
+    {
+        return true;
+    }
+
+    punch_length = length;
+    if (offset + punch_length > writer->file_end)
+    {
+        punch_length = writer->file_end - offset;
+    }
+
+    if (fallocate(writer->fd,
+                  FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  offset,
+                  punch_length) == 0)
+    {
+        return true;
+    }
+
+    //
+    // No hole punching on this file system, write the zeros after all.
+    //
+    while (punch_length > 0)
+    {
+        length = punch_length < sizeof(zeros) ? punch_length : sizeof(zeros);
+        if (vhd_sync_xt_writer_write_data(writer, zeros, length, offset) == false)
+        {
+            return false;
+        }
+
+        offset += length;
+        punch_length -= length;
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_writer_type_from_name(
+    const char* name,
+    pvhd_sync_xt_writer_type type
+    )
+/*
+ * This function looks up a writer backend by its name.
+ *
+ * Parameters:
+ *
+ *      name - Supplies the name of the backend.
+ *
+ *      type - Supplies a placeholder to return the backend.
+ *
+ * Return Value:
+ *
+ *      TRUE if there is a backend by that name, FALSE otherwise.
+ */
+{
+    int i;
+
+    for (i = 0; i < VHD_SYNC_XT_WRITER_TYPE_COUNT; ++i)
+    {
+        if (strcmp(name, g_vhd_sync_xt_writer_ops[i].name) == 0)
+        {
+            *type = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char*
+vhd_sync_xt_writer_name(
+    vhd_sync_xt_writer_type type
+    )
+/*
+ * This function returns the name of a writer backend.
+ *
+ * Parameters:
+ *
+ *      type - Supplies the backend.
+ *
+ * Return Value:
+ *
+ *      The name of the backend.
+ */
+{
+    return g_vhd_sync_xt_writer_ops[type].name;
+}
+
+bool
+vhd_sync_xt_open_writer(
+    char* path,
+    vhd_sync_xt_writer_type type,
+    unsigned long int file_size,
+    bool sparse,
+    bool writeback,
+    pvhd_sync_xt_writer* writer
+    )
+/*
+ * This function opens a file for writing with one of the backends, creating
+ * it if it does not exist. What is already in the file is left alone.
+ *
+ * Parameters:
+ *
+ *      path - Supplies the path of the file.
+ *
+ *      type - Supplies the backend to write with.
+ *
+ *      file_size - Supplies the size the file will have once complete.
+ *
+ *      sparse - Supplies whether to leave blocks of zeros out of the file.
+ *
+ *      writeback - Supplies whether to keep the data written out of the page
+ *          cache.
+ *
+ *      writer - Supplies a placeholder to return the writer.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_writer writer_local;
+    off_t file_end;
+
+    status = false;
+
+    writer_local = calloc(1, sizeof(vhd_sync_xt_writer));
+    if (writer_local == NULL)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_writer: Could not allocate memory for writer.\n");
+        goto End;
+    }
+    writer_local->fd = -1;
+    writer_local->direct_fd = -1;
+    writer_local->type = type;
+    writer_local->ops = &g_vhd_sync_xt_writer_ops[type];
+    writer_local->sparse = sparse;
+    writer_local->writeback = writeback;
+    writer_local->file_size = file_size;
+
+    //
+    // Not opened for append, data is written at its own offset.
+    //
+    writer_local->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (writer_local->fd < 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_writer: Could not open %s : %d\n", path, errno);
+        goto End;
+    }
+
+    file_end = lseek(writer_local->fd, 0, SEEK_END);
+    if (file_end < 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_writer: Could not seek in %s.\n", path);
+        goto End;
+    }
+    writer_local->file_end = file_end;
+
+    status = writer_local->ops->open(writer_local);
+    if (status == false)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_open_writer: Could not set up %s writer.\n",
+                             writer_local->ops->name);
+        goto End;
+    }
+
+    *writer = writer_local;
+    writer_local = NULL;
+
+    status = true;
+
+End:
+    vhd_sync_xt_destroy_writer(writer_local);
+    return status;
+}
+
+void
+vhd_sync_xt_destroy_writer(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function closes a writer. Data not synced yet stays in the page
+ * cache, where the kernel writes it out.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (writer == NULL)
+    {
+        return;
+    }
+
+    writer->ops->close(writer);
+
+    if (writer->fd >= 0)
+    {
+        close(writer->fd);
+    }
+
+    free(writer);
+}
+
+bool
+vhd_sync_xt_writer_register_buffers(
+    pvhd_sync_xt_writer writer,
+    struct iovec* buffers,
+    int buffer_count
+    )
+/*
+ * This function tells the writer which buffers data will be written from,
+ * so backends that can register them with the kernel up front do.
+ * Registering is an optimization, a backend that cannot falls back to
+ * writing from unregistered buffers.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      buffers - Supplies the buffers.
+ *
+ *      buffer_count - Supplies the number of buffers.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+#ifdef VHD_SYNC_XT_HAVE_IO_URING
+    pvhd_sync_xt_writer_uring uring;
+
+    uring = writer->uring;
+    if (uring == NULL || uring->buffers != NULL || buffer_count == 0)
+    {
+        return true;
+    }
+
+    if (syscall(__NR_io_uring_register,
+                uring->ring_fd,
+                IORING_REGISTER_BUFFERS,
+                buffers,
+                buffer_count) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_register_buffers: Could not register buffers, writing without : %d\n", errno);
+        return true;
+    }
+
+    uring->buffers = malloc(buffer_count * sizeof(struct iovec));
+    if (uring->buffers == NULL)
+    {
+        syscall(__NR_io_uring_register,
+                uring->ring_fd,
+                IORING_UNREGISTER_BUFFERS,
+                NULL,
+                0);
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_register_buffers: Could not allocate memory for buffers.\n");
+        return false;
+    }
+
+    memcpy(uring->buffers, buffers, buffer_count * sizeof(struct iovec));
+    uring->buffer_count = buffer_count;
+#endif
+
+    return true;
+}
+
+bool
+vhd_sync_xt_writer_reserve(
+    pvhd_sync_xt_writer writer,
+    unsigned long int offset,
+    unsigned long int length
+    )
+/*
+ * This function reserves space for a region of the file without changing
+ * its size, so that data written out of order does not fragment it.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      offset - Supplies the offset of the region.
+ *
+ *      length - Supplies the length of the region.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    return fallocate(writer->fd, FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+}
+
+bool
+vhd_sync_xt_writer_write(
+    pvhd_sync_xt_writer writer,
+    const char* data,
+    size_t length,
+    unsigned long int offset
+    )
+/*
+ * This function writes a block of data to the file. For a sparse file, the
+ * file system blocks that are all zeros are left out.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ *      offset - Supplies the offset in the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    size_t position;
+    size_t run_start;
+    size_t piece_end;
+    bool zero;
+    bool run_zero;
+
+    if (writer->sparse == false)
+    {
+        return vhd_sync_xt_writer_write_data(writer, data, length, offset);
+    }
+
+    //
+    // Walk the data in pieces that line up with file system blocks, and write
+    // out each run of pieces that are all zero or not in one go. Only whole
+    // blocks can be left out.
+    //
+    position = 0;
+    run_start = 0;
+    run_zero = false;
+    while (position < length)
+    {
+        piece_end = (offset + position) / VHD_SYNC_XT_SPARSE_BLOCK_SIZE
+                    * VHD_SYNC_XT_SPARSE_BLOCK_SIZE
+                    + VHD_SYNC_XT_SPARSE_BLOCK_SIZE
+                    - offset;
+        if (piece_end > length)
+        {
+            piece_end = length;
+        }
+
+        zero = (piece_end - position == VHD_SYNC_XT_SPARSE_BLOCK_SIZE)
+               && vhd_sync_xt_is_zero(data + position, piece_end - position);
+
+        if (position != 0 && zero != run_zero)
+        {
+            if (run_zero == true)
+            {
+                if (vhd_sync_xt_writer_write_zero(writer,
+                                                  position - run_start,
+                                                  offset + run_start) == false)
+                {
+                    return false;
+                }
+            }
+            else if (vhd_sync_xt_writer_write_data(writer,
+                                                   data + run_start,
+                                                   position - run_start,
+                                                   offset + run_start) == false)
+            {
+                return false;
+            }
+
+            run_start = position;
+        }
+
+        run_zero = zero;
+        position = piece_end;
+    }
+
+    if (run_zero == true)
+    {
+        return vhd_sync_xt_writer_write_zero(writer,
+                                             length - run_start,
+                                             offset + run_start);
+    }
+
+    return vhd_sync_xt_writer_write_data(writer,
+                                         data + run_start,
+                                         length - run_start,
+                                         offset + run_start);
+}
+
+static bool
+vhd_sync_xt_writer_moved(
+    pvhd_sync_xt_writer writer,
+    unsigned long int offset,
+    size_t length
+    )
+/*
+ * This function does what follows data that the kernel moved into the file
+ * without the backend, which is writing it back and extending the file.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      offset - Supplies the offset of the data in the file.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    if (writer->writeback == true
+        && vhd_sync_xt_writer_start_writeback(writer, offset, length) == false)
+    {
+        return false;
+    }
+
+    if (offset + length > writer->file_end)
+    {
+        writer->file_end = offset + length;
+    }
+
+    return true;
+}
+
+bool
+vhd_sync_xt_writer_splice(
+    pvhd_sync_xt_writer writer,
+    int pipe_fd,
+    size_t length,
+    unsigned long int offset
+    )
+/*
+ * This function moves data that is waiting in a pipe into the file, without
+ * it passing through user space. Every backend has a buffered descriptor of
+ * the file, which the data goes to. It cannot be looked at, so nothing is
+ * left out of a sparse file.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      pipe_fd - Supplies the read end of the pipe.
+ *
+ *      length - Supplies how much of the data in the pipe to move.
+ *
+ *      offset - Supplies the offset in the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    loff_t file_offset;
+    size_t moved;
+    ssize_t result;
+
+    file_offset = offset;
+    moved = 0;
+    while (moved < length)
+    {
+        result = splice(pipe_fd,
+                        NULL,
+                        writer->fd,
+                        &file_offset,
+                        length - moved,
+                        SPLICE_F_MOVE
+                        );
+        if (result <= 0)
+        {
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_splice: Could not splice to partial file : %d\n", errno);
+            return false;
+        }
+
+        moved += result;
+    }
+
+    return vhd_sync_xt_writer_moved(writer, offset, length);
+}
+
+bool
+vhd_sync_xt_writer_copy_range(
+    pvhd_sync_xt_writer writer,
+    int source_fd,
+    unsigned long int source_offset,
+    size_t length,
+    unsigned long int offset
+    )
+/*
+ * This function copies a range of another file into the file within the
+ * kernel, which can share the blocks or copy them on the storage where the
+ * filesystems allow it. Like a splice it goes to the buffered descriptor,
+ * and nothing is left out of a sparse file.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ *      source_fd - Supplies the file to copy from.
+ *
+ *      source_offset - Supplies the offset in the file to copy from.
+ *
+ *      length - Supplies how much to copy.
+ *
+ *      offset - Supplies the offset in the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE if the kernel cannot copy between the two
+ *      files or there was an error. Whatever was copied before that has to
+ *      be copied again.
+ */
+{
+    loff_t input_offset;
+    loff_t output_offset;
+    ssize_t result;
+
+    input_offset = source_offset;
+    output_offset = offset;
+    while (output_offset < offset + length)
+    {
+        result = copy_file_range(source_fd,
+                                 &input_offset,
+                                 writer->fd,
+                                 &output_offset,
+                                 offset + length - output_offset,
+                                 0
+                                 );
+        if (result <= 0)
+        {
+            if (result < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+    }
+
+    return vhd_sync_xt_writer_moved(writer, offset, length);
+}
+
+bool
+vhd_sync_xt_writer_finish(
+    pvhd_sync_xt_writer writer
+    )
+/*
+ * This function sets the file to its full size once all of the data is in,
+ * and syncs it. A stale file can be longer than it should be, and the end of
+ * the file can be a run of zeros that was never written. With writeback on
+ * almost everything is on disk already, so the sync is cheap.
+ *
+ * Parameters:
+ *
+ *      writer - Supplies the writer.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    while (writer->region_count > 0)
+    {
+        if (vhd_sync_xt_writer_drop_region(writer) == false)
+        {
+            return false;
+        }
+    }
+
+    if (ftruncate(writer->fd, writer->file_size) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_finish: Could not set size of file : %d\n", errno);
+        return false;
+    }
+
+    if (fdatasync(writer->fd) != 0)
+    {
+        VHD_SYNC_XT_ERRORLOG("vhd_sync_xt_writer_finish: Could not sync file : %d\n", errno);
+        return false;
+    }
+
+    writer->file_end = writer->file_size;
+
+    return true;
+}
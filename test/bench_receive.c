@@ -0,0 +1,835 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is a benchmark of the two ways the body of a response gets into the
+ * partial file over plaintext HTTP. A forked server on loopback sends
+ * the same file to each with sendfile. Curl hands the body over in pieces
+ * that are copied into a 4MB buffer and written out the way a download
+ * does, while the raw client splices it from the socket into the file. The
+ * file is synced before the clock stops. For each it reports the throughput
+ * and the CPU time the receiving process spent per GB.
+ *
+ *      bench_receive <target directory> [size in MB]
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_curl.h>
+#include <vhdsyncxt_rawhttp.h>
+#include <vhdsyncxt_writer.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+#define BENCH_RECEIVE_SOURCE_NAME           "bench_receive.src"
+#define BENCH_RECEIVE_FILE_NAME             "bench_receive.part"
+#define BENCH_RECEIVE_DEFAULT_SIZE_MB       1024
+#define BENCH_RECEIVE_BUFFER_SIZE           (4 * 1024 * 1024)
+#define BENCH_RECEIVE_BLOCK_SIZE            (2 * 1024 * 1024)
+#define BENCH_RECEIVE_REQUEST_LENGTH        4096
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+//
+// Where the curl write callback is up to.
+//
+typedef struct _bench_receive_sink
+{
+    pvhd_sync_xt_writer writer;
+    char *buffer;
+    size_t buffer_length;
+    unsigned long int offset;
+    bool failed;
+
+} bench_receive_sink, *pbench_receive_sink;
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static double
+bench_receive_cpu_seconds(
+    )
+/*
+ * This function returns the user and system CPU time used so far.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      CPU seconds.
+ */
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+           + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static double
+bench_receive_wall_seconds(
+    )
+/*
+ * This function returns the monotonic clock in seconds.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      Seconds.
+ */
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void
+bench_receive_serve(
+    int listen_socket,
+    char *source_path,
+    unsigned long int file_size
+    )
+/*
+ * This function is the server, which runs in its own process until it is
+ * killed. It answers each ranged GET on a connection with a 206 and the
+ * range of the source file.
+ *
+ * Parameters:
+ *
+ *      listen_socket - Supplies the listening socket.
+ *
+ *      source_path - Supplies the path of the file to serve.
+ *
+ *      file_size - Supplies the size of the file.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    char request[BENCH_RECEIVE_REQUEST_LENGTH];
+    char response[BENCH_RECEIVE_REQUEST_LENGTH];
+    size_t request_length;
+    ssize_t result;
+    char *range;
+    char *end;
+    unsigned long int start_offset;
+    unsigned long int end_offset;
+    off_t offset;
+    int connection;
+    int source;
+    int length;
+
+    source = open(source_path, O_RDONLY);
+
+    while ((connection = accept(listen_socket, NULL, NULL)) >= 0)
+    {
+        request_length = 0;
+        while (true)
+        {
+            request[request_length] = '\0';
+            end = strstr(request, "\r\n\r\n");
+            if (end == NULL)
+            {
+                result = recv(connection,
+                              request + request_length,
+                              sizeof(request) - 1 - request_length,
+                              0
+                              );
+                if (result <= 0)
+                {
+                    break;
+                }
+                request_length += result;
+                continue;
+            }
+
+            start_offset = 0;
+            end_offset = file_size - 1;
+            range = strstr(request, "Range: bytes=");
+            if (range != NULL)
+            {
+                sscanf(range, "Range: bytes=%lu-%lu", &start_offset, &end_offset);
+            }
+
+            length = snprintf(response,
+                              sizeof(response),
+                              "HTTP/1.1 206 Partial Content\r\n"
+                              "Content-Range: bytes %lu-%lu/%lu\r\n"
+                              "Content-Length: %lu\r\n"
+                              "\r\n",
+                              start_offset,
+                              end_offset,
+                              file_size,
+                              end_offset + 1 - start_offset
+                              );
+            send(connection, response, length, MSG_NOSIGNAL);
+
+            offset = start_offset;
+            while (offset <= end_offset
+                   && sendfile(connection, source, &offset, end_offset + 1 - offset) > 0)
+            {
+            }
+
+            end += 4;
+            request_length -= end - request;
+            memmove(request, end, request_length);
+        }
+
+        close(connection);
+    }
+
+    _exit(0);
+}
+
+static size_t
+bench_receive_write_callback(
+    char *data,
+    size_t size,
+    size_t nmemb,
+    void *user_data
+    )
+/*
+ * This function takes the body from curl, copying it into the buffer and
+ * writing the buffer out when it is full.
+ *
+ * Parameters:
+ *
+ *      data - Supplies the data.
+ *
+ *      size - Supplies the size of a member.
+ *
+ *      nmemb - Supplies the number of members.
+ *
+ *      user_data - Supplies the sink.
+ *
+ * Return Value:
+ *
+ *      The number of bytes taken.
+ */
+{
+    pbench_receive_sink sink;
+    size_t length;
+    size_t used;
+
+    sink = user_data;
+    length = size * nmemb;
+
+    while (length > 0)
+    {
+        used = BENCH_RECEIVE_BUFFER_SIZE - sink->buffer_length;
+        if (used > length)
+        {
+            used = length;
+        }
+
+        memcpy(sink->buffer + sink->buffer_length, data, used);
+        sink->buffer_length += used;
+        data += used;
+        length -= used;
+
+        if (sink->buffer_length == BENCH_RECEIVE_BUFFER_SIZE)
+        {
+            if (vhd_sync_xt_writer_write(sink->writer,
+                                         sink->buffer,
+                                         sink->buffer_length,
+                                         sink->offset) == false)
+            {
+                sink->failed = true;
+                return 0;
+            }
+
+            sink->offset += sink->buffer_length;
+            sink->buffer_length = 0;
+        }
+    }
+
+    return size * nmemb;
+}
+
+static size_t
+bench_receive_header_callback(
+    char *data,
+    size_t size,
+    size_t nmemb,
+    void *user_data
+    )
+/*
+ * This function drops the headers curl hands over.
+ *
+ * Parameters:
+ *
+ *      data - Supplies the header.
+ *
+ *      size - Supplies the size of a member.
+ *
+ *      nmemb - Supplies the number of members.
+ *
+ *      user_data - Supplies nothing.
+ *
+ * Return Value:
+ *
+ *      The number of bytes taken.
+ */
+{
+    return size * nmemb;
+}
+
+static bool
+bench_receive_curl(
+    char *url,
+    pvhd_sync_xt_writer writer,
+    char *buffer,
+    unsigned long int file_size
+    )
+/*
+ * This function receives the file with curl. Curl opens its own connection,
+ * as some versions of it fail to take one that is already connected, and
+ * what happens to the body once connected is the same either way.
+ *
+ * Parameters:
+ *
+ *      url - Supplies the url of the file.
+ *
+ *      writer - Supplies the writer of the file.
+ *
+ *      buffer - Supplies a buffer of BENCH_RECEIVE_BUFFER_SIZE.
+ *
+ *      file_size - Supplies the size of the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_curl_config curl_config = NULL;
+    pvhd_sync_xt_curl_transfer transfer = NULL;
+    bench_receive_sink sink;
+
+    status = false;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.writer = writer;
+    sink.buffer = buffer;
+
+    if (vhd_sync_xt_create_curl_config(&curl_config, 0) == false
+        || vhd_sync_xt_set_url(curl_config, url, NULL, NULL, NULL) == false
+        || vhd_sync_xt_create_curl_transfer(curl_config, &transfer) == false
+        || vhd_sync_xt_set_curl_transfer_write(transfer,
+                                               bench_receive_header_callback,
+                                               bench_receive_write_callback,
+                                               &sink) == false
+        || vhd_sync_xt_set_curl_transfer_range(transfer, 0, file_size - 1) == false
+        || vhd_sync_xt_start_curl_transfer(curl_config, transfer) == false)
+    {
+        goto End;
+    }
+
+    while (transfer->active == true)
+    {
+        if (vhd_sync_xt_wait_curl_transfers(curl_config) == false)
+        {
+            goto End;
+        }
+    }
+
+    if (transfer->result != CURLE_OK || sink.failed == true)
+    {
+        goto End;
+    }
+
+    status = sink.buffer_length == 0
+             || vhd_sync_xt_writer_write(writer,
+                                         sink.buffer,
+                                         sink.buffer_length,
+                                         sink.offset);
+
+End:
+    vhd_sync_xt_destroy_curl_transfer(curl_config, transfer);
+    vhd_sync_xt_destroy_curl_config(curl_config);
+    return status;
+}
+
+static bool
+bench_receive_splice(
+    int connection,
+    char *url,
+    pvhd_sync_xt_writer writer,
+    unsigned long int file_size
+    )
+/*
+ * This function receives the file with the raw client, splicing the body
+ * into the file a VHD block at a time the way a download does.
+ *
+ * Parameters:
+ *
+ *      connection - Supplies the socket.
+ *
+ *      url - Supplies the url of the file.
+ *
+ *      writer - Supplies the writer of the file.
+ *
+ *      file_size - Supplies the size of the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_raw_http raw_http = NULL;
+    unsigned long int offset;
+    unsigned long int length;
+
+    status = false;
+
+    if (vhd_sync_xt_create_raw_http(connection, url, NULL, NULL, &raw_http) == false
+        || vhd_sync_xt_raw_http_request(raw_http, NULL, 0, file_size - 1, NULL) == false
+        || raw_http->remaining != file_size)
+    {
+        goto End;
+    }
+
+    for (offset = 0; offset < file_size; offset += length)
+    {
+        length = file_size - offset;
+        if (length > BENCH_RECEIVE_BLOCK_SIZE)
+        {
+            length = BENCH_RECEIVE_BLOCK_SIZE;
+        }
+
+        if (vhd_sync_xt_raw_http_splice_body(raw_http, writer, offset, length) == false)
+        {
+            goto End;
+        }
+    }
+
+    status = true;
+
+End:
+    vhd_sync_xt_destroy_raw_http(raw_http);
+    close(connection);
+    return status;
+}
+
+static bool
+bench_receive_same(
+    char *path,
+    char *source_path,
+    unsigned long int file_size,
+    char *buffer
+    )
+/*
+ * This function checks that the file received is the file served.
+ *
+ * Parameters:
+ *
+ *      path - Supplies the path of the file received.
+ *
+ *      source_path - Supplies the path of the file served.
+ *
+ *      file_size - Supplies the size of the files.
+ *
+ *      buffer - Supplies a buffer of BENCH_RECEIVE_BUFFER_SIZE.
+ *
+ * Return Value:
+ *
+ *      TRUE if they are the same, FALSE otherwise.
+ */
+{
+    bool status;
+    int fd;
+    int source;
+    unsigned long int offset;
+    size_t length;
+
+    status = false;
+    fd = open(path, O_RDONLY);
+    source = open(source_path, O_RDONLY);
+    if (fd < 0 || source < 0)
+    {
+        goto End;
+    }
+
+    for (offset = 0; offset < file_size; offset += length)
+    {
+        length = file_size - offset;
+        if (length > BENCH_RECEIVE_BUFFER_SIZE / 2)
+        {
+            length = BENCH_RECEIVE_BUFFER_SIZE / 2;
+        }
+
+        if (pread(fd, buffer, length, offset) != length
+            || pread(source, buffer + length, length, offset) != length
+            || memcmp(buffer, buffer + length, length) != 0)
+        {
+            goto End;
+        }
+    }
+
+    status = true;
+
+End:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (source >= 0)
+    {
+        close(source);
+    }
+    return status;
+}
+
+static bool
+bench_receive_run(
+    char *path,
+    char *source_path,
+    char *url,
+    struct sockaddr_in *address,
+    bool splice,
+    char *buffer,
+    unsigned long int file_size
+    )
+/*
+ * This function receives the file one way over a new connection and prints
+ * the results.
+ *
+ * Parameters:
+ *
+ *      path - Supplies the path of the file to write.
+ *
+ *      source_path - Supplies the path of the file served.
+ *
+ *      url - Supplies the url of the file.
+ *
+ *      address - Supplies the address of the server.
+ *
+ *      splice - Supplies whether to splice, rather than use curl.
+ *
+ *      buffer - Supplies an aligned buffer of BENCH_RECEIVE_BUFFER_SIZE.
+ *
+ *      file_size - Supplies the size of the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_writer writer = NULL;
+    struct iovec iov;
+    int connection;
+    double wall;
+    double cpu;
+
+    status = false;
+
+    unlink(path);
+
+    connection = -1;
+    if (splice == true)
+    {
+        connection = socket(AF_INET, SOCK_STREAM, 0);
+        if (connection < 0
+            || connect(connection, (struct sockaddr*)address, sizeof(*address)) != 0)
+        {
+            if (connection >= 0)
+            {
+                close(connection);
+            }
+            goto End;
+        }
+    }
+
+    wall = bench_receive_wall_seconds();
+    cpu = bench_receive_cpu_seconds();
+
+    status = vhd_sync_xt_open_writer(path,
+                                     VHD_SYNC_XT_WRITER_PWRITE,
+                                     file_size,
+                                     false,
+                                     false,
+                                     &writer
+                                     );
+    if (status == false)
+    {
+        if (connection >= 0)
+        {
+            close(connection);
+        }
+        goto End;
+    }
+
+    iov.iov_base = buffer;
+    iov.iov_len = BENCH_RECEIVE_BUFFER_SIZE;
+    vhd_sync_xt_writer_register_buffers(writer, &iov, 1);
+
+    if (splice == true)
+    {
+        status = bench_receive_splice(connection, url, writer, file_size);
+    }
+    else
+    {
+        status = bench_receive_curl(url, writer, buffer, file_size);
+    }
+
+    if (status == false
+        || vhd_sync_xt_writer_finish(writer) == false
+        || fdatasync(writer->fd) != 0)
+    {
+        status = false;
+        goto End;
+    }
+
+    vhd_sync_xt_destroy_writer(writer);
+    writer = NULL;
+
+    wall = bench_receive_wall_seconds() - wall;
+    cpu = bench_receive_cpu_seconds() - cpu;
+
+    status = bench_receive_same(path, source_path, file_size, buffer);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    printf("%-8s %10.1f MB/s %10.3f CPU s/GB\n",
+           (splice == true) ? "splice" : "curl",
+           file_size / wall / (1024 * 1024),
+           cpu / ((double)file_size / (1024 * 1024 * 1024)));
+
+End:
+    vhd_sync_xt_destroy_writer(writer);
+    unlink(path);
+    return status;
+}
+
+static bool
+bench_receive_create_source(
+    char *source_path,
+    char *buffer,
+    unsigned long int file_size
+    )
+/*
+ * This function writes the file the server sends, which changes every word
+ * so nothing about it can be skipped.
+ *
+ * Parameters:
+ *
+ *      source_path - Supplies the path of the file.
+ *
+ *      buffer - Supplies a buffer of BENCH_RECEIVE_BUFFER_SIZE.
+ *
+ *      file_size - Supplies the size of the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    int fd;
+    unsigned long int offset;
+    unsigned long int length;
+    unsigned long int i;
+
+    status = false;
+
+    fd = open(source_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    for (offset = 0; offset < file_size; offset += length)
+    {
+        length = file_size - offset;
+        if (length > BENCH_RECEIVE_BUFFER_SIZE)
+        {
+            length = BENCH_RECEIVE_BUFFER_SIZE;
+        }
+
+        for (i = 0; i < length; i += sizeof(unsigned long int))
+        {
+            *(unsigned long int*)(buffer + i) = offset + i + 1;
+        }
+
+        if (pwrite(fd, buffer, length, offset) != length)
+        {
+            goto End;
+        }
+    }
+
+    status = fsync(fd) == 0;
+
+End:
+    close(fd);
+    return status;
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs the benchmark.
+ *
+ * Parameters:
+ *
+ *      argv[1] - Supplies the directory to write in.
+ *
+ *      argv[2] - Optionally supplies the size of the file in MB.
+ *
+ * Return Value:
+ *
+ *      0 if both ways received the file.
+ */
+{
+    bool status;
+    char path[VHD_SYNC_XT_PATH_LENGTH];
+    char source_path[VHD_SYNC_XT_PATH_LENGTH];
+    char url[VHD_SYNC_XT_PATH_LENGTH];
+    char *buffer = NULL;
+    unsigned long int file_size;
+    struct sockaddr_in address;
+    socklen_t address_length;
+    int listen_socket;
+    pid_t server;
+    int run;
+
+    status = false;
+    server = -1;
+    listen_socket = -1;
+
+    if (argc < 2)
+    {
+        printf("Usage: %s <target directory> [size in MB]\n", argv[0]);
+        goto End;
+    }
+
+    file_size = BENCH_RECEIVE_DEFAULT_SIZE_MB;
+    if (argc > 2)
+    {
+        file_size = strtoul(argv[2], NULL, 10);
+    }
+    file_size *= 1024 * 1024;
+
+    snprintf(path, sizeof(path), "%s/%s", argv[1], BENCH_RECEIVE_FILE_NAME);
+    snprintf(source_path, sizeof(source_path), "%s/%s", argv[1], BENCH_RECEIVE_SOURCE_NAME);
+
+    if (posix_memalign((void**)&buffer,
+                       VHD_SYNC_XT_WRITER_DIRECT_ALIGNMENT,
+                       BENCH_RECEIVE_BUFFER_SIZE) != 0)
+    {
+        buffer = NULL;
+        goto End;
+    }
+
+    if (bench_receive_create_source(source_path, buffer, file_size) == false)
+    {
+        printf("Could not write %s\n", source_path);
+        goto End;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address_length = sizeof(address);
+
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0
+        || bind(listen_socket, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(listen_socket, 4) != 0
+        || getsockname(listen_socket, (struct sockaddr*)&address, &address_length) != 0)
+    {
+        printf("Could not listen on loopback\n");
+        goto End;
+    }
+
+    snprintf(url,
+             sizeof(url),
+             "http://127.0.0.1:%d/%s",
+             ntohs(address.sin_port),
+             BENCH_RECEIVE_SOURCE_NAME
+             );
+
+    server = fork();
+    if (server == 0)
+    {
+        bench_receive_serve(listen_socket, source_path, file_size);
+    }
+
+    if (server < 0)
+    {
+        goto End;
+    }
+
+    status = true;
+    for (run = 0; run < 2; ++run)
+    {
+        if (bench_receive_run(path,
+                              source_path,
+                              url,
+                              &address,
+                              run == 1,
+                              buffer,
+                              file_size) == false)
+        {
+            printf("%-8s failed\n", (run == 1) ? "splice" : "curl");
+            status = false;
+        }
+    }
+
+End:
+    if (server > 0)
+    {
+        kill(server, SIGKILL);
+        waitpid(server, NULL, 0);
+    }
+    if (listen_socket >= 0)
+    {
+        close(listen_socket);
+    }
+    if (argc >= 2)
+    {
+        unlink(source_path);
+    }
+    free(buffer);
+    return (status == true)?0:1;
+}
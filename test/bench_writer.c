@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is a benchmark of the writer backends. Each backend writes the same
+ * sparse file, a VHD block of zeros in every three, from 4MB aligned buffers
+ * the way a download does, and the file is synced before the clock stops.
+ * Each backend runs with and without writeback. For each it reports the
+ * throughput, the CPU time spent per GB written and how much of the file is
+ * left in the page cache afterwards.
+ *
+ *      bench_writer <target directory> [size in MB]
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_writer.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+#define BENCH_WRITER_FILE_NAME              "bench_writer.part"
+#define BENCH_WRITER_DEFAULT_SIZE_MB        1024
+#define BENCH_WRITER_BUFFER_SIZE            (4 * 1024 * 1024)
+#define BENCH_WRITER_BLOCK_SIZE             (2 * 1024 * 1024)
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static double
+bench_writer_cpu_seconds(
+    )
+/*
+ * This function returns the user and system CPU time used so far.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      CPU seconds.
+ */
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+           + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static double
+bench_writer_wall_seconds(
+    )
+/*
+ * This function returns the monotonic clock in seconds.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      Seconds.
+ */
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static unsigned long int
+bench_writer_cached_bytes(
+    char *path,
+    unsigned long int file_size
+    )
+/*
+ * This function returns how much of a file is in the page cache.
+ *
+ * Parameters:
+ *
+ *      path - Supplies the path of the file.
+ *
+ *      file_size - Supplies the size of the file.
+ *
+ * Return Value:
+ *
+ *      Bytes in the page cache.
+ */
+{
+    int fd;
+    void *mapping;
+    unsigned char *pages;
+    unsigned long int page_size;
+    unsigned long int page_count;
+    unsigned long int cached;
+    unsigned long int i;
+
+    cached = 0;
+    page_size = sysconf(_SC_PAGESIZE);
+    page_count = (file_size + page_size - 1) / page_size;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    mapping = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    pages = malloc(page_count);
+    if (mapping != MAP_FAILED
+        && pages != NULL
+        && mincore(mapping, file_size, pages) == 0)
+    {
+        for (i = 0; i < page_count; ++i)
+        {
+            if ((pages[i] & 1) != 0)
+            {
+                cached += page_size;
+            }
+        }
+    }
+
+    if (mapping != MAP_FAILED)
+    {
+        munmap(mapping, file_size);
+    }
+    free(pages);
+    close(fd);
+
+    return cached;
+}
+
+static bool
+bench_writer_run(
+    char *path,
+    vhd_sync_xt_writer_type type,
+    bool writeback,
+    char *buffer,
+    unsigned long int file_size
+    )
+/*
+ * This function writes the benchmark file with one backend and prints the
+ * results.
+ *
+ * Parameters:
+ *
+ *      path - Supplies the path of the file to write.
+ *
+ *      type - Supplies the backend.
+ *
+ *      writeback - Supplies whether to keep the file out of the page cache.
+ *
+ *      buffer - Supplies an aligned buffer of BENCH_WRITER_BUFFER_SIZE.
+ *
+ *      file_size - Supplies the size of the file.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_writer writer = NULL;
+    struct iovec iov;
+    unsigned long int offset;
+    unsigned long int length;
+    unsigned long int i;
+    double wall;
+    double cpu;
+
+    status = false;
+
+    unlink(path);
+
+    wall = bench_writer_wall_seconds();
+    cpu = bench_writer_cpu_seconds();
+
+    status = vhd_sync_xt_open_writer(path,
+                                     type,
+                                     file_size,
+                                     true,
+                                     writeback,
+                                     &writer
+                                     );
+    if (status == false)
+    {
+        printf("%-8s %-10s not available here\n",
+               vhd_sync_xt_writer_name(type),
+               (writeback == true) ? "writeback" : "");
+        status = true;
+        goto End;
+    }
+
+    iov.iov_base = buffer;
+    iov.iov_len = BENCH_WRITER_BUFFER_SIZE;
+    vhd_sync_xt_writer_register_buffers(writer, &iov, 1);
+
+    for (offset = 0; offset < file_size; offset += length)
+    {
+        length = file_size - offset;
+        if (length > BENCH_WRITER_BUFFER_SIZE)
+        {
+            length = BENCH_WRITER_BUFFER_SIZE;
+        }
+
+        //
+        // Every third VHD block is zeros, the rest changes every time so
+        // nothing can be skipped.
+        //
+        for (i = 0; i < length; i += sizeof(unsigned long int))
+        {
+            if ((offset + i) / BENCH_WRITER_BLOCK_SIZE % 3 == 2)
+            {
+                *(unsigned long int*)(buffer + i) = 0;
+            }
+            else
+            {
+                *(unsigned long int*)(buffer + i) = offset + i + 1;
+            }
+        }
+
+        if (vhd_sync_xt_writer_write(writer, buffer, length, offset) == false)
+        {
+            status = false;
+            goto End;
+        }
+    }
+
+    if (vhd_sync_xt_writer_finish(writer) == false
+        || fdatasync(writer->fd) != 0)
+    {
+        status = false;
+        goto End;
+    }
+
+    vhd_sync_xt_destroy_writer(writer);
+    writer = NULL;
+
+    wall = bench_writer_wall_seconds() - wall;
+    cpu = bench_writer_cpu_seconds() - cpu;
+
+    printf("%-8s %-10s %10.1f MB/s %10.3f CPU s/GB %10lu MB cached\n",
+           vhd_sync_xt_writer_name(type),
+           (writeback == true) ? "writeback" : "",
+           file_size / wall / (1024 * 1024),
+           cpu / ((double)file_size / (1024 * 1024 * 1024)),
+           bench_writer_cached_bytes(path, file_size) / (1024 * 1024));
+
+    status = true;
+
+End:
+    vhd_sync_xt_destroy_writer(writer);
+    unlink(path);
+    return status;
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs the benchmark.
+ *
+ * Parameters:
+ *
+ *      argv[1] - Supplies the directory to write in.
+ *
+ *      argv[2] - Optionally supplies the size of the file in MB.
+ *
+ * Return Value:
+ *
+ *      0 if every backend that is available ran.
+ */
+{
+    bool status;
+    char path[VHD_SYNC_XT_PATH_LENGTH];
+    char *buffer = NULL;
+    unsigned long int file_size;
+    int run;
+
+    status = false;
+
+    if (argc < 2)
+    {
+        printf("Usage: %s <target directory> [size in MB]\n", argv[0]);
+        goto End;
+    }
+
+    file_size = BENCH_WRITER_DEFAULT_SIZE_MB;
+    if (argc > 2)
+    {
+        file_size = strtoul(argv[2], NULL, 10);
+    }
+    file_size *= 1024 * 1024;
+
+    snprintf(path, sizeof(path), "%s/%s", argv[1], BENCH_WRITER_FILE_NAME);
+
+    if (posix_memalign((void**)&buffer,
+                       VHD_SYNC_XT_WRITER_DIRECT_ALIGNMENT,
+                       BENCH_WRITER_BUFFER_SIZE) != 0)
+    {
+        buffer = NULL;
+        goto End;
+    }
+
+    status = true;
+    for (run = 0; run < 2 * VHD_SYNC_XT_WRITER_TYPE_COUNT; ++run)
+    {
+        if (bench_writer_run(path, run / 2, run % 2 == 1, buffer, file_size) == false)
+        {
+            printf("%-8s failed\n", vhd_sync_xt_writer_name(run / 2));
+            status = false;
+        }
+    }
+
+End:
+    free(buffer);
+    return (status == true)?0:1;
+}
@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the file that contains the tests for the broker module, along
+ * with a stand-in broker that connects sockets to a local listener.
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <vhdsyncxt_broker.h>
+#include <vhdsyncxt_curl.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+#define TEST_BROKER_SOCKETS                 3
+#define TEST_BROKER_LIMIT                   2
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+bool
+test_broker_sockets(
+    );
+
+bool
+test_broker_limit(
+    );
+
+bool
+test_broker_curl(
+    );
+
+bool
+test_broker_no_answer(
+    );
+
+vhd_sync_xt_test g_broker_tests[] =
+{
+        {"Broker passes connected sockets", test_broker_sockets,        0},
+        {"Broker runs out of sockets",      test_broker_limit,          0},
+        {"Broker sockets for curl",         test_broker_curl,           0},
+        {"Broker that does not answer",     test_broker_no_answer,      0}
+};
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static int
+test_broker_listen(
+    struct sockaddr_in* address
+    )
+/*
+ * This function opens a listener on a free local port.
+ *
+ * Parameters:
+ *
+ *      address - Supplies a placeholder to return the address listened on.
+ *
+ * Return Value:
+ *
+ *      The listening socket, -1 on failure.
+ */
+{
+    socklen_t length;
+    int listener;
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        return -1;
+    }
+
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    length = sizeof(*address);
+
+    if (bind(listener, (struct sockaddr*)address, sizeof(*address)) != 0
+        || listen(listener, VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS) != 0
+        || getsockname(listener, (struct sockaddr*)address, &length) != 0)
+    {
+        close(listener);
+        return -1;
+    }
+
+    return listener;
+}
+
+static pid_t
+test_broker_start(
+    struct sockaddr_in* address,
+    int limit,
+    int* broker_fd
+    )
+/*
+ * This function starts a stand-in broker in a child process. It connects
+ * sockets to the address for every request, until it has given out limit
+ * of them, and exits once our end of its unix socket is closed.
+ *
+ * Parameters:
+ *
+ *      address - Supplies the address to connect sockets to.
+ *
+ *      limit - Supplies the most sockets the broker gives out.
+ *
+ *      broker_fd - Supplies a placeholder to return our end of the unix
+ *          socket to the broker.
+ *
+ * Return Value:
+ *
+ *      The pid of the broker, -1 on failure.
+ */
+{
+    int sockets[VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS];
+    int pair[2];
+    int count;
+    int given;
+    int i;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+    {
+        return -1;
+    }
+
+    pid = fork();
+    if (pid != 0)
+    {
+        close(pair[1]);
+        *broker_fd = pair[0];
+        return pid;
+    }
+
+    close(pair[0]);
+    given = 0;
+
+    while (vhd_sync_xt_broker_read_request(pair[1], &count) == true)
+    {
+        for (i = 0; i < count && given < limit; ++i, ++given)
+        {
+            sockets[i] = socket(AF_INET, SOCK_STREAM, 0);
+            if (sockets[i] < 0
+                || connect(sockets[i],
+                           (struct sockaddr*)address,
+                           sizeof(*address)) != 0)
+            {
+                _exit(1);
+            }
+        }
+
+        vhd_sync_xt_broker_send_sockets(pair[1], sockets, i);
+        while (i > 0)
+        {
+            close(sockets[--i]);
+        }
+    }
+
+    _exit(0);
+}
+
+static bool
+test_broker_stop(
+    pid_t pid,
+    int broker_fd
+    )
+/*
+ * This function closes our end of the unix socket to the stand-in broker
+ * and waits for it to exit.
+ *
+ * Parameters:
+ *
+ *      pid - Supplies the pid of the broker.
+ *
+ *      broker_fd - Supplies our end of the unix socket to the broker.
+ *
+ * Return Value:
+ *
+ *      TRUE if the broker exited cleanly, FALSE otherwise.
+ */
+{
+    int exit_status;
+
+    close(broker_fd);
+    if (waitpid(pid, &exit_status, 0) != pid)
+    {
+        return false;
+    }
+
+    return WIFEXITED(exit_status) && WEXITSTATUS(exit_status) == 0;
+}
+
+bool
+test_broker_sockets(
+    )
+/*
+ * This function tests that the sockets from the broker arrive connected to
+ * the server.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    struct sockaddr_in address;
+    int sockets[VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS];
+    int received;
+    int listener;
+    int broker_fd;
+    int accepted;
+    char data;
+    int i;
+    pid_t pid;
+
+    status = false;
+    received = 0;
+    pid = -1;
+
+    listener = test_broker_listen(&address);
+    if (listener < 0)
+    {
+        goto End;
+    }
+
+    pid = test_broker_start(&address, VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS, &broker_fd);
+    if (pid < 0)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_broker_request_sockets(broker_fd,
+                                                TEST_BROKER_SOCKETS,
+                                                sockets,
+                                                &received
+                                                );
+    if (status == false || received != TEST_BROKER_SOCKETS)
+    {
+        status = false;
+        goto End;
+    }
+
+    //
+    // Whatever goes in one of our sockets comes out of the server end.
+    //
+    for (i = 0; i < received; ++i)
+    {
+        data = 'a' + i;
+        accepted = accept(listener, NULL, NULL);
+        if (accepted < 0
+            || write(sockets[i], &data, 1) != 1
+            || read(accepted, &data, 1) != 1
+            || data != 'a' + i)
+        {
+            status = false;
+            goto End;
+        }
+        close(accepted);
+    }
+
+    status = true;
+
+End:
+    for (i = 0; i < received; ++i)
+    {
+        close(sockets[i]);
+    }
+
+    if (pid > 0 && test_broker_stop(pid, broker_fd) == false)
+    {
+        status = false;
+    }
+
+    if (listener >= 0)
+    {
+        close(listener);
+    }
+
+    return status;
+}
+
+bool
+test_broker_limit(
+    )
+/*
+ * This function tests asking a broker for more sockets than it will give.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    struct sockaddr_in address;
+    int sockets[VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS];
+    int received;
+    int listener;
+    int broker_fd;
+    int i;
+    pid_t pid;
+
+    status = false;
+    received = 0;
+    pid = -1;
+
+    listener = test_broker_listen(&address);
+    if (listener < 0)
+    {
+        goto End;
+    }
+
+    pid = test_broker_start(&address, TEST_BROKER_LIMIT, &broker_fd);
+    if (pid < 0)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_broker_request_sockets(broker_fd,
+                                                TEST_BROKER_SOCKETS,
+                                                sockets,
+                                                &received
+                                                );
+    if (status == false || received != TEST_BROKER_LIMIT)
+    {
+        status = false;
+        goto End;
+    }
+
+    for (i = 0; i < received; ++i)
+    {
+        close(sockets[i]);
+    }
+
+    //
+    // Once it is out it says so, which is not an error.
+    //
+    status = vhd_sync_xt_broker_request_sockets(broker_fd,
+                                                1,
+                                                sockets,
+                                                &received
+                                                );
+    if (status == false || received != 0)
+    {
+        status = false;
+        goto End;
+    }
+
+    status = true;
+
+End:
+    if (pid > 0 && test_broker_stop(pid, broker_fd) == false)
+    {
+        status = false;
+    }
+
+    if (listener >= 0)
+    {
+        close(listener);
+    }
+
+    return status;
+}
+
+bool
+test_broker_curl(
+    )
+/*
+ * This function tests that the curl configuration takes a socket from the
+ * broker for each connection it is asked for, as far as the broker goes.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_curl_config curl_config;
+    struct sockaddr_in address;
+    int listener;
+    int broker_fd;
+    pid_t pid;
+
+    status = false;
+    curl_config = NULL;
+    pid = -1;
+
+    listener = test_broker_listen(&address);
+    if (listener < 0)
+    {
+        goto End;
+    }
+
+    pid = test_broker_start(&address, TEST_BROKER_LIMIT, &broker_fd);
+    if (pid < 0)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_create_curl_config(&curl_config, 0);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_set_curl_broker(curl_config,
+                                         broker_fd,
+                                         TEST_BROKER_SOCKETS
+                                         );
+    if (status == false || curl_config->spare_count != TEST_BROKER_LIMIT)
+    {
+        status = false;
+        goto End;
+    }
+
+    status = true;
+
+End:
+    vhd_sync_xt_destroy_curl_config(curl_config);
+
+    if (pid > 0 && test_broker_stop(pid, broker_fd) == false)
+    {
+        status = false;
+    }
+
+    if (listener >= 0)
+    {
+        close(listener);
+    }
+
+    return status;
+}
+
+bool
+test_broker_no_answer(
+    )
+/*
+ * This function tests that a request the broker has not answered fails,
+ * and that the failed read leaves other sockets alone.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    int pair[2];
+    int sockets[VHD_SYNC_XT_BROKER_MAXIMUM_SOCKETS];
+    int received;
+    int other;
+
+    status = false;
+    other = -1;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) != 0)
+    {
+        return false;
+    }
+
+    other = socket(AF_INET, SOCK_STREAM, 0);
+    if (other < 0)
+    {
+        goto End;
+    }
+
+    //
+    // Nobody reads the other end, so the read finds nothing there.
+    //
+    status = vhd_sync_xt_broker_request_sockets(pair[0],
+                                                1,
+                                                sockets,
+                                                &received) == false
+             && received == 0
+             && fcntl(other, F_GETFD) != -1;
+
+End:
+    if (other >= 0)
+    {
+        close(other);
+    }
+    close(pair[0]);
+    close(pair[1]);
+    return status;
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs all the tests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      0 if all tests succeed.
+ */
+{
+    bool status;
+
+    status = run_tests(g_broker_tests,
+                       sizeof(g_broker_tests)/sizeof(vhd_sync_xt_test)
+                       );
+    print_test_results(g_broker_tests,
+                       sizeof(g_broker_tests)/sizeof(vhd_sync_xt_test)
+                       );
+
+End:
+    return (status == true)?0:1;
+}
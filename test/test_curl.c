@@ -33,13 +33,26 @@
  *
  * $ test_curl http://localhost/test_curl.bin
  *
+ * The tests of downloads from a server that gets in the way fork their own
+ * server on loopback.
+ *
  *   Sharath George (t_sharathg) Jan 2012
  */
 
 
 /* ---------------- Header includes --------------------------------------- */
+#define _GNU_SOURCE
+
 #include "vhdsyncxt_test.h"
 #include <vhdsyncxt_curl.h>
+#include <vhdsyncxt_download.h>
+#include <poll.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 /* ---------------- Pre processor defines ----------------------------------*/
 #define TEST_CURL_FILENAME             "test_curl.bin"
@@ -50,9 +63,69 @@
 //
 #define TEST_FILE_SIZE_INT             5120000
 #define TEST_FILE_RANGE                  80000
+#define TEST_CURL_TRANSFERS                  4
+#define TEST_CURL_TIMER_MS                  10
+#define TEST_CURL_TIMER_TICKS                3
+
+//
+// The downloads that run into trouble get a file of a few chunks from a
+// forked server on loopback. A hedge starts on the block after where a
+// stalled range got to, so a chunk is two blocks. A request is read in one
+// go, and a stalled response waits this long for the client to go away.
+//
+#define TEST_CURL_SERVER_FILE               "test_curl_download.bin"
+#define TEST_CURL_SERVER_CHUNK_SIZE         (2 * VHD_SYNC_XT_VHD_BLOCK_SIZE)
+#define TEST_CURL_SERVER_FILE_SIZE          (4 * TEST_CURL_SERVER_CHUNK_SIZE + 100)
+#define TEST_CURL_SERVER_REQUEST_LENGTH     4096
+#define TEST_CURL_SERVER_RESETS             3
+#define TEST_CURL_SERVER_RESET_DELAY_USEC   100000
+#define TEST_CURL_SERVER_STALL_BYTES        (64 * 1024)
+#define TEST_CURL_SERVER_STALL_MS           60000
+#define TEST_CURL_SERVER_STREAMS            2
 
 /* ---------------- Struct defines and globals------------------------------*/
 
+//
+// How the server gets in the way of the download. The first request is
+// always answered, so the download gets going.
+//
+typedef enum _test_curl_server_mode
+{
+    //
+    // A few requests are reset halfway through the body.
+    //
+    TEST_CURL_SERVER_RESET_MIDWAY = 0,
+
+    //
+    // Every request is reset before any of the body.
+    //
+    TEST_CURL_SERVER_RESET_EARLY,
+
+    //
+    // The first request for the second chunk sends a little and stalls.
+    //
+    TEST_CURL_SERVER_STALL
+
+} test_curl_server_mode;
+
+//
+// The server, and what its connections share.
+//
+typedef struct _test_curl_server
+{
+    test_curl_server_mode mode;
+    char *data;
+    int listener;
+    unsigned short port;
+    pid_t pid;
+
+    //
+    // Shared with the process of each connection.
+    //
+    int *shared;
+
+} test_curl_server, *ptest_curl_server;
+
 bool
 test_curl_initialize(
     );
@@ -73,12 +146,42 @@ bool
 test_curl_get_data_range(
     );
 
+bool
+test_curl_parallel_transfers(
+    );
+
+bool
+test_curl_event_loop(
+    );
+
+bool
+test_curl_shared_pool(
+    );
+
+bool
+test_curl_retry_reset(
+    );
+
+bool
+test_curl_retry_limit(
+    );
+
+bool
+test_curl_stalled_range(
+    );
+
 vhd_sync_xt_test g_curl_tests[] =
 {
         {"Curl Init",                  test_curl_init,             0},
         {"Curl Get Header",            test_curl_get_header,       0},
         {"Curl Get Data",              test_curl_get_data,         0},
-        {"Curl Get Range Data",        test_curl_get_data_range,   0}
+        {"Curl Get Range Data",        test_curl_get_data_range,   0},
+        {"Curl Parallel Transfers",    test_curl_parallel_transfers, 0},
+        {"Curl Event Loop",            test_curl_event_loop,       0},
+        {"Curl Shared Pool",           test_curl_shared_pool,      0},
+        {"Retry ranges that are reset", test_curl_retry_reset,     0},
+        {"Retries stop at the limit",  test_curl_retry_limit,      0},
+        {"Hedge or split a stalled range", test_curl_stalled_range, 0}
 };
 
 pvhd_sync_xt_curl_config g_curl_config;
@@ -487,6 +590,955 @@ End:
     }
     return status;
 }
+static size_t
+test_curl_transfer_write_callback(
+        void *data_stream,
+        size_t size,
+        size_t nmemb,
+        void *user_data
+        )
+/*
+ * This function is the callback set to receive the body of a transfer. It
+ * appends the data to the stream of the transfer.
+ *
+ * Parameters:
+ *
+ *      data_stream - Supplies the data received.
+ *
+ *      size - Supplies the size of the data unit in the stream.
+ *
+ *      nmemb - Supplies the number of members of the data.
+ *
+ *      user_data - Set to point to the output file of the transfer.
+ *
+ * Return Value:
+ *
+ *      Returns the size of data written.
+ */
+{
+    return fwrite(data_stream, size, nmemb, (FILE*)user_data) * size;
+}
+
+bool
+test_curl_parallel_transfers(
+    )
+/*
+ * This function tests running several ranged transfers at the same time.
+ * Each transfer gets a different quarter of the file.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_curl_transfer transfers[TEST_CURL_TRANSFERS] = {NULL};
+    FILE *out[TEST_CURL_TRANSFERS] = {NULL};
+    unsigned long int range_size;
+    int test;
+    int i;
+    int j;
+    int active;
+
+    status = false;
+    range_size = TEST_FILE_SIZE_INT * sizeof(int) / TEST_CURL_TRANSFERS;
+
+    status = vhd_sync_xt_create_curl_config(&g_curl_config, 0);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_set_url(g_curl_config, g_server_url, NULL, NULL, NULL);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    for (i = 0; i < TEST_CURL_TRANSFERS; ++i)
+    {
+        out[i] = tmpfile();
+
+        status = vhd_sync_xt_create_curl_transfer(g_curl_config, &transfers[i]);
+        if (status == false || out[i] == NULL)
+        {
+            status = false;
+            goto End;
+        }
+
+        status = vhd_sync_xt_set_curl_transfer_write(transfers[i],
+                                                     test_curl_header_callback_null,
+                                                     test_curl_transfer_write_callback,
+                                                     out[i]
+                                                     );
+        if (status == false)
+        {
+            goto End;
+        }
+
+        status = vhd_sync_xt_set_curl_transfer_range(transfers[i],
+                                                     i * range_size,
+                                                     (i + 1) * range_size - 1
+                                                     );
+        if (status == false)
+        {
+            goto End;
+        }
+
+        status = vhd_sync_xt_start_curl_transfer(g_curl_config, transfers[i]);
+        if (status == false)
+        {
+            goto End;
+        }
+    }
+
+    do
+    {
+        status = vhd_sync_xt_wait_curl_transfers(g_curl_config);
+        if (status == false)
+        {
+            goto End;
+        }
+
+        active = 0;
+        for (i = 0; i < TEST_CURL_TRANSFERS; ++i)
+        {
+            if (transfers[i]->active == true)
+            {
+                ++active;
+            }
+        }
+    } while (active != 0);
+
+    //
+    // verify each transfer got its own quarter of the file.
+    //
+    for (i = 0; i < TEST_CURL_TRANSFERS; ++i)
+    {
+        if (transfers[i]->result != CURLE_OK
+            || ftell(out[i]) != range_size)
+        {
+            status = false;
+            goto End;
+        }
+
+        fseek(out[i], 0L, SEEK_SET);
+        for (j = 0; j < range_size / sizeof(int); ++j)
+        {
+            if (fread(&test, sizeof(int), 1, out[i]) < 1
+                || test != i * (range_size / sizeof(int)) + j)
+            {
+                status = false;
+                goto End;
+            }
+        }
+    }
+
+    status = true;
+End:
+    for (i = 0; i < TEST_CURL_TRANSFERS; ++i)
+    {
+        vhd_sync_xt_destroy_curl_transfer(g_curl_config, transfers[i]);
+        if (out[i] != NULL)
+        {
+            fclose(out[i]);
+        }
+    }
+    vhd_sync_xt_destroy_curl_config(g_curl_config);
+    return status;
+}
+
+static int g_timer_ticks;
+static int g_fd_reads;
+static pvhd_sync_xt_curl_event g_fd_event;
+
+static bool
+test_curl_timer_callback(
+    void *user_data
+    )
+/*
+ * This function is the callback set for the timer, and counts its ticks.
+ *
+ * Parameters:
+ *
+ *      user_data - Unused.
+ *
+ * Return Value:
+ *
+ *      TRUE.
+ */
+{
+    ++g_timer_ticks;
+    return true;
+}
+
+static bool
+test_curl_fd_callback(
+    void *user_data
+    )
+/*
+ * This function is the callback set for the read end of a pipe. It reads
+ * what is there and takes the pipe out of the loop.
+ *
+ * Parameters:
+ *
+ *      user_data - Supplies a pointer to the fd of the pipe.
+ *
+ * Return Value:
+ *
+ *      TRUE if there was something to read, FALSE otherwise.
+ */
+{
+    char data;
+
+    if (read(*(int*)user_data, &data, 1) != 1)
+    {
+        return false;
+    }
+
+    ++g_fd_reads;
+    vhd_sync_xt_remove_curl_event(g_curl_config, g_fd_event);
+    return true;
+}
+
+bool
+test_curl_event_loop(
+    )
+/*
+ * This function tests that fds and timers of our own are handled by the
+ * event loop along with a transfer, and that an event can take itself out
+ * of the loop from its callback.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_curl_transfer transfer = NULL;
+    pvhd_sync_xt_curl_event timer_event;
+    FILE *out = NULL;
+    int pipe_fds[2] = {-1, -1};
+    int i;
+
+    status = false;
+    g_timer_ticks = 0;
+    g_fd_reads = 0;
+
+    status = vhd_sync_xt_create_curl_config(&g_curl_config, 0);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_set_url(g_curl_config, g_server_url, NULL, NULL, NULL);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    out = tmpfile();
+    status = (out != NULL && pipe(pipe_fds) == 0)
+             && vhd_sync_xt_create_curl_transfer(g_curl_config, &transfer)
+             && vhd_sync_xt_set_curl_transfer_write(transfer,
+                                                    test_curl_header_callback_null,
+                                                    test_curl_transfer_write_callback,
+                                                    out)
+             && vhd_sync_xt_add_curl_timer(g_curl_config,
+                                           TEST_CURL_TIMER_MS,
+                                           test_curl_timer_callback,
+                                           NULL,
+                                           &timer_event)
+             && vhd_sync_xt_add_curl_event(g_curl_config,
+                                           pipe_fds[0],
+                                           test_curl_fd_callback,
+                                           &pipe_fds[0],
+                                           &g_fd_event)
+             && vhd_sync_xt_start_curl_transfer(g_curl_config, transfer);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    //
+    // Two bytes, but the fd is out of the loop after the first.
+    //
+    write(pipe_fds[1], "xx", 2);
+
+    while (transfer->active == true
+           || g_timer_ticks < TEST_CURL_TIMER_TICKS)
+    {
+        status = vhd_sync_xt_wait_curl_transfers(g_curl_config);
+        if (status == false)
+        {
+            goto End;
+        }
+    }
+
+    vhd_sync_xt_remove_curl_event(g_curl_config, timer_event);
+    i = g_timer_ticks;
+
+    vhd_sync_xt_set_curl_wait_timeout(g_curl_config, 3 * TEST_CURL_TIMER_MS);
+    status = vhd_sync_xt_wait_curl_transfers(g_curl_config);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    fseek(out, 0L, SEEK_END);
+    if (transfer->result != CURLE_OK
+        || ftell(out) != TEST_FILE_SIZE_INT * sizeof(int)
+        || g_fd_reads != 1
+        || g_timer_ticks != i)
+    {
+        status = false;
+        goto End;
+    }
+
+    status = true;
+End:
+    vhd_sync_xt_destroy_curl_transfer(g_curl_config, transfer);
+    vhd_sync_xt_destroy_curl_config(g_curl_config);
+    if (out != NULL)
+    {
+        fclose(out);
+    }
+
+    for (i = 0; i < 2; ++i)
+    {
+        if (pipe_fds[i] >= 0)
+        {
+            close(pipe_fds[i]);
+        }
+    }
+    return status;
+}
+
+static bool
+test_curl_shared_transfer(
+    pvhd_sync_xt_curl_config curl_config,
+    long* connects
+    )
+/*
+ * This function gets the first bytes of the test file with a transfer of
+ * a configuration, and returns how many connections it opened for them.
+ *
+ * Parameters:
+ *
+ *      curl_config - Supplies the curl configuration.
+ *
+ *      connects - Supplies a placeholder to return the number of new
+ *          connections.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_curl_transfer transfer;
+    FILE *out;
+
+    transfer = NULL;
+    out = tmpfile();
+
+    status = out != NULL
+             && vhd_sync_xt_set_url(curl_config, g_server_url, NULL, NULL, NULL) == true
+             && vhd_sync_xt_create_curl_transfer(curl_config, &transfer) == true
+             && vhd_sync_xt_set_curl_transfer_write(transfer,
+                                                    test_curl_header_callback_null,
+                                                    test_curl_transfer_write_callback,
+                                                    out) == true
+             && vhd_sync_xt_set_curl_transfer_range(transfer, 0, 1023) == true
+             && vhd_sync_xt_start_curl_transfer(curl_config, transfer) == true;
+
+    while (status == true && transfer->active == true)
+    {
+        status = vhd_sync_xt_wait_curl_transfers(curl_config);
+    }
+
+    if (status == true)
+    {
+        status = transfer->result == CURLE_OK
+                 && ftell(out) == 1024
+                 && curl_easy_getinfo(transfer->curlhandle,
+                                      CURLINFO_NUM_CONNECTS,
+                                      connects) == CURLE_OK;
+    }
+
+    vhd_sync_xt_destroy_curl_transfer(curl_config, transfer);
+    if (out != NULL)
+    {
+        fclose(out);
+    }
+
+    return status;
+}
+
+bool
+test_curl_shared_pool(
+    )
+/*
+ * This function tests that a configuration picks up the connection another
+ * one left behind, once the other is gone.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_curl_config first_config;
+    pvhd_sync_xt_curl_config second_config;
+    long connects;
+
+    first_config = NULL;
+    second_config = NULL;
+
+    status = vhd_sync_xt_create_curl_config(&first_config, 0)
+             && vhd_sync_xt_create_curl_config(&second_config, 0)
+             && first_config->share == second_config->share
+             && test_curl_shared_transfer(first_config, &connects) == true
+             && connects == 1;
+    if (status == false)
+    {
+        goto End;
+    }
+
+    vhd_sync_xt_destroy_curl_config(first_config);
+    first_config = NULL;
+
+    status = test_curl_shared_transfer(second_config, &connects) == true
+             && connects == 0;
+
+End:
+    vhd_sync_xt_destroy_curl_config(first_config);
+    vhd_sync_xt_destroy_curl_config(second_config);
+    return status;
+}
+
+static void
+test_curl_server_reset(
+    int connection
+    )
+/*
+ * This function resets a connection, rather than closing it cleanly.
+ *
+ * Parameters:
+ *
+ *      connection - Supplies the connected socket.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    struct linger linger;
+
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    setsockopt(connection, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(connection);
+}
+
+static bool
+test_curl_server_send(
+    int connection,
+    const char *data,
+    size_t length
+    )
+/*
+ * This function sends all of a buffer.
+ *
+ * Parameters:
+ *
+ *      connection - Supplies the connected socket.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    ssize_t result;
+
+    while (length > 0)
+    {
+        result = send(connection, data, length, MSG_NOSIGNAL);
+        if (result <= 0)
+        {
+            return false;
+        }
+        data += result;
+        length -= result;
+    }
+
+    return true;
+}
+
+static void
+test_curl_server_connection(
+    ptest_curl_server server,
+    int connection
+    )
+/*
+ * This function answers the requests on a connection until it is closed,
+ * or the mode of the server says to stop answering.
+ *
+ * Parameters:
+ *
+ *      server - Supplies the server.
+ *
+ *      connection - Supplies the accepted socket.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    char request[TEST_CURL_SERVER_REQUEST_LENGTH];
+    char headers[TEST_CURL_SERVER_REQUEST_LENGTH];
+    size_t received;
+    ssize_t result;
+    char *range;
+    unsigned long int start;
+    unsigned long int end;
+    unsigned long int length;
+    int number;
+    struct pollfd poll_fd;
+
+    while (true)
+    {
+        received = 0;
+        request[0] = '\0';
+        while (strstr(request, "\r\n\r\n") == NULL)
+        {
+            result = recv(connection,
+                          request + received,
+                          sizeof(request) - 1 - received,
+                          0);
+            if (result <= 0 || received + result == sizeof(request) - 1)
+            {
+                close(connection);
+                return;
+            }
+            received += result;
+            request[received] = '\0';
+        }
+
+        start = 0;
+        end = TEST_CURL_SERVER_FILE_SIZE - 1;
+        range = strcasestr(request, "\r\nRange: bytes=");
+        if (range != NULL)
+        {
+            sscanf(range, "\r\n%*[^=]=%lu-%lu", &start, &end);
+        }
+        if (end >= TEST_CURL_SERVER_FILE_SIZE)
+        {
+            end = TEST_CURL_SERVER_FILE_SIZE - 1;
+        }
+        length = end + 1 - start;
+
+        snprintf(headers,
+                 sizeof(headers),
+                 "HTTP/1.1 206 Partial Content\r\n"
+                 "Content-Range: bytes %lu-%lu/%d\r\n"
+                 "Content-Length: %lu\r\n"
+                 "Accept-Ranges: bytes\r\n"
+                 "\r\n",
+                 start,
+                 end,
+                 TEST_CURL_SERVER_FILE_SIZE,
+                 length);
+
+        number = __sync_fetch_and_add(&server->shared[0], 1);
+
+        if (test_curl_server_send(connection, headers, strlen(headers)) == false)
+        {
+            close(connection);
+            return;
+        }
+
+        if (number > 0
+            && (server->mode == TEST_CURL_SERVER_RESET_EARLY
+                || (server->mode == TEST_CURL_SERVER_RESET_MIDWAY
+                    && number <= TEST_CURL_SERVER_RESETS)))
+        {
+            if (server->mode == TEST_CURL_SERVER_RESET_MIDWAY)
+            {
+                test_curl_server_send(connection, server->data + start, length / 2);
+                usleep(TEST_CURL_SERVER_RESET_DELAY_USEC);
+            }
+            test_curl_server_reset(connection);
+            return;
+        }
+
+        //
+        // Only the first request for the chunk stalls, a hedge for it does
+        // not.
+        //
+        if (server->mode == TEST_CURL_SERVER_STALL
+            && start == TEST_CURL_SERVER_CHUNK_SIZE
+            && __sync_bool_compare_and_swap(&server->shared[1], 0, 1) == true)
+        {
+            test_curl_server_send(connection,
+                                  server->data + start,
+                                  TEST_CURL_SERVER_STALL_BYTES);
+            poll_fd.fd = connection;
+            poll_fd.events = POLLIN;
+            poll(&poll_fd, 1, TEST_CURL_SERVER_STALL_MS);
+            close(connection);
+            return;
+        }
+
+        if (test_curl_server_send(connection, server->data + start, length) == false)
+        {
+            close(connection);
+            return;
+        }
+    }
+}
+
+static bool
+test_curl_start_server(
+    test_curl_server_mode mode,
+    ptest_curl_server server
+    )
+/*
+ * This function forks a server on loopback that serves a test file, each
+ * connection in a process of its own.
+ *
+ * Parameters:
+ *
+ *      mode - Supplies how the server gets in the way.
+ *
+ *      server - Supplies the server to start.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    struct sockaddr_in address;
+    socklen_t address_length;
+    int connection;
+    unsigned long int i;
+
+    memset(server, 0, sizeof(*server));
+    server->mode = mode;
+    server->listener = -1;
+    server->pid = -1;
+
+    server->data = malloc(TEST_CURL_SERVER_FILE_SIZE);
+    server->shared = mmap(NULL,
+                          2 * sizeof(int),
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS,
+                          -1,
+                          0);
+    if (server->data == NULL || server->shared == MAP_FAILED)
+    {
+        server->shared = NULL;
+        return false;
+    }
+    server->shared[0] = 0;
+    server->shared[1] = 0;
+
+    for (i = 0; i < TEST_CURL_SERVER_FILE_SIZE; ++i)
+    {
+        server->data[i] = (char)(i * 7 + i / 4099);
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address_length = sizeof(address);
+
+    server->listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listener < 0
+        || bind(server->listener, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(server->listener, 16) != 0
+        || getsockname(server->listener,
+                       (struct sockaddr*)&address,
+                       &address_length) != 0)
+    {
+        return false;
+    }
+    server->port = ntohs(address.sin_port);
+
+    server->pid = fork();
+    if (server->pid < 0)
+    {
+        return false;
+    }
+
+    if (server->pid == 0)
+    {
+        signal(SIGCHLD, SIG_IGN);
+        while (true)
+        {
+            connection = accept(server->listener, NULL, NULL);
+            if (connection < 0)
+            {
+                continue;
+            }
+            if (fork() == 0)
+            {
+                close(server->listener);
+                test_curl_server_connection(server, connection);
+                _exit(0);
+            }
+            close(connection);
+        }
+    }
+
+    return true;
+}
+
+static void
+test_curl_stop_server(
+    ptest_curl_server server
+    )
+/*
+ * This function stops a server. The processes of its connections go once
+ * the client closes them.
+ *
+ * Parameters:
+ *
+ *      server - Supplies the server.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (server->pid > 0)
+    {
+        kill(server->pid, SIGKILL);
+        waitpid(server->pid, NULL, 0);
+    }
+    if (server->listener >= 0)
+    {
+        close(server->listener);
+    }
+    if (server->shared != NULL)
+    {
+        munmap(server->shared, 2 * sizeof(int));
+    }
+    free(server->data);
+}
+
+static void
+test_curl_remove_download(
+    )
+/*
+ * This function removes what a download from the server left behind.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    unlink(TEST_CURL_SERVER_FILE);
+    unlink(TEST_CURL_SERVER_FILE VHD_SYNC_XT_VALIDATORS_EXTENSION);
+    unlink(TEST_CURL_SERVER_FILE VHD_SYNC_XT_PARTIAL_FILE_EXTENSION);
+    unlink(TEST_CURL_SERVER_FILE VHD_SYNC_XT_PARTIAL_FILE_EXTENSION
+           VHD_SYNC_XT_RESUME_MAP_EXTENSION);
+    unlink(TEST_CURL_SERVER_FILE VHD_SYNC_XT_PARTIAL_FILE_EXTENSION
+           VHD_SYNC_XT_VALIDATORS_EXTENSION);
+}
+
+static bool
+test_curl_download(
+    test_curl_server_mode mode,
+    int parallel_streams,
+    pvhd_sync_xt_download_stats stats
+    )
+/*
+ * This function downloads the file of a server in chunks of two blocks,
+ * and checks what it got.
+ *
+ * Parameters:
+ *
+ *      mode - Supplies how the server gets in the way.
+ *
+ *      parallel_streams - Supplies the number of ranges in flight.
+ *
+ *      stats - Supplies a placeholder for the counters of the download.
+ *
+ * Return Value:
+ *
+ *      TRUE if the file was downloaded whole, FALSE otherwise.
+ */
+{
+    bool status;
+    test_curl_server server;
+    pvhd_sync_xt_curl_config curl_config = NULL;
+    pvhd_sync_xt_download_context download_context = NULL;
+    vhd_sync_xt_download_options options;
+    char url[VHD_SYNC_XT_PATH_LENGTH];
+    char *data = NULL;
+    FILE *file = NULL;
+
+    status = false;
+    memset(stats, 0, sizeof(*stats));
+    test_curl_remove_download();
+
+    if (test_curl_start_server(mode, &server) == false
+        || vhd_sync_xt_create_curl_config(&curl_config, 0) == false)
+    {
+        goto End;
+    }
+
+    snprintf(url,
+             sizeof(url),
+             "http://127.0.0.1:%u/" TEST_CURL_SERVER_FILE,
+             server.port);
+
+    memset(&options, 0, sizeof(options));
+    options.parallel_streams = parallel_streams;
+    options.writer_type = VHD_SYNC_XT_WRITER_PWRITE;
+    options.write_buffer_size = VHD_SYNC_XT_VHD_BLOCK_SIZE;
+
+    if (vhd_sync_xt_create_download_context(curl_config,
+                                            ".",
+                                            TEST_CURL_SERVER_FILE,
+                                            url,
+                                            NULL,
+                                            NULL,
+                                            NULL,
+                                            0,
+                                            &options,
+                                            &download_context) == false)
+    {
+        goto End;
+    }
+    download_context->chunk_size = TEST_CURL_SERVER_CHUNK_SIZE;
+
+    status = vhd_sync_xt_start_download(download_context) == 0
+             && vhd_sync_xt_finalize_download(download_context) == true;
+    *stats = download_context->stats;
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = false;
+    data = malloc(TEST_CURL_SERVER_FILE_SIZE + 1);
+    file = fopen(TEST_CURL_SERVER_FILE, "rb");
+    if (data == NULL
+        || file == NULL
+        || fread(data, 1, TEST_CURL_SERVER_FILE_SIZE + 1, file)
+           != TEST_CURL_SERVER_FILE_SIZE
+        || memcmp(data, server.data, TEST_CURL_SERVER_FILE_SIZE) != 0)
+    {
+        goto End;
+    }
+
+    status = true;
+
+End:
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    free(data);
+    vhd_sync_xt_destroy_download_context(download_context);
+    vhd_sync_xt_destroy_curl_config(curl_config);
+    test_curl_stop_server(&server);
+    test_curl_remove_download();
+    return status;
+}
+
+bool
+test_curl_retry_reset(
+    )
+/*
+ * This function tests that ranges reset partway through are asked for
+ * again, once each, and the file comes out whole.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_download_stats stats;
+
+    return test_curl_download(TEST_CURL_SERVER_RESET_MIDWAY,
+                              TEST_CURL_SERVER_STREAMS,
+                              &stats) == true
+           && stats.retries == TEST_CURL_SERVER_RESETS;
+}
+
+bool
+test_curl_retry_limit(
+    )
+/*
+ * This function tests that a range that never gets anything is retried as
+ * many times as the limit allows, and then the download fails.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_download_stats stats;
+
+    return test_curl_download(TEST_CURL_SERVER_RESET_EARLY, 1, &stats) == false
+           && stats.retries == VHD_SYNC_XT_RETRY_LIMIT;
+}
+
+bool
+test_curl_stalled_range(
+    )
+/*
+ * This function tests that a range that stalls is hedged or split by a
+ * range with nothing left to do, and the file comes out whole.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_download_stats stats;
+
+    return test_curl_download(TEST_CURL_SERVER_STALL,
+                              TEST_CURL_SERVER_STREAMS,
+                              &stats) == true
+           && stats.hedges + stats.splits > 0;
+}
+
 int
 main(
     int argc,
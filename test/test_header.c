@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the file that contains the tests for the header parsing module.
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_header.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+bool
+test_header_partial(
+    );
+
+bool
+test_header_full(
+    );
+
+bool
+test_header_unsatisfiable(
+    );
+
+bool
+test_header_bad_values(
+    );
+
+bool
+test_header_redirect(
+    );
+
+vhd_sync_xt_test g_header_tests[] =
+{
+        {"Header partial response",         test_header_partial,        0},
+        {"Header full response",            test_header_full,           0},
+        {"Header range past the end",       test_header_unsatisfiable,  0},
+        {"Header bad values",               test_header_bad_values,     0},
+        {"Header last response wins",       test_header_redirect,       0}
+};
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static void
+test_header_parse(
+    pvhd_sync_xt_http_headers headers,
+    const char** lines
+    )
+/*
+ * This function feeds lines to the parser the way curl does, one at a time
+ * and without a terminating NUL.
+ *
+ * Parameters:
+ *
+ *      headers - Supplies the headers to fill in.
+ *
+ *      lines - Supplies the lines, ending with NULL.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    char line[512];
+    size_t length;
+
+    for (; *lines != NULL; ++lines)
+    {
+        length = strlen(*lines);
+        memcpy(line, *lines, length);
+        memset(line + length, 'x', sizeof(line) - length);
+        vhd_sync_xt_parse_http_header(headers, line, length);
+    }
+}
+
+bool
+test_header_partial(
+    )
+/*
+ * This function tests a partial response, with header names in any case.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_http_headers headers;
+    unsigned long int file_size;
+    const char* lines[] =
+    {
+        "HTTP/1.1 206 Partial Content\r\n",
+        "content-length: 1024\r\n",
+        "CONTENT-RANGE:  bytes 0-1023/5000000000 \r\n",
+        "ETag: \"abc-123\"\r\n",
+        "last-modified: Tue, 01 Jan 2013 00:00:00 GMT\r\n",
+        "\r\n",
+        NULL
+    };
+
+    vhd_sync_xt_reset_http_headers(&headers);
+    test_header_parse(&headers, lines);
+
+    return headers.complete == true
+           && headers.status_code == 206
+           && headers.has_content_length == true
+           && headers.content_length == 1024
+           && headers.has_range == true
+           && headers.range_start == 0
+           && headers.range_end == 1023
+           && headers.has_total_size == true
+           && headers.total_size == 5000000000UL
+           && strcmp(headers.etag, "\"abc-123\"") == 0
+           && strcmp(headers.last_modified, "Tue, 01 Jan 2013 00:00:00 GMT") == 0
+           && vhd_sync_xt_http_headers_size(&headers, &file_size) == true
+           && file_size == 5000000000UL;
+}
+
+bool
+test_header_full(
+    )
+/*
+ * This function tests a server that ignores the range and sends the whole
+ * file.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_http_headers headers;
+    unsigned long int file_size;
+    const char* lines[] =
+    {
+        "HTTP/2 200 \r\n",
+        "accept-ranges: none\r\n",
+        "content-length: 4096\r\n",
+        "\r\n",
+        NULL
+    };
+
+    vhd_sync_xt_reset_http_headers(&headers);
+    test_header_parse(&headers, lines);
+
+    return headers.complete == true
+           && headers.status_code == 200
+           && headers.accept_ranges == false
+           && headers.has_range == false
+           && vhd_sync_xt_http_headers_size(&headers, &file_size) == true
+           && file_size == 4096;
+}
+
+bool
+test_header_unsatisfiable(
+    )
+/*
+ * This function tests a range that starts past the end of an empty file,
+ * which gets the size on its own.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_http_headers headers;
+    unsigned long int file_size;
+    const char* lines[] =
+    {
+        "HTTP/1.1 416 Range Not Satisfiable\r\n",
+        "Accept-Ranges: bytes\r\n",
+        "Content-Range: bytes */0\r\n",
+        "Content-Length: 0\r\n",
+        "\r\n",
+        NULL
+    };
+
+    vhd_sync_xt_reset_http_headers(&headers);
+    test_header_parse(&headers, lines);
+
+    return headers.accept_ranges == true
+           && headers.has_range == false
+           && vhd_sync_xt_http_headers_size(&headers, &file_size) == true
+           && file_size == 0;
+}
+
+bool
+test_header_bad_values(
+    )
+/*
+ * This function tests that values that do not parse, or do not fit, are
+ * left out rather than half used.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_http_headers headers;
+    unsigned long int file_size;
+    char etag[VHD_SYNC_XT_HEADER_VALUE_LENGTH + 16];
+    const char* lines[] =
+    {
+        "HTTP/1.1 206 Partial Content\r\n",
+        "Content-Length: 99999999999999999999999\r\n",
+        "Content-Range: bytes 10-5/100\r\n",
+        etag,
+        "\r\n",
+        NULL
+    };
+
+    memcpy(etag, "ETag: ", 6);
+    memset(etag + 6, 'e', sizeof(etag) - 6);
+    etag[sizeof(etag) - 1] = '\0';
+
+    vhd_sync_xt_reset_http_headers(&headers);
+    test_header_parse(&headers, lines);
+
+    if (headers.has_content_length == true
+        || headers.has_range == true
+        || headers.has_total_size == true
+        || headers.etag[0] != '\0'
+        || vhd_sync_xt_http_headers_size(&headers, &file_size) == true)
+    {
+        return false;
+    }
+
+    //
+    // A range that runs past the total is just as wrong.
+    //
+    lines[2] = "Content-Range: bytes 0-100/100\r\n";
+    vhd_sync_xt_reset_http_headers(&headers);
+    test_header_parse(&headers, lines);
+
+    return headers.has_range == false
+           && vhd_sync_xt_http_headers_size(&headers, &file_size) == false;
+}
+
+bool
+test_header_redirect(
+    )
+/*
+ * This function tests that only the headers of the last response, after a
+ * redirect, are kept.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_http_headers headers;
+    const char* lines[] =
+    {
+        "HTTP/1.1 302 Found\r\n",
+        "ETag: \"old\"\r\n",
+        "Content-Length: 5\r\n",
+        "\r\n",
+        "HTTP/1.1 206 Partial Content\r\n",
+        "Content-Range: bytes 0-9/10\r\n",
+        NULL
+    };
+
+    vhd_sync_xt_reset_http_headers(&headers);
+    test_header_parse(&headers, lines);
+
+    return headers.complete == false
+           && headers.status_code == 206
+           && headers.etag[0] == '\0'
+           && headers.has_content_length == false
+           && headers.has_total_size == true
+           && headers.total_size == 10;
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs all the tests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      0 if all tests succeed.
+ */
+{
+    bool status;
+
+    status = run_tests(g_header_tests,
+                       sizeof(g_header_tests)/sizeof(vhd_sync_xt_test)
+                       );
+    print_test_results(g_header_tests,
+                       sizeof(g_header_tests)/sizeof(vhd_sync_xt_test)
+                       );
+
+End:
+    return (status == true)?0:1;
+}
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the file that contains the tests for the token bucket that caps
+ * the bandwidth of a download. Time passing is stood in for by moving the
+ * last refill of the bucket back.
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_limiter.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+//
+// Round numbers, so that what is earned over a time comes out exact.
+//
+#define TEST_LIMITER_RATE                   1000000
+#define TEST_LIMITER_BURST                  250000
+#define TEST_LIMITER_SLOW_RATE              100000
+
+//
+// Slack for the time the test itself takes between refills, in tokens.
+//
+#define TEST_LIMITER_SLACK                  (8 * 1024)
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+bool
+test_limiter_unlimited(
+    );
+
+bool
+test_limiter_burst(
+    );
+
+bool
+test_limiter_refill(
+    );
+
+bool
+test_limiter_rate_change(
+    );
+
+vhd_sync_xt_test g_limiter_tests[] =
+{
+        {"No limit lets everything through", test_limiter_unlimited,    0},
+        {"Burst caps the bucket",           test_limiter_burst,         0},
+        {"Refill at the rate pays off debt", test_limiter_refill,       0},
+        {"Rate change while running",       test_limiter_rate_change,   0}
+};
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static void
+test_limiter_age(
+    pvhd_sync_xt_limiter limiter,
+    unsigned long int usec
+    )
+/*
+ * This function makes the last refill of a limiter look longer ago.
+ *
+ * Parameters:
+ *
+ *      limiter - Supplies the limiter.
+ *
+ *      usec - Supplies how much longer ago, in usec.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    long int nsec;
+
+    nsec = limiter->last_refill.tv_nsec - (long int)(usec % 1000000) * 1000;
+    limiter->last_refill.tv_sec -= usec / 1000000;
+    if (nsec < 0)
+    {
+        nsec += 1000000000;
+        limiter->last_refill.tv_sec -= 1;
+    }
+    limiter->last_refill.tv_nsec = nsec;
+}
+
+static bool
+test_limiter_near(
+    long int tokens,
+    long int expected
+    )
+/*
+ * This function tells whether a bucket holds what is expected, give or
+ * take the tokens earned while the test ran.
+ *
+ * Parameters:
+ *
+ *      tokens - Supplies the tokens in the bucket.
+ *
+ *      expected - Supplies the tokens expected.
+ *
+ * Return Value:
+ *
+ *      TRUE if they are near enough, FALSE otherwise.
+ */
+{
+    return tokens >= expected && tokens <= expected + TEST_LIMITER_SLACK;
+}
+
+bool
+test_limiter_unlimited(
+    )
+/*
+ * This function tests that a limiter without a rate never holds data back.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_limiter limiter;
+
+    memset(&limiter, 0, sizeof(limiter));
+    vhd_sync_xt_set_rate_limit(&limiter, 0, 0);
+
+    return vhd_sync_xt_take_tokens(&limiter, TEST_LIMITER_BURST) == true
+           && vhd_sync_xt_take_tokens(&limiter, TEST_LIMITER_BURST) == true
+           && limiter.tokens == 0;
+}
+
+bool
+test_limiter_burst(
+    )
+/*
+ * This function tests that the burst is picked from the rate when not
+ * given, and that however long the bucket sits it holds no more than the
+ * burst.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_limiter limiter;
+
+    memset(&limiter, 0, sizeof(limiter));
+
+    //
+    // A tenth of a second, but not below the minimum.
+    //
+    vhd_sync_xt_set_rate_limit(&limiter, TEST_LIMITER_RATE * 10, 0);
+    if (limiter.burst != TEST_LIMITER_RATE)
+    {
+        return false;
+    }
+
+    vhd_sync_xt_set_rate_limit(&limiter, TEST_LIMITER_SLOW_RATE, 0);
+    if (limiter.burst != VHD_SYNC_XT_RATE_MINIMUM_BURST)
+    {
+        return false;
+    }
+
+    vhd_sync_xt_set_rate_limit(&limiter, TEST_LIMITER_RATE, TEST_LIMITER_BURST);
+    limiter.tokens = 0;
+    test_limiter_age(&limiter, 10000000);
+    vhd_sync_xt_refill_tokens(&limiter);
+    if (limiter.tokens != TEST_LIMITER_BURST)
+    {
+        return false;
+    }
+
+    //
+    // Data goes through while there are any tokens, and then waits.
+    //
+    return vhd_sync_xt_take_tokens(&limiter, TEST_LIMITER_BURST - 1) == true
+           && vhd_sync_xt_take_tokens(&limiter, TEST_LIMITER_BURST) == true
+           && limiter.tokens < 0
+           && vhd_sync_xt_take_tokens(&limiter, 1) == false;
+}
+
+bool
+test_limiter_refill(
+    )
+/*
+ * This function tests that tokens come back at the rate, and that a debt
+ * is paid off before data goes through again.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_limiter limiter;
+
+    memset(&limiter, 0, sizeof(limiter));
+    vhd_sync_xt_set_rate_limit(&limiter, TEST_LIMITER_RATE, TEST_LIMITER_BURST);
+
+    //
+    // A tenth of a second earns a tenth of the rate.
+    //
+    limiter.tokens = -(TEST_LIMITER_RATE / 5);
+    test_limiter_age(&limiter, 100000);
+    if (vhd_sync_xt_take_tokens(&limiter, 1) == true
+        || test_limiter_near(limiter.tokens, -(TEST_LIMITER_RATE / 10)) == false)
+    {
+        return false;
+    }
+
+    test_limiter_age(&limiter, 150000);
+    if (vhd_sync_xt_take_tokens(&limiter, TEST_LIMITER_RATE / 20) == false)
+    {
+        return false;
+    }
+
+    return test_limiter_near(limiter.tokens, 0);
+}
+
+bool
+test_limiter_rate_change(
+    )
+/*
+ * This function tests changing the rate of a limiter in use, as a command
+ * on the control fd does. A lower burst cuts the bucket down to it, the
+ * new rate holds from then on, and a higher rate adds no tokens at once.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_limiter limiter;
+
+    memset(&limiter, 0, sizeof(limiter));
+    vhd_sync_xt_set_rate_limit(&limiter, TEST_LIMITER_RATE, TEST_LIMITER_BURST);
+    limiter.tokens = TEST_LIMITER_BURST;
+
+    if (vhd_sync_xt_take_tokens(&limiter, TEST_LIMITER_BURST / 4) == false)
+    {
+        return false;
+    }
+
+    vhd_sync_xt_set_rate_limit(&limiter, TEST_LIMITER_SLOW_RATE, 0);
+    if (limiter.burst != VHD_SYNC_XT_RATE_MINIMUM_BURST
+        || limiter.tokens != VHD_SYNC_XT_RATE_MINIMUM_BURST)
+    {
+        return false;
+    }
+
+    //
+    // Half a second at the slow rate pays off half a second's worth of a
+    // debt of a whole one.
+    //
+    limiter.tokens = -(TEST_LIMITER_SLOW_RATE);
+    test_limiter_age(&limiter, 500000);
+    vhd_sync_xt_refill_tokens(&limiter);
+    if (test_limiter_near(limiter.tokens, -(TEST_LIMITER_SLOW_RATE / 2)) == false)
+    {
+        return false;
+    }
+
+    //
+    // A higher rate adds no tokens at once, so the debt still holds data
+    // back, until the limit is lifted.
+    //
+    vhd_sync_xt_set_rate_limit(&limiter, TEST_LIMITER_RATE, TEST_LIMITER_BURST);
+    if (limiter.tokens >= 0
+        || vhd_sync_xt_take_tokens(&limiter, 1) == true)
+    {
+        return false;
+    }
+
+    vhd_sync_xt_set_rate_limit(&limiter, 0, 0);
+    return vhd_sync_xt_take_tokens(&limiter, TEST_LIMITER_BURST) == true;
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs all the tests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      0 if all tests succeed.
+ */
+{
+    bool status;
+
+    status = run_tests(g_limiter_tests,
+                       sizeof(g_limiter_tests)/sizeof(vhd_sync_xt_test)
+                       );
+    print_test_results(g_limiter_tests,
+                       sizeof(g_limiter_tests)/sizeof(vhd_sync_xt_test)
+                       );
+
+End:
+    return (status == true)?0:1;
+}
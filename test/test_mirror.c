@@ -0,0 +1,364 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the file that contains the tests for the mirror module.
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_mirror.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+#define TEST_MIRROR_FILE_SIZE               (8 * 1024 * 1024)
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+bool
+test_mirror_pick_unmeasured(
+    );
+
+bool
+test_mirror_pick_share(
+    );
+
+bool
+test_mirror_pick_avoid(
+    );
+
+bool
+test_mirror_drop(
+    );
+
+bool
+test_mirror_consistent(
+    );
+
+vhd_sync_xt_test g_mirror_tests[] =
+{
+        {"Unmeasured mirrors are tried first",  test_mirror_pick_unmeasured,    0},
+        {"Requests follow throughput",          test_mirror_pick_share,         0},
+        {"Retries go to another mirror",        test_mirror_pick_avoid,         0},
+        {"Failing mirrors are dropped",         test_mirror_drop,               0},
+        {"Mirrors must have the same file",     test_mirror_consistent,         0}
+};
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static bool
+test_mirror_set(
+    pvhd_sync_xt_mirror_set mirror_set,
+    int count
+    )
+/*
+ * This function fills a set with mirrors that have not been used yet.
+ *
+ * Parameters:
+ *
+ *      mirror_set - Supplies the set to fill.
+ *
+ *      count - Supplies the number of mirrors.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    static char* urls[] =
+    {
+        "http://a/img.vhd",
+        "http://b/img.vhd",
+        "http://c/img.vhd"
+    };
+    int i;
+
+    memset(mirror_set, 0, sizeof(*mirror_set));
+
+    for (i = 0; i < count; ++i)
+    {
+        if (vhd_sync_xt_add_mirror(mirror_set, urls[i]) == false)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+test_mirror_pick_unmeasured(
+    )
+/*
+ * This function tests that each mirror gets a request before any mirror
+ * gets a second one.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_mirror_set mirror_set;
+    pvhd_sync_xt_mirror mirror;
+    int i;
+
+    if (test_mirror_set(&mirror_set, 3) == false)
+    {
+        return false;
+    }
+
+    for (i = 0; i < 3; ++i)
+    {
+        mirror = vhd_sync_xt_pick_mirror(&mirror_set, NULL);
+        if (mirror != &mirror_set.mirrors[i])
+        {
+            return false;
+        }
+        vhd_sync_xt_begin_mirror_request(mirror);
+    }
+
+    return true;
+}
+
+bool
+test_mirror_pick_share(
+    )
+/*
+ * This function tests that a mirror three times as fast as another gets
+ * three times the requests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_mirror_set mirror_set;
+    pvhd_sync_xt_mirror mirror;
+    int i;
+
+    if (test_mirror_set(&mirror_set, 2) == false)
+    {
+        return false;
+    }
+
+    mirror_set.mirrors[0].throughput = 3000000;
+    mirror_set.mirrors[1].throughput = 1000000;
+
+    for (i = 0; i < 8; ++i)
+    {
+        mirror = vhd_sync_xt_pick_mirror(&mirror_set, NULL);
+        if (mirror == NULL)
+        {
+            return false;
+        }
+        vhd_sync_xt_begin_mirror_request(mirror);
+    }
+
+    return mirror_set.mirrors[0].active == 6
+           && mirror_set.mirrors[1].active == 2;
+}
+
+bool
+test_mirror_pick_avoid(
+    )
+/*
+ * This function tests that the mirror to avoid is picked only when there
+ * is no other left, and that the first mirror is still picked once all of
+ * them have been dropped.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_mirror_set mirror_set;
+
+    if (test_mirror_set(&mirror_set, 2) == false)
+    {
+        return false;
+    }
+
+    mirror_set.mirrors[0].throughput = 3000000;
+    mirror_set.mirrors[1].throughput = 1000000;
+
+    if (vhd_sync_xt_pick_mirror(&mirror_set, &mirror_set.mirrors[0])
+        != &mirror_set.mirrors[1])
+    {
+        return false;
+    }
+
+    vhd_sync_xt_drop_mirror(&mirror_set.mirrors[1]);
+    if (vhd_sync_xt_pick_mirror(&mirror_set, &mirror_set.mirrors[0])
+        != &mirror_set.mirrors[0])
+    {
+        return false;
+    }
+
+    vhd_sync_xt_drop_mirror(&mirror_set.mirrors[0]);
+    return vhd_sync_xt_pick_mirror(&mirror_set, NULL) == &mirror_set.mirrors[0];
+}
+
+bool
+test_mirror_drop(
+    )
+/*
+ * This function tests that a mirror is dropped after failures in a row, and
+ * that a success in between keeps it.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_mirror_set mirror_set;
+    pvhd_sync_xt_mirror mirror;
+    int i;
+
+    if (test_mirror_set(&mirror_set, 1) == false)
+    {
+        return false;
+    }
+    mirror = &mirror_set.mirrors[0];
+
+    for (i = 0; i < VHD_SYNC_XT_MIRROR_MAXIMUM_FAILURES - 1; ++i)
+    {
+        vhd_sync_xt_begin_mirror_request(mirror);
+        vhd_sync_xt_end_mirror_request(mirror, 0, 0, false);
+    }
+
+    vhd_sync_xt_begin_mirror_request(mirror);
+    vhd_sync_xt_end_mirror_request(mirror, 1000000, 1000000, true);
+    if (mirror->dropped == true || mirror->throughput != 1000000)
+    {
+        return false;
+    }
+
+    for (i = 0; i < VHD_SYNC_XT_MIRROR_MAXIMUM_FAILURES; ++i)
+    {
+        vhd_sync_xt_begin_mirror_request(mirror);
+        vhd_sync_xt_end_mirror_request(mirror, 0, 0, false);
+    }
+
+    return mirror->dropped == true && mirror->active == 0;
+}
+
+bool
+test_mirror_consistent(
+    )
+/*
+ * This function tests that responses with another size or other validators
+ * are not taken for the same file, and that missing validators are.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_http_headers reference;
+    vhd_sync_xt_http_headers headers;
+
+    vhd_sync_xt_reset_http_headers(&reference);
+    reference.status_code = 206;
+    reference.has_total_size = true;
+    reference.total_size = TEST_MIRROR_FILE_SIZE;
+    strcpy(reference.etag, "\"1\"");
+    strcpy(reference.last_modified, "Mon, 01 Jan 2024 00:00:00 GMT");
+
+    headers = reference;
+    if (vhd_sync_xt_mirror_consistent(&reference, TEST_MIRROR_FILE_SIZE, &headers) == false)
+    {
+        return false;
+    }
+
+    headers.total_size = TEST_MIRROR_FILE_SIZE - 1;
+    if (vhd_sync_xt_mirror_consistent(&reference, TEST_MIRROR_FILE_SIZE, &headers) == true)
+    {
+        return false;
+    }
+
+    headers = reference;
+    strcpy(headers.etag, "\"2\"");
+    if (vhd_sync_xt_mirror_consistent(&reference, TEST_MIRROR_FILE_SIZE, &headers) == true)
+    {
+        return false;
+    }
+
+    headers = reference;
+    strcpy(headers.last_modified, "Tue, 02 Jan 2024 00:00:00 GMT");
+    if (vhd_sync_xt_mirror_consistent(&reference, TEST_MIRROR_FILE_SIZE, &headers) == true)
+    {
+        return false;
+    }
+
+    headers = reference;
+    headers.etag[0] = '\0';
+    headers.last_modified[0] = '\0';
+    return vhd_sync_xt_mirror_consistent(&reference, TEST_MIRROR_FILE_SIZE, &headers);
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs all the tests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      0 if all tests succeed.
+ */
+{
+    bool status;
+
+    status = run_tests(g_mirror_tests,
+                       sizeof(g_mirror_tests)/sizeof(vhd_sync_xt_test)
+                       );
+    print_test_results(g_mirror_tests,
+                       sizeof(g_mirror_tests)/sizeof(vhd_sync_xt_test)
+                       );
+
+End:
+    return (status == true)?0:1;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the file that contains the tests for the multipart module.
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_multipart.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+#define TEST_MULTIPART_BOUNDARY             "3d6b6a416f9b5"
+#define TEST_MULTIPART_FILE_SIZE            64
+
+#define TEST_MULTIPART_BODY                                         \
+    "preamble\r\n"                                                  \
+    "--" TEST_MULTIPART_BOUNDARY "\r\n"                             \
+    "Content-Type: application/octet-stream\r\n"                    \
+    "Content-Range: bytes 4-9/64\r\n"                               \
+    "\r\n"                                                          \
+    "456789"                                                        \
+    "\r\n--" TEST_MULTIPART_BOUNDARY "\r\n"                         \
+    "Content-Range: bytes 32-35/64\r\n"                             \
+    "\r\n"                                                          \
+    "WXYZ"                                                          \
+    "\r\n--" TEST_MULTIPART_BOUNDARY "--\r\n"
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+//
+// What the parser hands over, laid out as the file.
+//
+typedef struct _test_multipart_file
+{
+    char data[TEST_MULTIPART_FILE_SIZE];
+    int calls;
+
+} test_multipart_file, *ptest_multipart_file;
+
+bool
+test_multipart_pieces(
+    );
+
+bool
+test_multipart_content_type(
+    );
+
+bool
+test_multipart_malformed(
+    );
+
+bool
+test_multipart_single_part(
+    );
+
+vhd_sync_xt_test g_multipart_tests[] =
+{
+        {"Parts split across pieces",       test_multipart_pieces,          0},
+        {"Boundary from Content-Type",      test_multipart_content_type,    0},
+        {"Malformed bodies rejected",       test_multipart_malformed,       0},
+        {"Merged range as a single part",   test_multipart_single_part,     0}
+};
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static bool
+test_multipart_callback(
+    void* user_data,
+    unsigned long int offset,
+    const char* data,
+    size_t length
+    )
+/*
+ * This function copies the data of a part to where it goes in the file.
+ *
+ * Parameters:
+ *
+ *      user_data - Set to point to the file.
+ *
+ *      offset - Supplies where in the file the data goes.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      TRUE if the data fits in the file, FALSE otherwise.
+ */
+{
+    ptest_multipart_file file;
+
+    file = (ptest_multipart_file) user_data;
+
+    if (offset + length > TEST_MULTIPART_FILE_SIZE)
+    {
+        return false;
+    }
+
+    memcpy(file->data + offset, data, length);
+    ++file->calls;
+
+    return true;
+}
+
+static bool
+test_multipart_parse(
+    const char* body,
+    size_t piece_length,
+    ptest_multipart_file file
+    )
+/*
+ * This function parses a body handed over a few bytes at a time.
+ *
+ * Parameters:
+ *
+ *      body - Supplies the body.
+ *
+ *      piece_length - Supplies how many bytes to hand over at a time.
+ *
+ *      file - Supplies the file the parts go to.
+ *
+ * Return Value:
+ *
+ *      TRUE if the body parsed and was complete, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_multipart multipart;
+    size_t length;
+    size_t offset;
+    size_t piece;
+
+    memset(file, '.', sizeof(*file));
+    file->calls = 0;
+
+    vhd_sync_xt_reset_multipart(&multipart,
+                                TEST_MULTIPART_BOUNDARY,
+                                test_multipart_callback,
+                                file
+                                );
+
+    length = strlen(body);
+    for (offset = 0; offset < length; offset += piece)
+    {
+        piece = length - offset;
+        if (piece > piece_length)
+        {
+            piece = piece_length;
+        }
+
+        if (vhd_sync_xt_parse_multipart(&multipart, body + offset, piece) == false)
+        {
+            return false;
+        }
+    }
+
+    return vhd_sync_xt_multipart_complete(&multipart);
+}
+
+bool
+test_multipart_pieces(
+    )
+/*
+ * This function tests that the parts of a body end up at their offsets
+ * however the body is cut up on the way in.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    test_multipart_file file;
+    size_t piece_length;
+
+    for (piece_length = 1; piece_length <= sizeof(TEST_MULTIPART_BODY); ++piece_length)
+    {
+        if (test_multipart_parse(TEST_MULTIPART_BODY, piece_length, &file) == false
+            || memcmp(file.data + 4, "456789", 6) != 0
+            || memcmp(file.data + 32, "WXYZ", 4) != 0
+            || file.data[3] != '.'
+            || file.data[10] != '.'
+            || file.data[31] != '.'
+            || file.data[36] != '.')
+        {
+            return false;
+        }
+    }
+
+    //
+    // Handed over in one go, no part is cut up.
+    //
+    return file.calls == 2;
+}
+
+bool
+test_multipart_content_type(
+    )
+/*
+ * This function tests picking the boundary out of the Content-Type of a
+ * response, quoted or not.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_http_headers headers;
+    char line[] = "Content-Type: multipart/byteranges; boundary=" TEST_MULTIPART_BOUNDARY "\r\n";
+    char quoted[] = "content-type: Multipart/Byteranges; charset=x; boundary=\"a b:c\"\r\n";
+    char other[] = "Content-Type: application/octet-stream\r\n";
+
+    vhd_sync_xt_reset_http_headers(&headers);
+    vhd_sync_xt_parse_http_header(&headers, line, strlen(line));
+    if (headers.multipart == false
+        || strcmp(headers.boundary, TEST_MULTIPART_BOUNDARY) != 0)
+    {
+        return false;
+    }
+
+    vhd_sync_xt_reset_http_headers(&headers);
+    vhd_sync_xt_parse_http_header(&headers, quoted, strlen(quoted));
+    if (headers.multipart == false
+        || strcmp(headers.boundary, "a b:c") != 0)
+    {
+        return false;
+    }
+
+    vhd_sync_xt_reset_http_headers(&headers);
+    vhd_sync_xt_parse_http_header(&headers, other, strlen(other));
+    return headers.multipart == false;
+}
+
+bool
+test_multipart_malformed(
+    )
+/*
+ * This function tests that a part without a range, text between parts and
+ * a body cut short are not taken as complete.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    test_multipart_file file;
+
+    if (test_multipart_parse("--" TEST_MULTIPART_BOUNDARY "\r\n"
+                             "Content-Type: application/octet-stream\r\n"
+                             "\r\n"
+                             "0123",
+                             7,
+                             &file) == true)
+    {
+        return false;
+    }
+
+    if (test_multipart_parse("--" TEST_MULTIPART_BOUNDARY "\r\n"
+                             "Content-Range: bytes 0-3/64\r\n"
+                             "\r\n"
+                             "0123"
+                             "\r\nstray\r\n--" TEST_MULTIPART_BOUNDARY "--\r\n",
+                             7,
+                             &file) == true)
+    {
+        return false;
+    }
+
+    if (test_multipart_parse("--" TEST_MULTIPART_BOUNDARY "\r\n"
+                             "Content-Range: bytes 0-3/64\r\n"
+                             "\r\n"
+                             "01",
+                             7,
+                             &file) == true)
+    {
+        return false;
+    }
+
+    //
+    // Parts that do not fit stop the parse.
+    //
+    return test_multipart_parse("--" TEST_MULTIPART_BOUNDARY "\r\n"
+                                "Content-Range: bytes 62-65/66\r\n"
+                                "\r\n"
+                                "0123"
+                                "\r\n--" TEST_MULTIPART_BOUNDARY "--\r\n",
+                                7,
+                                &file) == false;
+}
+
+bool
+test_multipart_single_part(
+    )
+/*
+ * This function tests taking a plain partial response, as a server that
+ * merges ranges sends, as a body of one part.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_http_headers headers;
+    vhd_sync_xt_multipart multipart;
+    test_multipart_file file;
+    char line[] = "Content-Range: bytes 8-15/64\r\n";
+
+    memset(&file, '.', sizeof(file));
+    file.calls = 0;
+
+    vhd_sync_xt_reset_http_headers(&headers);
+    vhd_sync_xt_reset_multipart(&multipart, "", test_multipart_callback, &file);
+    if (vhd_sync_xt_expect_single_part(&multipart, &headers) == true)
+    {
+        return false;
+    }
+
+    vhd_sync_xt_parse_http_header(&headers, line, strlen(line));
+    vhd_sync_xt_reset_multipart(&multipart, "", test_multipart_callback, &file);
+    if (vhd_sync_xt_expect_single_part(&multipart, &headers) == false
+        || vhd_sync_xt_parse_multipart(&multipart, "89ab", 4) == false
+        || vhd_sync_xt_multipart_complete(&multipart) == true
+        || vhd_sync_xt_parse_multipart(&multipart, "cdef", 4) == false
+        || vhd_sync_xt_multipart_complete(&multipart) == false)
+    {
+        return false;
+    }
+
+    return memcmp(file.data + 8, "89abcdef", 8) == 0
+           && file.data[7] == '.'
+           && file.data[16] == '.';
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs all the tests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      0 if all tests succeed.
+ */
+{
+    bool status;
+
+    status = run_tests(g_multipart_tests,
+                       sizeof(g_multipart_tests)/sizeof(vhd_sync_xt_test)
+                       );
+    print_test_results(g_multipart_tests,
+                       sizeof(g_multipart_tests)/sizeof(vhd_sync_xt_test)
+                       );
+
+End:
+    return (status == true)?0:1;
+}
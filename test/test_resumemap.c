@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the file that contains the tests for the resume map module.
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_resumemap.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+#define TEST_RESUME_MAP_PARTIAL_FILE        "test_resumemap.part"
+#define TEST_RESUME_MAP_UNIT_SIZE           1024
+
+//
+// Ten full units and a short one at the end.
+//
+#define TEST_RESUME_MAP_FILE_SIZE           (10 * TEST_RESUME_MAP_UNIT_SIZE + 100)
+
+//
+// A partial file of its own, whose map is never written out.
+//
+#define TEST_RESUME_MAP_TAIL_FILE           "test_resumemap_tail.part"
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+bool
+test_resume_map_create(
+    );
+
+bool
+test_resume_map_set(
+    );
+
+bool
+test_resume_map_reload(
+    );
+
+bool
+test_resume_map_hash(
+    );
+
+bool
+test_resume_map_mismatch(
+    );
+
+bool
+test_resume_map_tail(
+    );
+
+bool
+test_resume_map_long_path(
+    );
+
+vhd_sync_xt_test g_resume_map_tests[] =
+{
+        {"Resume map create",               test_resume_map_create,     0},
+        {"Resume map set and find missing", test_resume_map_set,        0},
+        {"Resume map reload",               test_resume_map_reload,     0},
+        {"Resume map hash state",           test_resume_map_hash,       0},
+        {"Resume map size mismatch",        test_resume_map_mismatch,   0},
+        {"Resume map short last unit",      test_resume_map_tail,       0},
+        {"Resume map path too long",        test_resume_map_long_path,  0}
+};
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+bool
+test_resume_map_create(
+    )
+/*
+ * This function tests creating a resume map where there was none.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_resume_map resume_map = NULL;
+    unsigned long int start_offset;
+    unsigned long int end_offset;
+
+    status = false;
+
+    unlink(TEST_RESUME_MAP_PARTIAL_FILE VHD_SYNC_XT_RESUME_MAP_EXTENSION);
+
+    status = vhd_sync_xt_open_resume_map(TEST_RESUME_MAP_PARTIAL_FILE,
+                                         TEST_RESUME_MAP_FILE_SIZE,
+                                         TEST_RESUME_MAP_UNIT_SIZE,
+                                         &resume_map
+                                         );
+    if (status == false)
+    {
+        goto End;
+    }
+
+    //
+    // Nothing should be complete, the whole file is one missing run.
+    //
+    if (resume_map->existed == true
+        || resume_map->loaded == true
+        || vhd_sync_xt_resume_map_complete_bytes(resume_map) != 0
+        || vhd_sync_xt_resume_map_next_missing(resume_map,
+                                               0,
+                                               &start_offset,
+                                               &end_offset) == false
+        || start_offset != 0
+        || end_offset != TEST_RESUME_MAP_FILE_SIZE)
+    {
+        status = false;
+        goto End;
+    }
+
+    status = true;
+End:
+    vhd_sync_xt_destroy_resume_map(resume_map);
+    return status;
+}
+
+bool
+test_resume_map_set(
+    )
+/*
+ * This function tests marking ranges complete and finding the runs that are
+ * still missing.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_resume_map resume_map = NULL;
+    unsigned long int start_offset;
+    unsigned long int end_offset;
+
+    status = false;
+
+    status = vhd_sync_xt_open_resume_map(TEST_RESUME_MAP_PARTIAL_FILE,
+                                         TEST_RESUME_MAP_FILE_SIZE,
+                                         TEST_RESUME_MAP_UNIT_SIZE,
+                                         &resume_map
+                                         );
+    if (status == false)
+    {
+        goto End;
+    }
+
+    //
+    // Units 0 and 1, half of unit 2 (which should not count), units 5 to 7
+    // and the short last unit.
+    //
+    vhd_sync_xt_resume_map_set(resume_map,
+                               0,
+                               2 * TEST_RESUME_MAP_UNIT_SIZE + TEST_RESUME_MAP_UNIT_SIZE / 2
+                               );
+    vhd_sync_xt_resume_map_set(resume_map,
+                               5 * TEST_RESUME_MAP_UNIT_SIZE,
+                               8 * TEST_RESUME_MAP_UNIT_SIZE
+                               );
+    vhd_sync_xt_resume_map_set(resume_map,
+                               10 * TEST_RESUME_MAP_UNIT_SIZE,
+                               TEST_RESUME_MAP_FILE_SIZE
+                               );
+
+    if (vhd_sync_xt_resume_map_complete_bytes(resume_map)
+        != 5 * TEST_RESUME_MAP_UNIT_SIZE + 100)
+    {
+        status = false;
+        goto End;
+    }
+
+    if (vhd_sync_xt_resume_map_next_missing(resume_map,
+                                            0,
+                                            &start_offset,
+                                            &end_offset) == false
+        || start_offset != 2 * TEST_RESUME_MAP_UNIT_SIZE
+        || end_offset != 5 * TEST_RESUME_MAP_UNIT_SIZE)
+    {
+        status = false;
+        goto End;
+    }
+
+    if (vhd_sync_xt_resume_map_next_missing(resume_map,
+                                            end_offset,
+                                            &start_offset,
+                                            &end_offset) == false
+        || start_offset != 8 * TEST_RESUME_MAP_UNIT_SIZE
+        || end_offset != 10 * TEST_RESUME_MAP_UNIT_SIZE)
+    {
+        status = false;
+        goto End;
+    }
+
+    if (vhd_sync_xt_resume_map_next_missing(resume_map,
+                                            end_offset,
+                                            &start_offset,
+                                            &end_offset) == true)
+    {
+        status = false;
+        goto End;
+    }
+
+    status = vhd_sync_xt_flush_resume_map(resume_map, -1, true);
+
+End:
+    vhd_sync_xt_destroy_resume_map(resume_map);
+    return status;
+}
+
+bool
+test_resume_map_reload(
+    )
+/*
+ * This function tests that a flushed map reads back the same.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_resume_map resume_map = NULL;
+
+    status = false;
+
+    status = vhd_sync_xt_open_resume_map(TEST_RESUME_MAP_PARTIAL_FILE,
+                                         TEST_RESUME_MAP_FILE_SIZE,
+                                         TEST_RESUME_MAP_UNIT_SIZE,
+                                         &resume_map
+                                         );
+    if (status == false)
+    {
+        goto End;
+    }
+
+    if (resume_map->loaded == false
+        || vhd_sync_xt_resume_map_complete_bytes(resume_map)
+           != 5 * TEST_RESUME_MAP_UNIT_SIZE + 100)
+    {
+        status = false;
+        goto End;
+    }
+
+    status = true;
+End:
+    vhd_sync_xt_destroy_resume_map(resume_map);
+    return status;
+}
+
+bool
+test_resume_map_hash(
+    )
+/*
+ * This function tests that a hash state kept with the map is read back,
+ * and does not disturb the bitmap.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_resume_map resume_map = NULL;
+    unsigned long int complete;
+    unsigned long int offset;
+    char state[64];
+    char loaded_state[64];
+
+    status = false;
+
+    status = vhd_sync_xt_open_resume_map(TEST_RESUME_MAP_PARTIAL_FILE,
+                                         TEST_RESUME_MAP_FILE_SIZE,
+                                         TEST_RESUME_MAP_UNIT_SIZE,
+                                         &resume_map
+                                         );
+    if (status == false
+        || vhd_sync_xt_resume_map_get_hash(resume_map,
+                                           &offset,
+                                           loaded_state,
+                                           sizeof(loaded_state)) == true)
+    {
+        status = false;
+        goto End;
+    }
+
+    complete = vhd_sync_xt_resume_map_complete_bytes(resume_map);
+    memset(state, 0x5A, sizeof(state));
+    vhd_sync_xt_resume_map_set_hash(resume_map, 1234, state, sizeof(state));
+
+    status = vhd_sync_xt_flush_resume_map(resume_map, -1, true);
+    vhd_sync_xt_destroy_resume_map(resume_map);
+    resume_map = NULL;
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_open_resume_map(TEST_RESUME_MAP_PARTIAL_FILE,
+                                         TEST_RESUME_MAP_FILE_SIZE,
+                                         TEST_RESUME_MAP_UNIT_SIZE,
+                                         &resume_map
+                                         );
+    if (status == false
+        || resume_map->loaded == false
+        || vhd_sync_xt_resume_map_complete_bytes(resume_map) != complete
+        || vhd_sync_xt_resume_map_get_hash(resume_map,
+                                           &offset,
+                                           loaded_state,
+                                           sizeof(loaded_state)) == false
+        || offset != 1234
+        || memcmp(state, loaded_state, sizeof(state)) != 0)
+    {
+        status = false;
+        goto End;
+    }
+
+    status = true;
+
+End:
+    vhd_sync_xt_destroy_resume_map(resume_map);
+    return status;
+}
+
+bool
+test_resume_map_mismatch(
+    )
+/*
+ * This function tests that a map written for a different file size is
+ * not trusted.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_resume_map resume_map = NULL;
+
+    status = false;
+
+    status = vhd_sync_xt_open_resume_map(TEST_RESUME_MAP_PARTIAL_FILE,
+                                         TEST_RESUME_MAP_FILE_SIZE + 1,
+                                         TEST_RESUME_MAP_UNIT_SIZE,
+                                         &resume_map
+                                         );
+    if (status == false)
+    {
+        goto End;
+    }
+
+    if (resume_map->existed == false
+        || resume_map->loaded == true
+        || vhd_sync_xt_resume_map_complete_bytes(resume_map) != 0)
+    {
+        status = false;
+        goto End;
+    }
+
+    status = vhd_sync_xt_remove_resume_map(resume_map);
+
+End:
+    vhd_sync_xt_destroy_resume_map(resume_map);
+    return status;
+}
+
+bool
+test_resume_map_tail(
+    )
+/*
+ * This function tests that a short last unit that is missing is found once,
+ * and that nothing is found from the end of the file on, so walking the
+ * holes comes to an end.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_resume_map resume_map = NULL;
+    unsigned long int start_offset;
+    unsigned long int end_offset;
+
+    status = false;
+
+    unlink(TEST_RESUME_MAP_TAIL_FILE VHD_SYNC_XT_RESUME_MAP_EXTENSION);
+
+    status = vhd_sync_xt_open_resume_map(TEST_RESUME_MAP_TAIL_FILE,
+                                         TEST_RESUME_MAP_FILE_SIZE,
+                                         TEST_RESUME_MAP_UNIT_SIZE,
+                                         &resume_map
+                                         );
+    if (status == false)
+    {
+        goto End;
+    }
+
+    vhd_sync_xt_resume_map_set(resume_map, 0, 10 * TEST_RESUME_MAP_UNIT_SIZE);
+
+    if (vhd_sync_xt_resume_map_next_missing(resume_map,
+                                            0,
+                                            &start_offset,
+                                            &end_offset) == false
+        || start_offset != 10 * TEST_RESUME_MAP_UNIT_SIZE
+        || end_offset != TEST_RESUME_MAP_FILE_SIZE)
+    {
+        status = false;
+        goto End;
+    }
+
+    //
+    // Looking on from the end of the hole is looking from the end of the
+    // file, which is still in the short unit.
+    //
+    if (vhd_sync_xt_resume_map_next_missing(resume_map,
+                                            end_offset,
+                                            &start_offset,
+                                            &end_offset) == true
+        || vhd_sync_xt_resume_map_next_missing(resume_map,
+                                               TEST_RESUME_MAP_FILE_SIZE + 1,
+                                               &start_offset,
+                                               &end_offset) == true)
+    {
+        status = false;
+        goto End;
+    }
+
+    status = true;
+
+End:
+    vhd_sync_xt_destroy_resume_map(resume_map);
+    unlink(TEST_RESUME_MAP_TAIL_FILE VHD_SYNC_XT_RESUME_MAP_EXTENSION);
+    return status;
+}
+
+bool
+test_resume_map_long_path(
+    )
+/*
+ * This function tests that a map is not opened when its path does not fit,
+ * here where what fits is the path of the partial file itself.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_resume_map resume_map = NULL;
+    char path[VHD_SYNC_XT_PATH_LENGTH];
+    char data[TEST_RESUME_MAP_UNIT_SIZE];
+    size_t prefix;
+    size_t i;
+    FILE *file;
+
+    status = false;
+
+    //
+    // Pad the path out with "./" to the longest one there is room for.
+    //
+    prefix = VHD_SYNC_XT_PATH_LENGTH - 1 - strlen(TEST_RESUME_MAP_TAIL_FILE);
+    memset(path, '/', prefix);
+    for (i = 0; i + 1 < prefix; i += 2)
+    {
+        path[i] = '.';
+    }
+    strcpy(path + prefix, TEST_RESUME_MAP_TAIL_FILE);
+
+    memset(data, 0x5A, sizeof(data));
+    file = fopen(TEST_RESUME_MAP_TAIL_FILE, "wb");
+    if (file == NULL)
+    {
+        goto End;
+    }
+    fwrite(data, 1, sizeof(data), file);
+    fclose(file);
+
+    if (vhd_sync_xt_open_resume_map(path,
+                                    TEST_RESUME_MAP_FILE_SIZE,
+                                    TEST_RESUME_MAP_UNIT_SIZE,
+                                    &resume_map) == true)
+    {
+        goto End;
+    }
+
+    //
+    // The partial file is as it was.
+    //
+    memset(data, 0, sizeof(data));
+    file = fopen(TEST_RESUME_MAP_TAIL_FILE, "rb");
+    if (file == NULL)
+    {
+        goto End;
+    }
+    status = fread(data, 1, sizeof(data) + 1, file) == sizeof(data)
+             && data[0] == 0x5A
+             && data[sizeof(data) - 1] == 0x5A;
+    fclose(file);
+
+End:
+    vhd_sync_xt_destroy_resume_map(resume_map);
+    unlink(TEST_RESUME_MAP_TAIL_FILE);
+    return status;
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs all the tests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      0 if all tests succeed.
+ */
+{
+    bool status;
+
+    status = run_tests(g_resume_map_tests,
+                       sizeof(g_resume_map_tests)/sizeof(vhd_sync_xt_test)
+                       );
+    print_test_results(g_resume_map_tests,
+                       sizeof(g_resume_map_tests)/sizeof(vhd_sync_xt_test)
+                       );
+
+End:
+    return (status == true)?0:1;
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the file that contains the tests for the TLS session cache module.
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_session.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+#define TEST_SESSION_CACHE_FILE             "test_session.cache"
+#define TEST_SESSION_KEY                    "server:443|ca.pem|"
+#define TEST_SESSION_OTHER_KEY              "other:443|ca.pem|"
+#define TEST_SESSION_TIMEOUT                3600
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+bool
+test_session_keep(
+    );
+
+bool
+test_session_keys(
+    );
+
+bool
+test_session_expire(
+    );
+
+vhd_sync_xt_test g_session_tests[] =
+{
+        {"Session cache keeps sessions",    test_session_keep,          0},
+        {"Session cache keys apart",        test_session_keys,          0},
+        {"Session cache expires sessions",  test_session_expire,        0}
+};
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static bool
+test_session_store(
+    const char* key,
+    int count,
+    long int age,
+    long int lifetime
+    )
+/*
+ * This function puts made up sessions in the cache file under a key, as
+ * if the server had given them.
+ *
+ * Parameters:
+ *
+ *      key - Supplies the key.
+ *
+ *      count - Supplies the number of sessions.
+ *
+ *      age - Supplies how many seconds ago the sessions were made.
+ *
+ *      lifetime - Supplies how many seconds the server says they last.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_session_cache session_cache;
+    SSL_SESSION *session;
+    SSL_CTX *ssl_ctx;
+    SSL *ssl;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned char master_key[48];
+    int i;
+
+    session_cache = NULL;
+    ssl = NULL;
+
+    //
+    // A session needs a cipher, and only a connection has those to give.
+    //
+    ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (ssl_ctx != NULL)
+    {
+        ssl = SSL_new(ssl_ctx);
+    }
+
+    status = ssl != NULL
+             && vhd_sync_xt_create_session_cache(TEST_SESSION_CACHE_FILE,
+                                                 key,
+                                                 TEST_SESSION_TIMEOUT,
+                                                 &session_cache) == true;
+    if (status == false)
+    {
+        goto End;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        memset(id, i + 1, sizeof(id));
+        memset(master_key, i + 1, sizeof(master_key));
+
+        session = SSL_SESSION_new();
+        if (session == NULL
+            || SSL_SESSION_set_protocol_version(session, TLS1_2_VERSION) != 1
+            || SSL_SESSION_set1_id(session, id, sizeof(id)) != 1
+            || SSL_SESSION_set1_master_key(session, master_key, sizeof(master_key)) != 1
+            || SSL_SESSION_set_cipher(session,
+                                      sk_SSL_CIPHER_value(SSL_get_ciphers(ssl), 0)) != 1)
+        {
+            SSL_SESSION_free(session);
+            status = false;
+            break;
+        }
+
+        SSL_SESSION_set_time(session, time(NULL) - age);
+        SSL_SESSION_set_timeout(session, lifetime);
+        session_cache->new_sessions[session_cache->new_session_count++] = session;
+    }
+
+    if (status == true)
+    {
+        status = vhd_sync_xt_save_session_cache(session_cache);
+    }
+
+End:
+    vhd_sync_xt_destroy_session_cache(session_cache);
+    SSL_free(ssl);
+    SSL_CTX_free(ssl_ctx);
+    return status;
+}
+
+static int
+test_session_count(
+    const char* key
+    )
+/*
+ * This function counts the sessions the cache file has for a key.
+ *
+ * Parameters:
+ *
+ *      key - Supplies the key.
+ *
+ * Return Value:
+ *
+ *      The number of sessions, -1 on failure.
+ */
+{
+    pvhd_sync_xt_session_cache session_cache;
+    int count;
+
+    if (vhd_sync_xt_create_session_cache(TEST_SESSION_CACHE_FILE,
+                                         key,
+                                         TEST_SESSION_TIMEOUT,
+                                         &session_cache) == false)
+    {
+        return -1;
+    }
+
+    count = session_cache->session_count;
+    vhd_sync_xt_destroy_session_cache(session_cache);
+
+    return count;
+}
+
+bool
+test_session_keep(
+    )
+/*
+ * This function tests that sessions saved by one cache are found by the
+ * next, replacing the ones before them.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    unlink(TEST_SESSION_CACHE_FILE);
+
+    return test_session_count(TEST_SESSION_KEY) == 0
+           && test_session_store(TEST_SESSION_KEY, 3, 0, TEST_SESSION_TIMEOUT) == true
+           && test_session_count(TEST_SESSION_KEY) == 3
+           && test_session_store(TEST_SESSION_KEY, 2, 0, TEST_SESSION_TIMEOUT) == true
+           && test_session_count(TEST_SESSION_KEY) == 2;
+}
+
+bool
+test_session_keys(
+    )
+/*
+ * This function tests that sessions are only found under their own key,
+ * and that saving under one key keeps the sessions of another.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    unlink(TEST_SESSION_CACHE_FILE);
+
+    return test_session_store(TEST_SESSION_KEY, 2, 0, TEST_SESSION_TIMEOUT) == true
+           && test_session_count(TEST_SESSION_OTHER_KEY) == 0
+           && test_session_store(TEST_SESSION_OTHER_KEY, 1, 0, TEST_SESSION_TIMEOUT) == true
+           && test_session_count(TEST_SESSION_KEY) == 2
+           && test_session_count(TEST_SESSION_OTHER_KEY) == 1;
+}
+
+bool
+test_session_expire(
+    )
+/*
+ * This function tests that sessions the server says are over are not
+ * offered again.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+
+    unlink(TEST_SESSION_CACHE_FILE);
+
+    status = test_session_store(TEST_SESSION_KEY, 2, 20, 10) == true
+             && test_session_count(TEST_SESSION_KEY) == 0;
+
+    unlink(TEST_SESSION_CACHE_FILE);
+    return status;
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs all the tests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      0 if all tests succeed.
+ */
+{
+    bool status;
+
+    status = run_tests(g_session_tests,
+                       sizeof(g_session_tests)/sizeof(vhd_sync_xt_test)
+                       );
+    print_test_results(g_session_tests,
+                       sizeof(g_session_tests)/sizeof(vhd_sync_xt_test)
+                       );
+
+End:
+    return (status == true)?0:1;
+}
@@ -0,0 +1,690 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the file that contains the tests for the transports that do not
+ * need a server, the mock and local files.
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_transport.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+#define TEST_TRANSPORT_SOURCE               "test_transport.bin"
+#define TEST_TRANSPORT_SUFFIX               ".synchash"
+#define TEST_TRANSPORT_FILE                 "test_transport.part"
+#define TEST_TRANSPORT_ETAG                 "\"5e1f-3a\""
+
+//
+// Longer than a piece, and not a whole number of them.
+//
+#define TEST_TRANSPORT_FILE_SIZE            (VHD_SYNC_XT_TRANSPORT_PIECE_SIZE * 2 + 4099)
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+//
+// What a sink got, laid out as the file.
+//
+typedef struct _test_transport_file
+{
+    char *data;
+    unsigned long int size;
+    unsigned long int received;
+    unsigned long int written;
+    pvhd_sync_xt_writer writer;
+
+} test_transport_file, *ptest_transport_file;
+
+bool
+test_transport_mock_conditions(
+    );
+
+bool
+test_transport_mock_ranges(
+    );
+
+bool
+test_transport_file_writer(
+    );
+
+bool
+test_transport_file_suffix(
+    );
+
+vhd_sync_xt_test g_transport_tests[] =
+{
+        {"Mock stat and conditions",        test_transport_mock_conditions, 0},
+        {"Mock ranges in one read",         test_transport_mock_ranges,     0},
+        {"File ranges into a writer",       test_transport_file_writer,     0},
+        {"File next to the file",           test_transport_file_suffix,     0}
+};
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static void
+test_transport_fill(
+    char* data,
+    unsigned long int size
+    )
+/*
+ * This function fills a file with data that differs from block to block.
+ *
+ * Parameters:
+ *
+ *      data - Supplies the file.
+ *
+ *      size - Supplies the size of the file.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    unsigned long int i;
+
+    for (i = 0; i < size; ++i)
+    {
+        data[i] = (char)((i * 7) ^ (i >> 12));
+    }
+}
+
+static bool
+test_transport_data(
+    void* user_data,
+    unsigned long int offset,
+    const char* data,
+    size_t length
+    )
+/*
+ * This function is the sink for data in memory. It is written to the
+ * writer if there is one, and kept otherwise.
+ *
+ * Parameters:
+ *
+ *      user_data - Set to point to the file.
+ *
+ *      offset - Supplies where in the file the data goes.
+ *
+ *      data - Supplies the data.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      TRUE if the data fits in the file, FALSE otherwise.
+ */
+{
+    ptest_transport_file file;
+
+    file = (ptest_transport_file) user_data;
+
+    if (offset > file->size || length > file->size - offset)
+    {
+        return false;
+    }
+
+    file->received += length;
+
+    if (file->writer != NULL)
+    {
+        return vhd_sync_xt_writer_write(file->writer, data, length, offset);
+    }
+
+    memcpy(file->data + offset, data, length);
+    return true;
+}
+
+static bool
+test_transport_written(
+    void* user_data,
+    unsigned long int offset,
+    size_t length
+    )
+/*
+ * This function is the sink for data put into the writer.
+ *
+ * Parameters:
+ *
+ *      user_data - Set to point to the file.
+ *
+ *      offset - Supplies where in the file the data is.
+ *
+ *      length - Supplies the length of the data.
+ *
+ * Return Value:
+ *
+ *      TRUE if the data is in the file, FALSE otherwise.
+ */
+{
+    ptest_transport_file file;
+
+    file = (ptest_transport_file) user_data;
+
+    if (offset > file->size || length > file->size - offset)
+    {
+        return false;
+    }
+
+    file->written += length;
+    return true;
+}
+
+static void
+test_transport_sink(
+    ptest_transport_file file,
+    char* data,
+    unsigned long int size,
+    pvhd_sync_xt_writer writer,
+    pvhd_sync_xt_transport_sink sink
+    )
+/*
+ * This function sets up a sink for a file.
+ *
+ * Parameters:
+ *
+ *      file - Supplies the file.
+ *
+ *      data - Supplies where the data is kept, filled with '.'.
+ *
+ *      size - Supplies the size of the file.
+ *
+ *      writer - Supplies the writer, NULL to keep data in memory.
+ *
+ *      sink - Supplies the sink.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    memset(file, 0, sizeof(*file));
+    memset(data, '.', size);
+    file->data = data;
+    file->size = size;
+    file->writer = writer;
+
+    memset(sink, 0, sizeof(*sink));
+    sink->data = test_transport_data;
+    sink->user_data = file;
+    if (writer != NULL)
+    {
+        sink->written = test_transport_written;
+        sink->writer = writer;
+    }
+}
+
+static bool
+test_transport_write_file(
+    const char* path,
+    const char* data,
+    size_t length
+    )
+/*
+ * This function writes a file for a transport to read.
+ *
+ * Parameters:
+ *
+ *      path - Supplies the path of the file.
+ *
+ *      data - Supplies the contents.
+ *
+ *      length - Supplies the length of the contents.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    FILE *file;
+    bool status;
+
+    file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    status = fwrite(data, 1, length, file) == length;
+    return (fclose(file) == 0) && status;
+}
+
+static bool
+test_transport_url(
+    const char* name,
+    char* url,
+    size_t length
+    )
+/*
+ * This function makes the file:// url of a file in the current directory.
+ *
+ * Parameters:
+ *
+ *      name - Supplies the name of the file.
+ *
+ *      url - Supplies a buffer for the url.
+ *
+ *      length - Supplies the size of the buffer.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    char directory[VHD_SYNC_XT_TRANSPORT_URL_LENGTH];
+
+    if (getcwd(directory, sizeof(directory)) == NULL)
+    {
+        return false;
+    }
+
+    return snprintf(url, length, "file://%s/%s", directory, name) < length;
+}
+
+bool
+test_transport_mock_conditions(
+    )
+/*
+ * This function tests that the mock answers a stat as a server would, and
+ * holds reads to their condition.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_transport transport = NULL;
+    vhd_sync_xt_http_headers headers;
+    vhd_sync_xt_transport_sink sink;
+    test_transport_file file;
+    char data[64];
+    char received[64];
+
+    test_transport_fill(data, sizeof(data));
+    test_transport_sink(&file, received, sizeof(received), NULL, &sink);
+
+    status = vhd_sync_xt_open_mock_transport(data,
+                                             sizeof(data),
+                                             TEST_TRANSPORT_ETAG,
+                                             &transport
+                                             );
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_transport_stat(transport, NULL, &headers)
+             && headers.status_code == 200
+             && headers.content_length == sizeof(data)
+             && strcmp(headers.etag, TEST_TRANSPORT_ETAG) == 0
+             && vhd_sync_xt_transport_stat(transport,
+                                           "If-None-Match: " TEST_TRANSPORT_ETAG,
+                                           &headers)
+             && headers.status_code == 304
+             && vhd_sync_xt_transport_stat(transport,
+                                           "If-None-Match: \"other\"",
+                                           &headers)
+             && headers.status_code == 200;
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_transport_read_range(transport,
+                                              NULL,
+                                              8,
+                                              15,
+                                              "If-Range: " TEST_TRANSPORT_ETAG,
+                                              &sink)
+             && vhd_sync_xt_transport_read_range(transport,
+                                                 NULL,
+                                                 8,
+                                                 15,
+                                                 "If-Range: \"other\"",
+                                                 &sink) == false
+             && vhd_sync_xt_transport_read_range(transport,
+                                                 TEST_TRANSPORT_SUFFIX,
+                                                 0,
+                                                 7,
+                                                 NULL,
+                                                 &sink) == false
+             && file.received == 8
+             && memcmp(received + 8, data + 8, 8) == 0;
+
+End:
+    vhd_sync_xt_close_transport(transport);
+    return status;
+}
+
+bool
+test_transport_mock_ranges(
+    )
+/*
+ * This function tests reading several ranges at once, and that ranges out
+ * of order or past the end are refused.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_transport transport = NULL;
+    vhd_sync_xt_transport_sink sink;
+    test_transport_file file;
+    char data[64];
+    char received[64];
+    unsigned long int start_offsets[] = {0, 10, 60};
+    unsigned long int end_offsets[] = {3, 19, 63};
+    unsigned long int unordered_starts[] = {10, 0};
+    unsigned long int unordered_ends[] = {19, 3};
+
+    test_transport_fill(data, sizeof(data));
+    test_transport_sink(&file, received, sizeof(received), NULL, &sink);
+
+    status = vhd_sync_xt_open_mock_transport(data, sizeof(data), NULL, &transport);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_transport_read(transport,
+                                        NULL,
+                                        start_offsets,
+                                        end_offsets,
+                                        3,
+                                        NULL,
+                                        &sink)
+             && transport->requests == 1
+             && file.received == 4 + 10 + 4
+             && memcmp(received, data, 4) == 0
+             && received[4] == '.'
+             && memcmp(received + 10, data + 10, 10) == 0
+             && received[20] == '.'
+             && memcmp(received + 60, data + 60, 4) == 0;
+    if (status == false)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_transport_read(transport,
+                                        NULL,
+                                        unordered_starts,
+                                        unordered_ends,
+                                        2,
+                                        NULL,
+                                        &sink) == false
+             && vhd_sync_xt_transport_read_range(transport,
+                                                 NULL,
+                                                 60,
+                                                 64,
+                                                 NULL,
+                                                 &sink) == false
+             && file.received == 4 + 10 + 4;
+
+End:
+    vhd_sync_xt_close_transport(transport);
+    return status;
+}
+
+bool
+test_transport_file_writer(
+    )
+/*
+ * This function tests reading ranges of a local file into a writer, which
+ * is copied in the kernel where it can be and through memory otherwise.
+ * Either way all of it has to be there, and the sink told of all of it.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_transport transport = NULL;
+    pvhd_sync_xt_writer writer = NULL;
+    vhd_sync_xt_transport_options options;
+    vhd_sync_xt_http_headers headers;
+    vhd_sync_xt_transport_sink sink;
+    test_transport_file file;
+    char url[VHD_SYNC_XT_TRANSPORT_URL_LENGTH];
+    char *data = NULL;
+    char *received = NULL;
+    FILE *part = NULL;
+    unsigned long int start_offsets[2];
+    unsigned long int end_offsets[2];
+
+    status = false;
+    memset(&options, 0, sizeof(options));
+
+    data = malloc(TEST_TRANSPORT_FILE_SIZE);
+    received = malloc(TEST_TRANSPORT_FILE_SIZE);
+    if (data == NULL || received == NULL)
+    {
+        goto End;
+    }
+
+    test_transport_fill(data, TEST_TRANSPORT_FILE_SIZE);
+    if (test_transport_write_file(TEST_TRANSPORT_SOURCE,
+                                  data,
+                                  TEST_TRANSPORT_FILE_SIZE) == false
+        || test_transport_url(TEST_TRANSPORT_SOURCE, url, sizeof(url)) == false)
+    {
+        goto End;
+    }
+
+    remove(TEST_TRANSPORT_FILE);
+    status = vhd_sync_xt_open_writer(TEST_TRANSPORT_FILE,
+                                     VHD_SYNC_XT_WRITER_PWRITE,
+                                     TEST_TRANSPORT_FILE_SIZE,
+                                     false,
+                                     false,
+                                     &writer)
+             && vhd_sync_xt_open_transport(url,
+                                           VHD_SYNC_XT_TRANSPORT_FILE,
+                                           &options,
+                                           &transport);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    test_transport_sink(&file, received, TEST_TRANSPORT_FILE_SIZE, writer, &sink);
+
+    //
+    // The first block, and from the middle of the second to the end.
+    //
+    start_offsets[0] = 0;
+    end_offsets[0] = VHD_SYNC_XT_TRANSPORT_PIECE_SIZE - 1;
+    start_offsets[1] = VHD_SYNC_XT_TRANSPORT_PIECE_SIZE + 100;
+    end_offsets[1] = TEST_TRANSPORT_FILE_SIZE - 1;
+
+    status = vhd_sync_xt_transport_stat(transport, NULL, &headers)
+             && headers.status_code == 200
+             && headers.content_length == TEST_TRANSPORT_FILE_SIZE
+             && headers.etag[0] != '\0'
+             && headers.last_modified[0] != '\0'
+             && vhd_sync_xt_transport_read(transport,
+                                           NULL,
+                                           start_offsets,
+                                           end_offsets,
+                                           2,
+                                           NULL,
+                                           &sink)
+             && file.written == TEST_TRANSPORT_FILE_SIZE - 100
+             && vhd_sync_xt_writer_finish(writer);
+    if (status == false)
+    {
+        goto End;
+    }
+
+    vhd_sync_xt_destroy_writer(writer);
+    writer = NULL;
+
+    part = fopen(TEST_TRANSPORT_FILE, "rb");
+    status = part != NULL
+             && fread(received, 1, TEST_TRANSPORT_FILE_SIZE, part) == TEST_TRANSPORT_FILE_SIZE
+             && memcmp(received, data, end_offsets[0] + 1) == 0
+             && memcmp(received + start_offsets[1],
+                       data + start_offsets[1],
+                       TEST_TRANSPORT_FILE_SIZE - start_offsets[1]) == 0;
+
+End:
+    if (part != NULL)
+    {
+        fclose(part);
+    }
+
+    vhd_sync_xt_close_transport(transport);
+    vhd_sync_xt_destroy_writer(writer);
+    remove(TEST_TRANSPORT_FILE);
+    remove(TEST_TRANSPORT_SOURCE);
+    free(data);
+    free(received);
+    return status;
+}
+
+bool
+test_transport_file_suffix(
+    )
+/*
+ * This function tests reading the file next to a local file, as the
+ * synchash is read, and that a condition on the file is checked against
+ * the validators made up for it.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_transport transport = NULL;
+    vhd_sync_xt_transport_options options;
+    vhd_sync_xt_http_headers headers;
+    vhd_sync_xt_transport_sink sink;
+    test_transport_file file;
+    char url[VHD_SYNC_XT_TRANSPORT_URL_LENGTH];
+    char condition[VHD_SYNC_XT_HEADER_VALUE_LENGTH + 32];
+    char data[64];
+    char received[64];
+
+    status = false;
+    memset(&options, 0, sizeof(options));
+    test_transport_fill(data, sizeof(data));
+    test_transport_sink(&file, received, sizeof(received), NULL, &sink);
+
+    if (test_transport_write_file(TEST_TRANSPORT_SOURCE, "image", 5) == false
+        || test_transport_write_file(TEST_TRANSPORT_SOURCE TEST_TRANSPORT_SUFFIX,
+                                     data,
+                                     sizeof(data)) == false
+        || test_transport_url(TEST_TRANSPORT_SOURCE, url, sizeof(url)) == false
+        || vhd_sync_xt_open_transport(url,
+                                      VHD_SYNC_XT_TRANSPORT_FILE,
+                                      &options,
+                                      &transport) == false
+        || vhd_sync_xt_transport_stat(transport, NULL, &headers) == false)
+    {
+        goto End;
+    }
+
+    snprintf(condition, sizeof(condition), "If-None-Match: %s", headers.etag);
+    status = vhd_sync_xt_transport_stat(transport, condition, &headers)
+             && headers.status_code == 304;
+    if (status == false)
+    {
+        goto End;
+    }
+
+    snprintf(condition, sizeof(condition), "If-Range: %s", headers.etag);
+    status = vhd_sync_xt_transport_read_range(transport,
+                                              TEST_TRANSPORT_SUFFIX,
+                                              16,
+                                              47,
+                                              NULL,
+                                              &sink)
+             && memcmp(received + 16, data + 16, 32) == 0
+             && vhd_sync_xt_transport_read_range(transport,
+                                                 NULL,
+                                                 0,
+                                                 4,
+                                                 condition,
+                                                 &sink)
+             && memcmp(received, "image", 5) == 0
+             && vhd_sync_xt_transport_read_range(transport,
+                                                 TEST_TRANSPORT_SUFFIX,
+                                                 60,
+                                                 64,
+                                                 NULL,
+                                                 &sink) == false;
+
+End:
+    vhd_sync_xt_close_transport(transport);
+    remove(TEST_TRANSPORT_SOURCE TEST_TRANSPORT_SUFFIX);
+    remove(TEST_TRANSPORT_SOURCE);
+    return status;
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs all the tests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      0 if all tests succeed.
+ */
+{
+    bool status;
+
+    status = run_tests(g_transport_tests,
+                       sizeof(g_transport_tests)/sizeof(vhd_sync_xt_test)
+                       );
+    print_test_results(g_transport_tests,
+                       sizeof(g_transport_tests)/sizeof(vhd_sync_xt_test)
+                       );
+
+End:
+    return (status == true)?0:1;
+}
@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the file that contains the tests for tuning sockets to the link,
+ * on connections over the loopback.
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_tune.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+
+//
+// What goes back and forth over the loopback before the kernel is asked for
+// a round trip time.
+//
+#define TEST_TUNE_MESSAGE_SIZE              1024
+#define TEST_TUNE_EXCHANGES                 8
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+bool
+test_tune_buffer_size(
+    );
+
+bool
+test_tune_receive_buffer(
+    );
+
+bool
+test_tune_rtt(
+    );
+
+bool
+test_tune_congestion(
+    );
+
+vhd_sync_xt_test g_tune_tests[] =
+{
+        {"Buffer size from the link",       test_tune_buffer_size,      0},
+        {"Receive buffer only grows",       test_tune_receive_buffer,   0},
+        {"Round trip time of a connection", test_tune_rtt,              0},
+        {"Congestion control algorithm",    test_tune_congestion,       0}
+};
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static bool
+test_tune_connect(
+    int* client,
+    int* server
+    )
+/*
+ * This function connects a pair of sockets over the loopback.
+ *
+ * Parameters:
+ *
+ *      client - Supplies a placeholder for the socket that connected.
+ *
+ *      server - Supplies a placeholder for the socket that was accepted.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    int listener;
+    struct sockaddr_in address;
+    socklen_t length;
+
+    status = false;
+    *client = -1;
+    *server = -1;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    length = sizeof(address);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0
+        || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(listener, 1) != 0
+        || getsockname(listener, (struct sockaddr*)&address, &length) != 0)
+    {
+        goto End;
+    }
+
+    *client = socket(AF_INET, SOCK_STREAM, 0);
+    if (*client < 0
+        || connect(*client, (struct sockaddr*)&address, sizeof(address)) != 0)
+    {
+        goto End;
+    }
+
+    *server = accept(listener, NULL, NULL);
+    status = *server >= 0;
+
+End:
+    if (listener >= 0)
+    {
+        close(listener);
+    }
+    return status;
+}
+
+static void
+test_tune_close(
+    int client,
+    int server
+    )
+/*
+ * This function closes a pair of sockets.
+ *
+ * Parameters:
+ *
+ *      client - Supplies the socket that connected, -1 for none.
+ *
+ *      server - Supplies the socket that was accepted, -1 for none.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    if (client >= 0)
+    {
+        close(client);
+    }
+    if (server >= 0)
+    {
+        close(server);
+    }
+}
+
+bool
+test_tune_buffer_size(
+    )
+/*
+ * This function tests that the buffer is twice the bandwidth-delay product,
+ * kept within its bounds and rounded to 64KB.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    //
+    // 100MB/s over 50ms is 5MB in flight.
+    //
+    return vhd_sync_xt_tune_buffer_size(0, 50000) == 0
+           && vhd_sync_xt_tune_buffer_size(100000000, 0) == 0
+           && vhd_sync_xt_tune_buffer_size(100000000, 50000) == 10027008
+           && vhd_sync_xt_tune_buffer_size(1000000, 100)
+              == VHD_SYNC_XT_TUNE_MINIMUM_RECEIVE_BUFFER
+           && vhd_sync_xt_tune_buffer_size(10000000000UL, 1000000)
+              == VHD_SYNC_XT_TUNE_MAXIMUM_RECEIVE_BUFFER;
+}
+
+bool
+test_tune_receive_buffer(
+    )
+/*
+ * This function tests that a receive buffer is grown to what is asked,
+ * and left alone when it already has that.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    int client;
+    unsigned long int size;
+    unsigned long int initial;
+    unsigned long int grown;
+
+    status = false;
+    size = VHD_SYNC_XT_TUNE_MINIMUM_RECEIVE_BUFFER * 2;
+
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if (client < 0)
+    {
+        goto End;
+    }
+
+    //
+    // Without privileges the buffer stops at net.core.rmem_max, so all it
+    // can be held to is growing.
+    //
+    status = vhd_sync_xt_tune_receive_buffer(client, 0, &initial)
+             && vhd_sync_xt_tune_receive_buffer(client, size, &grown)
+             && grown > initial
+             && vhd_sync_xt_tune_receive_buffer(client,
+                                                VHD_SYNC_XT_TUNE_MINIMUM_RECEIVE_BUFFER,
+                                                &size)
+             && size == grown
+             && vhd_sync_xt_tune_receive_buffer(client, size, NULL);
+
+End:
+    test_tune_close(client, -1);
+    return status;
+}
+
+bool
+test_tune_rtt(
+    )
+/*
+ * This function tests that the kernel has a round trip time for a
+ * connection once data has gone back and forth over it.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    int client;
+    int server;
+    char data[TEST_TUNE_MESSAGE_SIZE];
+    int i;
+    unsigned long int rtt_usec;
+
+    status = false;
+    memset(data, 0, sizeof(data));
+
+    if (test_tune_connect(&client, &server) == false)
+    {
+        goto End;
+    }
+
+    for (i = 0; i < TEST_TUNE_EXCHANGES; ++i)
+    {
+        if (send(server, data, sizeof(data), 0) != sizeof(data)
+            || recv(client, data, sizeof(data), MSG_WAITALL) != sizeof(data)
+            || send(client, data, sizeof(data), 0) != sizeof(data)
+            || recv(server, data, sizeof(data), MSG_WAITALL) != sizeof(data))
+        {
+            goto End;
+        }
+    }
+
+    rtt_usec = 0;
+    status = vhd_sync_xt_tune_rtt(client, &rtt_usec) && rtt_usec > 0;
+
+End:
+    test_tune_close(client, server);
+    return status;
+}
+
+bool
+test_tune_congestion(
+    )
+/*
+ * This function tests that a socket can be given the congestion control
+ * algorithm it already has, and not one that is not there.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    int client;
+    char congestion[VHD_SYNC_XT_TUNE_CONGESTION_LENGTH];
+    char short_name[2];
+
+    status = false;
+
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if (client < 0)
+    {
+        goto End;
+    }
+
+    status = vhd_sync_xt_tune_get_congestion(client, congestion, sizeof(congestion))
+             && strlen(congestion) > 0
+             && vhd_sync_xt_tune_set_congestion(client, congestion)
+             && vhd_sync_xt_tune_set_congestion(client, "no-such-cc") == false
+             && vhd_sync_xt_tune_get_congestion(client, short_name, sizeof(short_name)) == false;
+
+End:
+    test_tune_close(client, -1);
+    return status;
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs all the tests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      0 if all tests succeed.
+ */
+{
+    bool status;
+
+    status = run_tests(g_tune_tests,
+                       sizeof(g_tune_tests)/sizeof(vhd_sync_xt_test)
+                       );
+    print_test_results(g_tune_tests,
+                       sizeof(g_tune_tests)/sizeof(vhd_sync_xt_test)
+                       );
+
+End:
+    return (status == true)?0:1;
+}
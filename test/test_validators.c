@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the file that contains the tests for the validators module.
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_validators.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+#define TEST_VALIDATORS_FILE_SIZE           (8 * 1024 * 1024)
+#define TEST_VALIDATORS_ETAG                "\"5f-800000\""
+#define TEST_VALIDATORS_WEAK_ETAG           "W/\"5f-800000\""
+#define TEST_VALIDATORS_LAST_MODIFIED       "Mon, 01 Jan 2024 00:00:00 GMT"
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+bool
+test_validators_condition(
+    );
+
+bool
+test_validators_match(
+    );
+
+bool
+test_validators_sidecar(
+    );
+
+vhd_sync_xt_test g_validators_tests[] =
+{
+        {"Conditional headers",             test_validators_condition,      0},
+        {"Responses match validators",      test_validators_match,          0},
+        {"Sidecar saved, loaded and moved", test_validators_sidecar,        0}
+};
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static void
+test_validators_headers(
+    pvhd_sync_xt_http_headers headers,
+    const char* etag,
+    const char* last_modified
+    )
+/*
+ * This function fills in the headers of a partial response.
+ *
+ * Parameters:
+ *
+ *      headers - Supplies the headers to fill in.
+ *
+ *      etag - Supplies the ETag, "" for none.
+ *
+ *      last_modified - Supplies the Last-Modified date, "" for none.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    vhd_sync_xt_reset_http_headers(headers);
+    headers->status_code = 206;
+    headers->has_total_size = true;
+    headers->total_size = TEST_VALIDATORS_FILE_SIZE;
+    strcpy(headers->etag, etag);
+    strcpy(headers->last_modified, last_modified);
+}
+
+bool
+test_validators_condition(
+    )
+/*
+ * This function tests the conditional headers built from validators. A weak
+ * ETag cannot go in If-Range, so the date does.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_http_headers headers;
+    vhd_sync_xt_validators validators;
+    char header[VHD_SYNC_XT_VALIDATORS_HEADER_LENGTH];
+
+    test_validators_headers(&headers, TEST_VALIDATORS_ETAG, TEST_VALIDATORS_LAST_MODIFIED);
+    if (vhd_sync_xt_validators_from_headers(&headers,
+                                            TEST_VALIDATORS_FILE_SIZE,
+                                            &validators) == false
+        || vhd_sync_xt_validators_condition(&validators, false, header, sizeof(header)) == false
+        || strcmp(header, "If-None-Match: " TEST_VALIDATORS_ETAG) != 0
+        || vhd_sync_xt_validators_condition(&validators, true, header, sizeof(header)) == false
+        || strcmp(header, "If-Range: " TEST_VALIDATORS_ETAG) != 0)
+    {
+        return false;
+    }
+
+    test_validators_headers(&headers, TEST_VALIDATORS_WEAK_ETAG, TEST_VALIDATORS_LAST_MODIFIED);
+    if (vhd_sync_xt_validators_from_headers(&headers,
+                                            TEST_VALIDATORS_FILE_SIZE,
+                                            &validators) == false
+        || vhd_sync_xt_validators_condition(&validators, false, header, sizeof(header)) == false
+        || strcmp(header, "If-None-Match: " TEST_VALIDATORS_WEAK_ETAG) != 0
+        || vhd_sync_xt_validators_condition(&validators, true, header, sizeof(header)) == false
+        || strcmp(header, "If-Range: " TEST_VALIDATORS_LAST_MODIFIED) != 0)
+    {
+        return false;
+    }
+
+    test_validators_headers(&headers, "", TEST_VALIDATORS_LAST_MODIFIED);
+    if (vhd_sync_xt_validators_from_headers(&headers,
+                                            TEST_VALIDATORS_FILE_SIZE,
+                                            &validators) == false
+        || vhd_sync_xt_validators_condition(&validators, false, header, sizeof(header)) == false
+        || strcmp(header, "If-Modified-Since: " TEST_VALIDATORS_LAST_MODIFIED) != 0)
+    {
+        return false;
+    }
+
+    //
+    // Without validators nothing can be asked for conditionally.
+    //
+    test_validators_headers(&headers, "", "");
+    return vhd_sync_xt_validators_from_headers(&headers,
+                                               TEST_VALIDATORS_FILE_SIZE,
+                                               &validators) == false
+           && vhd_sync_xt_validators_condition(&validators, true, header, sizeof(header)) == false;
+}
+
+bool
+test_validators_match(
+    )
+/*
+ * This function tests matching responses against validators. The ETag
+ * decides when both have one, the date otherwise.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    vhd_sync_xt_http_headers headers;
+    vhd_sync_xt_validators validators;
+
+    test_validators_headers(&headers, TEST_VALIDATORS_ETAG, TEST_VALIDATORS_LAST_MODIFIED);
+    vhd_sync_xt_validators_from_headers(&headers, TEST_VALIDATORS_FILE_SIZE, &validators);
+
+    if (vhd_sync_xt_validators_match(&validators, &headers, TEST_VALIDATORS_FILE_SIZE) == false
+        || vhd_sync_xt_validators_match(&validators, &headers, TEST_VALIDATORS_FILE_SIZE + 1) == true)
+    {
+        return false;
+    }
+
+    test_validators_headers(&headers, "\"60-800000\"", TEST_VALIDATORS_LAST_MODIFIED);
+    if (vhd_sync_xt_validators_match(&validators, &headers, TEST_VALIDATORS_FILE_SIZE) == true)
+    {
+        return false;
+    }
+
+    test_validators_headers(&headers, "", TEST_VALIDATORS_LAST_MODIFIED);
+    if (vhd_sync_xt_validators_match(&validators, &headers, TEST_VALIDATORS_FILE_SIZE) == false)
+    {
+        return false;
+    }
+
+    test_validators_headers(&headers, "", "");
+    return vhd_sync_xt_validators_match(&validators, &headers, TEST_VALIDATORS_FILE_SIZE) == false;
+}
+
+bool
+test_validators_sidecar(
+    )
+/*
+ * This function tests that a sidecar reads back as written, follows its
+ * file when moved, and that moving a file without one leaves none behind.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    vhd_sync_xt_http_headers headers;
+    vhd_sync_xt_validators validators;
+    vhd_sync_xt_validators loaded;
+    char directory[] = "/tmp/test_validators.XXXXXX";
+    char image_path[VHD_SYNC_XT_PATH_LENGTH];
+    char partial_path[VHD_SYNC_XT_PATH_LENGTH];
+
+    status = false;
+
+    if (mkdtemp(directory) == NULL)
+    {
+        return false;
+    }
+
+    snprintf(image_path, sizeof(image_path), "%s/img.vhd", directory);
+    snprintf(partial_path, sizeof(partial_path), "%s/img.vhd.part", directory);
+
+    test_validators_headers(&headers, TEST_VALIDATORS_ETAG, TEST_VALIDATORS_LAST_MODIFIED);
+    vhd_sync_xt_validators_from_headers(&headers, TEST_VALIDATORS_FILE_SIZE, &validators);
+
+    if (vhd_sync_xt_load_validators(partial_path, &loaded) == true
+        || vhd_sync_xt_save_validators(partial_path, &validators) == false
+        || vhd_sync_xt_load_validators(partial_path, &loaded) == false
+        || memcmp(&loaded, &validators, sizeof(validators)) != 0)
+    {
+        goto End;
+    }
+
+    if (vhd_sync_xt_move_validators(partial_path, image_path) == false
+        || vhd_sync_xt_load_validators(partial_path, &loaded) == true
+        || vhd_sync_xt_load_validators(image_path, &loaded) == false
+        || memcmp(&loaded, &validators, sizeof(validators)) != 0)
+    {
+        goto End;
+    }
+
+    if (vhd_sync_xt_move_validators(partial_path, image_path) == false
+        || vhd_sync_xt_load_validators(image_path, &loaded) == true)
+    {
+        goto End;
+    }
+
+    status = true;
+
+End:
+    vhd_sync_xt_remove_validators(partial_path);
+    vhd_sync_xt_remove_validators(image_path);
+    rmdir(directory);
+
+    return status;
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs all the tests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      0 if all tests succeed.
+ */
+{
+    bool status;
+
+    status = run_tests(g_validators_tests,
+                       sizeof(g_validators_tests)/sizeof(vhd_sync_xt_test)
+                       );
+    print_test_results(g_validators_tests,
+                       sizeof(g_validators_tests)/sizeof(vhd_sync_xt_test)
+                       );
+
+End:
+    return (status == true)?0:1;
+}
@@ -0,0 +1,492 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ *
+ * This is the file that contains the tests for the writer backends.
+ *
+ */
+
+
+/* ---------------- Header includes --------------------------------------- */
+#define _GNU_SOURCE
+
+#include "vhdsyncxt_test.h"
+#include <vhdsyncxt_writer.h>
+#include <fcntl.h>
+
+/* ---------------- Pre processor defines ----------------------------------*/
+#define TEST_WRITER_FILE                    "test_writer.part"
+#define TEST_WRITER_BLOCK_SIZE              (64 * 1024)
+
+//
+// A block of data, a block of zeros, a block of data and a short tail.
+//
+#define TEST_WRITER_FILE_SIZE               (3 * TEST_WRITER_BLOCK_SIZE + 100)
+
+//
+// Long enough to be scanned 64 bytes at a time, with a tail that is not.
+//
+#define TEST_WRITER_SCAN_SIZE               (3 * 64 + 13)
+
+//
+// A data block, a zero block, a block that is zero but for one byte and
+// another zero block, as file system blocks.
+//
+#define TEST_WRITER_SPARSE_FILE_SIZE        (4 * VHD_SYNC_XT_SPARSE_BLOCK_SIZE)
+#define TEST_WRITER_SPARSE_BYTE             (2 * VHD_SYNC_XT_SPARSE_BLOCK_SIZE + 2049)
+
+/* ---------------- Struct defines and globals------------------------------*/
+
+bool
+test_writer_backends(
+    );
+
+bool
+test_writer_overwrite_zeros(
+    );
+
+bool
+test_writer_zero_scan(
+    );
+
+bool
+test_writer_sparse_blocks(
+    );
+
+vhd_sync_xt_test g_writer_tests[] =
+{
+        {"Writer backends",                 test_writer_backends,           0},
+        {"Writer zeros over old data",      test_writer_overwrite_zeros,    0},
+        {"Zero scan",                       test_writer_zero_scan,          0},
+        {"Writer leaves out zero blocks",   test_writer_sparse_blocks,      0}
+};
+
+/* ---------------- Function Definitions -----------------------------------*/
+
+static void
+test_writer_fill(
+    char *data,
+    size_t length
+    )
+/*
+ * This function fills a buffer with the test pattern, a block of zeros in
+ * the middle of data.
+ *
+ * Parameters:
+ *
+ *      data - Supplies the buffer.
+ *
+ *      length - Supplies the length of the buffer.
+ *
+ * Return Value:
+ *
+ *      None.
+ */
+{
+    size_t i;
+
+    for (i = 0; i < length; ++i)
+    {
+        if (i / TEST_WRITER_BLOCK_SIZE == 1)
+        {
+            data[i] = 0;
+        }
+        else
+        {
+            data[i] = (char)(i * 7 + 1);
+        }
+    }
+}
+
+static bool
+test_writer_check(
+    const char *expected,
+    size_t length
+    )
+/*
+ * This function checks the file written matches what was expected.
+ *
+ * Parameters:
+ *
+ *      expected - Supplies the expected contents.
+ *
+ *      length - Supplies the expected length.
+ *
+ * Return Value:
+ *
+ *      TRUE if it matches, FALSE otherwise.
+ */
+{
+    bool status;
+    char *actual;
+    FILE *file;
+
+    status = false;
+    file = NULL;
+
+    actual = malloc(length + 1);
+    if (actual == NULL)
+    {
+        goto End;
+    }
+
+    file = fopen(TEST_WRITER_FILE, "rb");
+    if (file == NULL
+        || fread(actual, 1, length + 1, file) != length
+        || memcmp(actual, expected, length) != 0)
+    {
+        goto End;
+    }
+
+    status = true;
+
+End:
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    free(actual);
+    return status;
+}
+
+bool
+test_writer_backends(
+    )
+/*
+ * This function tests that each backend, with and without writeback, writes
+ * a sparse file out of order from a registered buffer, and reads back what
+ * was written.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_writer writer = NULL;
+    char *data = NULL;
+    struct iovec buffer;
+    int run;
+    int type;
+    bool writeback;
+
+    status = false;
+
+    if (posix_memalign((void**)&data,
+                       VHD_SYNC_XT_WRITER_DIRECT_ALIGNMENT,
+                       TEST_WRITER_FILE_SIZE) != 0)
+    {
+        data = NULL;
+        goto End;
+    }
+    test_writer_fill(data, TEST_WRITER_FILE_SIZE);
+
+    buffer.iov_base = data;
+    buffer.iov_len = TEST_WRITER_FILE_SIZE;
+
+    for (run = 0; run < 2 * VHD_SYNC_XT_WRITER_TYPE_COUNT; ++run)
+    {
+        type = run / 2;
+        writeback = (run % 2 == 1);
+
+        unlink(TEST_WRITER_FILE);
+
+        status = vhd_sync_xt_open_writer(TEST_WRITER_FILE,
+                                         type,
+                                         TEST_WRITER_FILE_SIZE,
+                                         true,
+                                         writeback,
+                                         &writer
+                                         );
+        if (status == false)
+        {
+            printf("%s writer is not available here.\n",
+                   vhd_sync_xt_writer_name(type));
+            continue;
+        }
+
+        //
+        // The tail first, then the rest in one go.
+        //
+        status = vhd_sync_xt_writer_register_buffers(writer, &buffer, 1)
+                 && vhd_sync_xt_writer_write(writer,
+                                             data + 2 * TEST_WRITER_BLOCK_SIZE,
+                                             TEST_WRITER_BLOCK_SIZE + 100,
+                                             2 * TEST_WRITER_BLOCK_SIZE)
+                 && vhd_sync_xt_writer_write(writer,
+                                             data,
+                                             2 * TEST_WRITER_BLOCK_SIZE,
+                                             0)
+                 && vhd_sync_xt_writer_finish(writer);
+
+        vhd_sync_xt_destroy_writer(writer);
+        writer = NULL;
+
+        if (status == false
+            || test_writer_check(data, TEST_WRITER_FILE_SIZE) == false)
+        {
+            status = false;
+            goto End;
+        }
+    }
+
+    status = true;
+
+End:
+    vhd_sync_xt_destroy_writer(writer);
+    free(data);
+    unlink(TEST_WRITER_FILE);
+    return status;
+}
+
+bool
+test_writer_overwrite_zeros(
+    )
+/*
+ * This function tests that zeros written sparse over old data read back as
+ * zeros.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_writer writer = NULL;
+    char *data = NULL;
+
+    status = false;
+
+    data = malloc(TEST_WRITER_FILE_SIZE);
+    if (data == NULL)
+    {
+        goto End;
+    }
+
+    unlink(TEST_WRITER_FILE);
+
+    memset(data, 0xAA, TEST_WRITER_FILE_SIZE);
+    status = vhd_sync_xt_open_writer(TEST_WRITER_FILE,
+                                     VHD_SYNC_XT_WRITER_PWRITE,
+                                     TEST_WRITER_FILE_SIZE,
+                                     false,
+                                     false,
+                                     &writer
+                                     );
+    if (status == false
+        || vhd_sync_xt_writer_write(writer, data, TEST_WRITER_FILE_SIZE, 0) == false)
+    {
+        status = false;
+        goto End;
+    }
+    vhd_sync_xt_destroy_writer(writer);
+    writer = NULL;
+
+    test_writer_fill(data, TEST_WRITER_FILE_SIZE);
+    status = vhd_sync_xt_open_writer(TEST_WRITER_FILE,
+                                     VHD_SYNC_XT_WRITER_PWRITE,
+                                     TEST_WRITER_FILE_SIZE,
+                                     true,
+                                     false,
+                                     &writer
+                                     );
+    if (status == false
+        || writer->file_end != TEST_WRITER_FILE_SIZE
+        || vhd_sync_xt_writer_write(writer, data, TEST_WRITER_FILE_SIZE, 0) == false
+        || vhd_sync_xt_writer_finish(writer) == false
+        || test_writer_check(data, TEST_WRITER_FILE_SIZE) == false)
+    {
+        status = false;
+        goto End;
+    }
+
+    status = true;
+
+End:
+    vhd_sync_xt_destroy_writer(writer);
+    free(data);
+    unlink(TEST_WRITER_FILE);
+    return status;
+}
+
+bool
+test_writer_zero_scan(
+    )
+/*
+ * This function tests the scan for blocks of zeros on a block that is all
+ * zeros, one with a byte set anywhere in it, and one that is zero only in
+ * part, at any alignment.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    char data[TEST_WRITER_SCAN_SIZE + 1];
+    size_t start;
+    size_t i;
+
+    memset(data, 0, sizeof(data));
+
+    for (start = 0; start < 2; ++start)
+    {
+        if (vhd_sync_xt_is_zero(data + start, 0) == false
+            || vhd_sync_xt_is_zero(data + start, TEST_WRITER_SCAN_SIZE) == false)
+        {
+            return false;
+        }
+
+        //
+        // A single byte set, in the 64 byte stretches and in the tail.
+        //
+        for (i = 0; i < TEST_WRITER_SCAN_SIZE; ++i)
+        {
+            data[start + i] = (char)0x80;
+            if (vhd_sync_xt_is_zero(data + start, TEST_WRITER_SCAN_SIZE) == true)
+            {
+                return false;
+            }
+
+            //
+            // What comes before the byte is still zero.
+            //
+            if (vhd_sync_xt_is_zero(data + start, i) == false)
+            {
+                return false;
+            }
+            data[start + i] = 0;
+        }
+    }
+
+    return true;
+}
+
+bool
+test_writer_sparse_blocks(
+    )
+/*
+ * This function tests that a sparse write leaves out the blocks that are
+ * all zeros, and writes the data and the block that is only partly zero.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      TRUE on success, FALSE otherwise.
+ */
+{
+    bool status;
+    pvhd_sync_xt_writer writer = NULL;
+    char *data = NULL;
+    int fd;
+
+    status = false;
+    fd = -1;
+
+    data = calloc(1, TEST_WRITER_SPARSE_FILE_SIZE);
+    if (data == NULL)
+    {
+        goto End;
+    }
+    memset(data, 0x55, VHD_SYNC_XT_SPARSE_BLOCK_SIZE);
+    data[TEST_WRITER_SPARSE_BYTE] = 1;
+
+    unlink(TEST_WRITER_FILE);
+
+    status = vhd_sync_xt_open_writer(TEST_WRITER_FILE,
+                                     VHD_SYNC_XT_WRITER_PWRITE,
+                                     TEST_WRITER_SPARSE_FILE_SIZE,
+                                     true,
+                                     false,
+                                     &writer
+                                     );
+    if (status == false
+        || vhd_sync_xt_writer_write(writer, data, TEST_WRITER_SPARSE_FILE_SIZE, 0) == false
+        || vhd_sync_xt_writer_finish(writer) == false
+        || test_writer_check(data, TEST_WRITER_SPARSE_FILE_SIZE) == false)
+    {
+        status = false;
+        goto End;
+    }
+
+    //
+    // Data, a hole, data, and a hole to the end.
+    //
+    fd = open(TEST_WRITER_FILE, O_RDONLY);
+    status = fd >= 0
+             && lseek(fd, 0, SEEK_HOLE) == VHD_SYNC_XT_SPARSE_BLOCK_SIZE
+             && lseek(fd, VHD_SYNC_XT_SPARSE_BLOCK_SIZE, SEEK_DATA)
+                == 2 * VHD_SYNC_XT_SPARSE_BLOCK_SIZE
+             && lseek(fd, 2 * VHD_SYNC_XT_SPARSE_BLOCK_SIZE, SEEK_HOLE)
+                == 3 * VHD_SYNC_XT_SPARSE_BLOCK_SIZE;
+
+End:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    vhd_sync_xt_destroy_writer(writer);
+    free(data);
+    unlink(TEST_WRITER_FILE);
+    return status;
+}
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*
+ * This function is the main function that runs all the tests.
+ *
+ * Parameters:
+ *
+ *      None.
+ *
+ * Return Value:
+ *
+ *      0 if all tests succeed.
+ */
+{
+    bool status;
+
+    status = run_tests(g_writer_tests,
+                       sizeof(g_writer_tests)/sizeof(vhd_sync_xt_test)
+                       );
+    print_test_results(g_writer_tests,
+                       sizeof(g_writer_tests)/sizeof(vhd_sync_xt_test)
+                       );
+
+End:
+    return (status == true)?0:1;
+}